@@ -41,6 +41,16 @@
 
 #define kMLVAttributeKeyVideoBlocksCount     @"Video Blocks Count"      // NSNumber
 #define kMLVAttributeKeyAudioBlocksCount     @"Audio Blocks Count"      // NSNumber
+#define kMLVAttributeKeyIndexing             @"Indexing"                // NSNumber: BOOL, frames are still being indexed
+#define kMLVAttributeKeySkippedBytes         @"Skipped Bytes"           // NSNumber: damaged bytes that were not indexed
+#define kMLVAttributeKeyDroppedFrames        @"Dropped Frames"          // NSNumber
+
+// requestFrameGapsForFileWithId:
+#define kMLVFrameGapsKeyMissingFrames        @"Missing Frames"          // NSArray<NSArray<NSNumber*>*>: first frame number, count
+#define kMLVFrameGapsKeyJitterFrames         @"Jitter Frames"           // NSArray<NSNumber*>: frame numbers
+#define kMLVFrameGapsKeyMissingPerChunk      @"Missing Per Chunk"       // NSArray<NSNumber*>
+#define kMLVFrameGapsKeyJitterPerChunk       @"Jitter Per Chunk"        // NSArray<NSNumber*>
+#define kMLVFrameGapsKeyDamagedFrames        @"Damaged Frames"          // NSArray<NSNumber*>: video frame indexes
 
 typedef NS_ENUM(NSInteger, MLVProcessorOptions) {
     kMLVProcessorOptionsNone                = 0,
@@ -49,12 +59,26 @@ typedef NS_ENUM(NSInteger, MLVProcessorOptions) {
     kMLVProcessorOptionsFixVerticalBanding  = 1 << 2,
     kMLVProcessorOptionsConvertTo14Bit      = 1 << 3,
     kMLVProcessorOptionsCreateHighlightsMap = 1 << 4,
-    kMLVProcessorOptionsOmitDngThumbnail    = 1 << 5
+    kMLVProcessorOptionsOmitDngThumbnail    = 1 << 5,
+    kMLVProcessorOptionsBulkRead            = 1 << 6,   // frames are read once, bypass the page cache
+    kMLVProcessorOptionsKeepCompressed      = 1 << 7,   // LJ92 frames go into the DNG as recorded, without a preview, unless pixels are fixed, converted or mapped
+    kMLVProcessorOptionsCompressDng         = 1 << 8    // uncompressed frames are encoded, DNGs are written with lossless JPEG
+};
+
+typedef NS_ENUM(NSInteger, MLVOpenOptions) {
+    kMLVOpenOptionsNone                     = 0,
+    kMLVOpenOptionsMemoryMapped             = 1 << 0,   // only for complete recordings, a mapped chunk that gets truncated crashes the service
+    kMLVOpenOptionsWriteIndex               = 1 << 1,   // write a <base>.IDX index next to the recording after it was scanned
+    kMLVOpenOptionsWatchForChanges          = 1 << 2,   // index frames appended to a recording that is still being written or copied, see MLVProcessorClientProtocol
+    kMLVOpenOptionsRecover                  = 1 << 3    // skip damaged ranges instead of failing, see kMLVAttributeKeySkippedBytes
 };
 
 @protocol MLVProcessorProtocol
 
 - (void) openFileWithURL:(NSURL*)url withReply:(void (^)(NSString *fileId, NSDictionary<NSString*, id>* attributes, NSData* archiveData, NSError* error))reply;
+- (void) openFileWithURL:(NSURL*)url options:(MLVOpenOptions)options withReply:(void (^)(NSString *fileId, NSDictionary<NSString*, id>* attributes, NSData* archiveData, NSError* error))reply;
+// replies after the header blocks, the block counts grow while kMLVAttributeKeyIndexing is set
+- (void) openFileProgressivelyWithURL:(NSURL*)url withReply:(void (^)(NSString *fileId, NSDictionary<NSString*, id>* attributes, NSData* archiveData, NSError* error))reply;
 - (void) requestReadProgressForFileWithURL:(NSURL*)url withReply:(void (^)(float progress))reply;
 
 - (void) openFileWithArchiveData:(NSData*)data withReply:(void (^)(NSString *fileId, NSDictionary<NSString*, id>* attributes, NSError* error))reply;
@@ -64,7 +88,19 @@ typedef NS_ENUM(NSInteger, MLVProcessorOptions) {
 - (void) readVideoFrameAtIndex:(NSInteger)frameIndex fileId:(NSString*)fileId options:(MLVProcessorOptions)options withReply:(void (^)(NSData* dngData, NSData* highlightMap, NSDictionary<NSString*, id>* avSettings, NSError* error))reply;
 - (void) readAudioFrameAtIndex:(NSInteger)frameIndex fileId:(NSString*)fileId options:(MLVProcessorOptions)options withReply:(void (^)(NSData* audioData, NSDictionary<NSString*, id>* avSettings, NSError* error))reply;
 
+// dropped frames and frames with timestamps more than tolerance frames off, from the block index only
+- (void) requestFrameGapsForFileWithId:(NSString*)fileId tolerance:(double)tolerance withReply:(void (^)(NSDictionary<NSString*, id>* frameGaps, NSError* error))reply;
+
+// indexes frames appended to a recording that is still growing, replies with the new attributes
+- (void) updateFileWithId:(NSString*)fileId withReply:(void (^)(NSDictionary<NSString*, id>* attributes, NSError* error))reply;
+
 - (void) closeFileWithId:(NSString*)fileId withReply:(void (^)(NSError* error))reply;
 @end
 
+// exported by the client to be told about files opened with kMLVOpenOptionsWatchForChanges
+@protocol MLVProcessorClientProtocol
+
+- (void) fileWithIdDidChange:(NSString*)fileId attributes:(NSDictionary<NSString*, id>*)attributes;
+@end
+
 #endif /* MLVProcessorProtocol_h */
@@ -9,7 +9,14 @@
 #import <XCTest/XCTest.h>
 #import "MLVFile.h"
 #import "MLVRawImage+DNG.h"
+#import "MLVFrameIndex.h"
+#import "MLVFileIndex.h"
+#import "mlv.h"
 #import "MLVProcessorProtocol.h"
+#import "MLVRawPacking.h"
+#import "MLVRawKernels.h"
+#import "MLVRawImage+Inline.h"
+#import "lj92.h"
 
 #define TEST_FILE_PATH @"/Volumes/Media 1/MLV/Test/700D/700D_crop_rec.MLV"
 
@@ -53,11 +60,1420 @@ static inline void hxRunInMainLoop(void(^block)(BOOL *done)) {
     MLVFile* file = [[MLVFile alloc] initWithURL:url reportProgress:NULL];
 
     MLVErrorCode errCode;
-    MLVRawImage* rawImage = [file readVideoDataBlock:file.videoBlocks[0] errorCode:&errCode];
+    MLVRawImage* rawImage = [file readVideoDataBlock:[file videoBlockAtIndex:0] errorCode:&errCode];
     
     NSData* dngData = rawImage.dngData;
     [dngData writeToFile:@"/Users/hering/Desktop/test.dng" atomically:YES];
 }
+
+/* 1000 byte frames stored in frame number order, 40ms apart without timestamps */
+static void MLVTestAddFrames(MLVFrameIndex* frameIndex, const UInt32* frameNumbers, const UInt64* timestamps, NSUInteger count, UInt16 fileNum)
+{
+    for(NSUInteger i=0; i<count; i++) {
+        mlv_vidf_hdr_t hdr;
+        memset(&hdr, 0, sizeof(mlv_vidf_hdr_t));
+        memcpy(hdr.blockType, "VIDF", 4);
+        hdr.blockSize = 1000;
+        hdr.timestamp = timestamps ? timestamps[i] : frameNumbers[i] * 40000ULL;
+        hdr.frameNumber = frameNumbers[i];
+        [frameIndex addBlockBuffer:&hdr fileNum:fileNum filePosition:1000ULL * frameNumbers[i]];
+    }
+}
+
+- (void)testFrameIndexLookup {
+
+    MLVFrameIndex* frameIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+
+    // frames are added out of order
+    UInt32 frameNumbers[] = { 2, 0, 3, 1 };
+    MLVTestAddFrames(frameIndex, frameNumbers, NULL, 4, 0);
+    [frameIndex sortByTime];
+
+    XCTAssertEqual(frameIndex.count, 4);
+    for(UInt32 i=0; i<4; i++) {
+        XCTAssertEqual([frameIndex frameNumberAtIndex:i], i);
+        XCTAssertEqual([frameIndex indexOfFrameNumber:i], i);
+    }
+    XCTAssertEqual([frameIndex indexOfFrameNumber:4], NSNotFound);
+
+    XCTAssertEqual([frameIndex indexOfFirstBlockAtOrAfterTime:0], 0);
+    XCTAssertEqual([frameIndex indexOfFirstBlockAtOrAfterTime:0.05], 2);
+    XCTAssertEqual([frameIndex indexOfFirstBlockAtOrAfterTime:0.2], NSNotFound);
+
+    MLVVideoBlock* block = [frameIndex blockAtIndex:3];
+    XCTAssertEqual(block.frameNumber, 3);
+    XCTAssertEqual(block.filePosition, 3000);
+    XCTAssertEqual(block.size, 1000);
+
+    NSMutableData* data = [[NSMutableData alloc] init];
+    [frameIndex appendToData:data];
+    MLVFrameIndex* mappedIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo count:4 data:data offset:0];
+    XCTAssertEqual([mappedIndex timestampAtIndex:2], 80000);
+}
+
+- (void)testFrameIndexLookupWithSparseFrameNumbers {
+
+    // a recording that starts late and one damaged frame number at the end of the range
+    UInt32 frameNumbers[][4] = {
+        { 1000000, 1000001, 1000002, 1000003 },
+        { 0, 1, 2, UINT32_MAX },
+    };
+    UInt64 timestamps[] = { 0, 40000, 80000, 120000 };
+
+    for(int n=0; n<2; n++) {
+        MLVFrameIndex* frameIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+        MLVTestAddFrames(frameIndex, frameNumbers[n], timestamps, 4, 0);
+        [frameIndex sortByTime];
+
+        for(NSUInteger i=0; i<4; i++) {
+            XCTAssertEqual([frameIndex indexOfFrameNumber:frameNumbers[n][i]], i);
+        }
+        XCTAssertEqual([frameIndex indexOfFrameNumber:999999], NSNotFound);
+        XCTAssertEqual([frameIndex indexOfFrameNumber:100000], NSNotFound);
+    }
+}
+
+- (void)testFrameIndexSnapshotsWhileAppending {
+
+    MLVFrameIndex* frameIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+    NSMutableArray<MLVFrameIndex*>* snapshots = [[NSMutableArray alloc] init];
+
+    // 1000 frames in steps of 100, the last step repeats frames 950 to 999 which are left out
+    for(UInt32 step=0; step<11; step++) {
+        UInt32 frameNumbers[100];
+        UInt64 timestamps[100];
+        for(UInt32 i=0; i<100; i++) {
+            frameNumbers[i] = (step < 10) ? step * 100 + i : 950 + i;
+            timestamps[i] = frameNumbers[i] * 40000 + ((step == 10 && frameNumbers[i] < 1000) ? 100 : 0);
+        }
+
+        MLVFrameIndex* chunkIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+        MLVTestAddFrames(chunkIndex, frameNumbers, timestamps, 100, 0);
+        XCTAssertEqual([frameIndex appendFrameIndex:chunkIndex], (step < 10) ? 100 : 50);
+        [snapshots addObject:[frameIndex snapshot]];
+    }
+
+    XCTAssertEqual(frameIndex.count, 1050);
+    for(NSUInteger step=0; step<snapshots.count; step++) {
+        MLVFrameIndex* snapshot = snapshots[step];
+        XCTAssertEqual(snapshot.count, MIN(step + 1, 10) * 100 + ((step == 10) ? 50 : 0));
+        for(NSUInteger i=0; i<snapshot.count; i++) {
+            XCTAssertEqual([snapshot frameNumberAtIndex:i], i);
+            XCTAssertEqual([snapshot timestampAtIndex:i], i * 40000);
+        }
+    }
+}
+
+- (void)testFrameIndexKeepsPublishedFramesWhenAnEarlierChunkGrows {
+
+    MLVFrameIndex* frameIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+
+    // chunk 1 is indexed before chunk 0 is complete
+    UInt32 chunk0[] = { 0, 1, 2, 3 };
+    UInt32 chunk1[] = { 8, 9, 10, 11 };
+    UInt32 chunk0Tail[] = { 4, 5, 6, 7 };
+
+    MLVFrameIndex* chunkIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+    MLVTestAddFrames(chunkIndex, chunk0, NULL, 4, 0);
+    XCTAssertEqual([frameIndex appendFrameIndex:chunkIndex], 4);
+
+    chunkIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+    MLVTestAddFrames(chunkIndex, chunk1, NULL, 4, 1);
+    XCTAssertEqual([frameIndex appendFrameIndex:chunkIndex], 4);
+    MLVFrameIndex* snapshot = [frameIndex snapshot];
+
+    chunkIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+    MLVTestAddFrames(chunkIndex, chunk0Tail, NULL, 4, 0);
+    XCTAssertEqual([frameIndex appendFrameIndex:chunkIndex], 0);
+
+    // the frames handed out before keep their index in the snapshot and in the growing index
+    XCTAssertEqual(frameIndex.count, 8);
+    for(NSUInteger i=0; i<8; i++) {
+        UInt32 frameNumber = (i < 4) ? chunk0[i] : chunk1[i - 4];
+        XCTAssertEqual([snapshot frameNumberAtIndex:i], frameNumber);
+        XCTAssertEqual([frameIndex frameNumberAtIndex:i], frameNumber);
+        XCTAssertEqual([frameIndex indexOfFrameNumber:frameNumber], i);
+        XCTAssertEqual([frameIndex fileNumAtIndex:i], (i < 4) ? 0 : 1);
+    }
+    XCTAssertEqual([frameIndex indexOfFrameNumber:4], NSNotFound);
+}
+
+- (void)testFrameIndexDuplicates {
+
+    MLVFrameIndex* frameIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+
+    // frame 1 was written twice, the copy in the second chunk comes later
+    UInt32 frameNumbers[] = { 1, 0, 2, 1 };
+    UInt64 timestamps[] = { 40000, 0, 80000, 40500 };
+    MLVTestAddFrames(frameIndex, frameNumbers, timestamps, 3, 0);
+    MLVTestAddFrames(frameIndex, frameNumbers + 3, timestamps + 3, 1, 1);
+    [frameIndex sortByTime];
+
+    XCTAssertEqual(frameIndex.count, 3);
+    for(UInt32 i=0; i<3; i++) {
+        XCTAssertEqual([frameIndex frameNumberAtIndex:i], i);
+    }
+    XCTAssertEqual([frameIndex fileNumAtIndex:1], 0);
+    XCTAssertEqual([frameIndex timestampAtIndex:1], 40000);
+}
+
+- (void)testFrameGapReport {
+
+    MLVFrameIndex* frameIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+
+    // frames 3 and 4 are dropped, frame 6 arrives 20ms late
+    UInt32 frameNumbers[] = { 0, 1, 2, 5, 6, 7 };
+    UInt64 timestamps[] = { 0, 40000, 80000, 200000, 260000, 280000 };
+    MLVTestAddFrames(frameIndex, frameNumbers, timestamps, 3, 0);
+    MLVTestAddFrames(frameIndex, frameNumbers + 3, timestamps + 3, 3, 1);
+
+    MLVFrameGapReport* report = [frameIndex gapReportWithFrameDuration:0.04 tolerance:0.25];
+    XCTAssertEqualObjects(report.missingFrameNumbers, [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(3, 2)]);
+    XCTAssertEqualObjects(report.missingFramesPerChunk, (@[@0, @2]));
+
+    NSMutableIndexSet* jitterFrameNumbers = [[NSMutableIndexSet alloc] initWithIndex:6];
+    [jitterFrameNumbers addIndex:7];
+    XCTAssertEqualObjects(report.jitterFrameNumbers, jitterFrameNumbers);
+}
+
+- (void)testFrameGapReportStartsAtTheFirstFrame {
+
+    MLVFrameIndex* frameIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+
+    // the recording starts with frame 100, frame 102 is dropped
+    UInt32 frameNumbers[] = { 100, 101, 103, 104 };
+    UInt64 timestamps[] = { 0, 40000, 120000, 160000 };
+    MLVTestAddFrames(frameIndex, frameNumbers, timestamps, 4, 0);
+
+    MLVFrameGapReport* report = [frameIndex gapReportWithFrameDuration:0.04 tolerance:0.25];
+    XCTAssertEqualObjects(report.missingFrameNumbers, [NSIndexSet indexSetWithIndex:102]);
+    XCTAssertEqualObjects(report.missingFramesPerChunk, (@[@1]));
+    XCTAssertEqual(report.jitterFrameNumbers.count, 0);
+    XCTAssertEqual(report.damagedFrameIndexes.count, 0);
+}
+
+- (void)testFrameGapReportSkipsDamagedFrameNumbers {
+
+    MLVFrameIndex* frameIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+
+    // the numbers at index 0, 3 and 5 are damaged, frames 3 and 5 are missing with them and frame 6 is dropped
+    UInt32 frameNumbers[] = { 9000, 1, 2, 5000, 4, 1, 7 };
+    UInt64 timestamps[] = { 40000, 40000, 80000, 120000, 160000, 200000, 280000 };
+    MLVTestAddFrames(frameIndex, frameNumbers, timestamps, 7, 0);
+
+    MLVFrameGapReport* report = [frameIndex gapReportWithFrameDuration:0.04 tolerance:0.25];
+    NSMutableIndexSet* damagedFrameIndexes = [[NSMutableIndexSet alloc] initWithIndex:0];
+    [damagedFrameIndexes addIndex:3];
+    [damagedFrameIndexes addIndex:5];
+    XCTAssertEqualObjects(report.damagedFrameIndexes, damagedFrameIndexes);
+
+    NSMutableIndexSet* missingFrameNumbers = [[NSMutableIndexSet alloc] initWithIndex:3];
+    [missingFrameNumbers addIndexesInRange:NSMakeRange(5, 2)];
+    XCTAssertEqualObjects(report.missingFrameNumbers, missingFrameNumbers);
+    XCTAssertEqual(report.jitterFrameNumbers.count, 0);
+}
+
+- (void)testFrameGapReportClassifiesTheLastFrameAgain {
+
+    // the damaged frame number is the last frame when the first report is made
+    UInt32 frameNumbers[] = { 0, 1, 5000, 3, 4 };
+    UInt64 timestamps[] = { 0, 40000, 80000, 120000, 160000 };
+
+    MLVFrameIndex* frameIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+    MLVTestAddFrames(frameIndex, frameNumbers, timestamps, 3, 0);
+    MLVFrameGapReport* report = [frameIndex gapReportWithFrameDuration:0.04 tolerance:0.25];
+    XCTAssertEqual(report.missingFrameNumbers.count, 4998);
+    XCTAssertEqual(report.damagedFrameIndexes.count, 0);
+
+    MLVFrameIndex* grownIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+    MLVTestAddFrames(grownIndex, frameNumbers, timestamps, 5, 0);
+    MLVFrameGapReport* extendedReport = [grownIndex gapReportByExtendingReport:report frameDuration:0.04 tolerance:0.25];
+    MLVFrameGapReport* fullReport = [grownIndex gapReportWithFrameDuration:0.04 tolerance:0.25];
+
+    XCTAssertEqualObjects(extendedReport.damagedFrameIndexes, [NSIndexSet indexSetWithIndex:2]);
+    XCTAssertEqualObjects(extendedReport.missingFrameNumbers, [NSIndexSet indexSetWithIndex:2]);
+    XCTAssertEqualObjects(extendedReport.damagedFrameIndexes, fullReport.damagedFrameIndexes);
+    XCTAssertEqualObjects(extendedReport.missingFrameNumbers, fullReport.missingFrameNumbers);
+    XCTAssertEqualObjects(extendedReport.missingFramesPerChunk, fullReport.missingFramesPerChunk);
+}
+
+- (void)testFrameGapReportExtendsWithAppendedFrames {
+
+    MLVFrameIndex* frameIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+
+    // the report of the first chunk is continued with the second one, frame 4 is dropped across the chunks
+    UInt32 frameNumbers[] = { 0, 1, 2, 3, 5, 6, 9 };
+    UInt64 timestamps[] = { 0, 40000, 80000, 120000, 200000, 250000, 360000 };
+
+    MLVFrameIndex* chunkIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+    MLVTestAddFrames(chunkIndex, frameNumbers, timestamps, 4, 0);
+    [frameIndex appendFrameIndex:chunkIndex];
+    MLVFrameGapReport* report = [[frameIndex snapshot] gapReportWithFrameDuration:0.04 tolerance:0.25];
+
+    chunkIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+    MLVTestAddFrames(chunkIndex, frameNumbers + 4, timestamps + 4, 3, 1);
+    [frameIndex appendFrameIndex:chunkIndex];
+    MLVFrameIndex* snapshot = [frameIndex snapshot];
+
+    MLVFrameGapReport* extendedReport = [snapshot gapReportByExtendingReport:report frameDuration:0.04 tolerance:0.25];
+    MLVFrameGapReport* fullReport = [snapshot gapReportWithFrameDuration:0.04 tolerance:0.25];
+    XCTAssertEqualObjects(extendedReport.missingFrameNumbers, fullReport.missingFrameNumbers);
+    XCTAssertEqualObjects(extendedReport.jitterFrameNumbers, fullReport.jitterFrameNumbers);
+    XCTAssertEqualObjects(extendedReport.missingFramesPerChunk, fullReport.missingFramesPerChunk);
+    XCTAssertEqualObjects(extendedReport.jitterFramesPerChunk, fullReport.jitterFramesPerChunk);
+    XCTAssertEqual(extendedReport.missingFrameNumbers.count, 3);
+
+    // a report with other parameters starts over
+    MLVFrameGapReport* otherReport = [snapshot gapReportByExtendingReport:report frameDuration:0.05 tolerance:0.25];
+    XCTAssertEqualObjects(otherReport.jitterFrameNumbers, [snapshot gapReportWithFrameDuration:0.05 tolerance:0.25].jitterFrameNumbers);
+}
+
+#pragma mark - Recordings
+
+static NSMutableData* MLVTestRecording(UInt64 guid)
+{
+    mlv_file_hdr_t file_hdr;
+    memset(&file_hdr, 0, sizeof(mlv_file_hdr_t));
+    memcpy(file_hdr.fileMagic, "MLVI", 4);
+    file_hdr.blockSize = sizeof(mlv_file_hdr_t);
+    memcpy(file_hdr.versionString, "v2.0", 5);
+    file_hdr.fileGuid = guid;
+    file_hdr.fileCount = 1;
+    file_hdr.videoClass = 1;
+    file_hdr.audioClass = 1;
+    file_hdr.sourceFpsNom = 25000;
+    file_hdr.sourceFpsDenom = 1000;
+
+    NSMutableData* data = [[NSMutableData alloc] init];
+    [data appendBytes:&file_hdr length:sizeof(mlv_file_hdr_t)];
+    return data;
+}
+
+/* the payload behind the header is filled with a pattern that contains no block signature */
+static void MLVTestAppendBlock(NSMutableData* data, const char* type, void* header, size_t headerSize, uint32_t blockSize, UInt64 timestamp)
+{
+    mlv_hdr_t* hdr = header;
+    memcpy(hdr->blockType, type, 4);
+    hdr->blockSize = blockSize;
+    hdr->timestamp = timestamp;
+    [data appendBytes:header length:headerSize];
+
+    NSUInteger start = data.length;
+    [data increaseLengthBy:blockSize - headerSize];
+    uint8_t* payload = (uint8_t*)data.mutableBytes + start;
+    for(size_t i=0; i<blockSize - headerSize; i++) {
+        payload[i] = (uint8_t)(i % 61);
+    }
+}
+
+static void MLVTestAppendVideoFrame(NSMutableData* data, UInt32 frameNumber, UInt64 timestamp)
+{
+    mlv_vidf_hdr_t hdr;
+    memset(&hdr, 0, sizeof(mlv_vidf_hdr_t));
+    hdr.frameNumber = frameNumber;
+    MLVTestAppendBlock(data, "VIDF", &hdr, sizeof(mlv_vidf_hdr_t), 1024, timestamp);
+}
+
+static void MLVTestAppendAudioFrame(NSMutableData* data, UInt32 frameNumber, UInt64 timestamp)
+{
+    mlv_audf_hdr_t hdr;
+    memset(&hdr, 0, sizeof(mlv_audf_hdr_t));
+    hdr.frameNumber = frameNumber;
+    MLVTestAppendBlock(data, "AUDF", &hdr, sizeof(mlv_audf_hdr_t), 512, timestamp);
+}
+
+static void MLVTestAppendLens(NSMutableData* data, const char* lensName, UInt64 timestamp)
+{
+    mlv_lens_hdr_t hdr;
+    memset(&hdr, 0, sizeof(mlv_lens_hdr_t));
+    strncpy((char*)hdr.lensName, lensName, sizeof(hdr.lensName) - 1);
+    MLVTestAppendBlock(data, "LENS", &hdr, sizeof(mlv_lens_hdr_t), sizeof(mlv_lens_hdr_t), timestamp);
+}
+
+static void MLVTestAppendExposure(NSMutableData* data, UInt32 isoValue, UInt64 timestamp)
+{
+    mlv_expo_hdr_t hdr;
+    memset(&hdr, 0, sizeof(mlv_expo_hdr_t));
+    hdr.isoValue = isoValue;
+    MLVTestAppendBlock(data, "EXPO", &hdr, sizeof(mlv_expo_hdr_t), sizeof(mlv_expo_hdr_t), timestamp);
+}
+
+static void MLVTestAppendNull(NSMutableData* data, uint32_t blockSize)
+{
+    mlv_hdr_t hdr;
+    memset(&hdr, 0, sizeof(mlv_hdr_t));
+    MLVTestAppendBlock(data, "NULL", &hdr, sizeof(mlv_hdr_t), blockSize, 0);
+}
+
+static NSURL* MLVTestDirectory(void)
+{
+    char path[] = "/tmp/MLVTests.XXXXXX";
+    return [NSURL fileURLWithPath:@(mkdtemp(path)) isDirectory:YES];
+}
+
+static void MLVTestAssertSameFrames(Tests* self, MLVFrameIndex* frameIndex, MLVFrameIndex* otherIndex)
+{
+    XCTAssertEqual(frameIndex.count, otherIndex.count);
+    for(NSUInteger i=0; i<MIN(frameIndex.count, otherIndex.count); i++) {
+        XCTAssertEqual([frameIndex fileNumAtIndex:i], [otherIndex fileNumAtIndex:i]);
+        XCTAssertEqual([frameIndex filePositionAtIndex:i], [otherIndex filePositionAtIndex:i]);
+        XCTAssertEqual([frameIndex sizeAtIndex:i], [otherIndex sizeAtIndex:i]);
+        XCTAssertEqual([frameIndex timestampAtIndex:i], [otherIndex timestampAtIndex:i]);
+        XCTAssertEqual([frameIndex frameNumberAtIndex:i], [otherIndex frameNumberAtIndex:i]);
+    }
+}
+
+- (void)testXrefIndexMatchesFullScan {
+
+    // the lens and exposure change after the fifth frame, padded with a NULL block
+    NSMutableData* data = MLVTestRecording(0x1234);
+    MLVTestAppendLens(data, "EF50mm f/1.8", 0);
+    MLVTestAppendExposure(data, 100, 0);
+    for(UInt32 i=0; i<10; i++) {
+        if (i == 5) {
+            MLVTestAppendLens(data, "EF24-70mm f/2.8L", i * 40000);
+            MLVTestAppendExposure(data, 800, i * 40000);
+            MLVTestAppendNull(data, 64);
+        }
+        MLVTestAppendVideoFrame(data, i, i * 40000);
+        if (i % 2 == 0) {
+            MLVTestAppendAudioFrame(data, i / 2, i * 40000 + 10);
+        }
+    }
+
+    NSURL* url = [MLVTestDirectory() URLByAppendingPathComponent:@"M17-1200.MLV"];
+    XCTAssertTrue([data writeToURL:url atomically:NO]);
+
+    MLVFile* scannedFile = [[MLVFile alloc] initWithURL:url options:kMLVFileOptionsWriteIndex reportProgress:nil];
+    NSURL* indexURL = [url.URLByDeletingPathExtension URLByAppendingPathExtension:@"IDX"];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:indexURL.path]);
+
+    MLVFile* indexedFile = [[MLVFile alloc] initWithURL:url options:kMLVFileOptionsNone reportProgress:nil];
+    XCTAssertNotNil(indexedFile);
+
+    XCTAssertEqualObjects(scannedFile.lensInfo.lensName, @"EF24-70mm f/2.8L");
+    XCTAssertEqualObjects(indexedFile.lensInfo.lensName, scannedFile.lensInfo.lensName);
+    XCTAssertEqual(scannedFile.expoInfo.isoValue, 800);
+    XCTAssertEqual(indexedFile.expoInfo.isoValue, scannedFile.expoInfo.isoValue);
+    XCTAssertEqual(indexedFile.mainheader.guid, scannedFile.mainheader.guid);
+
+    XCTAssertEqual(scannedFile.videoIndex.count, 10);
+    XCTAssertEqual(scannedFile.audioIndex.count, 5);
+    MLVTestAssertSameFrames(self, indexedFile.videoIndex, scannedFile.videoIndex);
+    MLVTestAssertSameFrames(self, indexedFile.audioIndex, scannedFile.audioIndex);
+
+    [[NSFileManager defaultManager] removeItemAtURL:url.URLByDeletingLastPathComponent error:nil];
+}
+
+- (void)testIndexCacheRoundTrip {
+
+    NSMutableData* data = MLVTestRecording(0x5678);
+    MLVTestAppendLens(data, "EF50mm f/1.8", 0);
+    for(UInt32 i=0; i<8; i++) {
+        MLVTestAppendVideoFrame(data, i, i * 40000);
+        MLVTestAppendAudioFrame(data, i, i * 40000 + 10);
+    }
+
+    NSURL* directoryURL = MLVTestDirectory();
+    NSURL* url = [directoryURL URLByAppendingPathComponent:@"M17-1300.MLV"];
+    NSURL* indexURL = [directoryURL URLByAppendingPathComponent:@"5678.mlvindex"];
+    XCTAssertTrue([data writeToURL:url atomically:NO]);
+
+    MLVFile* file = [[MLVFile alloc] initWithURL:url options:kMLVFileOptionsNone reportProgress:nil];
+    int fd = open(url.fileSystemRepresentation, O_RDWR);
+    NSData* chunkStats = [MLVFileIndex chunkStatsWithFileDescriptors:&fd count:1];
+    XCTAssertTrue([MLVFileIndex writeIndexWithGUID:0x5678 chunkStats:chunkStats infoBlocks:@[file.mainheader, file.lensInfo]
+                                        videoIndex:file.videoIndex audioIndex:file.audioIndex toURL:indexURL]);
+
+    MLVFileIndex* index = [[MLVFileIndex alloc] initWithContentsOfURL:indexURL guid:0x5678 chunkStats:chunkStats];
+    XCTAssertNotNil(index);
+    XCTAssertEqual(index.infoBlocks.count, 2);
+    XCTAssertEqual(((MLVFileBlock*)index.infoBlocks[0]).guid, 0x5678);
+    XCTAssertEqualObjects(((MLVLensBlock*)index.infoBlocks[1]).lensName, @"EF50mm f/1.8");
+    XCTAssertEqual(index.infoBlocks[1].filePosition, file.lensInfo.filePosition);
+    MLVTestAssertSameFrames(self, index.videoIndex, file.videoIndex);
+    MLVTestAssertSameFrames(self, index.audioIndex, file.audioIndex);
+
+    // another recording with the same name
+    XCTAssertNil([[MLVFileIndex alloc] initWithContentsOfURL:indexURL guid:0x5679 chunkStats:chunkStats]);
+
+    // a chunk that was touched without changing its size
+    struct timeval times[2] = { { 1000, 0 }, { 1000, 0 } };
+    XCTAssertEqual(futimes(fd, times), 0);
+    NSData* touchedStats = [MLVFileIndex chunkStatsWithFileDescriptors:&fd count:1];
+    XCTAssertNotEqualObjects(touchedStats, chunkStats);
+    XCTAssertNil([[MLVFileIndex alloc] initWithContentsOfURL:indexURL guid:0x5678 chunkStats:touchedStats]);
+
+    // a chunk that grew, with its old modification date
+    NSMutableData* frame = [[NSMutableData alloc] init];
+    MLVTestAppendVideoFrame(frame, 8, 8 * 40000);
+    XCTAssertEqual(pwrite(fd, frame.bytes, frame.length, data.length), (ssize_t)frame.length);
+    XCTAssertEqual(futimes(fd, times), 0);
+    NSData* grownStats = [MLVFileIndex chunkStatsWithFileDescriptors:&fd count:1];
+    XCTAssertNotEqualObjects(grownStats, touchedStats);
+    XCTAssertNil([[MLVFileIndex alloc] initWithContentsOfURL:indexURL guid:0x5678 chunkStats:grownStats]);
+
+    close(fd);
+    [[NSFileManager defaultManager] removeItemAtURL:directoryURL error:nil];
+}
+
+- (void)testArchivedFileDropsTransientOptions {
+
+    NSMutableData* data = MLVTestRecording(0x9abc);
+    MLVTestAppendVideoFrame(data, 0, 0);
+
+    NSURL* directoryURL = MLVTestDirectory();
+    NSURL* url = [directoryURL URLByAppendingPathComponent:@"M17-1400.MLV"];
+    XCTAssertTrue([data writeToURL:url atomically:NO]);
+
+    MLVFile* file = [[MLVFile alloc] initWithURL:url options:kMLVFileOptionsWatchForChanges|kMLVFileOptionsMemoryMapped|kMLVFileOptionsRecover reportProgress:nil];
+    NSData* archive = [NSKeyedArchiver archivedDataWithRootObject:file requiringSecureCoding:YES error:nil];
+    MLVFile* decodedFile = [NSKeyedUnarchiver unarchivedObjectOfClass:[MLVFile class] fromData:archive error:nil];
+
+    XCTAssertNotNil(decodedFile);
+    XCTAssertEqual(decodedFile.options, kMLVFileOptionsRecover|kMLVFileOptionsIndexCache);
+    XCTAssertEqual(decodedFile.videoIndex.count, 1);
+
+    [[NSFileManager defaultManager] removeItemAtURL:directoryURL error:nil];
+}
+
+static void MLVTestAppendToFile(NSURL* url, NSData* data)
+{
+    NSFileHandle* fileHandle = [NSFileHandle fileHandleForWritingToURL:url error:nil];
+    [fileHandle seekToEndOfFile];
+    [fileHandle writeData:data];
+    [fileHandle closeFile];
+}
+
+- (void)testGrowingRecordingHoldsBackLaterChunks {
+
+    NSURL* directoryURL = MLVTestDirectory();
+    NSURL* url = [directoryURL URLByAppendingPathComponent:@"M17-1500.MLV"];
+    NSURL* chunkURL = [directoryURL URLByAppendingPathComponent:@"M17-1500.M00"];
+
+    // chunk 0 ends within frame 2
+    NSMutableData* data = MLVTestRecording(0xdef0);
+    for(UInt32 i=0; i<3; i++) {
+        MLVTestAppendVideoFrame(data, i, i * 40000);
+    }
+    NSUInteger splitLength = data.length - 100;
+    XCTAssertTrue([[data subdataWithRange:NSMakeRange(0, splitLength)] writeToURL:url atomically:NO]);
+
+    MLVFile* file = [[MLVFile alloc] initWithURL:url options:kMLVFileOptionsNone reportProgress:nil];
+    XCTAssertEqual(file.videoIndex.count, 2);
+    MLVFrameIndex* firstIndex = file.videoIndex;
+
+    // the next chunk appears while frame 3 of chunk 0 is still incomplete
+    MLVTestAppendVideoFrame(data, 3, 3 * 40000);
+    NSUInteger chunk0Length = data.length;
+    MLVTestAppendToFile(url, [data subdataWithRange:NSMakeRange(splitLength, chunk0Length - 100 - splitLength)]);
+
+    NSMutableData* chunk = MLVTestRecording(0xdef0);
+    ((mlv_file_hdr_t*)chunk.mutableBytes)->fileNum = 1;
+    for(UInt32 i=4; i<6; i++) {
+        MLVTestAppendVideoFrame(chunk, i, i * 40000);
+    }
+    XCTAssertTrue([chunk writeToURL:chunkURL atomically:NO]);
+
+    XCTAssertEqual([file updateBlockInfos], kMLVErrorCodeNone);
+    XCTAssertEqual(file.videoIndex.count, 3);
+
+    // chunk 0 is complete, now the frames of chunk 1 follow
+    MLVTestAppendToFile(url, [data subdataWithRange:NSMakeRange(chunk0Length - 100, 100)]);
+    XCTAssertEqual([file updateBlockInfos], kMLVErrorCodeNone);
+
+    MLVFrameIndex* videoIndex = file.videoIndex;
+    XCTAssertEqual(videoIndex.count, 6);
+    for(NSUInteger i=0; i<videoIndex.count; i++) {
+        XCTAssertEqual([videoIndex frameNumberAtIndex:i], i);
+        XCTAssertEqual([videoIndex fileNumAtIndex:i], (i < 4) ? 0 : 1);
+    }
+
+    // a snapshot taken before still shows the same frames
+    XCTAssertEqual(firstIndex.count, 2);
+    XCTAssertEqual([firstIndex frameNumberAtIndex:1], 1);
+
+    [[NSFileManager defaultManager] removeItemAtURL:directoryURL error:nil];
+}
+
+- (void)testProgressiveOpeningCompletesPendingFrames {
+
+    NSURL* directoryURL = MLVTestDirectory();
+    NSURL* url = [directoryURL URLByAppendingPathComponent:@"M17-1600.MLV"];
+
+    NSMutableData* data = MLVTestRecording(0x1600);
+    for(UInt32 i=0; i<100; i++) {
+        MLVTestAppendVideoFrame(data, i, i * 40000);
+    }
+    XCTAssertTrue([data writeToURL:url atomically:NO]);
+
+    MLVFile* file = [[MLVFile alloc] initWithURL:url options:kMLVFileOptionsProgressive reportProgress:nil];
+
+    // the last frame is reported once it is indexed, a frame past the end when indexing stops
+    XCTestExpectation* lastFrame = [self expectationWithDescription:@"last frame"];
+    [file whenVideoBlockAtIndex:99 isIndexed:^(BOOL available) {
+        XCTAssertTrue(available);
+        XCTAssertGreaterThanOrEqual(file.videoIndex.count, 100);
+        [lastFrame fulfill];
+    }];
+
+    XCTestExpectation* missingFrame = [self expectationWithDescription:@"missing frame"];
+    [file whenVideoBlockAtIndex:100 isIndexed:^(BOOL available) {
+        XCTAssertFalse(available);
+        XCTAssertFalse(file.indexing);
+        [missingFrame fulfill];
+    }];
+
+    [self waitForExpectationsWithTimeout:10 handler:nil];
+    XCTAssertEqual(file.videoIndex.count, 100);
+
+    [[NSFileManager defaultManager] removeItemAtURL:directoryURL error:nil];
+}
+
+#pragma mark - Recovery
+
+#define MLVTestScanWindowSize (8 * 1024 * 1024)     // read window of the block scanner in MLVFile.m
+
+/* reference for the block scanner, a plain memcmp at every position with the same plausibility rules */
+static BOOL MLVTestIsBlockAtPosition(NSData* data, NSUInteger position)
+{
+    static const char* types[] = { "MLVI", "VIDF", "AUDF", "LENS", "EXPO", "NULL" };
+    const uint8_t* bytes = data.bytes;
+    if (position + sizeof(mlv_hdr_t) > data.length) {
+        return NO;
+    }
+
+    BOOL known = NO;
+    for(size_t t=0; t<sizeof(types)/sizeof(types[0]); t++) {
+        known |= (memcmp(bytes + position, types[t], 4) == 0);
+    }
+
+    mlv_hdr_t hdr;
+    memcpy(&hdr, bytes + position, sizeof(mlv_hdr_t));
+    return known && hdr.blockSize >= sizeof(mlv_hdr_t) && hdr.blockSize <= 50 * 1024 * 1024 && position + hdr.blockSize <= data.length;
+}
+
+static NSUInteger MLVTestFindBlock(NSData* data, NSUInteger position)
+{
+    for(; position + sizeof(mlv_hdr_t) <= data.length; position++) {
+        if (!MLVTestIsBlockAtPosition(data, position)) {
+            continue;
+        }
+
+        mlv_hdr_t hdr;
+        memcpy(&hdr, (const uint8_t*)data.bytes + position, sizeof(mlv_hdr_t));
+        if (memcmp(hdr.blockType, "VIDF", 4) == 0) {
+            mlv_vidf_hdr_t vidf;
+            if (hdr.blockSize < sizeof(mlv_vidf_hdr_t)) {
+                continue;
+            }
+            memcpy(&vidf, (const uint8_t*)data.bytes + position, sizeof(mlv_vidf_hdr_t));
+            if (vidf.frameSpace > hdr.blockSize - sizeof(mlv_vidf_hdr_t)) {
+                continue;
+            }
+        }
+
+        NSUInteger next = position + hdr.blockSize;
+        if (next + sizeof(mlv_hdr_t) > data.length || MLVTestIsBlockAtPosition(data, next)) {
+            return position;
+        }
+    }
+    return data.length;
+}
+
+static void MLVTestAppendGarbage(NSMutableData* data, NSUInteger length)
+{
+    NSUInteger start = data.length;
+    [data increaseLengthBy:length];
+    memset((uint8_t*)data.mutableBytes + start, 0xee, length);
+}
+
+/* opens the recording with recovery and compares the damaged range with the reference scan */
+static void MLVTestAssertRecovery(Tests* self, NSData* data, NSUInteger damagedPosition, NSUInteger resyncPosition, NSUInteger videoFrameCount)
+{
+    XCTAssertEqual(MLVTestFindBlock(data, damagedPosition + 1), resyncPosition);
+
+    NSURL* directoryURL = MLVTestDirectory();
+    NSURL* url = [directoryURL URLByAppendingPathComponent:@"M17-1700.MLV"];
+    XCTAssertTrue([data writeToURL:url atomically:NO]);
+
+    MLVFile* file = [[MLVFile alloc] initWithURL:url options:kMLVFileOptionsRecover reportProgress:nil];
+    XCTAssertEqual(file.videoIndex.count, videoFrameCount);
+    XCTAssertEqualObjects(file.skippedRanges[@0], [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(damagedPosition, resyncPosition - damagedPosition)]);
+    XCTAssertEqual(file.skippedBytes, resyncPosition - damagedPosition);
+
+    [[NSFileManager defaultManager] removeItemAtURL:directoryURL error:nil];
+}
+
+- (void)testRecoverySkipsGarbageBetweenBlocks {
+
+    // every alignment of the next block to the 16 byte steps of the scanner
+    for(NSUInteger garbageLength=1; garbageLength<=40; garbageLength++) {
+        NSMutableData* data = MLVTestRecording(0x1700);
+        MLVTestAppendVideoFrame(data, 0, 0);
+        MLVTestAppendVideoFrame(data, 1, 40000);
+        NSUInteger damagedPosition = data.length;
+        MLVTestAppendGarbage(data, garbageLength);
+        NSUInteger resyncPosition = data.length;
+        MLVTestAppendVideoFrame(data, 2, 80000);
+        MLVTestAppendVideoFrame(data, 3, 120000);
+
+        MLVTestAssertRecovery(self, data, damagedPosition, resyncPosition, 4);
+    }
+}
+
+- (void)testRecoveryIgnoresSignaturesInFrameData {
+
+    NSMutableData* data = MLVTestRecording(0x1700);
+    MLVTestAppendVideoFrame(data, 0, 0);
+
+    // the header of frame 1 is overwritten, its frame data contains a VIDF header that no block follows
+    NSUInteger damagedPosition = data.length;
+    MLVTestAppendVideoFrame(data, 1, 40000);
+    memset((uint8_t*)data.mutableBytes + damagedPosition, 0xee, sizeof(mlv_hdr_t));
+
+    mlv_vidf_hdr_t fake;
+    memset(&fake, 0, sizeof(mlv_vidf_hdr_t));
+    memcpy(fake.blockType, "VIDF", 4);
+    fake.blockSize = 200;
+    memcpy((uint8_t*)data.mutableBytes + damagedPosition + 100, &fake, sizeof(mlv_vidf_hdr_t));
+
+    NSUInteger resyncPosition = data.length;
+    MLVTestAppendVideoFrame(data, 2, 80000);
+
+    MLVTestAssertRecovery(self, data, damagedPosition, resyncPosition, 2);
+}
+
+- (void)testRecoveryFindsSignaturesAtTheWindowEdge {
+
+    // the signature of the next block starts before, at and behind the end of the first read window
+    for(NSInteger offset=-3; offset<=1; offset++) {
+        NSMutableData* data = MLVTestRecording(0x1700);
+        MLVTestAppendVideoFrame(data, 0, 0);
+        NSUInteger damagedPosition = data.length;
+        NSUInteger resyncPosition = MLVTestScanWindowSize + offset;
+        MLVTestAppendGarbage(data, resyncPosition - damagedPosition);
+        MLVTestAppendVideoFrame(data, 1, 40000);
+        MLVTestAppendVideoFrame(data, 2, 80000);
+
+        MLVTestAssertRecovery(self, data, damagedPosition, resyncPosition, 3);
+    }
+}
+
+- (void)testRecoverySkipsBlockSizePastEndOfFile {
+
+    NSMutableData* data = MLVTestRecording(0x1700);
+    MLVTestAppendVideoFrame(data, 0, 0);
+
+    // a damaged size points behind the end of the file while blocks follow
+    NSUInteger damagedPosition = data.length;
+    MLVTestAppendVideoFrame(data, 1, 40000);
+    ((mlv_hdr_t*)((uint8_t*)data.mutableBytes + damagedPosition))->blockSize = 10 * 1024 * 1024;
+
+    NSUInteger resyncPosition = data.length;
+    MLVTestAppendVideoFrame(data, 2, 80000);
+    MLVTestAppendVideoFrame(data, 3, 120000);
+
+    MLVTestAssertRecovery(self, data, damagedPosition, resyncPosition, 3);
+}
+
+- (void)testRecoveryAtTheEndOfTheFile {
+
+    // the file ends within 3 bytes of a signature or in the header behind it
+    for(NSUInteger tailLength=1; tailLength<=sizeof(mlv_hdr_t); tailLength++) {
+        NSMutableData* data = MLVTestRecording(0x1700);
+        MLVTestAppendVideoFrame(data, 0, 0);
+        NSUInteger damagedPosition = data.length;
+        MLVTestAppendGarbage(data, 20);
+
+        NSMutableData* frame = [[NSMutableData alloc] init];
+        MLVTestAppendVideoFrame(frame, 1, 40000);
+        [data appendBytes:frame.bytes length:tailLength];
+
+        MLVTestAssertRecovery(self, data, damagedPosition, data.length, 1);
+    }
+}
+
+- (void)testUnpackingRawRows {
+
+    MLVRawPackingImplementation implementations[] = { kMLVRawPackingScalar, kMLVRawPackingSSE41, kMLVRawPackingAVX2, kMLVRawPackingNEON };
+    int bitsPerPixels[] = { 10, 12, 14 };
+
+    for(int b=0; b<3; b++) {
+        // odd block counts leave a tail for the scalar code
+        struct raw_info rawInfo;
+        memset(&rawInfo, 0, sizeof(struct raw_info));
+        rawInfo.bits_per_pixel = bitsPerPixels[b];
+        rawInfo.width = 8 * 37;
+        rawInfo.height = 2;
+        rawInfo.pitch = rawInfo.width * rawInfo.bits_per_pixel / 8;
+
+        NSMutableData* packed = [[NSMutableData alloc] initWithLength:rawInfo.pitch * rawInfo.height];
+        uint8_t* bytes = packed.mutableBytes;
+        for(NSUInteger i=0; i<packed.length; i++) {
+            bytes[i] = (uint8_t)arc4random();
+        }
+
+        uint16_t row[8 * 37];
+        for(int i=0; i<4; i++) {
+            if (!MLVRawPackingIsSupported(implementations[i])) {
+                continue;
+            }
+
+            for(int32_t y=0; y<rawInfo.height; y++) {
+                MLVUnpackRawRowWithImplementation(bytes + y * rawInfo.pitch, row, rawInfo.width, rawInfo.bits_per_pixel, implementations[i]);
+                for(int32_t x=0; x<rawInfo.width; x++) {
+                    XCTAssertEqual(row[x], GetRawPixel(&rawInfo, bytes, x, y), @"%d bit, implementation %d, x %d", rawInfo.bits_per_pixel, implementations[i], x);
+                }
+            }
+        }
+    }
+}
+
+- (void)testPackingRawRows {
+
+    MLVRawPackingImplementation implementations[] = { kMLVRawPackingScalar, kMLVRawPackingSSE41, kMLVRawPackingAVX2, kMLVRawPackingNEON };
+    int bitsPerPixels[] = { 10, 12, 14 };
+
+    for(int b=0; b<3; b++) {
+        int32_t bitsPerPixel = bitsPerPixels[b];
+        size_t width = 8 * 37;
+        size_t rowLength = MLVRawPackedRowLength(width, bitsPerPixel);
+
+        uint16_t samples[8 * 37];
+        for(size_t x=0; x<width; x++) {
+            samples[x] = (uint16_t)arc4random() & ((1 << bitsPerPixel) - 1);
+        }
+
+        // the scalar little endian row must read back through GetRawPixel
+        struct raw_info rawInfo;
+        memset(&rawInfo, 0, sizeof(struct raw_info));
+        rawInfo.bits_per_pixel = bitsPerPixel;
+        rawInfo.width = (int32_t)width;
+        rawInfo.height = 1;
+        rawInfo.pitch = (int32_t)rowLength;
+
+        NSMutableData* reference = [[NSMutableData alloc] initWithLength:rowLength];
+        MLVPackRawRowWithImplementation(samples, reference.mutableBytes, width, bitsPerPixel, kMLVRawPackingLittleEndian, kMLVRawPackingScalar);
+        for(int32_t x=0; x<width; x++) {
+            XCTAssertEqual(GetRawPixel(&rawInfo, reference.mutableBytes, x, 0), samples[x]);
+        }
+
+        NSMutableData* swapped = [[NSMutableData alloc] initWithLength:rowLength];
+        MLVSwapRawBytes(reference.bytes, swapped.mutableBytes, rowLength);
+
+        for(int i=0; i<4; i++) {
+            if (!MLVRawPackingIsSupported(implementations[i])) {
+                continue;
+            }
+
+            NSMutableData* packed = [[NSMutableData alloc] initWithLength:rowLength];
+            MLVPackRawRowWithImplementation(samples, packed.mutableBytes, width, bitsPerPixel, kMLVRawPackingLittleEndian, implementations[i]);
+            XCTAssertEqualObjects(packed, reference, @"%d bit, implementation %d", bitsPerPixel, implementations[i]);
+
+            MLVPackRawRowWithImplementation(samples, packed.mutableBytes, width, bitsPerPixel, kMLVRawPackingBigEndian, implementations[i]);
+            XCTAssertEqualObjects(packed, swapped, @"%d bit, implementation %d, big endian", bitsPerPixel, implementations[i]);
+        }
+    }
+}
+
+- (void)testUnpackedRawImage {
+
+    struct raw_info rawInfo;
+    memset(&rawInfo, 0, sizeof(struct raw_info));
+    rawInfo.bits_per_pixel = 12;
+    rawInfo.width = 64;
+    rawInfo.height = 4;
+    rawInfo.pitch = rawInfo.width * rawInfo.bits_per_pixel / 8;
+    rawInfo.frame_size = rawInfo.pitch * rawInfo.height;
+    rawInfo.black_level = 256;
+    rawInfo.white_level = 4000;
+
+    uint8_t* buffer = malloc(rawInfo.frame_size);
+    for(int32_t i=0; i<rawInfo.frame_size; i++) {
+        buffer[i] = (uint8_t)arc4random();
+    }
+
+    MLVRawImage* packedImage = [[MLVRawImage alloc] initWithInfo:rawInfo buffer:buffer compressed:NO];
+    MLVRawImage* unpackedImage = [packedImage copy];
+    [unpackedImage unpackBuffer];
+
+    XCTAssertFalse(packedImage.unpacked);
+    XCTAssertTrue(unpackedImage.unpacked);
+    XCTAssertEqual(unpackedImage.rawInfo->bits_per_pixel, 12);
+    XCTAssertEqual(unpackedImage.bufferInfo->bits_per_pixel, 16);
+
+    // both layouts hold the same samples, also after changing the bit depth
+    MLVRawImage* packedImage14 = [packedImage rawImageByChangingBitsPerPixel:14];
+    MLVRawImage* unpackedImage14 = [unpackedImage rawImageByChangingBitsPerPixel:14];
+    XCTAssertTrue(unpackedImage14.unpacked);
+    XCTAssertEqual(unpackedImage14.rawInfo->white_level, packedImage14.rawInfo->white_level);
+
+    for(int32_t y=0; y<rawInfo.height; y++) {
+        for(int32_t x=0; x<rawInfo.width; x++) {
+            XCTAssertEqual(GetRawPixel(unpackedImage.bufferInfo, unpackedImage.rawBuffer, x, y), GetRawPixel(packedImage.bufferInfo, packedImage.rawBuffer, x, y));
+            XCTAssertEqual(GetRawPixel(unpackedImage14.bufferInfo, unpackedImage14.rawBuffer, x, y), GetRawPixel(packedImage14.bufferInfo, packedImage14.rawBuffer, x, y));
+        }
+    }
+}
+
+- (void)testProcessingMatchesSeparatePasses {
+
+    struct raw_info rawInfo;
+    memset(&rawInfo, 0, sizeof(struct raw_info));
+    rawInfo.bits_per_pixel = 12;
+    rawInfo.width = 64;
+    rawInfo.height = 40;
+    rawInfo.pitch = rawInfo.width * rawInfo.bits_per_pixel / 8;
+    rawInfo.frame_size = rawInfo.pitch * rawInfo.height;
+    rawInfo.black_level = 256;
+    rawInfo.white_level = 4095;
+    rawInfo.cfa_pattern = 0x02010100;
+
+    // bright enough that scaled pixels are clipped at the white level
+    uint8_t* buffer = malloc(rawInfo.frame_size);
+    for(int32_t y=0; y<rawInfo.height; y++) {
+        for(int32_t x=0; x<rawInfo.width; x++) {
+            int32_t value = (arc4random_uniform(20) == 0) ? rawInfo.white_level : 300 + arc4random_uniform(rawInfo.white_level - 300);
+            setRawPixel(&rawInfo, buffer, x, y, value);
+        }
+    }
+
+    // isolated dead pixels and same color neighbors that are dead, some across the edge of 8 row bands
+    int32_t deadPixels[][2] = { {5, 3}, {40, 17}, {12, 38}, {20, 10}, {22, 10}, {20, 12}, {30, 6}, {30, 8}, {31, 7}, {31, 9}, {30, 10} };
+    for(size_t i=0; i<sizeof(deadPixels)/sizeof(deadPixels[0]); i++) {
+        setRawPixel(&rawInfo, buffer, deadPixels[i][0], deadPixels[i][1], 0);
+    }
+
+    double coefficients[8] = { 1, 1, 1.02, 0.98, 1.01, 0.99, 1.03, 0.97 };
+    NSData* coefficientsData = [NSData dataWithBytes:coefficients length:sizeof(coefficients)];
+
+    // with given coefficients and with coefficients found in the repaired frame
+    for(int pass=0; pass<2; pass++) {
+        NSData* givenCoefficients = (pass == 0) ? coefficientsData : nil;
+
+        uint8_t* frame = malloc(rawInfo.frame_size);
+        memcpy(frame, buffer, rawInfo.frame_size);
+        MLVRawImage* image = [[MLVRawImage alloc] initWithInfo:rawInfo buffer:frame compressed:NO];
+        MLVRawImage* processedImage = [image copy];
+
+        [image fixDeadPixelsBasedOnPixelMap:nil];
+        [image fixVerticalBandingWithCoefficients:givenCoefficients];
+        NSData* foundCoefficients = image.verticalBandingCoefficients;
+        image = [image rawImageByChangingBitsPerPixel:14];
+
+        [processedImage processWithCorrections:kMLVRawImageCorrectionsDeadPixels|kMLVRawImageCorrectionsVerticalBanding
+                               focusPixelsType:kMLVRawImageFocusPixelsTypeNone cropX:0 cropY:0
+                   verticalBandingCoefficients:givenCoefficients
+                                  bitsPerPixel:14];
+
+        XCTAssertEqualObjects(processedImage.verticalBandingCoefficients, foundCoefficients);
+        XCTAssertTrue(processedImage.unpacked);
+        XCTAssertEqual(processedImage.rawInfo->bits_per_pixel, 14);
+        XCTAssertEqual(processedImage.rawInfo->black_level, image.rawInfo->black_level);
+        XCTAssertEqual(processedImage.rawInfo->white_level, image.rawInfo->white_level);
+
+        for(int32_t y=0; y<rawInfo.height; y++) {
+            for(int32_t x=0; x<rawInfo.width; x++) {
+                XCTAssertEqual(GetRawPixel(processedImage.bufferInfo, processedImage.rawBuffer, x, y), GetRawPixel(image.bufferInfo, image.rawBuffer, x, y), @"x %d y %d pass %d", x, y, pass);
+            }
+        }
+    }
+    free(buffer);
+}
+
+- (void)testRawKernelsMatchPixelAccessors {
+
+    // packed bit depths and 16 bit unpacked samples, with every bayer pattern
+    int bitsPerPixels[] = { 10, 12, 14, 16 };
+    uint32_t cfaPatterns[] = { 0x02010100, 0x01000201, 0x01020001, 0x00010102 };
+
+    for(int k=0; k<16; k++) {
+        struct raw_info rawInfo;
+        memset(&rawInfo, 0, sizeof(struct raw_info));
+        rawInfo.bits_per_pixel = bitsPerPixels[k / 4];
+        rawInfo.width = 8 * 12;
+        rawInfo.height = 20;
+        rawInfo.pitch = rawInfo.width * rawInfo.bits_per_pixel / 8;
+        rawInfo.black_level = 1 << (rawInfo.bits_per_pixel - 4);
+        rawInfo.white_level = (1 << rawInfo.bits_per_pixel) - 1;
+        rawInfo.cfa_pattern = cfaPatterns[k % 4];
+
+        // the thumbnail samples stay inside the frame
+        rawInfo.jpeg.width = rawInfo.width - 2;
+        rawInfo.jpeg.height = rawInfo.height - 2;
+
+        NSMutableData* frame = [[NSMutableData alloc] initWithLength:rawInfo.pitch * rawInfo.height];
+        int32_t maxValue = 0;
+        for(int32_t y=0; y<rawInfo.height; y++) {
+            for(int32_t x=0; x<rawInfo.width; x++) {
+                int32_t value = (arc4random_uniform(30) == 0) ? 0 : rawInfo.black_level + arc4random_uniform(rawInfo.white_level - rawInfo.black_level);
+                setRawPixel(&rawInfo, frame.mutableBytes, x, y, value);
+                maxValue = MAX(maxValue, value);
+            }
+        }
+
+        const mlv_raw_kernels_t* kernels = MLVRawKernelsForInfo(&rawInfo);
+        XCTAssertTrue(kernels != NULL);
+        XCTAssertEqual(kernels->maxValue(&rawInfo, frame.bytes, 0, rawInfo.height), maxValue);
+
+        // thumbnail as sampled by the DNG writer
+        int32_t xadj = (rawInfo.cfa_pattern == 0x01020001) ? 1 : 0;
+        int32_t yadj = (rawInfo.cfa_pattern == 0x01000201) ? 1 : 0;
+        NSMutableData* thumbnail = [[NSMutableData alloc] initWithLength:dng_th_width*dng_th_height*3];
+        NSMutableData* referenceThumbnail = [[NSMutableData alloc] initWithLength:dng_th_width*dng_th_height*3];
+        uint8_t* th = referenceThumbnail.mutableBytes;
+        for(int32_t i=0; i<dng_th_height; i++) {
+            for(int32_t j=0; j<dng_th_width; j++) {
+                int32_t x = (((rawInfo.jpeg.width  * j) / dng_th_width)  & 0xFFFFFFFE) + xadj;
+                int32_t y = (((rawInfo.jpeg.height * i) / dng_th_height) & 0xFFFFFFFE) + yadj;
+                *th++ = RawTo8BitSRGB(GetRawPixel(&rawInfo, frame.mutableBytes, x, y), 0, &rawInfo);
+                *th++ = RawTo8BitSRGB(GetRawPixel(&rawInfo, frame.mutableBytes, x+1, y), -1, &rawInfo);
+                *th++ = RawTo8BitSRGB(GetRawPixel(&rawInfo, frame.mutableBytes, x+1, y+1), 0, &rawInfo);
+            }
+        }
+        kernels->thumbnail(&rawInfo, frame.bytes, thumbnail.mutableBytes, dng_th_width, dng_th_height, &rawInfo);
+        XCTAssertEqualObjects(thumbnail, referenceThumbnail, @"%d bit, pattern %08x", rawInfo.bits_per_pixel, rawInfo.cfa_pattern);
+
+        // highlights, the brightest pixel of every bayer quad
+        size_t halfW = rawInfo.width / 2;
+        NSMutableData* highlights = [[NSMutableData alloc] initWithLength:halfW * rawInfo.height / 2];
+        NSMutableData* referenceHighlights = [[NSMutableData alloc] initWithLength:halfW * rawInfo.height / 2];
+        uint8_t* hl = referenceHighlights.mutableBytes;
+        for(int32_t y=0; y<rawInfo.height; y+=2) {
+            for(int32_t x=0; x<rawInfo.width; x+=2) {
+                int32_t l = MAX(MAX(GetRawPixel(&rawInfo, frame.mutableBytes, x, y), GetRawPixel(&rawInfo, frame.mutableBytes, x+1, y)),
+                                MAX(GetRawPixel(&rawInfo, frame.mutableBytes, x, y+1), GetRawPixel(&rawInfo, frame.mutableBytes, x+1, y+1)));
+                l = RawTo8BitSRGB(l, 0, &rawInfo);
+                *hl++ = COERCE((MAX(0, l-204)*5), 0, 255);
+            }
+        }
+        kernels->highlightRows(&rawInfo, frame.bytes, 0, 10, highlights.mutableBytes, halfW, &rawInfo);
+        kernels->highlightRows(&rawInfo, frame.bytes, 10, rawInfo.height, highlights.mutableBytes, halfW, &rawInfo);
+        XCTAssertEqualObjects(highlights, referenceHighlights, @"%d bit, pattern %08x", rawInfo.bits_per_pixel, rawInfo.cfa_pattern);
+
+        mlv_raw_pixel_t pixels[8 * 12 * 20];
+        size_t count = kernels->findDeadPixels(&rawInfo, frame.bytes, 0, rawInfo.height, pixels);
+        for(size_t i=0; i<count; i++) {
+            XCTAssertEqual(GetRawPixel(&rawInfo, frame.mutableBytes, pixels[i].x, pixels[i].y), 0);
+        }
+
+        // dead pixels interpolated from the unfixed frame through the accessors
+        NSMutableData* reference = [frame mutableCopy];
+        for(size_t i=0; i<count; i++) {
+            int32_t x = pixels[i].x, y = pixels[i].y;
+            setRawPixel(&rawInfo, reference.mutableBytes, x, y, GetInterpolatedPixel(&rawInfo, frame.mutableBytes, x, y));
+        }
+
+        // in two halves, the second half reads rows of the first
+        mlv_raw_fix_t fixes[8 * 12 * 20];
+        size_t fixCount = kernels->interpolateDeadPixels(&rawInfo, frame.bytes, 0, 10, fixes);
+        fixCount += kernels->interpolateDeadPixels(&rawInfo, frame.bytes, 10, rawInfo.height, fixes + fixCount);
+        XCTAssertEqual(fixCount, count);
+
+        // the same values from the list of dead pixels
+        mlv_raw_fix_t listFixes[8 * 12 * 20];
+        XCTAssertEqual(kernels->interpolateDeadPixelList(&rawInfo, frame.bytes, pixels, count, listFixes), count);
+        XCTAssertEqual(memcmp(fixes, listFixes, count * sizeof(mlv_raw_fix_t)), 0);
+
+        kernels->applyFixes(&rawInfo, frame.mutableBytes, fixes, fixCount);
+        XCTAssertEqualObjects(frame, reference, @"%d bit, pattern %08x", rawInfo.bits_per_pixel, rawInfo.cfa_pattern);
+    }
+}
+
+- (void)testRawKernelsFixVerticalBandingOfPartialBlocks {
+
+    // the last 6 columns of a row are a partial block
+    int bitsPerPixels[] = { 10, 12, 14, 16 };
+    double coefficients[8] = { 1.0, 1.0, 1.1, 0.9, 1.05, 0.95, 1.2, 0.8 };
+
+    for(int k=0; k<4; k++) {
+        struct raw_info rawInfo;
+        memset(&rawInfo, 0, sizeof(struct raw_info));
+        rawInfo.bits_per_pixel = bitsPerPixels[k];
+        rawInfo.width = 8 * 12 + 6;
+        rawInfo.height = 4;
+        rawInfo.pitch = (rawInfo.bits_per_pixel == 16) ? rawInfo.width * 2 : (rawInfo.width + 7) / 8 * rawInfo.bits_per_pixel;
+        rawInfo.black_level = 1 << (rawInfo.bits_per_pixel - 4);
+        rawInfo.white_level = (1 << rawInfo.bits_per_pixel) - 1;
+
+        NSMutableData* frame = [[NSMutableData alloc] initWithLength:rawInfo.pitch * rawInfo.height];
+        for(int32_t y=0; y<rawInfo.height; y++) {
+            for(int32_t x=0; x<rawInfo.width; x++) {
+                setRawPixel(&rawInfo, frame.mutableBytes, x, y, rawInfo.black_level + arc4random_uniform((rawInfo.white_level - rawInfo.black_level) / 2));
+            }
+        }
+
+        int32_t low = rawInfo.black_level + 16;
+        int32_t white = rawInfo.white_level;
+        NSMutableData* reference = [frame mutableCopy];
+        for(int32_t y=0; y<rawInfo.height; y++) {
+            for(int32_t x=0; x<rawInfo.width; x++) {
+                int32_t p = GetRawPixel(&rawInfo, reference.mutableBytes, x, y);
+                if (x % 8 >= 2 && p < white && p > low) {
+                    setRawPixel(&rawInfo, reference.mutableBytes, x, y, MIN((int32_t)((p - rawInfo.black_level) * coefficients[x % 8] + rawInfo.black_level), white));
+                }
+            }
+        }
+
+        MLVRawKernelsForInfo(&rawInfo)->fixVerticalBanding(&rawInfo, frame.mutableBytes, 0, rawInfo.height, coefficients, low, white);
+        XCTAssertEqualObjects(frame, reference, @"%d bit", rawInfo.bits_per_pixel);
+    }
+}
+
+#pragma mark - LJ92
+
+/* the decoder once more with every huffman code searched, the reference for the lookup tables */
+#define LJ92_LOOKUP_BITS 0
+#define lj92_open   lj92_reference_open
+#define lj92_decode lj92_reference_decode
+#define lj92_close  lj92_reference_close
+#define lj92_encode lj92_reference_encode
+#define lj92_set_serial lj92_reference_set_serial
+#include "lj92.c"
+#undef lj92_open
+#undef lj92_decode
+#undef lj92_close
+#undef lj92_encode
+#undef lj92_set_serial
+
+/* minimal lossless jpeg writer for synthetic frames, one huffman table with the given code lengths per category */
+typedef struct {
+    __unsafe_unretained NSMutableData* data;
+    uint32_t        bits;
+    int             count;
+    uint16_t        codes[17];
+    uint8_t         lengths[17];
+} LJ92TestWriter;
+
+static void LJ92TestPutByte(LJ92TestWriter* w, uint8_t b) {
+    [w->data appendBytes:&b length:1];
+}
+
+static void LJ92TestPutBits(LJ92TestWriter* w, uint32_t value, int length) {
+    for(int i=length-1; i>=0; i--) {
+        w->bits = (w->bits << 1) | ((value >> i) & 1);
+        if (++w->count == 8) {
+            LJ92TestPutByte(w, w->bits);
+            if (w->bits == 0xFF) {
+                LJ92TestPutByte(w, 0);
+            }
+            w->bits = 0;
+            w->count = 0;
+        }
+    }
+}
+
+static void LJ92TestFlush(LJ92TestWriter* w) {
+    while (w->count) {
+        LJ92TestPutBits(w, 1, 1);
+    }
+}
+
+static NSData* LJ92TestEncode(const uint16_t* samples, int width, int height, int components, int bits, int predictor, int restartRows, const uint8_t* lengths)
+{
+    NSMutableData* data = [NSMutableData data];
+    LJ92TestWriter w = { data, 0, 0, {0}, {0} };
+    uint8_t counts[16] = {0};
+    for(int s=0; s<17; s++) {
+        counts[lengths[s]-1]++;
+    }
+
+    uint8_t header[] = { 0xFF, 0xD8, 0xFF, 0xC3, 0, 8 + 3 * components, bits, height >> 8, height, width >> 8, width, components };
+    [w.data appendBytes:header length:sizeof(header)];
+    for(int c=0; c<components; c++) {
+        uint8_t component[] = { c + 1, 0x11, 0 };
+        [w.data appendBytes:component length:3];
+    }
+
+    // canonical codes in order of length
+    uint8_t dht[] = { 0xFF, 0xC4, 0, 2 + 17 + 17, 0 };
+    [w.data appendBytes:dht length:sizeof(dht)];
+    [w.data appendBytes:counts length:16];
+    uint16_t code = 0;
+    for(int l=1; l<=16; l++) {
+        for(int s=0; s<17; s++) {
+            if (lengths[s] == l) {
+                LJ92TestPutByte(&w, s);
+                w.codes[s] = code++;
+                w.lengths[s] = l;
+            }
+        }
+        code <<= 1;
+    }
+
+    if (restartRows) {
+        int interval = restartRows * width;
+        uint8_t dri[] = { 0xFF, 0xDD, 0, 4, interval >> 8, interval };
+        [w.data appendBytes:dri length:sizeof(dri)];
+    }
+
+    uint8_t sos[] = { 0xFF, 0xDA, 0, 6 + 2 * components, components };
+    [w.data appendBytes:sos length:sizeof(sos)];
+    for(int c=0; c<components; c++) {
+        uint8_t component[] = { c + 1, 0 };
+        [w.data appendBytes:component length:2];
+    }
+    uint8_t scan[] = { predictor, 0, 0 };
+    [w.data appendBytes:scan length:3];
+
+    int stride = width * components;
+    for(int y=0; y<height; y++) {
+        BOOL restart = (y == 0 || (restartRows && y % restartRows == 0));
+        if (y > 0 && restart) {
+            LJ92TestFlush(&w);
+            LJ92TestPutByte(&w, 0xFF);
+            LJ92TestPutByte(&w, 0xD0 + (y / restartRows - 1) % 8);
+        }
+
+        for(int i=0; i<stride; i++) {
+            int ra = (i >= components) ? samples[y*stride + i - components] : 0;
+            int rb = (y > 0) ? samples[(y-1)*stride + i] : 0;
+            int rc = (y > 0 && i >= components) ? samples[(y-1)*stride + i - components] : 0;
+
+            int prediction;
+            if (restart) {
+                prediction = (i < components) ? 1 << (bits - 1) : ra;
+            } else if (i < components) {
+                prediction = rb;
+            } else {
+                int predictions[] = { 0, ra, rb, rc, ra + rb - rc, ra + ((rb - rc) >> 1), rb + ((ra - rc) >> 1), (ra + rb) >> 1 };
+                prediction = predictions[predictor];
+            }
+
+            int diff = (int16_t)(samples[y*stride + i] - prediction);
+            int ssss = 0;
+            for(int a=abs(diff); a; a>>=1) {
+                ssss++;
+            }
+            LJ92TestPutBits(&w, w.codes[ssss], w.lengths[ssss]);
+            if (ssss < 16) {
+                LJ92TestPutBits(&w, (diff < 0) ? diff + (1 << ssss) - 1 : diff, ssss);
+            }
+        }
+    }
+    LJ92TestFlush(&w);
+    LJ92TestPutByte(&w, 0xFF);
+    LJ92TestPutByte(&w, 0xD9);
+    return data;
+}
+
+static NSData* LJ92TestFrame(int width, int height, int components, int bits)
+{
+    NSMutableData* frame = [[NSMutableData alloc] initWithLength:width * height * components * sizeof(uint16_t)];
+    uint16_t* samples = frame.mutableBytes;
+    for(int y=0; y<height; y++) {
+        for(int i=0; i<width*components; i++) {
+            // smooth gradient with noise and a few outliers
+            int value = 1024 + (i / components) * 3 + y * 2 + arc4random_uniform(64);
+            if (arc4random_uniform(100) == 0) {
+                value = arc4random();
+            }
+            samples[y * width * components + i] = value & ((1 << bits) - 1);
+        }
+    }
+    return frame;
+}
+
+static NSData* LJ92TestDecode(NSData* encoded, int* error)
+{
+    lj92 handle;
+    int width, height, bits, components;
+    *error = lj92_open(&handle, encoded.bytes, (int)encoded.length, &width, &height, &bits, &components);
+    if (*error != LJ92_ERROR_NONE) {
+        return nil;
+    }
+
+    NSMutableData* decoded = [[NSMutableData alloc] initWithLength:width * height * components * sizeof(uint16_t)];
+    *error = lj92_decode(handle, decoded.mutableBytes, width * components, 0, NULL, 0);
+    lj92_close(handle);
+    return decoded;
+}
+
+static NSData* LJ92ReferenceDecode(NSData* encoded, int* error)
+{
+    lj92 handle;
+    int width, height, bits, components;
+    *error = lj92_reference_open(&handle, encoded.bytes, (int)encoded.length, &width, &height, &bits, &components);
+    if (*error != LJ92_ERROR_NONE) {
+        return nil;
+    }
+
+    NSMutableData* decoded = [[NSMutableData alloc] initWithLength:width * height * components * sizeof(uint16_t)];
+    *error = lj92_reference_decode(handle, decoded.mutableBytes, width * components, 0, NULL, 0);
+    lj92_reference_close(handle);
+    return decoded;
+}
+
+// short codes that mostly fit the lookup table and a table that needs codes up to 16 bits
+static const uint8_t kLJ92TestShortLengths[17] = { 4, 5, 5, 4, 4, 3, 3, 3, 4, 5, 6, 7, 8, 9, 10, 11, 11 };
+static const uint8_t kLJ92TestLongLengths[17] = { 16, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 };
+
+- (void)testLJ92DecodingIsBitExact {
+
+    const uint8_t* tables[] = { kLJ92TestShortLengths, kLJ92TestLongLengths };
+
+    for(int t=0; t<2; t++) {
+        for(int predictor=1; predictor<=7; predictor++) {
+            for(int components=1; components<=2; components++) {
+                for(int restartRows=0; restartRows<=3; restartRows+=3) {
+                    NSData* frame = LJ92TestFrame(64, 40, components, 14);
+                    NSData* encoded = LJ92TestEncode(frame.bytes, 64, 40, components, 14, predictor, restartRows, tables[t]);
+
+                    int error;
+                    NSData* decoded = LJ92TestDecode(encoded, &error);
+                    XCTAssertEqual(error, LJ92_ERROR_NONE);
+                    XCTAssertEqualObjects(decoded, frame, @"table %d, predictor %d, %d components, restart %d", t, predictor, components, restartRows);
+                }
+            }
+        }
+    }
+
+    // large enough to be decoded in bands
+    for(int predictor=1; predictor<=7; predictor+=3) {
+        NSData* frame = LJ92TestFrame(1024, 400, 2, 14);
+        NSData* encoded = LJ92TestEncode(frame.bytes, 1024, 400, 2, 14, predictor, 0, kLJ92TestShortLengths);
+
+        int error;
+        XCTAssertEqualObjects(LJ92TestDecode(encoded, &error), frame, @"predictor %d", predictor);
+
+        // truncated data must fail without reading past the end
+        NSData* truncated = [encoded subdataWithRange:NSMakeRange(0, encoded.length / 2)];
+        LJ92TestDecode(truncated, &error);
+        XCTAssertEqual(error, LJ92_ERROR_CORRUPT);
+    }
+}
+
+- (void)testLJ92EncodingRoundTrip {
+
+    for(int predictor=1; predictor<=7; predictor++) {
+        for(int components=1; components<=4; components++) {
+            for(int restartRows=0; restartRows<=5; restartRows+=5) {
+                NSData* frame = LJ92TestFrame(48, 30, components, 12);
+
+                uint8_t* encoded = NULL;
+                int encodedLength = 0;
+                int ret = lj92_encode(frame.bytes, 48, 30, 12, components, 48 * components, predictor, restartRows, &encoded, &encodedLength);
+                XCTAssertEqual(ret, LJ92_ERROR_NONE);
+
+                int error;
+                NSData* decoded = LJ92TestDecode([NSData dataWithBytesNoCopy:encoded length:encodedLength freeWhenDone:YES], &error);
+                XCTAssertEqual(error, LJ92_ERROR_NONE);
+                XCTAssertEqualObjects(decoded, frame, @"predictor %d, %d components, restart %d", predictor, components, restartRows);
+            }
+        }
+    }
+}
+
+- (void)testCompressingRawImage {
+
+    struct raw_info rawInfo;
+    memset(&rawInfo, 0, sizeof(struct raw_info));
+    rawInfo.bits_per_pixel = 14;
+    rawInfo.width = 64;
+    rawInfo.height = 40;
+    rawInfo.pitch = rawInfo.width * rawInfo.bits_per_pixel / 8;
+    rawInfo.frame_size = rawInfo.pitch * rawInfo.height;
+    rawInfo.black_level = 2048;
+    rawInfo.white_level = 15000;
+    rawInfo.cfa_pattern = 0x02010100;
+
+    uint8_t* buffer = malloc(rawInfo.frame_size);
+    for(int32_t y=0; y<rawInfo.height; y++) {
+        for(int32_t x=0; x<rawInfo.width; x++) {
+            setRawPixel(&rawInfo, buffer, x, y, 2048 + x * 16 + (y & 1) * 1000 + arc4random_uniform(256));
+        }
+    }
+
+    MLVRawImage* image = [[MLVRawImage alloc] initWithInfo:rawInfo buffer:buffer compressed:NO];
+    MLVRawImage* compressedImage = [image rawImageByCompressingBuffer];
+    XCTAssertTrue(compressedImage.compressed);
+    XCTAssertLessThan(compressedImage.rawInfo->frame_size, rawInfo.frame_size);
+
+    MLVRawImage* decompressedImage = [compressedImage rawImageByDecompressingBuffer];
+    for(int32_t y=0; y<rawInfo.height; y++) {
+        for(int32_t x=0; x<rawInfo.width; x++) {
+            XCTAssertEqual(GetRawPixel(decompressedImage.bufferInfo, decompressedImage.rawBuffer, x, y), GetRawPixel(&rawInfo, image.rawBuffer, x, y), @"x %d y %d", x, y);
+        }
+    }
+
+    XCTAssertLessThan([image dngDataIncludingThumbnail:YES compressed:YES].length, image.dngData.length);
+
+    // a truncated frame can't be compressed, its DNG is written uncompressed
+    struct raw_info truncatedInfo = rawInfo;
+    truncatedInfo.frame_size = rawInfo.frame_size / 2;
+    uint8_t* truncatedBuffer = malloc(truncatedInfo.frame_size);
+    memcpy(truncatedBuffer, image.rawBuffer, truncatedInfo.frame_size);
+    MLVRawImage* truncatedImage = [[MLVRawImage alloc] initWithInfo:truncatedInfo buffer:truncatedBuffer compressed:NO];
+    XCTAssertNil([truncatedImage rawImageByCompressingBuffer]);
+    XCTAssertEqual([truncatedImage dngDataIncludingThumbnail:YES compressed:YES].length, truncatedImage.dngData.length);
+
+    // a passed through frame has no preview, the raw image is the first IFD
+    NSData* passedThrough = compressedImage.dngData;
+    const uint8_t* tiff = passedThrough.bytes;
+    XCTAssertEqual(*(const uint16_t*)(tiff + 10), 0xFE);        // NewSubFileType
+    XCTAssertEqual(*(const uint32_t*)(tiff + 18), 0);           // main image
+    XCTAssertLessThan(passedThrough.length, compressedImage.rawInfo->frame_size + dng_th_width*dng_th_height*3);
+
+    // without a thumbnail the raw image is the first IFD as well
+    NSData* withoutThumbnail = [image dngDataIncludingThumbnail:NO];
+    XCTAssertEqual(*(const uint32_t*)((const uint8_t*)withoutThumbnail.bytes + 18), 0);
+    XCTAssertLessThanOrEqual(withoutThumbnail.length, image.dngData.length - dng_th_width*dng_th_height*3);
+}
+
+- (void)testLJ92DecodingPerformance {
+
+    // 14 bit, 960x2160 samples in 2 components, on one thread to compare with the reference decoder
+    NSData* frame = LJ92TestFrame(960, 2160, 2, 14);
+    NSData* encoded = LJ92TestEncode(frame.bytes, 960, 2160, 2, 14, 1, 0, kLJ92TestShortLengths);
+
+    lj92_set_serial(1);
+    [self measureBlock:^{
+        for(int i=0; i<10; i++) {
+            int error;
+            LJ92TestDecode(encoded, &error);
+        }
+    }];
+    lj92_set_serial(0);
+}
+
+- (void)testLJ92ReferenceDecodingPerformance {
+
+    // the frame of testLJ92DecodingPerformance with every code searched, on one thread as well
+    NSData* frame = LJ92TestFrame(960, 2160, 2, 14);
+    NSData* encoded = LJ92TestEncode(frame.bytes, 960, 2160, 2, 14, 1, 0, kLJ92TestShortLengths);
+
+    int error;
+    XCTAssertEqualObjects(LJ92ReferenceDecode(encoded, &error), frame);
+
+    lj92_set_serial(1);
+    lj92_reference_set_serial(1);
+
+    // best of a few runs, the lookup tables have to be faster than searching every code
+    CFTimeInterval decodingTime = INFINITY;
+    CFTimeInterval referenceDecodingTime = INFINITY;
+    for(int run=0; run<3; run++) {
+        CFTimeInterval start = CFAbsoluteTimeGetCurrent();
+        LJ92TestDecode(encoded, &error);
+        decodingTime = MIN(decodingTime, CFAbsoluteTimeGetCurrent() - start);
+
+        start = CFAbsoluteTimeGetCurrent();
+        LJ92ReferenceDecode(encoded, &error);
+        referenceDecodingTime = MIN(referenceDecodingTime, CFAbsoluteTimeGetCurrent() - start);
+    }
+    XCTAssertGreaterThan(referenceDecodingTime, decodingTime);
+
+    [self measureBlock:^{
+        for(int i=0; i<10; i++) {
+            int error;
+            LJ92ReferenceDecode(encoded, &error);
+        }
+    }];
+
+    lj92_set_serial(0);
+    lj92_reference_set_serial(0);
+}
+
 /*
 - (void)testXPCProcessAttributes
 {
@@ -0,0 +1,1256 @@
+/*
+lj92.c
+(c) Andrew Baldwin 2014
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "lj92.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#if defined(__APPLE__)
+#include <dispatch/dispatch.h>
+#endif
+
+#define LJ92_MAX_COMPONENTS         4
+#define LJ92_MAX_TABLES             4
+
+/* a few bands per core so uneven bands even out, small frames are not worth the index pass */
+#define LJ92_BANDS_PER_CPU          4
+#define LJ92_MIN_BAND_ROWS          16
+#define LJ92_MIN_PARALLEL_SAMPLES   (1 << 18)
+
+/*
+ * Codes up to LJ92_LOOKUP_BITS are decoded with one table lookup, together with
+ * their extra bits if those fit as well. Longer codes are rare and searched.
+ * One symbol is decoded per lookup. Built with LJ92_LOOKUP_BITS=0 every code is
+ * searched, the reference the tables are measured against.
+ */
+#ifndef LJ92_LOOKUP_BITS
+#define LJ92_LOOKUP_BITS            13
+#endif
+#define LJ92_LOOKUP_DECODED         0xFF
+
+typedef struct {
+    int16_t     diff;               // complete difference if ssss is LJ92_LOOKUP_DECODED
+    uint8_t     length;             // bits consumed, 0 for codes longer than the table
+    uint8_t     ssss;
+} lj92_lookup_t;
+
+typedef struct {
+    int32_t     maxcode[17];        // largest code of every length, -1 if there is none
+    int32_t     mincode[17];
+    int32_t     valptr[17];
+    uint8_t     huffval[256];
+    lj92_lookup_t lookup[1 << LJ92_LOOKUP_BITS];
+    bool        defined;
+} lj92_huffman_t;
+
+struct _lj92 {
+    const uint8_t*  data;
+    size_t          length;
+
+    int             width;              // samples per line and component
+    int             height;
+    int             bits;
+    int             components;
+    int             predictor;
+    int             pointTransform;
+    int             restartInterval;    // MCUs, 0 without restart markers
+
+    lj92_huffman_t  tables[LJ92_MAX_TABLES];
+    int             componentTable[LJ92_MAX_COMPONENTS];
+
+    size_t          scanOffset;         // first byte of the entropy coded data
+};
+
+/* entropy coded data without byte stuffing and restart markers */
+typedef struct {
+    uint8_t*        data;               // padded with zeros, a corrupt row can't read past it
+    size_t          length;
+    size_t*         segments;           // first byte of every restart interval
+    size_t          count;
+} lj92_stream_t;
+
+typedef struct {
+    const uint8_t*  data;
+    uint64_t        pos;                // bits
+} lj92_bits_t;
+
+static inline uint16_t _lj92_read16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+}
+
+#pragma mark - Headers
+
+static int _lj92_build_huffman(lj92_huffman_t* table, const uint8_t* counts, const uint8_t* values, int total)
+{
+    int32_t code = 0;
+    int32_t k = 0;
+    for (int l=1; l<=16; l++) {
+        table->valptr[l] = k;
+        table->mincode[l] = code;
+        code += counts[l-1];
+        k += counts[l-1];
+        if (code > (1 << l)) {
+            return LJ92_ERROR_CORRUPT;
+        }
+        table->maxcode[l] = (counts[l-1]) ? code - 1 : -1;
+        code <<= 1;
+    }
+
+    memcpy(table->huffval, values, total);
+    memset(table->lookup, 0, sizeof(table->lookup));
+
+    for (int l=1; l<=LJ92_LOOKUP_BITS; l++) {
+        for (int32_t code=table->mincode[l]; code<=table->maxcode[l]; code++) {
+            int ssss = table->huffval[table->valptr[l] + code - table->mincode[l]];
+            int spare = LJ92_LOOKUP_BITS - l;
+
+            for (int32_t e=0; e<(1 << spare); e++) {
+                lj92_lookup_t* entry = &table->lookup[(code << spare) | e];
+                entry->length = l;
+                entry->ssss = ssss;
+
+                if (ssss == 0) {
+                    entry->ssss = LJ92_LOOKUP_DECODED;
+                }
+                else if (ssss < 16 && ssss <= spare) {
+                    int v = e >> (spare - ssss);
+                    entry->diff = (v < (1 << (ssss - 1))) ? v - (1 << ssss) + 1 : v;
+                    entry->length = l + ssss;
+                    entry->ssss = LJ92_LOOKUP_DECODED;
+                }
+            }
+        }
+    }
+
+    table->defined = true;
+    return LJ92_ERROR_NONE;
+}
+
+static int _lj92_parse(struct _lj92* self)
+{
+    const uint8_t* data = self->data;
+    size_t length = self->length;
+    if (length < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return LJ92_ERROR_CORRUPT;
+    }
+
+    bool frame = false;
+    int componentIds[LJ92_MAX_COMPONENTS];
+
+    size_t pos = 2;
+    while (pos + 4 <= length) {
+        if (data[pos] != 0xFF) {
+            return LJ92_ERROR_CORRUPT;
+        }
+        uint8_t marker = data[pos+1];
+        if (marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        pos += 2;
+
+        if (marker == 0xD9) {
+            break;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            continue;
+        }
+
+        size_t segmentLength = _lj92_read16(data + pos);
+        if (segmentLength < 2 || pos + segmentLength > length) {
+            return LJ92_ERROR_CORRUPT;
+        }
+        const uint8_t* segment = data + pos + 2;
+        size_t n = segmentLength - 2;
+
+        switch (marker) {
+            case 0xC3: {
+                if (n < 6) {
+                    return LJ92_ERROR_CORRUPT;
+                }
+                self->bits = segment[0];
+                self->height = _lj92_read16(segment + 1);
+                self->width = _lj92_read16(segment + 3);
+                self->components = segment[5];
+                if (self->components < 1 || self->components > LJ92_MAX_COMPONENTS || n < 6 + 3 * (size_t)self->components ||
+                    self->bits < 2 || self->bits > 16 || self->width == 0 || self->height == 0)
+                {
+                    return LJ92_ERROR_CORRUPT;
+                }
+                for (int c=0; c<self->components; c++) {
+                    componentIds[c] = segment[6 + 3*c];
+                    /* no subsampling */
+                    if (segment[7 + 3*c] != 0x11) {
+                        return LJ92_ERROR_CORRUPT;
+                    }
+                }
+                frame = true;
+                break;
+            }
+
+            case 0xC4: {
+                while (n >= 17) {
+                    int th = segment[0] & 0x0F;
+                    int total = 0;
+                    for (int l=0; l<16; l++) {
+                        total += segment[1 + l];
+                    }
+                    if (th >= LJ92_MAX_TABLES || total > 256 || n < 17 + (size_t)total) {
+                        return LJ92_ERROR_CORRUPT;
+                    }
+                    if (_lj92_build_huffman(&self->tables[th], segment + 1, segment + 17, total) != LJ92_ERROR_NONE) {
+                        return LJ92_ERROR_CORRUPT;
+                    }
+                    segment += 17 + total;
+                    n -= 17 + total;
+                }
+                break;
+            }
+
+            case 0xDD: {
+                if (n < 2) {
+                    return LJ92_ERROR_CORRUPT;
+                }
+                self->restartInterval = _lj92_read16(segment);
+                break;
+            }
+
+            case 0xDA: {
+                /* one interleaved scan with all components */
+                if (!frame || n < 1 || segment[0] != self->components || n < 4 + 2 * (size_t)self->components) {
+                    return LJ92_ERROR_CORRUPT;
+                }
+                for (int c=0; c<self->components; c++) {
+                    int table = segment[2 + 2*c] >> 4;
+                    if (segment[1 + 2*c] != componentIds[c] || table >= LJ92_MAX_TABLES || !self->tables[table].defined) {
+                        return LJ92_ERROR_CORRUPT;
+                    }
+                    self->componentTable[c] = table;
+                }
+                self->predictor = segment[1 + 2*self->components];
+                self->pointTransform = segment[3 + 2*self->components] & 0x0F;
+                if (self->predictor < 1 || self->predictor > 7 || self->pointTransform >= self->bits) {
+                    return LJ92_ERROR_CORRUPT;
+                }
+
+                /* restart intervals of lossless scans are whole lines */
+                if (self->restartInterval % self->width != 0) {
+                    return LJ92_ERROR_CORRUPT;
+                }
+
+                self->scanOffset = pos + segmentLength;
+                return LJ92_ERROR_NONE;
+            }
+
+            case 0xC0: case 0xC1: case 0xC2: case 0xC5: case 0xC6: case 0xC7:
+            case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+                /* not lossless */
+                return LJ92_ERROR_CORRUPT;
+
+            default:
+                break;
+        }
+        pos += segmentLength;
+    }
+    return LJ92_ERROR_CORRUPT;
+}
+
+int lj92_open(lj92* lj, const uint8_t* data, int datalen, int* width, int* height, int* bitdepth, int* components)
+{
+    if (!lj || !data || datalen <= 0) {
+        return LJ92_ERROR_BAD_HANDLE;
+    }
+    *lj = NULL;
+
+    struct _lj92* self = calloc(1, sizeof(struct _lj92));
+    if (!self) {
+        return LJ92_ERROR_NO_MEMORY;
+    }
+    self->data = data;
+    self->length = datalen;
+
+    int ret = _lj92_parse(self);
+    if (ret != LJ92_ERROR_NONE) {
+        free(self);
+        return ret;
+    }
+
+    *lj = self;
+    if (width) *width = self->width;
+    if (height) *height = self->height;
+    if (bitdepth) *bitdepth = self->bits;
+    if (components) *components = self->components;
+    return LJ92_ERROR_NONE;
+}
+
+void lj92_close(lj92 lj)
+{
+    free(lj);
+}
+
+#pragma mark - Entropy coded data
+
+static void _lj92_free_stream(lj92_stream_t* stream)
+{
+    free(stream->data);
+    free(stream->segments);
+}
+
+static int _lj92_read_stream(const struct _lj92* self, lj92_stream_t* stream)
+{
+    const uint8_t* src = self->data + self->scanOffset;
+    size_t n = self->length - self->scanOffset;
+
+    /* a row of a corrupt stream reads at most 32 bits per sample */
+    size_t padding = (size_t)self->width * self->components * 4 + 16;
+    size_t maxSegments = 1;
+    if (self->restartInterval > 0) {
+        size_t rows = self->restartInterval / self->width;
+        maxSegments = (self->height + rows - 1) / rows;
+    }
+
+    stream->data = malloc(n + padding);
+    stream->segments = malloc(maxSegments * sizeof(size_t));
+    if (!stream->data || !stream->segments) {
+        _lj92_free_stream(stream);
+        return LJ92_ERROR_NO_MEMORY;
+    }
+
+    uint8_t* dst = stream->data;
+    size_t length = 0;
+    stream->segments[0] = 0;
+    stream->count = 1;
+
+    size_t i = 0;
+    while (i < n) {
+        const uint8_t* ff = memchr(src + i, 0xFF, n - i);
+        size_t run = (ff) ? (size_t)(ff - (src + i)) : n - i;
+        memcpy(dst + length, src + i, run);
+        length += run;
+        i += run;
+
+        if (!ff || i + 1 >= n) {
+            break;
+        }
+
+        uint8_t next = src[i+1];
+        if (next == 0x00) {
+            dst[length++] = 0xFF;
+            i += 2;
+        }
+        else if (next >= 0xD0 && next <= 0xD7) {
+            if (stream->count < maxSegments) {
+                stream->segments[stream->count++] = length;
+            }
+            i += 2;
+        }
+        else if (next == 0xFF) {
+            i++;
+        }
+        else {
+            /* EOI or another marker ends the scan */
+            break;
+        }
+    }
+
+    memset(dst + length, 0, padding);
+    stream->length = length;
+
+    if (stream->count < maxSegments) {
+        _lj92_free_stream(stream);
+        return LJ92_ERROR_CORRUPT;
+    }
+    return LJ92_ERROR_NONE;
+}
+
+#pragma mark - Decoding
+
+static inline uint32_t _lj92_peek16(const lj92_bits_t* bits)
+{
+    const uint8_t* p = bits->data + (bits->pos >> 3);
+    uint32_t v = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    return (v << (bits->pos & 7)) >> 16;
+}
+
+/* category of a code longer than the lookup table, -1 for a code that is not in the table */
+static int _lj92_decode_long_ssss(lj92_bits_t* bits, const lj92_huffman_t* table)
+{
+    uint32_t peek = _lj92_peek16(bits);
+    for (int l=LJ92_LOOKUP_BITS+1; l<=16; l++) {
+        int32_t code = peek >> (16 - l);
+        if (code <= table->maxcode[l]) {
+            bits->pos += l;
+            return table->huffval[table->valptr[l] + code - table->mincode[l]];
+        }
+    }
+    return -1;
+}
+
+/* consumes the code and returns the difference if it was decoded completely, otherwise sets ssss */
+static inline bool _lj92_lookup(lj92_bits_t* bits, const lj92_huffman_t* table, int* diff, int* ssss)
+{
+    lj92_lookup_t entry = table->lookup[_lj92_peek16(bits) >> (16 - LJ92_LOOKUP_BITS)];
+    if (entry.ssss == LJ92_LOOKUP_DECODED) {
+        bits->pos += entry.length;
+        *diff = entry.diff;
+        return true;
+    }
+
+    if (entry.length) {
+        bits->pos += entry.length;
+        *ssss = entry.ssss;
+    } else {
+        *ssss = _lj92_decode_long_ssss(bits, table);
+    }
+    return false;
+}
+
+static inline int _lj92_decode_diff(lj92_bits_t* bits, const lj92_huffman_t* table, int* error)
+{
+    int diff, ssss;
+    if (_lj92_lookup(bits, table, &diff, &ssss)) {
+        return diff;
+    }
+
+    if (ssss <= 0 || ssss >= 16) {
+        *error |= (ssss < 0 || ssss > 16);
+        return (ssss == 16) ? 32768 : 0;
+    }
+
+    uint32_t v = _lj92_peek16(bits) >> (16 - ssss);
+    bits->pos += ssss;
+    return (v < (1u << (ssss - 1))) ? (int)v - (1 << ssss) + 1 : (int)v;
+}
+
+static inline void _lj92_skip_diff(lj92_bits_t* bits, const lj92_huffman_t* table, int* error)
+{
+    int diff, ssss;
+    if (_lj92_lookup(bits, table, &diff, &ssss)) {
+        return;
+    }
+
+    if (ssss > 0 && ssss < 16) {
+        bits->pos += ssss;
+    }
+    *error |= (ssss < 0 || ssss > 16);
+}
+
+static inline int _lj92_predict(int predictor, int ra, int rb, int rc)
+{
+    switch (predictor) {
+        case 1:  return ra;
+        case 2:  return rb;
+        case 3:  return rc;
+        case 4:  return ra + rb - rc;
+        case 5:  return ra + ((rb - rc) >> 1);
+        case 6:  return rb + ((ra - rc) >> 1);
+        default: return (ra + rb) >> 1;
+    }
+}
+
+/* a row after its first sample, inlined for every predictor so nothing is switched per sample */
+static inline __attribute__((always_inline)) void _lj92_decode_row(lj92_bits_t* bits, const lj92_huffman_t** tables, int nc, size_t stride,
+                                                                   uint16_t* row, const uint16_t* above, int predictor, int* error)
+{
+    lj92_bits_t b = *bits;
+    int e = 0;
+
+    for (size_t i=nc; i<stride; i+=nc) {
+        for (int c=0; c<nc; c++) {
+            int pred = (predictor == 1) ? row[i+c-nc] : _lj92_predict(predictor, row[i+c-nc], above[i+c], above[i+c-nc]);
+            row[i+c] = pred + _lj92_decode_diff(&b, tables[c], &e);
+        }
+    }
+
+    *bits = b;
+    *error |= e;
+}
+
+static void _lj92_decode_predicted_row(lj92_bits_t* bits, const lj92_huffman_t** tables, int nc, size_t stride,
+                                       uint16_t* row, const uint16_t* above, int predictor, int* error)
+{
+    switch (predictor) {
+        case 1:  _lj92_decode_row(bits, tables, nc, stride, row, above, 1, error); break;
+        case 2:  _lj92_decode_row(bits, tables, nc, stride, row, above, 2, error); break;
+        case 3:  _lj92_decode_row(bits, tables, nc, stride, row, above, 3, error); break;
+        case 4:  _lj92_decode_row(bits, tables, nc, stride, row, above, 4, error); break;
+        case 5:  _lj92_decode_row(bits, tables, nc, stride, row, above, 5, error); break;
+        case 6:  _lj92_decode_row(bits, tables, nc, stride, row, above, 6, error); break;
+        default: _lj92_decode_row(bits, tables, nc, stride, row, above, 7, error); break;
+    }
+}
+
+static inline void _lj92_component_tables(const struct _lj92* self, const lj92_huffman_t** tables)
+{
+    for (int c=0; c<self->components; c++) {
+        tables[c] = &self->tables[self->componentTable[c]];
+    }
+}
+
+/* rows [y0, y1), the row before y0 is decoded already unless y0 starts the scan or a restart interval */
+static int _lj92_decode_rows(const struct _lj92* self, lj92_bits_t* bits, uint64_t limit, uint16_t* out, int y0, int y1, bool restart)
+{
+    const lj92_huffman_t* tables[LJ92_MAX_COMPONENTS];
+    _lj92_component_tables(self, tables);
+
+    int nc = self->components;
+    size_t stride = (size_t)self->width * nc;
+    int initial = 1 << (self->bits - self->pointTransform - 1);
+    int error = 0;
+
+    for (int y=y0; y<y1; y++) {
+        uint16_t* row = out + y * stride;
+        const uint16_t* above = row - stride;
+        bool firstLine = restart && y == y0;
+
+        for (int c=0; c<nc; c++) {
+            row[c] = ((firstLine) ? initial : above[c]) + _lj92_decode_diff(bits, tables[c], &error);
+        }
+
+        _lj92_decode_predicted_row(bits, tables, nc, stride, row, above, (firstLine) ? 1 : self->predictor, &error);
+
+        if (error || bits->pos > limit) {
+            return LJ92_ERROR_CORRUPT;
+        }
+    }
+    return LJ92_ERROR_NONE;
+}
+
+/*
+ * First pass without restart markers: walks the huffman codes to find the first bit of every band.
+ * With predictor 1 only the first column depends on the row above, it is reconstructed here
+ * and every band can be finished on its own.
+ */
+static int _lj92_index_rows(const struct _lj92* self, const lj92_stream_t* stream, int bandRows, uint64_t* positions, uint16_t* firstColumn)
+{
+    const lj92_huffman_t* tables[LJ92_MAX_COMPONENTS];
+    _lj92_component_tables(self, tables);
+
+    int nc = self->components;
+    int initial = 1 << (self->bits - self->pointTransform - 1);
+    uint64_t limit = (uint64_t)stream->length * 8;
+    lj92_bits_t bits = { stream->data, 0 };
+    int error = 0;
+
+    for (int y=0; y<self->height; y++) {
+        if (y % bandRows == 0) {
+            positions[y / bandRows] = bits.pos;
+        }
+
+        for (int c=0; c<nc; c++) {
+            if (firstColumn) {
+                int pred = (y == 0) ? initial : firstColumn[(y-1) * nc + c];
+                firstColumn[y * nc + c] = pred + _lj92_decode_diff(&bits, tables[c], &error);
+            } else {
+                _lj92_skip_diff(&bits, tables[c], &error);
+            }
+        }
+        for (int x=1; x<self->width; x++) {
+            for (int c=0; c<nc; c++) {
+                _lj92_skip_diff(&bits, tables[c], &error);
+            }
+        }
+
+        if (error || bits.pos > limit) {
+            return LJ92_ERROR_CORRUPT;
+        }
+    }
+    return LJ92_ERROR_NONE;
+}
+
+/* predictor 1 rows with the first column known from the index pass */
+static int _lj92_decode_rows_from_first_column(const struct _lj92* self, lj92_bits_t* bits, uint64_t limit, uint16_t* out, int y0, int y1, const uint16_t* firstColumn)
+{
+    const lj92_huffman_t* tables[LJ92_MAX_COMPONENTS];
+    _lj92_component_tables(self, tables);
+
+    int nc = self->components;
+    size_t stride = (size_t)self->width * nc;
+    int error = 0;
+
+    for (int y=y0; y<y1; y++) {
+        uint16_t* row = out + y * stride;
+        for (int c=0; c<nc; c++) {
+            _lj92_skip_diff(bits, tables[c], &error);
+            row[c] = firstColumn[y * nc + c];
+        }
+        _lj92_decode_row(bits, tables, nc, stride, row, NULL, 1, &error);
+
+        if (error || bits->pos > limit) {
+            return LJ92_ERROR_CORRUPT;
+        }
+    }
+    return LJ92_ERROR_NONE;
+}
+
+/* the other predictors need the whole row above, the bands only store the differences */
+static int _lj92_decode_differences(const struct _lj92* self, lj92_bits_t* bits, uint64_t limit, uint16_t* out, int y0, int y1)
+{
+    const lj92_huffman_t* tables[LJ92_MAX_COMPONENTS];
+    _lj92_component_tables(self, tables);
+
+    int nc = self->components;
+    size_t stride = (size_t)self->width * nc;
+    int error = 0;
+
+    for (int y=y0; y<y1; y++) {
+        uint16_t* row = out + y * stride;
+        for (size_t i=0; i<stride; i+=nc) {
+            for (int c=0; c<nc; c++) {
+                row[i+c] = _lj92_decode_diff(bits, tables[c], &error);
+            }
+        }
+
+        if (error || bits->pos > limit) {
+            return LJ92_ERROR_CORRUPT;
+        }
+    }
+    return LJ92_ERROR_NONE;
+}
+
+static inline __attribute__((always_inline)) void _lj92_add_row_predictions(uint16_t* row, const uint16_t* above, int nc, size_t stride, int predictor)
+{
+    for (size_t i=nc; i<stride; i++) {
+        row[i] += _lj92_predict(predictor, row[i-nc], above[i], above[i-nc]);
+    }
+}
+
+static void _lj92_add_predictions(const struct _lj92* self, uint16_t* out)
+{
+    int nc = self->components;
+    size_t stride = (size_t)self->width * nc;
+    int initial = 1 << (self->bits - self->pointTransform - 1);
+
+    for (int y=0; y<self->height; y++) {
+        uint16_t* row = out + y * stride;
+        const uint16_t* above = row - stride;
+
+        for (int c=0; c<nc; c++) {
+            row[c] += (y == 0) ? initial : above[c];
+        }
+        if (y == 0) {
+            for (size_t i=nc; i<stride; i++) {
+                row[i] += row[i-nc];
+            }
+        } else {
+            switch (self->predictor) {
+                case 2:  _lj92_add_row_predictions(row, above, nc, stride, 2); break;
+                case 3:  _lj92_add_row_predictions(row, above, nc, stride, 3); break;
+                case 4:  _lj92_add_row_predictions(row, above, nc, stride, 4); break;
+                case 5:  _lj92_add_row_predictions(row, above, nc, stride, 5); break;
+                case 6:  _lj92_add_row_predictions(row, above, nc, stride, 6); break;
+                default: _lj92_add_row_predictions(row, above, nc, stride, 7); break;
+            }
+        }
+    }
+}
+
+#pragma mark - Threads
+
+typedef struct {
+    const struct _lj92*     lj;
+    const lj92_stream_t*    stream;
+    uint16_t*               out;
+    int                     rows;           // rows of a band or restart interval
+    const uint64_t*         positions;      // first bit of every band
+    const uint16_t*         firstColumn;
+    int*                    errors;
+} lj92_job_t;
+
+static int _lj92_serial = 0;
+
+void lj92_set_serial(int serial)
+{
+    _lj92_serial = serial;
+}
+
+static void _lj92_apply(size_t count, void* context, void (*work)(void*, size_t))
+{
+#if defined(__APPLE__)
+    if (!_lj92_serial) {
+        dispatch_apply_f(count, dispatch_get_global_queue(0, 0), context, work);
+        return;
+    }
+#endif
+    for (size_t i=0; i<count; i++) {
+        work(context, i);
+    }
+}
+
+static void _lj92_decode_interval(void* context, size_t i)
+{
+    lj92_job_t* job = context;
+    const lj92_stream_t* stream = job->stream;
+
+    /* every interval ends byte aligned in front of the next marker */
+    uint64_t limit = (i + 1 < stream->count) ? stream->segments[i+1] * 8 : stream->length * 8;
+    lj92_bits_t bits = { stream->data, stream->segments[i] * 8 };
+
+    int y0 = (int)i * job->rows;
+    int y1 = (y0 + job->rows < job->lj->height) ? y0 + job->rows : job->lj->height;
+    job->errors[i] = _lj92_decode_rows(job->lj, &bits, limit, job->out, y0, y1, true);
+}
+
+static void _lj92_decode_band(void* context, size_t i)
+{
+    lj92_job_t* job = context;
+    uint64_t limit = job->stream->length * 8;
+    lj92_bits_t bits = { job->stream->data, job->positions[i] };
+
+    int y0 = (int)i * job->rows;
+    int y1 = (y0 + job->rows < job->lj->height) ? y0 + job->rows : job->lj->height;
+    job->errors[i] = (job->firstColumn) ? _lj92_decode_rows_from_first_column(job->lj, &bits, limit, job->out, y0, y1, job->firstColumn)
+                                        : _lj92_decode_differences(job->lj, &bits, limit, job->out, y0, y1);
+}
+
+static int _lj92_run(size_t count, lj92_job_t* job, void (*work)(void*, size_t))
+{
+    job->errors = calloc(count, sizeof(int));
+    if (!job->errors) {
+        return LJ92_ERROR_NO_MEMORY;
+    }
+
+    _lj92_apply(count, job, work);
+
+    int ret = LJ92_ERROR_NONE;
+    for (size_t i=0; i<count && ret == LJ92_ERROR_NONE; i++) {
+        ret = job->errors[i];
+    }
+    free(job->errors);
+    return ret;
+}
+
+static int _lj92_band_rows(const struct _lj92* self)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (_lj92_serial || cpus <= 1 || (size_t)self->width * self->components * self->height < LJ92_MIN_PARALLEL_SAMPLES) {
+        return self->height;
+    }
+
+    int target = (int)cpus * LJ92_BANDS_PER_CPU;
+    int rows = (self->height + target - 1) / target;
+    return (rows < LJ92_MIN_BAND_ROWS) ? LJ92_MIN_BAND_ROWS : rows;
+}
+
+static int _lj92_decode_frame(const struct _lj92* self, const lj92_stream_t* stream, uint16_t* out)
+{
+    lj92_job_t job;
+    memset(&job, 0, sizeof(lj92_job_t));
+    job.lj = self;
+    job.stream = stream;
+    job.out = out;
+
+    /* restart intervals are independent */
+    if (self->restartInterval > 0) {
+        job.rows = self->restartInterval / self->width;
+        return _lj92_run(stream->count, &job, _lj92_decode_interval);
+    }
+
+    int bandRows = _lj92_band_rows(self);
+    size_t bands = (self->height + bandRows - 1) / bandRows;
+    if (bands < 2) {
+        lj92_bits_t bits = { stream->data, 0 };
+        return _lj92_decode_rows(self, &bits, stream->length * 8, out, 0, self->height, true);
+    }
+
+    uint64_t* positions = malloc(bands * sizeof(uint64_t));
+    uint16_t* firstColumn = (self->predictor == 1) ? malloc((size_t)self->height * self->components * sizeof(uint16_t)) : NULL;
+    if (!positions || (self->predictor == 1 && !firstColumn)) {
+        free(positions);
+        free(firstColumn);
+        return LJ92_ERROR_NO_MEMORY;
+    }
+
+    int ret = _lj92_index_rows(self, stream, bandRows, positions, firstColumn);
+    if (ret == LJ92_ERROR_NONE) {
+        job.rows = bandRows;
+        job.positions = positions;
+        job.firstColumn = firstColumn;
+        ret = _lj92_run(bands, &job, _lj92_decode_band);
+    }
+    if (ret == LJ92_ERROR_NONE && !firstColumn) {
+        _lj92_add_predictions(self, out);
+    }
+
+    free(positions);
+    free(firstColumn);
+    return ret;
+}
+
+static void _lj92_write_target(const struct _lj92* self, const uint16_t* samples, uint16_t* target, int writeLength, int skipLength, const uint16_t* linearize, int linearizeLength)
+{
+    size_t count = (size_t)self->width * self->components * self->height;
+    int written = 0;
+
+    for (size_t i=0; i<count; i++) {
+        uint16_t v = samples[i] << self->pointTransform;
+        if (linearize && v < linearizeLength) {
+            v = linearize[v];
+        }
+        *target++ = v;
+
+        if (skipLength > 0 && writeLength > 0 && ++written == writeLength) {
+            target += skipLength;
+            written = 0;
+        }
+    }
+}
+
+int lj92_decode(lj92 lj, uint16_t* target, int writeLength, int skipLength, const uint16_t* linearize, int linearizeLength)
+{
+    if (!lj || !target) {
+        return LJ92_ERROR_BAD_HANDLE;
+    }
+
+    lj92_stream_t stream;
+    int ret = _lj92_read_stream(lj, &stream);
+    if (ret != LJ92_ERROR_NONE) {
+        return ret;
+    }
+
+    /* the common case decodes straight into the target */
+    bool direct = (skipLength <= 0 || writeLength <= 0) && !linearize && lj->pointTransform == 0;
+    uint16_t* samples = (direct) ? target : malloc((size_t)lj->width * lj->components * lj->height * sizeof(uint16_t));
+    if (!samples) {
+        _lj92_free_stream(&stream);
+        return LJ92_ERROR_NO_MEMORY;
+    }
+
+    ret = _lj92_decode_frame(lj, &stream, samples);
+
+    if (!direct) {
+        if (ret == LJ92_ERROR_NONE) {
+            _lj92_write_target(lj, samples, target, writeLength, skipLength, linearize, linearizeLength);
+        }
+        free(samples);
+    }
+
+    _lj92_free_stream(&stream);
+    return ret;
+}
+
+#pragma mark - Encoding
+
+typedef struct {
+    uint8_t*        data;
+    size_t          length;
+    size_t          capacity;
+    uint64_t        bits;               // pending bits in the low count bits
+    int             count;
+    bool            failed;
+} lj92_writer_t;
+
+typedef struct {
+    const uint16_t* image;
+    int             width;
+    int             height;
+    int             bits;
+    int             components;
+    int             pitch;
+    int             predictor;
+    int             rows;               // rows of a restart interval
+
+    uint32_t        (*histograms)[17];
+    uint16_t        codes[17];
+    uint8_t         lengths[17];
+    lj92_writer_t*  segments;
+} lj92_encoder_t;
+
+static inline void _lj92_put_byte(lj92_writer_t* w, uint8_t b)
+{
+    w->data[w->length++] = b;
+}
+
+static bool _lj92_reserve(lj92_writer_t* w, size_t length)
+{
+    if (w->length + length <= w->capacity) {
+        return true;
+    }
+
+    size_t capacity = (w->capacity + length) * 3 / 2;
+    uint8_t* data = realloc(w->data, capacity);
+    if (!data) {
+        w->failed = true;
+        return false;
+    }
+    w->data = data;
+    w->capacity = capacity;
+    return true;
+}
+
+/* at most 31 bits, written with byte stuffing */
+static inline void _lj92_put_bits(lj92_writer_t* w, uint32_t value, int length)
+{
+    if (w->length + 8 > w->capacity && !_lj92_reserve(w, 8)) {
+        return;
+    }
+
+    w->bits = (w->bits << length) | value;
+    w->count += length;
+    while (w->count >= 8) {
+        w->count -= 8;
+        uint8_t b = (uint8_t)(w->bits >> w->count);
+        _lj92_put_byte(w, b);
+        if (b == 0xFF) {
+            _lj92_put_byte(w, 0x00);
+        }
+    }
+}
+
+static void _lj92_flush_bits(lj92_writer_t* w)
+{
+    if (w->count > 0) {
+        _lj92_put_bits(w, (1u << (8 - w->count)) - 1, 8 - w->count);
+    }
+}
+
+static void _lj92_put_marker(lj92_writer_t* w, uint8_t marker, const uint8_t* segment, size_t length)
+{
+    if (!_lj92_reserve(w, 4 + length)) {
+        return;
+    }
+    _lj92_put_byte(w, 0xFF);
+    _lj92_put_byte(w, marker);
+    if (segment) {
+        _lj92_put_byte(w, (length + 2) >> 8);
+        _lj92_put_byte(w, (length + 2) & 0xFF);
+        memcpy(w->data + w->length, segment, length);
+        w->length += length;
+    }
+}
+
+/* rows [y0, y1) as one restart interval, only counts the categories if there is no writer */
+static inline __attribute__((always_inline)) void _lj92_encode_rows(const lj92_encoder_t* e, int y0, int y1, uint32_t* histogram, lj92_writer_t* w)
+{
+    int nc = e->components;
+    int stride = e->width * nc;
+    int initial = 1 << (e->bits - 1);
+
+    for (int y=y0; y<y1; y++) {
+        const uint16_t* row = e->image + (size_t)y * e->pitch;
+        const uint16_t* above = row - e->pitch;
+        bool firstLine = (y == y0);
+
+        for (int i=0; i<stride; i++) {
+            int prediction;
+            if (i < nc) {
+                prediction = (firstLine) ? initial : above[i];
+            } else if (firstLine || e->predictor == 1) {
+                prediction = row[i-nc];
+            } else {
+                prediction = _lj92_predict(e->predictor, row[i-nc], above[i], above[i-nc]);
+            }
+
+            int diff = (int16_t)(row[i] - prediction);
+            uint32_t magnitude = (diff < 0) ? -diff : diff;
+            int ssss = (magnitude) ? 32 - __builtin_clz(magnitude) : 0;
+
+            if (histogram) {
+                histogram[ssss]++;
+            } else if (ssss == 0 || ssss == 16) {
+                _lj92_put_bits(w, e->codes[ssss], e->lengths[ssss]);
+            } else {
+                uint32_t extra = (diff < 0) ? diff + (1 << ssss) - 1 : diff;
+                _lj92_put_bits(w, ((uint32_t)e->codes[ssss] << ssss) | extra, e->lengths[ssss] + ssss);
+            }
+        }
+    }
+}
+
+static void _lj92_count_interval(void* context, size_t i)
+{
+    lj92_encoder_t* e = context;
+    int y0 = (int)i * e->rows;
+    int y1 = (y0 + e->rows < e->height) ? y0 + e->rows : e->height;
+    _lj92_encode_rows(e, y0, y1, e->histograms[i], NULL);
+}
+
+static void _lj92_encode_interval(void* context, size_t i)
+{
+    lj92_encoder_t* e = context;
+    int y0 = (int)i * e->rows;
+    int y1 = (y0 + e->rows < e->height) ? y0 + e->rows : e->height;
+
+    /* sized for the coded bits, stuffed bytes grow it */
+    lj92_writer_t* w = &e->segments[i];
+    uint64_t bits = 0;
+    for (int s=0; s<17; s++) {
+        bits += (uint64_t)e->histograms[i][s] * (e->lengths[s] + ((s < 16) ? s : 0));
+    }
+    w->capacity = bits / 8 + bits / 2048 + 64;
+    w->data = malloc(w->capacity);
+    if (!w->data) {
+        w->failed = true;
+        return;
+    }
+
+    _lj92_encode_rows(e, y0, y1, NULL, w);
+    _lj92_flush_bits(w);
+}
+
+/*
+ * Code lengths of at most 16 bits (ITU T.81 K.2). A reserved symbol of frequency one
+ * keeps any code from being all ones.
+ */
+static void _lj92_build_code_lengths(const uint32_t* histogram, uint8_t* lengths)
+{
+    uint64_t freq[18];
+    int codesize[18];
+    int others[18];
+    for (int s=0; s<18; s++) {
+        freq[s] = (s < 17) ? histogram[s] : 1;
+        codesize[s] = 0;
+        others[s] = -1;
+    }
+
+    while (true) {
+        int v1 = -1, v2 = -1;
+        for (int s=0; s<18; s++) {
+            if (freq[s] > 0 && (v1 < 0 || freq[s] <= freq[v1])) {
+                v1 = s;
+            }
+        }
+        for (int s=0; s<18; s++) {
+            if (s != v1 && freq[s] > 0 && (v2 < 0 || freq[s] <= freq[v2])) {
+                v2 = s;
+            }
+        }
+        if (v2 < 0) {
+            break;
+        }
+
+        freq[v1] += freq[v2];
+        freq[v2] = 0;
+
+        codesize[v1]++;
+        while (others[v1] >= 0) {
+            v1 = others[v1];
+            codesize[v1]++;
+        }
+        others[v1] = v2;
+
+        codesize[v2]++;
+        while (others[v2] >= 0) {
+            v2 = others[v2];
+            codesize[v2]++;
+        }
+    }
+
+    int bits[40] = {0};
+    for (int s=0; s<18; s++) {
+        if (codesize[s] > 0) {
+            bits[codesize[s]]++;
+        }
+    }
+
+    for (int i=39; i>16; i--) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0) {
+                j--;
+            }
+            bits[i] -= 2;
+            bits[i-1]++;
+            bits[j+1] += 2;
+            bits[j]--;
+        }
+    }
+    int longest = 16;
+    while (bits[longest] == 0) {
+        longest--;
+    }
+    bits[longest]--;
+
+    /* symbols by their unlimited code size, the reserved one is last */
+    int order[18];
+    int n = 0;
+    for (int size=1; size<40; size++) {
+        for (int s=0; s<18; s++) {
+            if (codesize[s] == size) {
+                order[n++] = s;
+            }
+        }
+    }
+
+    memset(lengths, 0, 17);
+    int k = 0;
+    for (int l=1; l<=16; l++) {
+        for (int c=0; c<bits[l]; c++) {
+            lengths[order[k++]] = l;
+        }
+    }
+}
+
+static void _lj92_write_headers(const lj92_encoder_t* e, lj92_writer_t* w)
+{
+    _lj92_put_marker(w, 0xD8, NULL, 0);
+
+    uint8_t frame[6 + 3 * LJ92_MAX_COMPONENTS] = { e->bits, e->height >> 8, e->height & 0xFF, e->width >> 8, e->width & 0xFF, e->components };
+    for (int c=0; c<e->components; c++) {
+        frame[6 + 3*c] = c + 1;
+        frame[7 + 3*c] = 0x11;
+        frame[8 + 3*c] = 0;
+    }
+    _lj92_put_marker(w, 0xC3, frame, 6 + 3 * e->components);
+
+    /* canonical order, shorter codes first */
+    uint8_t table[1 + 16 + 17] = { 0x00 };
+    int n = 0;
+    for (int l=1; l<=16; l++) {
+        for (int s=0; s<17; s++) {
+            if (e->lengths[s] == l) {
+                table[1 + l - 1]++;
+                table[17 + n++] = s;
+            }
+        }
+    }
+    _lj92_put_marker(w, 0xC4, table, 17 + n);
+
+    if (e->rows < e->height) {
+        int interval = e->rows * e->width;
+        uint8_t dri[2] = { interval >> 8, interval & 0xFF };
+        _lj92_put_marker(w, 0xDD, dri, 2);
+    }
+
+    uint8_t scan[1 + 2 * LJ92_MAX_COMPONENTS + 3] = { e->components };
+    for (int c=0; c<e->components; c++) {
+        scan[1 + 2*c] = c + 1;
+        scan[2 + 2*c] = 0x00;
+    }
+    scan[1 + 2 * e->components] = e->predictor;
+    scan[2 + 2 * e->components] = 0;
+    scan[3 + 2 * e->components] = 0;
+    _lj92_put_marker(w, 0xDA, scan, 4 + 2 * e->components);
+}
+
+int lj92_encode(const uint16_t* image, int width, int height, int bitdepth, int components, int pitch, int predictor, int restartRows, uint8_t** encoded, int* encodedLength)
+{
+    if (!image || !encoded || !encodedLength || width < 1 || height < 1 || bitdepth < 2 || bitdepth > 16 ||
+        components < 1 || components > LJ92_MAX_COMPONENTS || pitch < width * components || predictor < 1 || predictor > 7)
+    {
+        return LJ92_ERROR_BAD_HANDLE;
+    }
+    if (width > 0xFFFF || height > 0xFFFF) {
+        return LJ92_ERROR_TOO_WIDE;
+    }
+
+    lj92_encoder_t e;
+    memset(&e, 0, sizeof(lj92_encoder_t));
+    e.image = image;
+    e.width = width;
+    e.height = height;
+    e.bits = bitdepth;
+    e.components = components;
+    e.pitch = pitch;
+    e.predictor = predictor;
+
+    /* the interval is a 16 bit count of samples per component */
+    e.rows = (restartRows > 0 && restartRows < height) ? restartRows : height;
+    if (e.rows < height && e.rows * width > 0xFFFF) {
+        e.rows = 0xFFFF / width;
+    }
+    if (e.rows < 1) {
+        e.rows = height;
+    }
+    size_t intervals = (height + e.rows - 1) / e.rows;
+
+    e.histograms = calloc(intervals, sizeof(uint32_t[17]));
+    e.segments = calloc(intervals, sizeof(lj92_writer_t));
+    lj92_writer_t w = { NULL, 0, 0, 0, 0, false };
+    int ret = LJ92_ERROR_NONE;
+
+    if (!e.histograms || !e.segments) {
+        ret = LJ92_ERROR_NO_MEMORY;
+        goto done;
+    }
+
+    /* first pass for the huffman table, the second one encodes the intervals */
+    _lj92_apply(intervals, &e, _lj92_count_interval);
+
+    uint32_t histogram[17] = {0};
+    for (size_t i=0; i<intervals; i++) {
+        for (int s=0; s<17; s++) {
+            histogram[s] += e.histograms[i][s];
+        }
+    }
+    _lj92_build_code_lengths(histogram, e.lengths);
+
+    uint16_t code = 0;
+    for (int l=1; l<=16; l++) {
+        for (int s=0; s<17; s++) {
+            if (e.lengths[s] == l) {
+                e.codes[s] = code++;
+            }
+        }
+        code <<= 1;
+    }
+
+    _lj92_apply(intervals, &e, _lj92_encode_interval);
+
+    size_t length = 256;
+    for (size_t i=0; i<intervals; i++) {
+        if (e.segments[i].failed) {
+            ret = LJ92_ERROR_NO_MEMORY;
+            goto done;
+        }
+        length += e.segments[i].length + 2;
+    }
+
+    if (!_lj92_reserve(&w, length)) {
+        ret = LJ92_ERROR_NO_MEMORY;
+        goto done;
+    }
+
+    _lj92_write_headers(&e, &w);
+    for (size_t i=0; i<intervals; i++) {
+        if (i > 0) {
+            _lj92_put_marker(&w, 0xD0 + ((i - 1) & 7), NULL, 0);
+        }
+        memcpy(w.data + w.length, e.segments[i].data, e.segments[i].length);
+        w.length += e.segments[i].length;
+    }
+    _lj92_put_marker(&w, 0xD9, NULL, 0);
+
+    if (w.failed || w.length > INT32_MAX) {
+        ret = LJ92_ERROR_NO_MEMORY;
+        goto done;
+    }
+
+    *encoded = w.data;
+    *encodedLength = (int)w.length;
+    w.data = NULL;
+
+done:
+    if (e.segments) {
+        for (size_t i=0; i<intervals; i++) {
+            free(e.segments[i].data);
+        }
+    }
+    free(e.segments);
+    free(e.histograms);
+    free(w.data);
+    return ret;
+}
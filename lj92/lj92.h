@@ -0,0 +1,74 @@
+/*
+lj92.h
+(c) Andrew Baldwin 2014
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef lj92_h
+#define lj92_h
+
+#include <stdint.h>
+
+/*
+ * Lossless JPEG (ITU T.81 process 14, SOF3) as used by LJ92 compressed MLV frames.
+ *
+ * One interleaved scan without subsampling, predictors 1-7 and restart intervals
+ * of whole lines. A frame is decoded on several threads: restart intervals are
+ * independent, without them a first pass over the huffman stream finds where the
+ * rows start. Small frames are decoded serially. Huffman codes and their extra
+ * bits are decoded with one table lookup in the common case.
+ *
+ * The encoder writes the same format with an optimized huffman table.
+ */
+
+enum LJ92_ERRORS {
+    LJ92_ERROR_NONE         = 0,
+    LJ92_ERROR_CORRUPT      = -1,
+    LJ92_ERROR_NO_MEMORY    = -2,
+    LJ92_ERROR_BAD_HANDLE   = -3,
+    LJ92_ERROR_TOO_WIDE     = -4,
+};
+
+typedef struct _lj92* lj92;
+
+// parses the headers, data is not copied and has to stay valid until lj92_close
+int lj92_open(lj92* lj, const uint8_t* data, int datalen, int* width, int* height, int* bitdepth, int* components);
+
+/*
+ * Writes width*components interleaved samples per row. With a skipLength, writeLength samples
+ * are written before skipLength samples of target are skipped. Samples below linearizeLength
+ * are mapped through linearize.
+ */
+int lj92_decode(lj92 lj, uint16_t* target, int writeLength, int skipLength, const uint16_t* linearize, int linearizeLength);
+
+void lj92_close(lj92 lj);
+
+// with serial set frames are decoded and encoded on the calling thread only, e.g. to compare decoders
+void lj92_set_serial(int serial);
+
+/*
+ * Encodes height lines of width*components interleaved samples, pitch samples apart in image.
+ * The huffman table is optimized for the image. With restartRows the lines are split into
+ * restart intervals of at most that many lines, which are encoded and decoded in parallel.
+ * encoded is allocated with malloc.
+ */
+int lj92_encode(const uint16_t* image, int width, int height, int bitdepth, int components, int pitch, int predictor, int restartRows, uint8_t** encoded, int* encodedLength);
+
+#endif /* lj92_h */
@@ -43,6 +43,7 @@ typedef NS_ENUM(UInt32, MLVBlockType) {
     kMLVBlockTypeWavInfo            = 'WAVI',
     kMLVBlockTypeNull               = 'NULL',
     kMLVBlockTypeBackup             = 'BKUP',
+    kMLVBlockTypeXRef               = 'XREF',
 };
 
 
@@ -27,17 +27,49 @@ NS_ASSUME_NONNULL_BEGIN
 @class CIContext;
 @class CIImage;
 @class MLVRawImage;
+@class MLVFrameIndex, MLVFrameGapReport;
 
 @class MLVAudioBlock, MLVVideoBlock;
 @class MLVLensBlock, MLVExposureBlock, MLVRAWInfoBlock, MLVCameraInfoBlock, MLVWAVInfoBlock, MLVFileBlock;
 
+typedef NS_ENUM(NSInteger, MLVFileOptions) {
+    kMLVFileOptionsNone             = 0,
+    kMLVFileOptionsMemoryMapped     = 1 << 0,   // map the chunks, video and audio data are read-only slices of the mapping, ignored while watching for changes
+    kMLVFileOptionsWriteIndex       = 1 << 1,   // write a <base>.IDX XREF index after a full scan, so the next open does not need one
+    kMLVFileOptionsIndexCache       = 1 << 2,   // load and store the block index in the caches directory
+    kMLVFileOptionsWatchForChanges  = 1 << 3,   // index blocks appended to a recording that is still being written or copied
+    kMLVFileOptionsProgressive      = 1 << 4,   // return after the header blocks, frames are indexed in the background
+    kMLVFileOptionsRecover          = 1 << 5,   // skip damaged ranges instead of failing, see skippedRanges
+};
 
+typedef NS_ENUM(NSInteger, MLVFileReadOptions) {
+    kMLVFileReadOptionsNone         = 0,
+    kMLVFileReadOptionsUncached     = 1 << 0,   // bypass the page cache for footage that is read once, e.g. batch exports
+    kMLVFileReadOptionsCompressed   = 1 << 1,   // return LJ92 frames without decoding them
+};
 
 @interface MLVFile : NSObject <NSSecureCoding>
 
 - (instancetype) initWithURL:(NSURL*)URL reportProgress:(nullable void (^)(float progress))progressBlock;
+- (instancetype) initWithURL:(NSURL*)URL options:(MLVFileOptions)options reportProgress:(nullable void (^)(float progress))progressBlock;
 - (void) changeURL:(NSURL*)url;
 
+// parses blocks appended since the last scan, including new chunks
+- (MLVErrorCode) updateBlockInfos;
+@property (copy, nullable) void (^blockInfosDidChangeHandler)(MLVFile* file);   // called on a private queue when watching for changes
+
+// progressive opening, frames are added to the indexes while this is set
+@property (readonly, getter=isIndexing) BOOL indexing;
+// handler is called on a global queue once the frame is indexed or indexing stopped, available is NO if there is no such frame
+- (void) whenVideoBlockAtIndex:(NSUInteger)index isIndexed:(void (^)(BOOL available))handler;
+- (void) whenAudioBlockAtIndex:(NSUInteger)index isIndexed:(void (^)(BOOL available))handler;
+
+@property (readonly) MLVFileOptions options;
+
+// byte positions of damaged ranges per chunk number, only filled with kMLVFileOptionsRecover
+@property (readonly) NSDictionary<NSNumber*, NSIndexSet*>* skippedRanges;
+@property (readonly) UInt64 skippedBytes;
+
 @property (readonly, getter=isMissing) BOOL missing;  // file is missing
 @property (readonly, getter=isValid) BOOL valid;      // file index is invalid
 
@@ -46,14 +78,24 @@ NS_ASSUME_NONNULL_BEGIN
 @property (readonly) NSTimeInterval duration;
 @property (readonly) NSTimeInterval firstTime;
 @property (readonly) UInt64 fileSize;
-@property (readonly) NSArray<MLVVideoBlock*>* videoBlocks;
+@property (readonly) MLVFrameIndex* videoIndex;
+@property (readonly) MLVFrameIndex* audioIndex;
+@property (readonly) NSArray<MLVVideoBlock*>* videoBlocks;    // blocks are created on access, prefer the index or -videoBlockAtIndex:
 @property (readonly) NSArray<MLVAudioBlock*>* audioBlocks;
 
+- (MLVVideoBlock*) videoBlockAtIndex:(NSUInteger)index;
+- (MLVAudioBlock*) audioBlockAtIndex:(NSUInteger)index;
+
+// dropped and irregular video frames with a tolerance of a quarter frame, computed on first access after the index changed
+@property (readonly) MLVFrameGapReport* videoGapReport;
+- (MLVFrameGapReport*) videoGapReportWithTolerance:(double)tolerance;     // tolerance in frames
+
 @property (readonly) NSDictionary<NSString*, id>* audioSettings;
 @property (readonly) NSDictionary<NSString*, id>* imageSettings;
 
 - (NSData*) readAudioDataBlock:(MLVAudioBlock*)block errorCode:(MLVErrorCode*)errorCode;
 - (MLVRawImage*) readVideoDataBlock:(MLVVideoBlock*)block errorCode:(MLVErrorCode*)errorCode;
+- (MLVRawImage*) readVideoDataBlock:(MLVVideoBlock*)block options:(MLVFileReadOptions)options errorCode:(MLVErrorCode*)errorCode;
 
 @property (readonly) MLVFileBlock* mainheader;
 @property (readonly) MLVCameraInfoBlock* idntInfo;
@@ -22,14 +22,371 @@
 #import "mlv.h"
 #import "MLVBlock.h"
 #import "MLVRawImage.h"
+#import "MLVFileIndex.h"
+#import "MLVFrameIndex.h"
 
 #import <AVFoundation/AVFoundation.h>
 #import <AppKit/AppKit.h>
 #import <CoreImage/CoreImage.h>
 #import <sys/stat.h>
+#import <sys/mman.h>
+#import <fcntl.h>
+#import <unistd.h>
+
+
+#define MLV_FILE_VERSION 2
+#define MLV_MAX_CHUNKS 100      // .MLV, .M00 to .M98
+#define MLV_GAP_TOLERANCE 0.25  // frames
+#define MLV_WATCH_COALESCING_INTERVAL 0.25     // seconds, writes to a recording within this interval are indexed in one update
+#define MLV_FILE_TRANSIENT_OPTIONS (kMLVFileOptionsMemoryMapped | kMLVFileOptionsWatchForChanges | kMLVFileOptionsProgressive)   // not archived, the decoded file is opened plainly
+
+/* read-only mapping of a whole chunk, slices handed out keep it alive */
+@interface MLVFileMapping : NSObject
+- (nullable instancetype) initWithFileDescriptor:(int)fd;
+@property (readonly) const uint8_t* bytes;
+@property (readonly) UInt64 length;
+@end
+
+@implementation MLVFileMapping
+
+- (nullable instancetype) initWithFileDescriptor:(int)fd {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        return nil;
+    }
+
+    void* bytes = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (bytes == MAP_FAILED) {
+        return nil;
+    }
+
+    if ((self = [super init])) {
+        _bytes = bytes;
+        _length = st.st_size;
+    }
+    return self;
+}
+
+- (void) dealloc {
+    if (_bytes) {
+        munmap((void*)_bytes, (size_t)_length);
+    }
+}
+
+@end
+
+#pragma mark -
+
+#define MLV_READAHEAD_LEAD_TIME     0.5                     // seconds of frames to keep in flight
+#define MLV_READAHEAD_MIN_FRAMES    2
+#define MLV_READAHEAD_MAX_FRAMES    32
+#define MLV_READAHEAD_MAX_LENGTH    (256 * 1024 * 1024)
+
+/* detects frames being read in file order and computes the range to read ahead */
+@interface MLVReadahead : NSObject
+- (BOOL) didReadFileNum:(UInt16)fileNum position:(UInt64)position length:(UInt64)length
+       prefetchPosition:(UInt64*)prefetchPosition prefetchLength:(UInt64*)prefetchLength;
+@end
+
+@implementation MLVReadahead {
+    UInt16          _fileNum;
+    UInt64          _lastPosition;
+    UInt64          _lastEnd;
+    NSUInteger      _sequentialCount;
+    NSTimeInterval  _lastTime;
+    NSTimeInterval  _interval;          // average time between two sequential reads
+    UInt64          _prefetchedEnd;
+}
+
+- (BOOL) didReadFileNum:(UInt16)fileNum position:(UInt64)position length:(UInt64)length
+       prefetchPosition:(UInt64*)prefetchPosition prefetchLength:(UInt64*)prefetchLength
+{
+    @synchronized (self) {
+        NSTimeInterval now = [NSProcessInfo processInfo].systemUptime;
+        UInt64 end = position + length;
+
+        /* audio blocks between the frames are skipped over */
+        BOOL sequential = _lastEnd > 0 && fileNum == _fileNum &&
+                          position >= _lastEnd && position - _lastEnd <= length;
+
+        if (!sequential) {
+            _sequentialCount = 0;
+            _interval = 0;
+            _prefetchedEnd = 0;
+        }
+        else {
+            NSTimeInterval dt = now - _lastTime;
+            _interval = (_sequentialCount == 0) ? dt : _interval * 0.8 + dt * 0.2;
+            _sequentialCount++;
+        }
+
+        UInt64 stride = position - _lastPosition;
+        _fileNum = fileNum;
+        _lastPosition = position;
+        _lastEnd = end;
+        _lastTime = now;
+
+        if (_sequentialCount < 2) {
+            return NO;
+        }
+
+        /* a faster consumer gets more frames in flight */
+        NSUInteger depth = (_interval > 0) ? (NSUInteger)ceil(MLV_READAHEAD_LEAD_TIME / _interval) : MLV_READAHEAD_MAX_FRAMES;
+        depth = MIN(MAX(depth, MLV_READAHEAD_MIN_FRAMES), MLV_READAHEAD_MAX_FRAMES);
+
+        UInt64 targetEnd = end + MIN(depth * stride, MLV_READAHEAD_MAX_LENGTH);
+
+        /* advise again when half of the range was consumed */
+        if (_prefetchedEnd > end && _prefetchedEnd - end >= (targetEnd - end) / 2) {
+            return NO;
+        }
+
+        UInt64 start = MAX(end, _prefetchedEnd);
+        if (targetEnd <= start) {
+            return NO;
+        }
+
+        *prefetchPosition = start;
+        *prefetchLength = targetEnd - start;
+        _prefetchedEnd = targetEnd;
+        return YES;
+    }
+}
+
+@end
+
+#pragma mark -
+
+/* blocks found while scanning a single chunk */
+@interface MLVFileChunkIndex : NSObject
+@property (nonatomic, strong) MLVFileBlock* fileHeader;
+@property (nonatomic, getter=isFirstFile) BOOL firstFile;
+@property (nonatomic, readonly) MLVFrameIndex* videoIndex;
+@property (nonatomic, readonly) MLVFrameIndex* audioIndex;
+@property (nonatomic, readonly) NSMutableArray<MLVBlock*>* infoBlocks;    // metadata blocks in file order
+@property (nonatomic) uint64_t endPosition;                                  // start of the first block not parsed
+@property (nonatomic) MLVErrorCode errorCode;
+@end
+
+@implementation MLVFileChunkIndex
+
+- (instancetype) init {
+    if ((self = [super init])) {
+        _videoIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+        _audioIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeAudio];
+        _infoBlocks = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+@end
+
+#pragma mark -
+
+/* pread until length bytes are read, it may return less on network volumes */
+static BOOL _MLVReadFully(int fd, void* buffer, size_t length, uint64_t position)
+{
+    uint8_t* dst = buffer;
+    while (length > 0) {
+        ssize_t readLength = pread(fd, dst, length, (off_t)position);
+        if (readLength < 0 && errno == EINTR) {
+            continue;
+        }
+        if (readLength <= 0) {
+            return NO;
+        }
+        dst += readLength;
+        position += readLength;
+        length -= readLength;
+    }
+    return YES;
+}
+
+#pragma mark -
+
+#define MLV_SCAN_WINDOW_SIZE        (8 * 1024 * 1024)
+#define MLV_SCAN_HEADER_READ_SIZE   (64 * 1024)
+
+/* read window used while indexing a chunk */
+typedef struct {
+    int         fd;
+    uint8_t*    buffer;
+    size_t      capacity;
+    uint64_t    start;          /* file position of buffer[0] */
+    size_t      length;         /* valid bytes in buffer */
+    uint32_t    lastBlockSize;  /* size of the block just skipped */
+    uint64_t    fileSize;
+} mlv_scan_window_t;
+
+static void _MLVScanWindowInit(mlv_scan_window_t* window, int fd, size_t capacity)
+{
+    memset(window, 0, sizeof(mlv_scan_window_t));
+    window->fd = fd;
+    window->capacity = MAX(capacity, sizeof(mlv_hdr_t));
+    window->buffer = malloc(window->capacity);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        window->fileSize = st.st_size;
+    }
+}
+
+static void _MLVScanWindowFree(mlv_scan_window_t* window)
+{
+    free(window->buffer);
+    window->buffer = NULL;
+}
+
+static BOOL _MLVScanWindowRead(mlv_scan_window_t* window, void* dst, uint64_t position, size_t length)
+{
+    if (position < window->start || position + length > window->start + window->length)
+    {
+        /* with blocks larger than half a window most of a full window would be skipped frame data, read only the headers */
+        size_t readSize = (window->lastBlockSize > window->capacity / 2) ? MLV_SCAN_HEADER_READ_SIZE : window->capacity;
+        readSize = MAX(readSize, length);
+
+        if (readSize > window->capacity) {
+            window->buffer = realloc(window->buffer, readSize);
+            window->capacity = readSize;
+        }
+
+        window->start = position;
+        window->length = 0;
+        while (window->length < readSize) {
+            ssize_t readLength = pread(window->fd, window->buffer + window->length, readSize - window->length, (off_t)(position + window->length));
+            if (readLength < 0 && errno == EINTR) {
+                continue;
+            }
+            if (readLength <= 0) {
+                break;
+            }
+            window->length += readLength;
+        }
+
+        if (window->length < length) {
+            return NO;
+        }
+    }
+
+    memcpy(dst, window->buffer + (position - window->start), length);
+    return YES;
+}
+
+#pragma mark -
+
+#define MLV_MAX_BLOCK_SIZE (50 * 1024 * 1024)
+
+typedef uint8_t mlv_bytes16_t __attribute__((ext_vector_type(16)));
+typedef signed char mlv_mask16_t __attribute__((ext_vector_type(16)));     // result of comparing mlv_bytes16_t
+
+static const char _MLVKnownBlockTypes[][4] = {
+    "MLVI", "VIDF", "AUDF", "LENS", "INFO", "ELVL", "STYL", "WBAL", "IDNT",
+    "RTCI", "MARK", "EXPO", "RAWI", "RAWC", "WAVI", "NULL", "BKUP", "XREF",
+    "DISO", "VERS", "DARK", "FLAT",
+};
+
+static BOOL _MLVIsKnownBlockType(const uint8_t* type)
+{
+    for(size_t i=0; i<sizeof(_MLVKnownBlockTypes)/sizeof(_MLVKnownBlockTypes[0]); i++) {
+        if (memcmp(type, _MLVKnownBlockTypes[i], 4) == 0) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+static BOOL _MLVIsValidBlockHeader(const mlv_hdr_t* hdr, uint64_t position, uint64_t fileSize)
+{
+    return _MLVIsKnownBlockType(hdr->blockType) && hdr->blockSize >= sizeof(mlv_hdr_t) && hdr->blockSize <= MLV_MAX_BLOCK_SIZE &&
+           position + hdr->blockSize <= fileSize;
+}
+
+/* a signature in frame data is not enough, the header has to make sense and the next block has to follow it */
+static BOOL _MLVIsPlausibleBlock(int fd, uint64_t position, uint64_t fileSize)
+{
+    mlv_hdr_t hdr;
+    if (!_MLVReadFully(fd, &hdr, sizeof(mlv_hdr_t), position) || !_MLVIsValidBlockHeader(&hdr, position, fileSize)) {
+        return NO;
+    }
+
+    if (memcmp(hdr.blockType, "VIDF", 4) == 0) {
+        mlv_vidf_hdr_t vidf;
+        if (hdr.blockSize < sizeof(mlv_vidf_hdr_t) || !_MLVReadFully(fd, &vidf, sizeof(mlv_vidf_hdr_t), position) ||
+            vidf.frameSpace > hdr.blockSize - sizeof(mlv_vidf_hdr_t)) {
+            return NO;
+        }
+    }
+    else if (memcmp(hdr.blockType, "AUDF", 4) == 0) {
+        mlv_audf_hdr_t audf;
+        if (hdr.blockSize < sizeof(mlv_audf_hdr_t) || !_MLVReadFully(fd, &audf, sizeof(mlv_audf_hdr_t), position) ||
+            audf.frameSpace > hdr.blockSize - sizeof(mlv_audf_hdr_t)) {
+            return NO;
+        }
+    }
+
+    uint64_t next = position + hdr.blockSize;
+    if (next + sizeof(mlv_hdr_t) > fileSize) {
+        return YES;
+    }
+
+    mlv_hdr_t nextHdr;
+    return _MLVReadFully(fd, &nextHdr, sizeof(mlv_hdr_t), next) && _MLVIsValidBlockHeader(&nextHdr, next, fileSize);
+}
+
+/* sequential search for the next block behind a damaged range, NO if the chunk ends first */
+static BOOL _MLVScanWindowFindBlock(mlv_scan_window_t* window, uint64_t position, uint64_t* found)
+{
+    window->lastBlockSize = 0;
+
+    while (position + sizeof(mlv_hdr_t) <= window->fileSize) {
+        mlv_hdr_t probe;
+        if (!_MLVScanWindowRead(window, &probe, position, sizeof(mlv_hdr_t))) {
+            return NO;
+        }
+
+        const uint8_t* bytes = window->buffer + (position - window->start);
+        size_t available = window->length - (size_t)(position - window->start);
+        size_t count = available - 3;
+        size_t i = 0;
+
+        /* 16 positions at once, all block types consist of four upper case letters */
+        for(; i + 16 + 3 <= available; i += 16) {
+            mlv_bytes16_t b0, b1, b2, b3;
+            memcpy(&b0, bytes + i, 16);
+            memcpy(&b1, bytes + i + 1, 16);
+            memcpy(&b2, bytes + i + 2, 16);
+            memcpy(&b3, bytes + i + 3, 16);
+
+            mlv_mask16_t mask = ((b0 - (uint8_t)'A') < (uint8_t)26) & ((b1 - (uint8_t)'A') < (uint8_t)26) &
+                                ((b2 - (uint8_t)'A') < (uint8_t)26) & ((b3 - (uint8_t)'A') < (uint8_t)26);
+
+            uint64_t lanes[2];
+            memcpy(lanes, &mask, sizeof(lanes));
+            if ((lanes[0] | lanes[1]) == 0) {
+                continue;
+            }
+
+            for(size_t k=0; k<16; k++) {
+                if (mask[k] && _MLVIsKnownBlockType(bytes + i + k) && _MLVIsPlausibleBlock(window->fd, position + i + k, window->fileSize)) {
+                    *found = position + i + k;
+                    return YES;
+                }
+            }
+        }
+
+        for(; i < count; i++) {
+            if (_MLVIsKnownBlockType(bytes + i) && _MLVIsPlausibleBlock(window->fd, position + i, window->fileSize)) {
+                *found = position + i;
+                return YES;
+            }
+        }
 
+        position += count;
+    }
+    return NO;
+}
 
-#define MLV_FILE_VERSION 1
+#pragma mark -
 
 @interface MLVFile ()
 @property (nonatomic, strong) NSURL* url;
@@ -38,9 +395,23 @@
 
 @implementation MLVFile {
     NSURL* _url;
+    MLVFileOptions _options;
 
-    FILE **in_files;
+    int *in_files;          // file descriptors of the chunks, read with pread only
     int in_file_count;
+    NSArray<MLVFileMapping*>* _mappings;
+    NSMutableData* _chunkEnds;                          // uint64_t per chunk, end of the parsed blocks
+    NSObject* _updateLock;                              // serializes updates and indexing with _close
+
+    dispatch_queue_t _updateQueue;                      // background indexing and file watching
+    NSMutableArray<dispatch_source_t>* _watchSources;
+    dispatch_source_t _updateTimer;                     // coalesces the file events, fires on the update queue
+    BOOL _updateScheduled;
+    NSMutableDictionary<NSNumber*, NSMutableArray*>* _pendingVideoFrames;  // completion handlers by frame index, called when the frame is indexed
+    NSMutableDictionary<NSNumber*, NSMutableArray*>* _pendingAudioFrames;
+    MLVReadahead* _readahead;
+    int *in_files_uncached;                             // F_NOCACHE descriptors, opened on first use
+    NSMutableDictionary<NSNumber*, NSMutableIndexSet*>* _skippedRanges;
 
     MLVFileBlock*               _mainheader;
     MLVLensBlock*               _lensInfo;
@@ -54,8 +425,11 @@
     MLVStyleBlock*              _stylInfo;
     MLVTimecodeBlock*           _rtciInfo;
 
-    NSArray<MLVVideoBlock*>*    _videoBlocks;
-    NSArray<MLVAudioBlock*>*    _audioBlocks;
+    MLVFrameIndex*              _videoIndex;
+    MLVFrameIndex*              _audioIndex;
+    MLVFrameIndex*              _growingVideoIndex;    // frames of a growing recording are appended here, _videoIndex is a snapshot
+    MLVFrameIndex*              _growingAudioIndex;
+    MLVFrameGapReport*          _videoGapReport;
 
     NSTimeInterval              _duration;
     NSTimeInterval              _firstTime;
@@ -64,11 +438,25 @@
     NSInteger                   _version;
 }
 
-- (instancetype) initWithURL:(NSURL*)URL reportProgress:(nullable void (^)(float progress))progressBlock
+- (instancetype) init
 {
     if ((self = [super init])) {
+        _updateLock = [[NSObject alloc] init];
+    }
+    return self;
+}
+
+- (instancetype) initWithURL:(NSURL*)URL reportProgress:(nullable void (^)(float progress))progressBlock
+{
+    return [self initWithURL:URL options:kMLVFileOptionsNone reportProgress:progressBlock];
+}
+
+- (instancetype) initWithURL:(NSURL*)URL options:(MLVFileOptions)options reportProgress:(nullable void (^)(float progress))progressBlock
+{
+    if ((self = [self init])) {
         _version = MLV_FILE_VERSION;
         _url = URL;
+        _options = options;
 
         if ([self _open] != kMLVErrorCodeNone) {
             self.missing = YES;
@@ -80,6 +468,10 @@
                 progressBlock(progress);
             }
         }];
+
+        if (_options & kMLVFileOptionsWatchForChanges) {
+            [self _startWatching];
+        }
     }
 
     return self;
@@ -97,68 +489,27 @@
     if ((self = [self init])) {
         _version = [aDecoder decodeIntegerForKey:@"_version"];
         _url = [aDecoder decodeObjectOfClass:[NSURL class] forKey:@"_url"];
+        _options = [aDecoder decodeIntegerForKey:@"_options"] & ~MLV_FILE_TRANSIENT_OPTIONS;
 
         if ([self _open] != kMLVErrorCodeNone) {
             self.missing = YES;
         }
+        else {
+            /* the blocks are not archived, they come from the index cache */
+            [self readBlockInfosAndReportProgress:^(float progress) {}];
 
-        _mainheader = [aDecoder decodeObjectOfClass:[MLVFileBlock class] forKey:@"_mainheader"];
-        _lensInfo = [aDecoder decodeObjectOfClass:[MLVLensBlock class] forKey:@"_lensInfo"];
-        _expoInfo = [aDecoder decodeObjectOfClass:[MLVExposureBlock class] forKey:@"_expoInfo"];
-        _idntInfo = [aDecoder decodeObjectOfClass:[MLVCameraInfoBlock class] forKey:@"_idntInfo"];
-        _wbalInfo = [aDecoder decodeObjectOfClass:[MLVWhiteBalanceBlock class] forKey:@"_wbalInfo"];
-        _waviInfo = [aDecoder decodeObjectOfClass:[MLVWAVInfoBlock class] forKey:@"_waviInfo"];
-        _rawiInfo = [aDecoder decodeObjectOfClass:[MLVRAWInfoBlock class] forKey:@"_rawiInfo"];
-        _rawcInfo = [aDecoder decodeObjectOfClass:[MLVRAWCaptureInfoBlock class] forKey:@"_rawcInfo"];
-        _elvlInfo = [aDecoder decodeObjectOfClass:[MLVElectronicLevelBlock class] forKey:@"_elvlInfo"];
-        _stylInfo = [aDecoder decodeObjectOfClass:[MLVStyleBlock class] forKey:@"_stylInfo"];
-        _rtciInfo = [aDecoder decodeObjectOfClass:[MLVTimecodeBlock class] forKey:@"_rtciInfo"];
-        _videoBlocks = [aDecoder decodeObjectOfClass:[NSArray class] forKey:@"_videoBlocks"];
-        _audioBlocks = [aDecoder decodeObjectOfClass:[NSArray class] forKey:@"_audioBlocks"];
+            if (_options & kMLVFileOptionsWatchForChanges) {
+                [self _startWatching];
+            }
+        }
     }
     return self;
 }
 
 - (void) encodeWithCoder:(NSCoder *)aCoder {
     [aCoder encodeObject:_url forKey:@"_url"];
-    [aCoder encodeObject:_mainheader forKey:@"_mainheader"];
-    if (_lensInfo) {
-        [aCoder encodeObject:_lensInfo forKey:@"_lensInfo"];
-    }
-    if (_expoInfo) {
-        [aCoder encodeObject:_expoInfo forKey:@"_expoInfo"];
-    }
-    if (_idntInfo) {
-        [aCoder encodeObject:_idntInfo forKey:@"_idntInfo"];
-    }
-    if (_wbalInfo) {
-        [aCoder encodeObject:_wbalInfo forKey:@"_wbalInfo"];
-    }
-    if (_waviInfo) {
-        [aCoder encodeObject:_waviInfo forKey:@"_waviInfo"];
-    }
-    if (_rawiInfo) {
-        [aCoder encodeObject:_rawiInfo forKey:@"_rawiInfo"];
-    }
-    if (_rawcInfo) {
-        [aCoder encodeObject:_rawiInfo forKey:@"_rawcInfo"];
-    }
-    if (_elvlInfo) {
-        [aCoder encodeObject:_elvlInfo forKey:@"_elvlInfo"];
-    }
-    if (_stylInfo) {
-        [aCoder encodeObject:_stylInfo forKey:@"_stylInfo"];
-    }
-    if (_rtciInfo) {
-        [aCoder encodeObject:_rtciInfo forKey:@"_rtciInfo"];
-    }
-    if (_videoBlocks) {
-        [aCoder encodeObject:_videoBlocks forKey:@"_videoBlocks"];
-    }
-    if (_audioBlocks) {
-        [aCoder encodeObject:_audioBlocks forKey:@"_audioBlocks"];
-    }
     [aCoder encodeInteger:_version forKey:@"_version"];
+    [aCoder encodeInteger:((_options & ~MLV_FILE_TRANSIENT_OPTIONS) | kMLVFileOptionsIndexCache) forKey:@"_options"];
 }
 
 - (BOOL) isValid {
@@ -166,15 +517,23 @@
 }
 
 - (void) changeURL:(NSURL*)url {
-    [self _close];
+    /* an update that was already queued must not see the new chunks before they are set up */
+    @synchronized (_updateLock) {
+        [self _close];
 
-    _url = url;
+        _url = url;
 
-    if ([self _open] != kMLVErrorCodeNone) {
-        self.missing = YES;
-    }
-    else {
-        self.missing = NO;
+        if ([self _open] != kMLVErrorCodeNone) {
+            self.missing = YES;
+        }
+        else {
+            self.missing = NO;
+
+            [self _setChunkEndsWithFrameIndexes];
+            if (_options & kMLVFileOptionsWatchForChanges) {
+                [self _startWatching];
+            }
+        }
     }
 }
 
@@ -187,203 +546,1325 @@
 
 - (NSTimeInterval) firstTime {
     if (_firstTime == 0) {
-        MLVVideoBlock* firstVideoBlock = _videoBlocks.firstObject;
-        _firstTime = firstVideoBlock.time;
+        if (_videoIndex.count > 0) {
+            _firstTime = [_videoIndex timestampAtIndex:0] / 1000000.0;
+        }
     }
     return _firstTime;
 }
 
-- (NSTimeInterval) duration {
+- (NSTimeInterval) duration {
+
+    if (_duration == 0) {
+
+        NSUInteger count = _videoIndex.count;
+        NSTimeInterval firstTime = (count > 0) ? [_videoIndex timestampAtIndex:0] / 1000000.0 : 0;
+        NSTimeInterval lastTime = (count > 0) ? [_videoIndex timestampAtIndex:count-1] / 1000000.0 : 0;
+
+        _duration = (lastTime - firstTime) + CMTimeGetSeconds([self frameTime]);
+    }
+    return _duration;
+}
+
+/* the indexes are replaced while a growing recording is indexed */
+- (MLVFrameIndex*) videoIndex {
+    @synchronized (self) {
+        return _videoIndex;
+    }
+}
+
+- (MLVFrameIndex*) audioIndex {
+    @synchronized (self) {
+        return _audioIndex;
+    }
+}
+
+- (NSArray<MLVVideoBlock*>*) videoBlocks {
+    return self.videoIndex.blocks;
+}
+
+- (NSArray<MLVAudioBlock*>*) audioBlocks {
+    return self.audioIndex.blocks;
+}
+
+- (MLVVideoBlock*) videoBlockAtIndex:(NSUInteger)index {
+    return [self.videoIndex blockAtIndex:index];
+}
+
+- (MLVAudioBlock*) audioBlockAtIndex:(NSUInteger)index {
+    return [self.audioIndex blockAtIndex:index];
+}
+
+- (MLVFrameGapReport*) videoGapReport {
+    MLVFrameIndex* videoIndex;
+    MLVFrameGapReport* gapReport;
+    @synchronized (self) {
+        videoIndex = _videoIndex;
+        gapReport = _videoGapReport;
+    }
+
+    /* a single pass over the packed index, done on first access after the index changed */
+    if (!gapReport) {
+        gapReport = [self _videoGapReportWithIndex:videoIndex extendingReport:nil tolerance:MLV_GAP_TOLERANCE];
+        @synchronized (self) {
+            if (_videoIndex == videoIndex) {
+                _videoGapReport = gapReport;
+            }
+        }
+    }
+    return gapReport;
+}
+
+- (MLVFrameGapReport*) videoGapReportWithTolerance:(double)tolerance {
+    return [self _videoGapReportWithIndex:self.videoIndex extendingReport:nil tolerance:tolerance];
+}
+
+- (MLVFrameGapReport*) _videoGapReportWithIndex:(MLVFrameIndex*)videoIndex extendingReport:(nullable MLVFrameGapReport*)report tolerance:(double)tolerance {
+    CMTime sourceFps = _mainheader.sourceFps;
+    NSTimeInterval frameDuration = (sourceFps.value > 0) ? CMTimeGetSeconds([self frameTime]) : 0;
+    return [videoIndex gapReportByExtendingReport:report frameDuration:frameDuration tolerance:tolerance];
+}
+
+#pragma mark -
+
+- (int *) _load:(const char *)base_filename numberOfChunks:(int *)entries
+{
+    int seq_number = 0;
+    size_t max_name_len = strlen(base_filename) + 16;
+    char *filename = malloc(max_name_len);
+
+    strncpy(filename, base_filename, max_name_len - 1);
+    /* room for all chunks, new chunks of a growing recording are added without moving the array */
+    int *files = malloc(MLV_MAX_CHUNKS * sizeof(int));
+
+
+    files[0] = open(filename, O_RDONLY);
+    if(files[0] < 0)
+    {
+        free(filename);
+        free(files);
+        return NULL;
+    }
+
+    struct stat st;
+    stat(filename, &st);
+    _fileSize += st.st_size;
+    
+    DebugLog(@"File %s opened\n", filename);
+
+    (*entries)++;
+    while(seq_number < MLV_MAX_CHUNKS - 1)
+    {
+        /* check for the next file M00, M01 etc */
+        char seq_name[8];
+
+        sprintf(seq_name, "%02d", seq_number);
+        seq_number++;
+
+        strcpy(&filename[strlen(filename) - 2], seq_name);
+
+        /* try to open */
+        files[*entries] = open(filename, O_RDONLY);
+        if(files[*entries] >= 0)
+        {
+            struct stat st;
+            stat(filename, &st);
+            _fileSize += st.st_size;
+            
+            DebugLog(@"File %s opened\n", filename);
+            (*entries)++;
+        }
+        else
+        {
+            DebugLog(@"File %s not existing.\n", filename);
+            break;
+        }
+    }
+    
+    free(filename);
+    return files;
+}
+
+- (MLVErrorCode) _open
+{
+    NSFileManager* fman = [[NSFileManager alloc] init];
+
+    /* option */
+    const char* input_filename = [fman fileSystemRepresentationWithPath:self.url.path];
+
+    /* open files */
+    @synchronized (self) {
+        in_files = NULL;
+        in_file_count = 0;
+
+        in_files = [self _load:input_filename numberOfChunks:&in_file_count];
+    }
+
+    if(!in_files || !in_file_count) {
+        DebugLog(@"Failed to open file '%s'\n", input_filename);
+        return kMLVErrorCodeFile;
+    }
+
+    /* a chunk that is still being written may be truncated or replaced, touching its mapping would raise SIGBUS */
+    if ((_options & kMLVFileOptionsMemoryMapped) && !(_options & kMLVFileOptionsWatchForChanges)) {
+        NSMutableArray<MLVFileMapping*>* mappings = [[NSMutableArray alloc] initWithCapacity:in_file_count];
+        for(int f=0; f<in_file_count; f++) {
+            MLVFileMapping* mapping = [[MLVFileMapping alloc] initWithFileDescriptor:in_files[f]];
+            if (!mapping) {
+                /* fall back to buffered reads for the whole file */
+                ErrLog(@"Failed to map chunk %d of '%s'", f, input_filename);
+                mappings = nil;
+                break;
+            }
+            [mappings addObject:mapping];
+        }
+        _mappings = mappings;
+    }
+
+    return kMLVErrorCodeNone;
+}
+
+- (void) _close
+{
+    [self _stopWatching];
+
+    /* waits for an update that is still running */
+    @synchronized (_updateLock) {
+        _chunkEnds = nil;
+
+        _indexing = NO;
+        [self _completePendingFrames];
+
+        @synchronized (self) {
+            _mappings = nil;
+
+            for(int f=0; f<in_file_count; f++) {
+                close(in_files[f]);
+            }
+
+            if (in_files) {
+                free(in_files);
+                in_files = NULL;
+            }
+
+            if (in_files_uncached) {
+                for(int f=0; f<in_file_count; f++) {
+                    if (in_files_uncached[f] >= 0) {
+                        close(in_files_uncached[f]);
+                    }
+                }
+                free(in_files_uncached);
+                in_files_uncached = NULL;
+            }
+            in_file_count = 0;
+        }
+    }
+}
+
+- (MLVErrorCode) readBlockInfosAndReportProgress:(void (^)(float progress))progressBlock
+{
+    DebugLog(@"Processing...\n");
+
+    if ((_options & kMLVFileOptionsIndexCache) && [self _readIndexCache]) {
+        progressBlock(1.0f);
+        return kMLVErrorCodeNone;
+    }
+
+    NSObject* progressLock = [[NSObject alloc] init];
+    __block uint64_t readSize = 0;
+    __block float lastProgress = 0;
+    UInt64 fileSize = _fileSize;
+
+    void (^chunkProgressBlock)(uint64_t) = ^(uint64_t blockSize) {
+        @synchronized (progressLock) {
+            readSize += blockSize;
+            float progress = (float)readSize/(float)fileSize;
+            if (progress > lastProgress + 0.01) {
+                progressBlock(progress);
+                lastProgress = progress;
+            }
+        }
+    };
+
+    /* if there is an XREF index, only the header blocks of the chunks and the referenced frame headers need to be read */
+    UInt64 sidecarGUID = 0;
+    NSData* xrefEntries = [self _readIndexSidecarWithGUID:&sidecarGUID];
+
+    NSArray<MLVFileChunkIndex*>* chunkIndexes = nil;
+    if (xrefEntries || (_options & kMLVFileOptionsProgressive)) {
+        chunkIndexes = [self _scanChunksHeaderOnly:YES reportProgress:nil];
+    }
+
+    if (xrefEntries) {
+        NSArray<MLVFileChunkIndex*>* xrefChunkIndexes = (sidecarGUID == [self _readGUID]) ? [self _chunkIndexesWithXrefEntries:xrefEntries headerIndexes:chunkIndexes] : nil;
+
+        MLVFrameIndex* videoIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+        MLVFrameIndex* audioIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeAudio];
+
+        if (xrefChunkIndexes && [self _mergeChunkIndexes:xrefChunkIndexes videoIndex:videoIndex audioIndex:audioIndex] == kMLVErrorCodeNone)
+        {
+            DebugLog(@"Opened from index with %lu video and %lu audio frames\n", (unsigned long)videoIndex.count, (unsigned long)audioIndex.count);
+            progressBlock(1.0f);
+            [self _setVideoIndex:videoIndex audioIndex:audioIndex];
+            [self _setChunkEndsWithChunkIndexes:xrefChunkIndexes];
+            if (_options & kMLVFileOptionsIndexCache) {
+                [self _writeIndexCache];
+            }
+            return kMLVErrorCodeNone;
+        }
+
+        ErrLog(@"XREF index does not match the recording, rescanning");
+    }
+
+    /* the header blocks are known now, the frames are indexed in the background */
+    if (_options & kMLVFileOptionsProgressive) {
+        MLVErrorCode errorCode = [self _mergeChunkIndexes:chunkIndexes videoIndex:nil audioIndex:nil];
+        if (errorCode != kMLVErrorCodeNone) {
+            return errorCode;
+        }
+
+        [self _setChunkEndsWithChunkIndexes:chunkIndexes];
+
+        [self _setVideoIndex:[[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo]
+                  audioIndex:[[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeAudio]];
+        [self _indexInBackgroundAndReportProgress:chunkProgressBlock];
+        return kMLVErrorCodeNone;
+    }
+
+    /* every chunk is scanned on its own worker, the results are merged in chunk order */
+    chunkIndexes = [self _scanChunksHeaderOnly:NO reportProgress:chunkProgressBlock];
+
+    MLVFrameIndex* videoIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+    MLVFrameIndex* audioIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeAudio];
+
+    MLVErrorCode errorCode = [self _mergeChunkIndexes:chunkIndexes videoIndex:videoIndex audioIndex:audioIndex];
+    if (errorCode != kMLVErrorCodeNone) {
+        return errorCode;
+    }
+
+    [self _setVideoIndex:videoIndex audioIndex:audioIndex];
+    [self _setChunkEndsWithChunkIndexes:chunkIndexes];
+
+    if (_options & kMLVFileOptionsWriteIndex) {
+        [self _writeIndexSidecar];
+    }
+
+    if (_options & kMLVFileOptionsIndexCache) {
+        [self _writeIndexCache];
+    }
+
+    return kMLVErrorCodeNone;
+}
+
+- (NSArray<MLVFileChunkIndex*>*) _scanChunksHeaderOnly:(BOOL)headerOnly reportProgress:(nullable void (^)(uint64_t blockSize))progressBlock
+{
+    NSMutableArray<MLVFileChunkIndex*>* chunkIndexes = [[NSMutableArray alloc] initWithCapacity:in_file_count];
+    for(int f=0; f<in_file_count; f++) {
+        [chunkIndexes addObject:[[MLVFileChunkIndex alloc] init]];
+    }
+
+    dispatch_apply(in_file_count, dispatch_get_global_queue(0, 0), ^(size_t f) {
+        @autoreleasepool {
+            MLVFileChunkIndex* chunkIndex = chunkIndexes[f];
+            chunkIndex.errorCode = [self _readBlockInfosOfChunk:(int)f into:chunkIndex startPosition:0 length:UINT64_MAX headerOnly:headerOnly reportProgress:progressBlock];
+        }
+    });
+
+    return chunkIndexes;
+}
+
+- (MLVErrorCode) _mergeChunkIndexes:(NSArray<MLVFileChunkIndex*>*)chunkIndexes videoIndex:(nullable MLVFrameIndex*)videoIndex audioIndex:(nullable MLVFrameIndex*)audioIndex
+{
+    for(MLVFileChunkIndex* chunkIndex in chunkIndexes) {
+        if (chunkIndex.fileHeader) {
+            /* is this the first file? */
+            if (chunkIndex.isFirstFile) {
+                _mainheader = chunkIndex.fileHeader;
+            }
+            /* no, its another chunk */
+            else if (_mainheader.guid != chunkIndex.fileHeader.guid) {
+                ErrLog(@"Error: GUID within the file chunks mismatch!");
+                break;
+            }
+        }
+
+        if (chunkIndex.errorCode != kMLVErrorCodeNone) {
+            return chunkIndex.errorCode;
+        }
+
+        for(MLVBlock* infoBlock in chunkIndex.infoBlocks) {
+            [self _applyInfoBlock:infoBlock];
+        }
+
+        [videoIndex addFrameIndex:chunkIndex.videoIndex];
+        [audioIndex addFrameIndex:chunkIndex.audioIndex];
+    }
+
+    return (_mainheader) ? kMLVErrorCodeNone : kMLVErrorCodeFile;
+}
+
+- (void) _setVideoIndex:(MLVFrameIndex*)videoIndex audioIndex:(MLVFrameIndex*)audioIndex
+{
+    [videoIndex sortByTime];
+    [audioIndex sortByTime];
+
+    @synchronized (self) {
+        _videoIndex = videoIndex;
+        _audioIndex = audioIndex;
+        _growingVideoIndex = nil;
+        _growingAudioIndex = nil;
+    }
+
+    [self _blocksDidChangeWithVideoGapReport:nil];
+}
+
+- (void) _blocksDidChangeWithVideoGapReport:(nullable MLVFrameGapReport*)gapReport
+{
+    @synchronized (self) {
+        _videoGapReport = gapReport;
+    }
+
+    [self willChangeValueForKey:@"frameTime"];
+    [self didChangeValueForKey:@"frameTime"];
+
+    [self willChangeValueForKey:@"duration"];
+    [self didChangeValueForKey:@"duration"];
+}
+
+#pragma mark - Recovery
+
+- (void) _addSkippedRange:(NSRange)range fileNum:(int)fileNum
+{
+    /* chunks are scanned concurrently, a range found twice is only kept once */
+    @synchronized (self) {
+        if (!_skippedRanges) {
+            _skippedRanges = [[NSMutableDictionary alloc] init];
+        }
+
+        NSMutableIndexSet* ranges = _skippedRanges[@(fileNum)];
+        if (!ranges) {
+            ranges = [[NSMutableIndexSet alloc] init];
+            _skippedRanges[@(fileNum)] = ranges;
+        }
+        [ranges addIndexesInRange:range];
+    }
+}
+
+- (NSDictionary<NSNumber*, NSIndexSet*>*) skippedRanges
+{
+    @synchronized (self) {
+        NSMutableDictionary<NSNumber*, NSIndexSet*>* skippedRanges = [[NSMutableDictionary alloc] init];
+        [_skippedRanges enumerateKeysAndObjectsUsingBlock:^(NSNumber* fileNum, NSMutableIndexSet* ranges, BOOL* stop) {
+            skippedRanges[fileNum] = [ranges copy];
+        }];
+        return skippedRanges;
+    }
+}
+
+- (UInt64) skippedBytes
+{
+    UInt64 skippedBytes = 0;
+    for(NSIndexSet* ranges in self.skippedRanges.allValues) {
+        skippedBytes += ranges.count;
+    }
+    return skippedBytes;
+}
+
+#pragma mark - Progressive Indexing
+
+#define MLV_PROGRESSIVE_SCAN_LENGTH (64 * 1024 * 1024)
+
+- (void) _indexInBackgroundAndReportProgress:(void (^)(uint64_t blockSize))progressBlock
+{
+    _pendingVideoFrames = [[NSMutableDictionary alloc] init];
+    _pendingAudioFrames = [[NSMutableDictionary alloc] init];
+    _indexing = YES;
+
+    WEAK_SELF
+    dispatch_async([self _updateQueue], ^{
+        /* chunks are indexed in order, so frames that were handed out keep their index */
+        for(int f=0; ; ) {
+            BOOL done = NO;
+
+            @autoreleasepool {
+                STRONG_SELF
+                if (!self) {
+                    return;
+                }
+                done = [self _indexNextBlocksOfChunk:&f reportProgress:progressBlock];
+            }
+
+            if (done) {
+                break;
+            }
+        }
+    });
+}
+
+/* parses the next part of a chunk and publishes its frames, returns YES when all chunks are done */
+- (BOOL) _indexNextBlocksOfChunk:(int*)fileNum reportProgress:(void (^)(uint64_t blockSize))progressBlock
+{
+    @synchronized (_updateLock) {
+        int f = *fileNum;
+        if (!_chunkEnds || f >= in_file_count) {
+            [self _finishBackgroundIndexing:(_chunkEnds != nil)];
+            return YES;
+        }
+
+        uint64_t* chunkEnds = _chunkEnds.mutableBytes;
+        MLVFileChunkIndex* chunkIndex = [[MLVFileChunkIndex alloc] init];
+        chunkIndex.errorCode = [self _readBlockInfosOfChunk:f into:chunkIndex startPosition:chunkEnds[f] length:MLV_PROGRESSIVE_SCAN_LENGTH headerOnly:NO reportProgress:progressBlock];
+        if (chunkIndex.errorCode != kMLVErrorCodeNone) {
+            ErrLog(@"Indexing chunk %d failed: %ld", f, (long)chunkIndex.errorCode);
+            [self _finishBackgroundIndexing:NO];
+            return YES;
+        }
+
+        /* nothing left in this chunk */
+        if (chunkIndex.endPosition <= chunkEnds[f]) {
+            (*fileNum)++;
+            return NO;
+        }
+        chunkEnds[f] = chunkIndex.endPosition;
+
+        [self _addChunkIndexes:@[chunkIndex]];
+        [self _completePendingFrames];
+    }
+    return NO;
+}
+
+- (void) _finishBackgroundIndexing:(BOOL)complete
+{
+    DebugLog(@"Background indexing finished with %lu video and %lu audio frames\n", (unsigned long)_videoIndex.count, (unsigned long)_audioIndex.count);
+
+    _indexing = NO;
+    [self _completePendingFrames];
+
+    if (!complete) {
+        return;
+    }
+
+    if (_options & kMLVFileOptionsWriteIndex) {
+        [self _writeIndexSidecar];
+    }
+
+    if (_options & kMLVFileOptionsIndexCache) {
+        [self _writeIndexCache];
+    }
+}
+
+- (NSMutableDictionary<NSNumber*, NSMutableArray*>*) _pendingFramesOfType:(MLVBlockType)type {
+    return (type == kMLVBlockTypeVideo) ? _pendingVideoFrames : _pendingAudioFrames;
+}
+
+- (void) _whenFrameAtIndex:(NSUInteger)index ofType:(MLVBlockType)type isIndexed:(void (^)(BOOL available))handler
+{
+    NSMutableDictionary<NSNumber*, NSMutableArray*>* pendingFrames = [self _pendingFramesOfType:type];
+
+    /* the indexer publishes frames before it looks at the table, a handler added in between is completed with them */
+    if (pendingFrames) {
+        @synchronized (pendingFrames) {
+            if (_indexing && ((type == kMLVBlockTypeVideo) ? self.videoIndex : self.audioIndex).count <= index) {
+                NSMutableArray* handlers = pendingFrames[@(index)];
+                if (!handlers) {
+                    handlers = [[NSMutableArray alloc] init];
+                    pendingFrames[@(index)] = handlers;
+                }
+                [handlers addObject:[handler copy]];
+                return;
+            }
+        }
+    }
+
+    BOOL available = (index < ((type == kMLVBlockTypeVideo) ? self.videoIndex : self.audioIndex).count);
+    dispatch_async(dispatch_get_global_queue(0, 0), ^{
+        handler(available);
+    });
+}
+
+/* called by the indexer after publishing frames and when it stops */
+- (void) _completePendingFrames
+{
+    for(NSNumber* type in @[@(kMLVBlockTypeVideo), @(kMLVBlockTypeAudio)]) {
+        NSMutableDictionary<NSNumber*, NSMutableArray*>* pendingFrames = [self _pendingFramesOfType:type.integerValue];
+        if (!pendingFrames) {
+            continue;
+        }
+
+        NSUInteger count = ((type.integerValue == kMLVBlockTypeVideo) ? self.videoIndex : self.audioIndex).count;
+        NSMutableDictionary<NSNumber*, NSMutableArray*>* completedFrames = [[NSMutableDictionary alloc] init];
+        @synchronized (pendingFrames) {
+            for(NSNumber* index in pendingFrames) {
+                if (!_indexing || index.unsignedIntegerValue < count) {
+                    completedFrames[index] = pendingFrames[index];
+                }
+            }
+            [pendingFrames removeObjectsForKeys:completedFrames.allKeys];
+        }
+
+        [completedFrames enumerateKeysAndObjectsUsingBlock:^(NSNumber* index, NSMutableArray* handlers, BOOL* stop) {
+            BOOL available = (index.unsignedIntegerValue < count);
+            for(void (^handler)(BOOL) in handlers) {
+                dispatch_async(dispatch_get_global_queue(0, 0), ^{
+                    handler(available);
+                });
+            }
+        }];
+    }
+}
+
+- (void) whenVideoBlockAtIndex:(NSUInteger)index isIndexed:(void (^)(BOOL available))handler {
+    [self _whenFrameAtIndex:index ofType:kMLVBlockTypeVideo isIndexed:handler];
+}
+
+- (void) whenAudioBlockAtIndex:(NSUInteger)index isIndexed:(void (^)(BOOL available))handler {
+    [self _whenFrameAtIndex:index ofType:kMLVBlockTypeAudio isIndexed:handler];
+}
+
+#pragma mark - Live Indexing
+
+- (void) _setChunkEndsWithChunkIndexes:(NSArray<MLVFileChunkIndex*>*)chunkIndexes
+{
+    _chunkEnds = [[NSMutableData alloc] initWithLength:in_file_count * sizeof(uint64_t)];
+    uint64_t* chunkEnds = _chunkEnds.mutableBytes;
+    for(int f=0; f<in_file_count; f++) {
+        chunkEnds[f] = chunkIndexes[f].endPosition;
+    }
+}
+
+- (void) _setChunkEndsWithFrameIndexes
+{
+    /* without a scan the last frame of every chunk marks where new blocks may follow */
+    _chunkEnds = [[NSMutableData alloc] initWithLength:in_file_count * sizeof(uint64_t)];
+    uint64_t* chunkEnds = _chunkEnds.mutableBytes;
+
+    for(MLVFrameIndex* frameIndex in @[_videoIndex, _audioIndex]) {
+        for(NSUInteger i=0; i<frameIndex.count; i++) {
+            UInt16 fileNum = [frameIndex fileNumAtIndex:i];
+            if (fileNum < in_file_count) {
+                chunkEnds[fileNum] = MAX(chunkEnds[fileNum], [frameIndex filePositionAtIndex:i] + [frameIndex sizeAtIndex:i]);
+            }
+        }
+    }
+}
+
+- (BOOL) _openNextChunk
+{
+    /* .MLV is followed by .M00, .M01 etc */
+    if (in_file_count >= MLV_MAX_CHUNKS) {
+        return NO;
+    }
+
+    NSString* path = self.url.path;
+    NSString* chunkPath = [NSString stringWithFormat:@"%@%02d", [path substringToIndex:path.length - 2], in_file_count - 1];
+
+    int fd = open(chunkPath.fileSystemRepresentation, O_RDONLY);
+    if (fd < 0) {
+        return NO;
+    }
+
+    @synchronized (self) {
+        in_files[in_file_count] = fd;
+        in_file_count++;
+    }
+
+    [_chunkEnds increaseLengthBy:sizeof(uint64_t)];
+
+    DebugLog(@"File %@ opened\n", chunkPath);
+    return YES;
+}
+
+- (MLVErrorCode) updateBlockInfos
+{
+    /* serializes updates, _close waits on the same lock */
+    @synchronized (_updateLock) {
+        if (!_mainheader || !_chunkEnds) {
+            return kMLVErrorCodeFile;
+        }
+
+        /* background indexing continues to the end of the last chunk anyway */
+        if (_indexing) {
+            return kMLVErrorCodeNone;
+        }
+
+        while ([self _openNextChunk]) {
+        }
+
+        NSMutableArray<MLVFileChunkIndex*>* chunkIndexes = [[NSMutableArray alloc] init];
+        uint64_t* chunkEnds = _chunkEnds.mutableBytes;
+        UInt64 fileSize = 0;
+        BOOL chunksChanged = NO;
+        BOOL holdBack = NO;
+
+        /* only blocks behind the last parsed one are read */
+        for(int f=0; f<in_file_count; f++) {
+            struct stat st;
+            if (fstat(in_files[f], &st) != 0) {
+                return kMLVErrorCodeFile;
+            }
+            fileSize += st.st_size;
+
+            MLVFileChunkIndex* chunkIndex = [[MLVFileChunkIndex alloc] init];
+            if (!holdBack && (uint64_t)st.st_size > chunkEnds[f]) {
+                chunkIndex.errorCode = [self _readBlockInfosOfChunk:f into:chunkIndex startPosition:chunkEnds[f] length:UINT64_MAX headerOnly:NO reportProgress:nil];
+                if (chunkIndex.errorCode != kMLVErrorCodeNone) {
+                    return chunkIndex.errorCode;
+                }
+                if (chunkIndex.fileHeader && chunkIndex.fileHeader.guid != _mainheader.guid) {
+                    ErrLog(@"Error: GUID within the file chunks mismatch!");
+                    break;
+                }
+                chunksChanged = YES;
+
+                /* a chunk that is still being written ends within a block, the frames of the next chunks wait until it is complete */
+                holdBack = (chunkIndex.endPosition > chunkEnds[f] && chunkIndex.endPosition < (uint64_t)st.st_size);
+            }
+            chunkIndex.endPosition = MAX(chunkIndex.endPosition, chunkEnds[f]);
+            [chunkIndexes addObject:chunkIndex];
+        }
+
+        if (!chunksChanged) {
+            return kMLVErrorCodeNone;
+        }
+
+        for(int f=0; f<chunkIndexes.count; f++) {
+            chunkEnds[f] = chunkIndexes[f].endPosition;
+        }
+
+        _fileSize = fileSize;
+        [self _unmapChunks];
+        [self _addChunkIndexes:chunkIndexes];
+    }
+
+    return kMLVErrorCodeNone;
+}
+
+- (void) _addChunkIndexes:(NSArray<MLVFileChunkIndex*>*)chunkIndexes
+{
+    /* frames are appended in place, readers get snapshots that only see the frames they were created with */
+    if (!_growingVideoIndex) {
+        _growingVideoIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo];
+        _growingAudioIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeAudio];
+        [_growingVideoIndex addFrameIndex:_videoIndex];
+        [_growingAudioIndex addFrameIndex:_audioIndex];
+    }
+
+    for(MLVFileChunkIndex* chunkIndex in chunkIndexes) {
+        for(MLVBlock* infoBlock in chunkIndex.infoBlocks) {
+            [self _applyInfoBlock:infoBlock];
+        }
+
+        NSUInteger frameCount = chunkIndex.videoIndex.count + chunkIndex.audioIndex.count;
+        NSUInteger appendedCount = [_growingVideoIndex appendFrameIndex:chunkIndex.videoIndex] + [_growingAudioIndex appendFrameIndex:chunkIndex.audioIndex];
+        if (appendedCount < frameCount) {
+            ErrLog(@"%lu frames sort before frames that were indexed already, they are left out until the file is opened again", (unsigned long)(frameCount - appendedCount));
+        }
+    }
+
+    _duration = 0;
+    _firstTime = 0;
+
+    DebugLog(@"Index updated: %lu -> %lu video frames\n", (unsigned long)_videoIndex.count, (unsigned long)_growingVideoIndex.count);
+    MLVFrameIndex* videoIndex = [_growingVideoIndex snapshot];
+    MLVFrameGapReport* gapReport;
+    @synchronized (self) {
+        gapReport = _videoGapReport;
+    }
+
+    /* the frames of a report that was asked for keep their index, only the appended frames are looked at */
+    if (gapReport) {
+        gapReport = [self _videoGapReportWithIndex:videoIndex extendingReport:gapReport tolerance:MLV_GAP_TOLERANCE];
+    }
+
+    @synchronized (self) {
+        _videoIndex = videoIndex;
+        _audioIndex = [_growingAudioIndex snapshot];
+    }
+
+    [self _blocksDidChangeWithVideoGapReport:gapReport];
+}
+
+- (void) _unmapChunks
+{
+    /* the recording grew, it is still being written and is read with pread from now on */
+    @synchronized (self) {
+        _mappings = nil;
+    }
+}
+
+- (dispatch_queue_t) _updateQueue
+{
+    @synchronized (self) {
+        if (!_updateQueue) {
+            _updateQueue = dispatch_queue_create("org.mlvprocess.fileUpdate", DISPATCH_QUEUE_SERIAL);
+        }
+        return _updateQueue;
+    }
+}
+
+/* the source owns fd and closes it once it is cancelled */
+- (void) _watchFileDescriptor:(int)fd
+{
+    dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_VNODE, fd, DISPATCH_VNODE_WRITE | DISPATCH_VNODE_EXTEND, [self _updateQueue]);
+
+    WEAK_SELF
+    dispatch_source_set_event_handler(source, ^{
+        STRONG_SELF
+        [self _scheduleUpdate];
+    });
+
+    dispatch_source_set_cancel_handler(source, ^{
+        close(fd);
+    });
+
+    [_watchSources addObject:source];
+    dispatch_resume(source);
+}
+
+- (void) _startWatching
+{
+    _watchSources = [[NSMutableArray alloc] init];
+
+    _updateTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, [self _updateQueue]);
+    WEAK_SELF
+    dispatch_source_set_event_handler(_updateTimer, ^{
+        STRONG_SELF
+        if (self) {
+            self->_updateScheduled = NO;
+            [self _watchedFileDidChange];
+        }
+    });
+    [_watchSources addObject:_updateTimer];
+    dispatch_resume(_updateTimer);
+
+    /* the directory changes when new chunks appear */
+    int dirFd = open(self.url.URLByDeletingLastPathComponent.path.fileSystemRepresentation, O_EVTONLY);
+    if (dirFd >= 0) {
+        [self _watchFileDescriptor:dirFd];
+    }
+
+    for(int f=0; f<in_file_count; f++) {
+        [self _watchChunk:f];
+    }
+}
+
+- (void) _watchChunk:(int)fileNum
+{
+    /* a descriptor of its own, the chunk descriptors are closed by _close while a cancelled source may still use its descriptor */
+    int fd = dup(in_files[fileNum]);
+    if (fd >= 0) {
+        [self _watchFileDescriptor:fd];
+    }
+}
+
+- (void) _stopWatching
+{
+    for(dispatch_source_t source in _watchSources) {
+        dispatch_source_cancel(source);
+    }
+    _watchSources = nil;
+    _updateTimer = nil;
+}
+
+/* called on the update queue for every write, a recording is written in many small writes that are indexed together */
+- (void) _scheduleUpdate
+{
+    if (!_watchSources || _updateScheduled) {
+        return;
+    }
+    _updateScheduled = YES;
+
+    dispatch_source_set_timer(_updateTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(MLV_WATCH_COALESCING_INTERVAL * NSEC_PER_SEC)),
+                              DISPATCH_TIME_FOREVER, (uint64_t)(MLV_WATCH_COALESCING_INTERVAL * NSEC_PER_SEC / 4));
+}
+
+- (void) _watchedFileDidChange
+{
+    if (!_watchSources) {
+        return;
+    }
+
+    NSUInteger videoCount = _videoIndex.count;
+    NSUInteger audioCount = _audioIndex.count;
+    int chunkCount = in_file_count;
+
+    if ([self updateBlockInfos] != kMLVErrorCodeNone) {
+        return;
+    }
+
+    for(int f=chunkCount; f<in_file_count; f++) {
+        [self _watchChunk:f];
+    }
+
+    if (_videoIndex.count != videoCount || _audioIndex.count != audioCount) {
+        void (^handler)(MLVFile*) = self.blockInfosDidChangeHandler;
+        if (handler) {
+            handler(self);
+        }
+    }
+}
+
+#pragma mark - Index Cache
+
+- (UInt64) _readGUID
+{
+    mlv_file_hdr_t file_hdr;
+    if (pread(in_files[0], &file_hdr, sizeof(mlv_file_hdr_t), 0) != sizeof(mlv_file_hdr_t) || memcmp(file_hdr.fileMagic, "MLVI", 4) != 0) {
+        return 0;
+    }
+    return file_hdr.fileGuid;
+}
+
+- (BOOL) _readIndexCache
+{
+    UInt64 guid = [self _readGUID];
+    NSData* chunkStats = [MLVFileIndex chunkStatsWithFileDescriptors:in_files count:in_file_count];
+    if (guid == 0 || !chunkStats) {
+        return NO;
+    }
+
+    MLVFileIndex* index = [[MLVFileIndex alloc] initWithContentsOfURL:[MLVFileIndex cacheURLWithGUID:guid] guid:guid chunkStats:chunkStats];
+    if (!index) {
+        return NO;
+    }
+
+    for(MLVBlock* infoBlock in index.infoBlocks) {
+        [self _applyInfoBlock:infoBlock];
+    }
+
+    if (!_mainheader) {
+        return NO;
+    }
+
+    /* stored sorted */
+    _videoIndex = index.videoIndex;
+    _audioIndex = index.audioIndex;
+    [self _blocksDidChangeWithVideoGapReport:nil];
+    [self _setChunkEndsWithFrameIndexes];
+
+    DebugLog(@"Opened from index cache with %lu video and %lu audio frames\n", (unsigned long)_videoIndex.count, (unsigned long)_audioIndex.count);
+    return YES;
+}
+
+- (BOOL) _writeIndexCache
+{
+    NSData* chunkStats = [MLVFileIndex chunkStatsWithFileDescriptors:in_files count:in_file_count];
+    if (!_mainheader || !chunkStats) {
+        return NO;
+    }
+
+    __unsafe_unretained MLVBlock* blocks[] = { _mainheader, _lensInfo, _elvlInfo, _stylInfo, _wbalInfo, _idntInfo, _expoInfo, _rawiInfo, _rawcInfo, _waviInfo, _rtciInfo };
+    NSMutableArray<MLVBlock*>* infoBlocks = [[NSMutableArray alloc] init];
+    for(size_t i=0; i<sizeof(blocks)/sizeof(blocks[0]); i++) {
+        if (blocks[i]) {
+            [infoBlocks addObject:blocks[i]];
+        }
+    }
+
+    return [MLVFileIndex writeIndexWithGUID:_mainheader.guid
+                                 chunkStats:chunkStats
+                                 infoBlocks:infoBlocks
+                                 videoIndex:_videoIndex
+                                 audioIndex:_audioIndex
+                                      toURL:[MLVFileIndex cacheURLWithGUID:_mainheader.guid]];
+}
+
+#pragma mark - XREF Index
+
+- (NSString*) _indexSidecarPath
+{
+    /* MLV Lite and mlv_dump store the index as <base>.IDX next to the .MLV */
+    return [self.url.path.stringByDeletingPathExtension stringByAppendingPathExtension:@"IDX"];
+}
+
+- (nullable NSData*) _xrefEntriesWithBlockBuffer:(const void*)buffer length:(size_t)length
+{
+    const mlv_xref_hdr_t* xref_hdr = buffer;
+    if (length < sizeof(mlv_xref_hdr_t) || xref_hdr->entryCount == 0) {
+        return nil;
+    }
+
+    size_t entriesLength = (size_t)xref_hdr->entryCount * sizeof(mlv_xref_t);
+    if (sizeof(mlv_xref_hdr_t) + entriesLength > MIN(length, xref_hdr->blockSize)) {
+        ErrLog(@"XREF block is truncated");
+        return nil;
+    }
+
+    return [NSData dataWithBytes:(const uint8_t*)buffer + sizeof(mlv_xref_hdr_t) length:entriesLength];
+}
+
+- (nullable NSData*) _readIndexSidecarWithGUID:(UInt64*)guid
+{
+    NSString* path = [self _indexSidecarPath];
+    NSData* data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:nil];
+    if (!data) {
+        return nil;
+    }
+
+    /* file header followed by the XREF block */
+    const mlv_file_hdr_t* file_hdr = data.bytes;
+    if (data.length < sizeof(mlv_file_hdr_t) || memcmp(file_hdr->fileMagic, "MLVI", 4) != 0 || file_hdr->blockSize > data.length) {
+        ErrLog(@"Invalid index file %@", path);
+        return nil;
+    }
+
+    const mlv_xref_hdr_t* xref_hdr = (const void*)((const uint8_t*)data.bytes + file_hdr->blockSize);
+    size_t xrefLength = data.length - file_hdr->blockSize;
+    if (xrefLength < sizeof(mlv_xref_hdr_t) || memcmp(xref_hdr->blockType, "XREF", 4) != 0) {
+        ErrLog(@"Invalid index file %@", path);
+        return nil;
+    }
+
+    /* the index has no chunk stats of its own, a chunk that was appended to or truncated after it was written is newer */
+    struct stat sidecarStat;
+    if (stat(path.fileSystemRepresentation, &sidecarStat) != 0) {
+        return nil;
+    }
+    for(int f=0; f<in_file_count; f++) {
+        struct stat st;
+        if (fstat(in_files[f], &st) != 0) {
+            return nil;
+        }
+        if (st.st_mtimespec.tv_sec > sidecarStat.st_mtimespec.tv_sec ||
+            (st.st_mtimespec.tv_sec == sidecarStat.st_mtimespec.tv_sec && st.st_mtimespec.tv_nsec > sidecarStat.st_mtimespec.tv_nsec))
+        {
+            DebugLog(@"Index file %@ is outdated", path.lastPathComponent);
+            return nil;
+        }
+    }
+
+    *guid = file_hdr->fileGuid;
+    return [self _xrefEntriesWithBlockBuffer:xref_hdr length:xrefLength];
+}
+
+static int _MLVCompareXrefOffsets(const void* a, const void* b)
+{
+    uint64_t offsetA = ((const mlv_xref_t*)a)->frameOffset;
+    uint64_t offsetB = ((const mlv_xref_t*)b)->frameOffset;
+    return (offsetA < offsetB) ? -1 : (offsetA > offsetB) ? 1 : 0;
+}
+
+/* nil if the XREF does not match the chunks, the header indexes are left untouched for a rescan */
+- (nullable NSArray<MLVFileChunkIndex*>*) _chunkIndexesWithXrefEntries:(NSData*)xrefEntries headerIndexes:(NSArray<MLVFileChunkIndex*>*)headerIndexes
+{
+    const mlv_xref_t* xrefs = xrefEntries.bytes;
+    size_t xrefCount = xrefEntries.length / sizeof(mlv_xref_t);
+
+    /* split by chunk once, every worker only sees the entries of its own chunk */
+    NSMutableArray<NSMutableData*>* chunkEntries = [[NSMutableArray alloc] initWithCapacity:in_file_count];
+    for(int f=0; f<in_file_count; f++) {
+        [chunkEntries addObject:[[NSMutableData alloc] init]];
+    }
+
+    for(size_t i=0; i<xrefCount; i++) {
+        if (xrefs[i].fileNumber >= in_file_count) {
+            ErrLog(@"XREF entry %zu refers to missing chunk %d", i, xrefs[i].fileNumber);
+            return nil;
+        }
+        [chunkEntries[xrefs[i].fileNumber] appendBytes:&xrefs[i] length:sizeof(mlv_xref_t)];
+    }
 
-    if (_duration == 0) {
+    NSMutableArray<MLVFileChunkIndex*>* chunkIndexes = [[NSMutableArray alloc] initWithCapacity:in_file_count];
+    for(int f=0; f<in_file_count; f++) {
+        MLVFileChunkIndex* headerIndex = headerIndexes[f];
+        MLVFileChunkIndex* chunkIndex = [[MLVFileChunkIndex alloc] init];
+        chunkIndex.fileHeader = headerIndex.fileHeader;
+        chunkIndex.firstFile = headerIndex.firstFile;
+        chunkIndex.errorCode = headerIndex.errorCode;
+        chunkIndex.endPosition = headerIndex.endPosition;
+        [chunkIndex.infoBlocks addObjectsFromArray:headerIndex.infoBlocks];
+        [chunkIndexes addObject:chunkIndex];
+    }
 
-        MLVVideoBlock* firstVideoBlock = _videoBlocks.firstObject;
-        MLVVideoBlock* lastVideoBlock = _videoBlocks.lastObject;
+    dispatch_apply(in_file_count, dispatch_get_global_queue(0, 0), ^(size_t f) {
+        @autoreleasepool {
+            MLVFileChunkIndex* chunkIndex = chunkIndexes[f];
+            if (chunkIndex.errorCode == kMLVErrorCodeNone) {
+                chunkIndex.errorCode = [self _readBlockInfosOfChunk:(int)f into:chunkIndex xrefEntries:chunkEntries[f]];
+            }
+        }
+    });
 
-        _duration = (lastVideoBlock.time - firstVideoBlock.time) + CMTimeGetSeconds([self frameTime]);
+    for(MLVFileChunkIndex* chunkIndex in chunkIndexes) {
+        if (chunkIndex.errorCode != kMLVErrorCodeNone) {
+            return nil;
+        }
     }
-    return _duration;
+    return chunkIndexes;
 }
 
-#pragma mark -
-
-- (FILE **) _load:(const char *)base_filename numberOfChunks:(int *)entries
+/* the referenced frame headers are read with positional reads, the blocks between the frames are parsed, e.g. metadata written while recording */
+- (MLVErrorCode) _readBlockInfosOfChunk:(int)fileNum into:(MLVFileChunkIndex*)chunkIndex xrefEntries:(NSMutableData*)entries
 {
-    int seq_number = 0;
-    size_t max_name_len = strlen(base_filename) + 16;
-    char *filename = malloc(max_name_len);
-
-    strncpy(filename, base_filename, max_name_len - 1);
-    FILE **files = malloc(sizeof(FILE*));
-
+    int fd = in_files[fileNum];
 
-    files[0] = fopen(filename, "rb");
-    if(!files[0])
-    {
-        free(filename);
-        free(files);
-        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return kMLVErrorCodeFile;
     }
 
-    struct stat st;
-    stat(filename, &st);
-    _fileSize += st.st_size;
-    
-    DebugLog(@"File %s opened\n", filename);
+    mlv_xref_t* xrefs = entries.mutableBytes;
+    size_t xrefCount = entries.length / sizeof(mlv_xref_t);
+    qsort(xrefs, xrefCount, sizeof(mlv_xref_t), _MLVCompareXrefOffsets);
+
+    /* the header blocks were parsed up to the first frame */
+    uint64_t position = chunkIndex.endPosition;
+
+    for(size_t i=0; i<=xrefCount; i++) {
+        /* the end of the chunk closes the last range, a block that is still being written may end it early */
+        BOOL last = (i == xrefCount);
+        uint64_t next = last ? (uint64_t)st.st_size : xrefs[i].frameOffset;
+
+        union {
+            mlv_hdr_t hdr;
+            mlv_vidf_hdr_t vidf;
+            mlv_audf_hdr_t audf;
+        } block_hdr;
+        memset(&block_hdr, 0, sizeof(block_hdr));
+
+        BOOL isFrame = NO;
+        if (!last) {
+            /* a frame beyond the end of the chunk means it was truncated */
+            ssize_t readLength = pread(fd, &block_hdr, sizeof(block_hdr), (off_t)next);
+            if (readLength < (ssize_t)sizeof(mlv_hdr_t) || next + block_hdr.hdr.blockSize > (uint64_t)st.st_size) {
+                return kMLVErrorCodeFile;
+            }
 
-    (*entries)++;
-    while(seq_number < 99)
-    {
-        FILE **realloc_files = realloc(files, (*entries + 1) * sizeof(FILE*));
+            isFrame = ((memcmp(block_hdr.hdr.blockType, "VIDF", 4) == 0 && readLength >= (ssize_t)MIN(sizeof(mlv_vidf_hdr_t), block_hdr.hdr.blockSize)) ||
+                       (memcmp(block_hdr.hdr.blockType, "AUDF", 4) == 0 && readLength >= (ssize_t)MIN(sizeof(mlv_audf_hdr_t), block_hdr.hdr.blockSize)));
 
-        if(!realloc_files)
-        {
-            free(filename);
-            free(files);
-            return NULL;
+            /* other blocks listed by the index are parsed with the range they are in */
+            if (!isFrame) {
+                if (xrefs[i].frameType != 0) {
+                    /* index points at something that is not a frame, it is stale */
+                    return kMLVErrorCodeFile;
+                }
+                continue;
+            }
+
+            /* listed twice or overlapping the previous frame */
+            if (next < position) {
+                return kMLVErrorCodeFile;
+            }
         }
 
-        files = realloc_files;
+        if (next > position) {
+            MLVFileChunkIndex* rangeIndex = [[MLVFileChunkIndex alloc] init];
+            MLVErrorCode errorCode = [self _readBlockInfosOfChunk:fileNum into:rangeIndex startPosition:position length:next - position headerOnly:NO reportProgress:nil];
+            if (errorCode != kMLVErrorCodeNone) {
+                return errorCode;
+            }
 
-        /* check for the next file M00, M01 etc */
-        char seq_name[8];
+            /* a frame that is not listed or blocks that do not end at the next frame, the index does not describe this chunk */
+            if (rangeIndex.videoIndex.count > 0 || rangeIndex.audioIndex.count > 0 || (!last && rangeIndex.endPosition != next)) {
+                return kMLVErrorCodeFile;
+            }
 
-        sprintf(seq_name, "%02d", seq_number);
-        seq_number++;
+            [chunkIndex.infoBlocks addObjectsFromArray:rangeIndex.infoBlocks];
+            position = rangeIndex.endPosition;
+        }
 
-        strcpy(&filename[strlen(filename) - 2], seq_name);
+        if (last) {
+            break;
+        }
 
-        /* try to open */
-        files[*entries] = fopen(filename, "rb");
-        if(files[*entries])
-        {
-            struct stat st;
-            stat(filename, &st);
-            _fileSize += st.st_size;
-            
-            DebugLog(@"File %s opened\n", filename);
-            (*entries)++;
+        if (memcmp(block_hdr.hdr.blockType, "VIDF", 4) == 0) {
+            [chunkIndex.videoIndex addBlockBuffer:&block_hdr.vidf fileNum:fileNum filePosition:next];
         }
-        else
-        {
-            DebugLog(@"File %s not existing.\n", filename);
-            break;
+        else {
+            [chunkIndex.audioIndex addBlockBuffer:&block_hdr.audf fileNum:fileNum filePosition:next];
         }
+        position = next + block_hdr.hdr.blockSize;
     }
-    
-    free(filename);
-    return files;
+
+    chunkIndex.endPosition = position;
+    return kMLVErrorCodeNone;
 }
 
-- (MLVErrorCode) _open
+- (BOOL) _writeIndexSidecar
 {
-    NSFileManager* fman = [[NSFileManager alloc] init];
-
-    /* option */
-    const char* input_filename = [fman fileSystemRepresentationWithPath:self.url.path];
-
-    /* open files */
-    @synchronized (self) {
-        in_files = NULL;
-        in_file_count = 0;
+    if (!_mainheader || in_file_count == 0) {
+        return NO;
+    }
 
-        in_files = [self _load:input_filename numberOfChunks:&in_file_count];
+    mlv_file_hdr_t file_hdr;
+    memset(&file_hdr, 0, sizeof(mlv_file_hdr_t));
+    size_t hdr_size = MIN(sizeof(mlv_file_hdr_t), _mainheader.size);
+    if (pread(in_files[_mainheader.fileNum], &file_hdr, hdr_size, (off_t)_mainheader.filePosition) != (ssize_t)hdr_size) {
+        return NO;
     }
+    file_hdr.blockSize = sizeof(mlv_file_hdr_t);
+
+    NSUInteger videoCount = _videoIndex.count;
+    NSUInteger audioCount = _audioIndex.count;
+    NSUInteger entryCount = videoCount + audioCount;
+
+    mlv_xref_hdr_t xref_hdr;
+    memset(&xref_hdr, 0, sizeof(mlv_xref_hdr_t));
+    memcpy(xref_hdr.blockType, "XREF", 4);
+    xref_hdr.blockSize = (uint32_t)(sizeof(mlv_xref_hdr_t) + entryCount * sizeof(mlv_xref_t));
+    xref_hdr.frameType = ((videoCount > 0) ? 1 : 0) | ((audioCount > 0) ? 2 : 0);
+    xref_hdr.entryCount = (uint32_t)entryCount;
+
+    NSMutableData* data = [[NSMutableData alloc] initWithCapacity:sizeof(mlv_file_hdr_t) + xref_hdr.blockSize];
+    [data appendBytes:&file_hdr length:sizeof(mlv_file_hdr_t)];
+    [data appendBytes:&xref_hdr length:sizeof(mlv_xref_hdr_t)];
+
+    /* entries are ordered by timestamp, video and audio interleaved */
+    NSUInteger v = 0, a = 0;
+    while(v < videoCount || a < audioCount) {
+        MLVFrameIndex* frameIndex;
+        NSUInteger index;
+        uint8_t frameType;
+        if (a >= audioCount || (v < videoCount && [_videoIndex timestampAtIndex:v] <= [_audioIndex timestampAtIndex:a])) {
+            frameIndex = _videoIndex;
+            index = v++;
+            frameType = 1;
+        }
+        else {
+            frameIndex = _audioIndex;
+            index = a++;
+            frameType = 2;
+        }
 
-    if(!in_files || !in_file_count) {
-        DebugLog(@"Failed to open file '%s'\n", input_filename);
-        return kMLVErrorCodeFile;
+        mlv_xref_t xref;
+        xref.fileNumber = [frameIndex fileNumAtIndex:index];
+        xref.empty = 0;
+        xref.frameType = frameType;
+        xref.frameOffset = [frameIndex filePositionAtIndex:index];
+        [data appendBytes:&xref length:sizeof(mlv_xref_t)];
     }
 
-    return kMLVErrorCodeNone;
+    NSError* error;
+    if (![data writeToFile:[self _indexSidecarPath] options:NSDataWritingAtomic error:&error]) {
+        ErrLog(@"Failed to write index file: %@", error);
+        return NO;
+    }
+    return YES;
 }
 
-- (void) _close
-{
-    @synchronized (self) {
-        for(int f=0; f<in_file_count; f++) {
-            fclose(in_files[f]);
-        }
+#pragma mark -
 
-        if (in_files) {
-            free(in_files);
-            in_files = NULL;
-        }
-        in_file_count = 0;
+- (void) _applyInfoBlock:(MLVBlock*)block
+{
+    /* later blocks replace earlier ones, except for the timecode which is taken from the first block */
+    switch (block.type) {
+        case kMLVBlockTypeMLVInfo:          _mainheader = (MLVFileBlock*)block; break;
+        case kMLVBlockTypeLens:             _lensInfo = (MLVLensBlock*)block; break;
+        case kMLVBlockTypeElectronicLevel:  _elvlInfo = (MLVElectronicLevelBlock*)block; break;
+        case kMLVBlockTypeStyle:            _stylInfo = (MLVStyleBlock*)block; break;
+        case kMLVBlockTypeWhiteBalance:     _wbalInfo = (MLVWhiteBalanceBlock*)block; break;
+        case kMLVBlockTypeIdentification:   _idntInfo = (MLVCameraInfoBlock*)block; break;
+        case kMLVBlockTypeExposure:         _expoInfo = (MLVExposureBlock*)block; break;
+        case kMLVBlockTypeRawInfo:          _rawiInfo = (MLVRAWInfoBlock*)block; break;
+        case kMLVBlockTypeRawCaptureInfo:   _rawcInfo = (MLVRAWCaptureInfoBlock*)block; break;
+        case kMLVBlockTypeWavInfo:          _waviInfo = (MLVWAVInfoBlock*)block; break;
+        case kMLVBlockTypeRTCI:
+            if (!_rtciInfo) {
+                _rtciInfo = (MLVTimecodeBlock*)block;
+            }
+            break;
+        default:
+            break;
     }
 }
 
-- (MLVErrorCode) readBlockInfosAndReportProgress:(void (^)(float progress))progressBlock
+- (MLVErrorCode) _readBlockInfosOfChunk:(int)in_file_num into:(MLVFileChunkIndex*)chunkIndex startPosition:(uint64_t)startPosition length:(uint64_t)length headerOnly:(BOOL)headerOnly reportProgress:(nullable void (^)(uint64_t blockSize))progressBlock
 {
-    NSMutableArray<MLVVideoBlock*>* videoBlocks = [[NSMutableArray alloc] init];
-    NSMutableArray<MLVAudioBlock*>* audioBlocks = [[NSMutableArray alloc] init];
-
-
     int blocks_processed = 0;
     char info_string[256] = "(MLV Video without INFO blocks)";
+    BOOL recover = ((_options & kMLVFileOptionsRecover) != 0);
 
-    int in_file_num = 0;
-    FILE *in_file = in_files[in_file_num];
-    uint64_t readSize = 0;
-    float _lastProgress = 0;
+    /* headers are parsed from large windows, the disk is only touched again when a block crosses the window edge */
+    /* a short range, e.g. the blocks between two XREF frames, does not need a full window */
+    mlv_scan_window_t window;
+    _MLVScanWindowInit(&window, in_files[in_file_num], (size_t)MIN(length, MLV_SCAN_WINDOW_SIZE));
 
-    DebugLog(@"Processing...\n");
-    uint64_t position_previous = 0;
+    uint64_t position = startPosition;
     do
     {
         mlv_hdr_t buf;
-        uint64_t position = 0;
 
-read_headers:
+        /* stop at a block boundary once enough was parsed */
+        if(position - startPosition >= length)
+        {
+            break;
+        }
 
-//        DebugLog(@"B:%d/%d V:%d/%d A:%d/%d\n", blocks_processed, block_xref?block_xref->entryCount:0, vidf_frames_processed, total_vidf_count, audf_frames_processed, total_audf_count);
+        if(!_MLVScanWindowRead(&window, &buf, position, sizeof(mlv_hdr_t)))
+        {
+            DebugLog(@"Reached end of chunk %d/%d after %i blocks\n", in_file_num + 1, in_file_count, blocks_processed);
+            break;
+        }
 
+        if (progressBlock) {
+            progressBlock(buf.blockSize);
+        }
 
-        position = ftello(in_file);
+        /* unexpected block header size? */
+        BOOL damaged = (buf.blockSize < sizeof(mlv_hdr_t) || buf.blockSize > MLV_MAX_BLOCK_SIZE);
+        if(!damaged && recover)
+        {
+            damaged = !_MLVIsKnownBlockType(buf.blockType);
+        }
 
-        if(fread(&buf, sizeof(mlv_hdr_t), 1, in_file) != 1)
+        if(damaged)
         {
-            DebugLog(@"Reached end of chunk %d/%d after %i blocks\n", in_file_num + 1, in_file_count, blocks_processed);
+            if(!recover)
+            {
+                ErrLog(@"Invalid block size at position 0x%08llu", position);
+                _MLVScanWindowFree(&window);
+                return kMLVErrorCodeFile;
+            }
 
-            if(in_file_num < (in_file_count - 1))
+            /* continue behind the damaged range */
+            uint64_t next;
+            if(!_MLVScanWindowFindBlock(&window, position + 1, &next))
             {
-                in_file_num++;
-                in_file = in_files[in_file_num];
+                next = window.fileSize;
             }
-            else
+
+            ErrLog(@"Skipping damaged range 0x%08llx-0x%08llx in chunk %d", position, next, in_file_num + 1);
+            [self _addSkippedRange:NSMakeRange((NSUInteger)position, (NSUInteger)(next - position)) fileNum:in_file_num];
+
+            if(next >= window.fileSize)
             {
+                position = next;
                 break;
             }
 
-            blocks_processed = 0;
-
-            goto read_headers;
-        }
-        
-        readSize += buf.blockSize;
-        float progress = (float)readSize/(float)_fileSize;
-        if (progress > _lastProgress + 0.01) {
-            progressBlock(progress);
-            _lastProgress = progress;
+            window.lastBlockSize = 0;
+            position = next;
+            continue;
         }
-        
 
-        /* jump back to the beginning of the block just read */
-        fseeko(in_file, position, SEEK_SET);
+        /* block is still being written or the chunk is truncated */
+        if(position + buf.blockSize > window.fileSize)
+        {
+            /* unless a block follows, then the size is damaged */
+            uint64_t next;
+            if(recover && _MLVScanWindowFindBlock(&window, position + 1, &next))
+            {
+                ErrLog(@"Skipping block with damaged size 0x%08llx-0x%08llx in chunk %d", position, next, in_file_num + 1);
+                [self _addSkippedRange:NSMakeRange((NSUInteger)position, (NSUInteger)(next - position)) fileNum:in_file_num];
 
-        position = ftello(in_file);
+                window.lastBlockSize = 0;
+                position = next;
+                continue;
+            }
 
-        /* unexpected block header size? */
-        if(buf.blockSize < sizeof(mlv_hdr_t) || buf.blockSize > 50 * 1024 * 1024)
-        {
-            ErrLog(@"Invalid block size at position 0x%08llu", position);
-            return kMLVErrorCodeFile;
+            DebugLog(@"Incomplete block at position 0x%08llx in chunk %d\n", position, in_file_num + 1);
+            break;
         }
 
         UInt64 blockPosition = position;
         MLVBlock* hdrBlock = [[MLVBlock alloc] initWithBlockBuffer:&buf fileNum:in_file_num filePosition:position];
 
-//        DebugLog(@"hdrBlock %c%c%c%c", hdrBlock.type >> 24, (hdrBlock.type >> 16) & 0xFF, (hdrBlock.type >> 8) & 0xFF, hdrBlock.type & 0xFF);
+        /* the header blocks end with the first frame */
+        if(headerOnly && (hdrBlock.type == kMLVBlockTypeVideo || hdrBlock.type == kMLVBlockTypeAudio))
+        {
+            break;
+        }
 
         /* file header */
         if(hdrBlock.type == kMLVBlockTypeMLVInfo)
@@ -392,34 +1873,24 @@ read_headers:
             size_t hdr_size = MIN(sizeof(mlv_file_hdr_t), buf.blockSize);
 
             /* read the whole header block, but limit size to either our local type size or the written block size */
-            if(fread(&file_hdr, hdr_size, 1, in_file) != 1)
+            if(!_MLVScanWindowRead(&window, &file_hdr, position, hdr_size))
             {
                 ErrLog(@"File ends in the middle of a block");
+                _MLVScanWindowFree(&window);
                 return kMLVErrorCodeFile;
             }
-            fseeko(in_file, position + file_hdr.blockSize, SEEK_SET);
-
-            MLVFileBlock* mainheader = [[MLVFileBlock alloc] initWithBlockBuffer:&file_hdr fileNum:in_file_num filePosition:position];
-
-            /* is this the first file? */
-            if(file_hdr.fileNum == 0) {
-                _mainheader = mainheader;
-            }
-            else
-            {
-                /* no, its another chunk */
-                if(_mainheader.guid != mainheader.guid) {
-                    ErrLog(@"Error: GUID within the file chunks mismatch!");
-                    break;
-                }
-            }
 
+            /* the GUID of the chunks is compared when merging */
+            chunkIndex.fileHeader = [[MLVFileBlock alloc] initWithBlockBuffer:&file_hdr fileNum:in_file_num filePosition:position];
+            chunkIndex.firstFile = (file_hdr.fileNum == 0);
         }
         else
         {
-            if(_mainheader.size == 0)
+            /* when continuing a chunk the header was read before */
+            if(!chunkIndex.fileHeader && startPosition == 0)
             {
                 ErrLog(@"Missing file header");
+                _MLVScanWindowFree(&window);
                 return kMLVErrorCodeFile;
             }
 
@@ -428,48 +1899,42 @@ read_headers:
                 mlv_audf_hdr_t block_hdr;
                 size_t hdr_size = MIN(sizeof(mlv_audf_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &block_hdr, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
-                MLVAudioBlock* block = [[MLVAudioBlock alloc] initWithBlockBuffer:&block_hdr fileNum:in_file_num filePosition:blockPosition];
-                [audioBlocks addObject:block];
-
-                fseeko(in_file, position + block_hdr.blockSize, SEEK_SET);
+                [chunkIndex.audioIndex addBlockBuffer:&block_hdr fileNum:in_file_num filePosition:blockPosition];
             }
             else if(hdrBlock.type == kMLVBlockTypeVideo)
             {
                 mlv_vidf_hdr_t block_hdr;
                 size_t hdr_size = MIN(sizeof(mlv_vidf_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &block_hdr, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
-                MLVVideoBlock* block = [[MLVVideoBlock alloc] initWithBlockBuffer:&block_hdr fileNum:in_file_num filePosition:blockPosition];
-                [videoBlocks addObject:block];
-
-                fseeko(in_file, position + block_hdr.blockSize, SEEK_SET);
+                [chunkIndex.videoIndex addBlockBuffer:&block_hdr fileNum:in_file_num filePosition:blockPosition];
             }
             else if(hdrBlock.type == kMLVBlockTypeLens)
             {
                 mlv_lens_hdr_t lens_info;
                 size_t hdr_size = MIN(sizeof(mlv_lens_hdr_t), buf.blockSize);
 
-                if(fread(&lens_info, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &lens_info, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
-                _lensInfo = [[MLVLensBlock alloc] initWithBlockBuffer:&lens_info fileNum:in_file_num filePosition:blockPosition];
-
-                /* skip remaining data, if there is any */
-                fseeko(in_file, position + lens_info.blockSize, SEEK_SET);
+                [chunkIndex.infoBlocks addObject:[[MLVLensBlock alloc] initWithBlockBuffer:&lens_info fileNum:in_file_num filePosition:blockPosition]];
 
             }
             else if(hdrBlock.type == kMLVBlockTypeInfo)
@@ -477,9 +1942,10 @@ read_headers:
                 mlv_info_hdr_t block_hdr;
                 size_t hdr_size = MIN(sizeof(mlv_info_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &block_hdr, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
@@ -491,10 +1957,11 @@ read_headers:
                 {
                     char *buf = malloc(str_length + 1);
 
-                    if(fread(buf, str_length, 1, in_file) != 1)
+                    if(!_MLVScanWindowRead(&window, buf, position + hdr_size, str_length))
                     {
                         free(buf);
                         ErrLog(@"File ends in the middle of a block");
+                        _MLVScanWindowFree(&window);
                         return kMLVErrorCodeFile;
                     }
 
@@ -514,91 +1981,80 @@ read_headers:
                 mlv_elvl_hdr_t block_hdr;
                 size_t hdr_size = MIN(sizeof(mlv_elvl_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &block_hdr, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
-                _elvlInfo = [[MLVElectronicLevelBlock alloc] initWithBlockBuffer:&block_hdr fileNum:in_file_num filePosition:blockPosition];
-
-                /* skip remaining data, if there is any */
-                fseeko(in_file, position + block_hdr.blockSize, SEEK_SET);
+                [chunkIndex.infoBlocks addObject:[[MLVElectronicLevelBlock alloc] initWithBlockBuffer:&block_hdr fileNum:in_file_num filePosition:blockPosition]];
             }
             else if(hdrBlock.type == kMLVBlockTypeStyle)
             {
                 mlv_styl_hdr_t block_hdr;
                 size_t hdr_size = MIN(sizeof(mlv_styl_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &block_hdr, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
-                _stylInfo = [[MLVStyleBlock alloc] initWithBlockBuffer:&block_hdr fileNum:in_file_num filePosition:blockPosition];
-
-                /* skip remaining data, if there is any */
-                fseeko(in_file, position + block_hdr.blockSize, SEEK_SET);
+                [chunkIndex.infoBlocks addObject:[[MLVStyleBlock alloc] initWithBlockBuffer:&block_hdr fileNum:in_file_num filePosition:blockPosition]];
             }
             else if(hdrBlock.type == kMLVBlockTypeWhiteBalance)
             {
                 mlv_wbal_hdr_t wbal_info;
                 size_t hdr_size = MIN(sizeof(mlv_wbal_hdr_t), buf.blockSize);
 
-                if(fread(&wbal_info, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &wbal_info, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
-                _wbalInfo = [[MLVWhiteBalanceBlock alloc] initWithBlockBuffer:&wbal_info fileNum:in_file_num filePosition:blockPosition];
-
-                /* skip remaining data, if there is any */
-                fseeko(in_file, position + wbal_info.blockSize, SEEK_SET);
+                [chunkIndex.infoBlocks addObject:[[MLVWhiteBalanceBlock alloc] initWithBlockBuffer:&wbal_info fileNum:in_file_num filePosition:blockPosition]];
             }
             else if(hdrBlock.type == kMLVBlockTypeIdentification)
             {
                 mlv_idnt_hdr_t idnt_info;
                 size_t hdr_size = MIN(sizeof(mlv_idnt_hdr_t), buf.blockSize);
 
-                if(fread(&idnt_info, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &idnt_info, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
-                _idntInfo = [[MLVCameraInfoBlock alloc] initWithBlockBuffer:&idnt_info fileNum:in_file_num filePosition:blockPosition];
-
-                /* skip remaining data, if there is any */
-                fseeko(in_file, position + idnt_info.blockSize, SEEK_SET);
+                [chunkIndex.infoBlocks addObject:[[MLVCameraInfoBlock alloc] initWithBlockBuffer:&idnt_info fileNum:in_file_num filePosition:blockPosition]];
             }
             else if(hdrBlock.type == kMLVBlockTypeRTCI)
             {
                 mlv_rtci_hdr_t rtci_info;
                 size_t hdr_size = MIN(sizeof(mlv_rtci_hdr_t), buf.blockSize);
 
-                if(fread(&rtci_info, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &rtci_info, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
-                if (!_rtciInfo) {
-                    _rtciInfo = [[MLVTimecodeBlock alloc] initWithBlockBuffer:&rtci_info fileNum:in_file_num filePosition:blockPosition];
-                }
-
-                /* skip remaining data, if there is any */
-                fseeko(in_file, position + rtci_info.blockSize, SEEK_SET);
+                [chunkIndex.infoBlocks addObject:[[MLVTimecodeBlock alloc] initWithBlockBuffer:&rtci_info fileNum:in_file_num filePosition:blockPosition]];
             }
             else if(hdrBlock.type == kMLVBlockTypeMarker)
             {
                 mlv_mark_hdr_t block_hdr;
                 size_t hdr_size = MIN(sizeof(mlv_mark_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &block_hdr, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
@@ -606,9 +2062,6 @@ read_headers:
 //                MLVMarkerBlock* block = [[MLVMarkerBlock alloc] initWithBlockBuffer:&block_hdr fileNum:in_file_num filePosition:blockPosition];
 //                DebugLog(@"marker: %d", block_hdr.type);
 
-                /* skip remaining data, if there is any */
-                fseeko(in_file, position + block_hdr.blockSize, SEEK_SET);
-
 //                blockInfo[@"button"] = @(block_hdr.type);
             }
             else if(hdrBlock.type == kMLVBlockTypeExposure)
@@ -616,25 +2069,24 @@ read_headers:
                 mlv_expo_hdr_t expo_info;
                 size_t hdr_size = MIN(sizeof(mlv_expo_hdr_t), buf.blockSize);
 
-                if(fread(&expo_info, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &expo_info, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
-                _expoInfo = [[MLVExposureBlock alloc] initWithBlockBuffer:&expo_info fileNum:in_file_num filePosition:blockPosition];
-
-                /* skip remaining data, if there is any */
-                fseeko(in_file, position + expo_info.blockSize, SEEK_SET);
+                [chunkIndex.infoBlocks addObject:[[MLVExposureBlock alloc] initWithBlockBuffer:&expo_info fileNum:in_file_num filePosition:blockPosition]];
             }
             else if(hdrBlock.type == kMLVBlockTypeRawInfo)
             {
                 mlv_rawi_hdr_t rawi_info;
                 size_t hdr_size = MIN(sizeof(mlv_rawi_hdr_t), buf.blockSize);
 
-                if(fread(&rawi_info, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &rawi_info, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
@@ -657,10 +2109,7 @@ read_headers:
                     rawi_info.raw_info.jpeg.height = rawi_info.raw_info.height;
                 }
 
-                _rawiInfo = [[MLVRAWInfoBlock alloc] initWithBlockBuffer:&rawi_info fileNum:in_file_num filePosition:blockPosition];
-
-                /* skip remaining data, if there is any */
-                fseeko(in_file, position + rawi_info.blockSize, SEEK_SET);
+                [chunkIndex.infoBlocks addObject:[[MLVRAWInfoBlock alloc] initWithBlockBuffer:&rawi_info fileNum:in_file_num filePosition:blockPosition]];
             }
 
             else if(hdrBlock.type == kMLVBlockTypeRawCaptureInfo)
@@ -668,13 +2117,14 @@ read_headers:
                 mlv_rawc_hdr_t rawc_info;
                 size_t hdr_size = MIN(sizeof(mlv_rawc_hdr_t), buf.blockSize);
 
-                if(fread(&rawc_info, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &rawc_info, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
-                _rawcInfo = [[MLVRAWCaptureInfoBlock alloc] initWithBlockBuffer:&rawc_info fileNum:in_file_num filePosition:blockPosition];
+                [chunkIndex.infoBlocks addObject:[[MLVRAWCaptureInfoBlock alloc] initWithBlockBuffer:&rawc_info fileNum:in_file_num filePosition:blockPosition]];
             }
 
             else if(hdrBlock.type == kMLVBlockTypeWavInfo)
@@ -682,57 +2132,44 @@ read_headers:
                 mlv_wavi_hdr_t block_hdr;
                 size_t hdr_size = MIN(sizeof(mlv_wavi_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(!_MLVScanWindowRead(&window, &block_hdr, position, hdr_size))
                 {
                     ErrLog(@"File ends in the middle of a block");
+                    _MLVScanWindowFree(&window);
                     return kMLVErrorCodeFile;
                 }
 
-                _waviInfo = [[MLVWAVInfoBlock alloc] initWithBlockBuffer:&block_hdr fileNum:in_file_num filePosition:blockPosition];
-
-                /* skip remaining data, if there is any */
-                fseeko(in_file, position + block_hdr.blockSize, SEEK_SET);
+                [chunkIndex.infoBlocks addObject:[[MLVWAVInfoBlock alloc] initWithBlockBuffer:&block_hdr fileNum:in_file_num filePosition:blockPosition]];
 
             }
+            else if(hdrBlock.type == kMLVBlockTypeXRef)
+            {
+                /* written at the end of a recording, the index is only read from the <base>.IDX file */
+            }
             else if(hdrBlock.type == kMLVBlockTypeNull)
             {
-                fseeko(in_file, position + buf.blockSize, SEEK_SET);
             }
             else if(hdrBlock.type == kMLVBlockTypeBackup)
             {
-                fseeko(in_file, position + buf.blockSize, SEEK_SET);
             }
             else
             {
                 DebugLog(@"Unknown Block: %c%c%c%c, skipping\n", buf.blockType[0], buf.blockType[1], buf.blockType[2], buf.blockType[3]);
-
-                fseeko(in_file, position + buf.blockSize, SEEK_SET);
             }
         }
         
         /* count any read block, no matter if header or video frame */
         blocks_processed++;
-        
-        position_previous = position;
-//
-//        if (blockInfo.count > 0 && ![blockInfo[@"code"] isEqualToString:@"NULL"]) {
-//            [blockInfos addObject:blockInfo];
-//        }
+
+        /* continue with the next block */
+        window.lastBlockSize = buf.blockSize;
+        position += buf.blockSize;
     }
-    while(!feof(in_file));
-    
-    NSSortDescriptor* sortDescriptor = [[NSSortDescriptor alloc] initWithKey:@"time" ascending:YES];
-    _videoBlocks = [videoBlocks sortedArrayUsingDescriptors:@[sortDescriptor]];
-    _audioBlocks = [audioBlocks sortedArrayUsingDescriptors:@[sortDescriptor]];
-    
-    [self willChangeValueForKey:@"frameTime"];
-    [self didChangeValueForKey:@"frameTime"];
-    
-    [self willChangeValueForKey:@"duration"];
-    [self didChangeValueForKey:@"duration"];
-    
-abort:
+    while(YES);
 
+    chunkIndex.endPosition = position;
+
+    _MLVScanWindowFree(&window);
     return kMLVErrorCodeNone;
 }
 
@@ -775,6 +2212,143 @@ abort:
     return nil;
 }
 
+- (void) _readaheadAfterFileNum:(UInt16)fileNum position:(UInt64)position length:(UInt64)length
+{
+    MLVReadahead* readahead;
+    NSArray<MLVFileMapping*>* mappings;
+    int fd = -1;
+    @synchronized (self) {
+        if (!_readahead) {
+            _readahead = [[MLVReadahead alloc] init];
+        }
+        readahead = _readahead;
+        mappings = _mappings;
+        if (fileNum < in_file_count) {
+            fd = in_files[fileNum];
+        }
+    }
+
+    UInt64 prefetchPosition, prefetchLength;
+    if (fd < 0 || ![readahead didReadFileNum:fileNum position:position length:length prefetchPosition:&prefetchPosition prefetchLength:&prefetchLength]) {
+        return;
+    }
+
+    /* both hints only start the reads, the pages arrive while this frame is processed */
+    if (fileNum < mappings.count) {
+        MLVFileMapping* mapping = mappings[fileNum];
+        if (prefetchPosition >= mapping.length) {
+            return;
+        }
+        UInt64 pageStart = prefetchPosition & ~(UInt64)(getpagesize() - 1);
+        UInt64 end = MIN(prefetchPosition + prefetchLength, mapping.length);
+        madvise((void*)(mapping.bytes + pageStart), (size_t)(end - pageStart), MADV_WILLNEED);
+    }
+    else {
+        struct radvisory advisory;
+        advisory.ra_offset = (off_t)prefetchPosition;
+        advisory.ra_count = (int)MIN(prefetchLength, INT_MAX);
+        fcntl(fd, F_RDADVISE, &advisory);
+    }
+}
+
+/* the descriptors are closed and the chunk list grows under the same lock, -1 if there is no such chunk */
+- (int) _fileDescriptorWithFileNum:(UInt16)fileNum
+{
+    @synchronized (self) {
+        return (fileNum < in_file_count) ? in_files[fileNum] : -1;
+    }
+}
+
+- (int) _uncachedFileDescriptorWithFileNum:(UInt16)fileNum
+{
+    @synchronized (self) {
+        if (fileNum >= in_file_count) {
+            return -1;
+        }
+
+        if (!in_files_uncached) {
+            in_files_uncached = malloc(MLV_MAX_CHUNKS * sizeof(int));
+            for(int f=0; f<MLV_MAX_CHUNKS; f++) {
+                in_files_uncached[f] = -1;
+            }
+        }
+
+        /* F_NOCACHE applies to the descriptor, the cached one keeps serving interactive reads */
+        if (in_files_uncached[fileNum] < 0) {
+            char path[MAXPATHLEN];
+            if (fcntl(in_files[fileNum], F_GETPATH, path) != 0) {
+                return -1;
+            }
+
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) {
+                return -1;
+            }
+            fcntl(fd, F_NOCACHE, 1);
+            in_files_uncached[fileNum] = fd;
+        }
+        return in_files_uncached[fileNum];
+    }
+}
+
+- (nullable NSData*) _uncachedDataWithFileNum:(UInt16)fileNum offset:(UInt64)offset length:(size_t)length
+{
+    int fd = [self _uncachedFileDescriptorWithFileNum:fileNum];
+    if (fd < 0) {
+        return nil;
+    }
+
+    /* uncached reads go straight to the device when offset, length and buffer are page aligned */
+    size_t pageSize = getpagesize();
+    UInt64 alignedOffset = offset & ~(UInt64)(pageSize - 1);
+    size_t head = (size_t)(offset - alignedOffset);
+    size_t alignedLength = (head + length + pageSize - 1) & ~(pageSize - 1);
+
+    void* buffer = NULL;
+    if (posix_memalign(&buffer, pageSize, alignedLength) != 0) {
+        return nil;
+    }
+
+    /* the last page may extend beyond the end of the chunk */
+    ssize_t readSize = 0;
+    while ((size_t)readSize < head + length) {
+        ssize_t result = pread(fd, (uint8_t*)buffer + readSize, alignedLength - readSize, (off_t)(alignedOffset + readSize));
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            free(buffer);
+            return nil;
+        }
+        readSize += result;
+    }
+
+    return [[NSData alloc] initWithBytesNoCopy:(uint8_t*)buffer + head length:length deallocator:^(void* bytes, NSUInteger len) {
+        free(buffer);
+    }];
+}
+
+- (nullable NSData*) _mappedDataWithFileNum:(UInt16)fileNum offset:(UInt64)offset length:(size_t)length
+{
+    NSArray<MLVFileMapping*>* mappings;
+    @synchronized (self) {
+        mappings = _mappings;
+    }
+    if (fileNum >= mappings.count) {
+        return nil;
+    }
+
+    MLVFileMapping* mapping = mappings[fileNum];
+    if (offset > mapping.length || length > mapping.length - offset) {
+        ErrLog(@"Block at 0x%08llx exceeds chunk %d", offset, fileNum);
+        return nil;
+    }
+
+    return [[NSData alloc] initWithBytesNoCopy:(void*)(mapping.bytes + offset) length:length deallocator:^(void* bytes, NSUInteger len) {
+        (void)mapping;
+    }];
+}
+
 - (NSData*) readAudioDataBlock:(MLVAudioBlock*)block errorCode:(MLVErrorCode*)errorCode
 {
     NSParameterAssert(block);
@@ -786,14 +2360,22 @@ abort:
     size_t size = block.size;
     size_t hdr_size = sizeof(mlv_audf_hdr_t);
 
-    FILE* in_file = in_files[file_num];
+    /* nil once the chunks were unmapped, then the data is read like without a mapping */
+    NSData* mappedData = [self _mappedDataWithFileNum:file_num offset:offset+space+hdr_size length:size-hdr_size-space];
+    if (mappedData) {
+        return mappedData;
+    }
 
-    fseeko(in_file, offset+space+hdr_size, SEEK_SET);
+    int fd = [self _fileDescriptorWithFileNum:file_num];
+    if (fd < 0) {
+        *errorCode = kMLVErrorCodeFile;
+        return nil;
+    }
 
     size_t dataSize = size-hdr_size-space;
     void* data_buf = malloc(dataSize);
 
-    if (fread(data_buf, dataSize, 1, in_file) != 1) {
+    if (!_MLVReadFully(fd, data_buf, dataSize, offset+space+hdr_size)) {
         *errorCode = kMLVErrorCodeFile;
         free(data_buf);
         return nil;
@@ -804,6 +2386,11 @@ abort:
 }
 
 - (MLVRawImage*) readVideoDataBlock:(MLVVideoBlock*)block errorCode:(MLVErrorCode*)errorCode
+{
+    return [self readVideoDataBlock:block options:kMLVFileReadOptionsNone errorCode:errorCode];
+}
+
+- (MLVRawImage*) readVideoDataBlock:(MLVVideoBlock*)block options:(MLVFileReadOptions)options errorCode:(MLVErrorCode*)errorCode
 {
     NSParameterAssert(block);
     NSParameterAssert(errorCode);
@@ -822,7 +2409,9 @@ abort:
     size_t size = block.size;
     size_t hdr_size = sizeof(mlv_vidf_hdr_t);
     
-    if (file_num >= in_file_count) {
+    int fd = [self _fileDescriptorWithFileNum:file_num];
+    if (fd < 0) {
+        *errorCode = kMLVErrorCodeFile;
         return nil;
     }
     
@@ -831,14 +2420,29 @@ abort:
         return nil;
     }
     
-    void* raw_buffer = malloc(dataSize);
-    
-    @synchronized (self) {
-        FILE* in_file = in_files[file_num];
-        
-        fseeko(in_file, offset+space+hdr_size, SEEK_SET);
-        
-        if (fread(raw_buffer, dataSize, 1, in_file) != 1) {
+    NSData* raw_data = nil;
+    void* raw_buffer = NULL;
+
+    if (options & kMLVFileReadOptionsUncached) {
+        /* read once, without evicting the pages of everything else */
+        raw_data = [self _uncachedDataWithFileNum:file_num offset:offset+space+hdr_size length:dataSize];
+        if (!raw_data) {
+            *errorCode = kMLVErrorCodeFile;
+            return nil;
+        }
+    }
+    else {
+        [self _readaheadAfterFileNum:file_num position:offset length:size];
+
+        /* no copy and no lock, the image copies the slice only if it gets modified */
+        raw_data = [self _mappedDataWithFileNum:file_num offset:offset+space+hdr_size length:dataSize];
+    }
+
+    if (!raw_data) {
+        /* positional read, no shared file offset and therefore no lock */
+        raw_buffer = malloc(dataSize);
+
+        if (!_MLVReadFully(fd, raw_buffer, dataSize, offset+space+hdr_size)) {
             *errorCode = kMLVErrorCodeFile;
             free(raw_buffer);
             return nil;
@@ -856,8 +2460,9 @@ abort:
     
     BOOL compressed = ((videoClass & kMLVFileVideoClassFlagLJ92) > 0);
     
-    MLVRawImage* rawImage = [[MLVRawImage alloc] initWithInfo:raw_info buffer:raw_buffer compressed:compressed];
-    if (rawImage.compressed) {
+    MLVRawImage* rawImage = (raw_data) ? [[MLVRawImage alloc] initWithInfo:raw_info data:raw_data compressed:compressed]
+                                       : [[MLVRawImage alloc] initWithInfo:raw_info buffer:raw_buffer compressed:compressed];
+    if (rawImage.compressed && !(options & kMLVFileReadOptionsCompressed)) {
         MLVRawImage* decompressedRawImage = [rawImage rawImageByDecompressingBuffer];
         if (decompressedRawImage) {
             rawImage = decompressedRawImage;
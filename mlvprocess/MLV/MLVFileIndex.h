@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2017 Martin Hering
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#import <Foundation/Foundation.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+@class MLVBlock, MLVFrameIndex;
+
+/*
+ * Flat binary block index of a recording, stored in the caches directory.
+ * The file is memory-mapped and the frame indexes use the mapped columns without copying.
+ */
+@interface MLVFileIndex : NSObject
+
++ (NSURL*) cacheURLWithGUID:(UInt64)guid;
+
+// size and modification date of every chunk, used to detect a changed recording
++ (nullable NSData*) chunkStatsWithFileDescriptors:(const int*)fds count:(int)count;
+
+- (nullable instancetype) initWithContentsOfURL:(NSURL*)url guid:(UInt64)guid chunkStats:(NSData*)chunkStats;
+
+@property (readonly) NSArray<MLVBlock*>* infoBlocks;
+@property (readonly) MLVFrameIndex* videoIndex;
+@property (readonly) MLVFrameIndex* audioIndex;
+
++ (BOOL) writeIndexWithGUID:(UInt64)guid
+                 chunkStats:(NSData*)chunkStats
+                 infoBlocks:(NSArray<MLVBlock*>*)infoBlocks
+                 videoIndex:(MLVFrameIndex*)videoIndex
+                 audioIndex:(MLVFrameIndex*)audioIndex
+                      toURL:(NSURL*)url;
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2017 Martin Hering
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#import "MLVFileIndex.h"
+#import "MLVBlock.h"
+#import "MLVFrameIndex.h"
+#import "mlv.h"
+
+#import <sys/stat.h>
+#import <sys/time.h>
+
+#define MLV_INDEX_VERSION 2
+#define MLV_INDEX_ALIGN(x) (((x) + 7) & ~7ULL)
+
+#define MLV_INDEX_CACHE_MAX_SIZE    (256 * 1024 * 1024)
+#define MLV_INDEX_CACHE_MAX_AGE     (30 * 24 * 60 * 60)
+
+#pragma pack(push,1)
+
+typedef struct {
+    uint8_t     magic[4];       /* "MLVX" */
+    uint32_t    version;
+    uint64_t    guid;           /* GUID of the MLVI header */
+    uint32_t    chunkCount;     /* mlv_index_chunk_t entries following the header */
+    uint32_t    infoCount;
+    uint32_t    videoCount;
+    uint32_t    audioCount;
+    uint64_t    infoOffset;     /* variable sized info records */
+    uint64_t    videoOffset;    /* MLVFrameIndex columns, sorted by time */
+    uint64_t    audioOffset;
+} mlv_index_hdr_t;
+
+typedef struct {
+    uint64_t    size;
+    int64_t     mtimeSec;
+    int64_t     mtimeNsec;
+} mlv_index_chunk_t;
+
+typedef struct {
+    uint64_t    filePosition;
+    uint16_t    fileNum;
+    uint16_t    blockLength;    /* length of the block structure following the record */
+    uint32_t    reserved;
+} mlv_index_rec_t;
+
+#pragma pack(pop)
+
+@interface MLVBlock ()
+- (NSData*) _blockData;
+@end
+
+/* the record of an info block holds exactly the structure the class stores */
+static Class _MLVBlockClassWithType(MLVBlockType type, size_t* blockLength)
+{
+    switch (type) {
+        case kMLVBlockTypeMLVInfo:          *blockLength = sizeof(mlv_file_hdr_t); return [MLVFileBlock class];
+        case kMLVBlockTypeVideo:            *blockLength = sizeof(mlv_vidf_hdr_t); return [MLVVideoBlock class];
+        case kMLVBlockTypeAudio:            *blockLength = sizeof(mlv_audf_hdr_t); return [MLVAudioBlock class];
+        case kMLVBlockTypeLens:             *blockLength = sizeof(mlv_lens_hdr_t); return [MLVLensBlock class];
+        case kMLVBlockTypeElectronicLevel:  *blockLength = sizeof(mlv_elvl_hdr_t); return [MLVElectronicLevelBlock class];
+        case kMLVBlockTypeStyle:            *blockLength = sizeof(mlv_styl_hdr_t); return [MLVStyleBlock class];
+        case kMLVBlockTypeWhiteBalance:     *blockLength = sizeof(mlv_wbal_hdr_t); return [MLVWhiteBalanceBlock class];
+        case kMLVBlockTypeIdentification:   *blockLength = sizeof(mlv_idnt_hdr_t); return [MLVCameraInfoBlock class];
+        case kMLVBlockTypeRTCI:             *blockLength = sizeof(mlv_rtci_hdr_t); return [MLVTimecodeBlock class];
+        case kMLVBlockTypeExposure:         *blockLength = sizeof(mlv_expo_hdr_t); return [MLVExposureBlock class];
+        case kMLVBlockTypeRawInfo:          *blockLength = sizeof(mlv_rawi_hdr_t); return [MLVRAWInfoBlock class];
+        case kMLVBlockTypeRawCaptureInfo:   *blockLength = sizeof(mlv_rawc_hdr_t); return [MLVRAWCaptureInfoBlock class];
+        case kMLVBlockTypeWavInfo:          *blockLength = sizeof(mlv_wavi_hdr_t); return [MLVWAVInfoBlock class];
+        default:                            *blockLength = 0; return nil;
+    }
+}
+
+#pragma mark -
+
+@implementation MLVFileIndex {
+    NSData* _data;
+}
+
++ (NSURL*) cacheURLWithGUID:(UInt64)guid
+{
+    NSURL* cachesURL = [[NSFileManager defaultManager] URLsForDirectory:NSCachesDirectory inDomains:NSUserDomainMask].firstObject;
+    NSURL* indexURL = [cachesURL URLByAppendingPathComponent:@"MLVIndex" isDirectory:YES];
+    return [indexURL URLByAppendingPathComponent:[NSString stringWithFormat:@"%016llx.mlvindex", guid]];
+}
+
++ (nullable NSData*) chunkStatsWithFileDescriptors:(const int*)fds count:(int)count
+{
+    NSMutableData* chunkStats = [[NSMutableData alloc] initWithLength:count * sizeof(mlv_index_chunk_t)];
+    mlv_index_chunk_t* chunks = chunkStats.mutableBytes;
+
+    for(int f=0; f<count; f++) {
+        struct stat st;
+        if (fstat(fds[f], &st) != 0) {
+            return nil;
+        }
+        chunks[f].size = st.st_size;
+        chunks[f].mtimeSec = st.st_mtimespec.tv_sec;
+        chunks[f].mtimeNsec = st.st_mtimespec.tv_nsec;
+    }
+    return chunkStats;
+}
+
+- (nullable instancetype) initWithContentsOfURL:(NSURL*)url guid:(UInt64)guid chunkStats:(NSData*)chunkStats
+{
+    if ((self = [super init])) {
+        _data = [NSData dataWithContentsOfURL:url options:NSDataReadingMappedAlways error:nil];
+        if (!_data) {
+            return nil;
+        }
+
+        const uint8_t* bytes = _data.bytes;
+        size_t length = _data.length;
+        const mlv_index_hdr_t* hdr = (const mlv_index_hdr_t*)bytes;
+
+        if (length < sizeof(mlv_index_hdr_t) || memcmp(hdr->magic, "MLVX", 4) != 0 || hdr->version != MLV_INDEX_VERSION) {
+            DebugLog(@"Index cache %@ has a different format", url.lastPathComponent);
+            return nil;
+        }
+
+        /* recording changed since the index was written? */
+        size_t chunksLength = hdr->chunkCount * sizeof(mlv_index_chunk_t);
+        if (hdr->guid != guid || chunksLength != chunkStats.length || length < sizeof(mlv_index_hdr_t) + chunksLength ||
+            memcmp(bytes + sizeof(mlv_index_hdr_t), chunkStats.bytes, chunksLength) != 0)
+        {
+            DebugLog(@"Index cache %@ is outdated", url.lastPathComponent);
+            return nil;
+        }
+
+        if (hdr->infoOffset > length) {
+            ErrLog(@"Index cache %@ is truncated", url.lastPathComponent);
+            return nil;
+        }
+
+        /* info blocks are few and are created right away */
+        NSMutableArray<MLVBlock*>* infoBlocks = [[NSMutableArray alloc] initWithCapacity:hdr->infoCount];
+        uint64_t offset = hdr->infoOffset;
+        for(uint32_t i=0; i<hdr->infoCount; i++) {
+            if (offset + sizeof(mlv_index_rec_t) > length) {
+                return nil;
+            }
+
+            const mlv_index_rec_t* rec = (const mlv_index_rec_t*)(bytes + offset);
+            if (offset + sizeof(mlv_index_rec_t) + rec->blockLength > length || rec->blockLength < sizeof(mlv_hdr_t)) {
+                return nil;
+            }
+
+            MLVBlock* headerBlock = [[MLVBlock alloc] initWithBlockBuffer:(void*)(rec + 1) fileNum:rec->fileNum filePosition:rec->filePosition];
+            size_t blockLength;
+            Class blockClass = _MLVBlockClassWithType(headerBlock.type, &blockLength);
+            if (blockClass) {
+                /* initWithBlockBuffer: copies the full structure, a record of another length was written by a different layout */
+                if (rec->blockLength != blockLength) {
+                    ErrLog(@"Index cache %@ has an invalid block record", url.lastPathComponent);
+                    return nil;
+                }
+                [infoBlocks addObject:[[blockClass alloc] initWithBlockBuffer:(void*)(rec + 1) fileNum:rec->fileNum filePosition:rec->filePosition]];
+            }
+
+            offset = MLV_INDEX_ALIGN(offset + sizeof(mlv_index_rec_t) + rec->blockLength);
+        }
+        _infoBlocks = infoBlocks;
+
+        /* the frame indexes use the mapped columns directly */
+        _videoIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeVideo count:hdr->videoCount data:_data offset:hdr->videoOffset];
+        _audioIndex = [[MLVFrameIndex alloc] initWithBlockType:kMLVBlockTypeAudio count:hdr->audioCount data:_data offset:hdr->audioOffset];
+        if (!_videoIndex || !_audioIndex) {
+            ErrLog(@"Index cache %@ is truncated", url.lastPathComponent);
+            return nil;
+        }
+
+        /* recently used entries are the last to be evicted */
+        utimes(url.fileSystemRepresentation, NULL);
+    }
+    return self;
+}
+
+static BOOL _MLVAppendBlockRecord(NSMutableData* data, MLVBlock* block, NSData* blockData)
+{
+    if (blockData.length > UINT16_MAX) {
+        return NO;
+    }
+
+    mlv_index_rec_t rec;
+    rec.filePosition = block.filePosition;
+    rec.fileNum = block.fileNum;
+    rec.blockLength = (uint16_t)blockData.length;
+    rec.reserved = 0;
+
+    [data appendBytes:&rec length:sizeof(mlv_index_rec_t)];
+    [data appendData:blockData];
+    return YES;
+}
+
+/* entries that were not used for a while go first, then the least recently used ones until the cache fits */
++ (void) _evictCacheEntriesInDirectory:(NSURL*)directoryURL keepingURL:(NSURL*)keptURL
+{
+    NSArray<NSURLResourceKey>* keys = @[NSURLContentModificationDateKey, NSURLFileSizeKey];
+    NSArray<NSURL*>* entryURLs = [[NSFileManager defaultManager] contentsOfDirectoryAtURL:directoryURL includingPropertiesForKeys:keys options:NSDirectoryEnumerationSkipsHiddenFiles error:nil];
+
+    NSMutableArray<NSURL*>* sortedURLs = [[NSMutableArray alloc] init];
+    NSMutableDictionary<NSURL*, NSDictionary<NSURLResourceKey, id>*>* entryValues = [[NSMutableDictionary alloc] init];
+    for(NSURL* entryURL in entryURLs) {
+        NSDictionary<NSURLResourceKey, id>* values = [entryURL resourceValuesForKeys:keys error:nil];
+        if ([entryURL.pathExtension isEqualToString:@"mlvindex"] && values[NSURLContentModificationDateKey] && values[NSURLFileSizeKey]) {
+            entryValues[entryURL] = values;
+            [sortedURLs addObject:entryURL];
+        }
+    }
+
+    [sortedURLs sortUsingComparator:^NSComparisonResult(NSURL* url1, NSURL* url2) {
+        return [entryValues[url2][NSURLContentModificationDateKey] compare:entryValues[url1][NSURLContentModificationDateKey]];
+    }];
+
+    NSDate* oldestDate = [NSDate dateWithTimeIntervalSinceNow:-MLV_INDEX_CACHE_MAX_AGE];
+    UInt64 cacheSize = 0;
+    for(NSURL* entryURL in sortedURLs) {
+        NSDictionary<NSURLResourceKey, id>* values = entryValues[entryURL];
+        cacheSize += [values[NSURLFileSizeKey] unsignedLongLongValue];
+
+        if ([entryURL.lastPathComponent isEqualToString:keptURL.lastPathComponent]) {
+            continue;
+        }
+
+        if (cacheSize > MLV_INDEX_CACHE_MAX_SIZE || [values[NSURLContentModificationDateKey] compare:oldestDate] == NSOrderedAscending) {
+            DebugLog(@"Evicting index cache %@", entryURL.lastPathComponent);
+            [[NSFileManager defaultManager] removeItemAtURL:entryURL error:nil];
+            cacheSize -= [values[NSURLFileSizeKey] unsignedLongLongValue];
+        }
+    }
+}
+
++ (BOOL) writeIndexWithGUID:(UInt64)guid
+                 chunkStats:(NSData*)chunkStats
+                 infoBlocks:(NSArray<MLVBlock*>*)infoBlocks
+                 videoIndex:(MLVFrameIndex*)videoIndex
+                 audioIndex:(MLVFrameIndex*)audioIndex
+                      toURL:(NSURL*)url
+{
+    NSMutableData* data = [[NSMutableData alloc] initWithCapacity:sizeof(mlv_index_hdr_t) + chunkStats.length + 4096 +
+                           [MLVFrameIndex dataLengthWithCount:videoIndex.count] + [MLVFrameIndex dataLengthWithCount:audioIndex.count]];
+
+    mlv_index_hdr_t hdr;
+    memset(&hdr, 0, sizeof(mlv_index_hdr_t));
+    memcpy(hdr.magic, "MLVX", 4);
+    hdr.version = MLV_INDEX_VERSION;
+    hdr.guid = guid;
+    hdr.chunkCount = (uint32_t)(chunkStats.length / sizeof(mlv_index_chunk_t));
+    hdr.videoCount = (uint32_t)videoIndex.count;
+    hdr.audioCount = (uint32_t)audioIndex.count;
+
+    [data appendBytes:&hdr length:sizeof(mlv_index_hdr_t)];
+    [data appendData:chunkStats];
+
+    hdr.infoOffset = MLV_INDEX_ALIGN(data.length);
+    data.length = hdr.infoOffset;
+    for(MLVBlock* block in infoBlocks) {
+        NSData* blockData = [block _blockData];
+        if (!blockData) {
+            continue;
+        }
+        if (!_MLVAppendBlockRecord(data, block, blockData)) {
+            ErrLog(@"Block of %lu bytes does not fit the index cache", (unsigned long)blockData.length);
+            return NO;
+        }
+        data.length = MLV_INDEX_ALIGN(data.length);
+        hdr.infoCount++;
+    }
+
+    hdr.videoOffset = data.length;
+    [videoIndex appendToData:data];
+
+    hdr.audioOffset = data.length;
+    [audioIndex appendToData:data];
+
+    [data replaceBytesInRange:NSMakeRange(0, sizeof(mlv_index_hdr_t)) withBytes:&hdr];
+
+    NSError* error;
+    [[NSFileManager defaultManager] createDirectoryAtURL:url.URLByDeletingLastPathComponent withIntermediateDirectories:YES attributes:nil error:nil];
+    if (![data writeToURL:url options:NSDataWritingAtomic error:&error]) {
+        ErrLog(@"Failed to write index cache: %@", error);
+        return NO;
+    }
+
+    [self _evictCacheEntriesInDirectory:url.URLByDeletingLastPathComponent keepingURL:url];
+    return YES;
+}
+
+@end
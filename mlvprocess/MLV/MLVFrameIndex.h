@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2017 Martin Hering
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#import <Foundation/Foundation.h>
+#import "MLVBlock.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+@class MLVFrameGapReport;
+
+/*
+ * Frame headers of one stream (VIDF or AUDF) stored as contiguous columns.
+ * Blocks are appended while scanning and sorted by time once, lookups by time
+ * are binary searches and lookups by frame number use a table.
+ */
+@interface MLVFrameIndex : NSObject
+
+- (instancetype) initWithBlockType:(MLVBlockType)blockType;
+
+// columns stored in data, as written by -appendToData:
+- (nullable instancetype) initWithBlockType:(MLVBlockType)blockType count:(NSUInteger)count data:(NSData*)data offset:(size_t)offset;
++ (size_t) dataLengthWithCount:(NSUInteger)count;
+- (void) appendToData:(NSMutableData*)data;
+
+// blockBuffer is a mlv_vidf_hdr_t or mlv_audf_hdr_t
+- (void) addBlockBuffer:(const void*)blockBuffer fileNum:(UInt16)fileNum filePosition:(UInt64)filePosition;
+- (void) addFrameIndex:(MLVFrameIndex*)frameIndex;
+- (void) sortByTime;    // by timestamp and frame number, duplicate frame numbers are removed
+
+// for an index that grows while it is read: appends sorted frames in place, rows that were
+// handed out with -snapshot are never written or moved, frames that would sort before the
+// last frame are left out, returns the number of frames that were appended
+- (NSUInteger) appendFrameIndex:(MLVFrameIndex*)frameIndex;
+- (MLVFrameIndex*) snapshot;    // read-only view of the current frames, shares the columns
+
+@property (readonly) MLVBlockType blockType;
+@property (readonly) NSUInteger count;
+
+- (UInt64) timestampAtIndex:(NSUInteger)index;
+- (UInt64) filePositionAtIndex:(NSUInteger)index;
+- (UInt32) sizeAtIndex:(NSUInteger)index;
+- (UInt32) frameNumberAtIndex:(NSUInteger)index;
+- (UInt16) fileNumAtIndex:(NSUInteger)index;
+
+- (NSUInteger) indexOfFirstBlockAtOrAfterTime:(NSTimeInterval)time;    // NSNotFound if all blocks are earlier
+- (NSUInteger) indexOfFrameNumber:(UInt32)frameNumber;                 // NSNotFound if there is no such frame
+
+- (__kindof MLVBlock*) blockAtIndex:(NSUInteger)index;
+@property (readonly) NSArray<__kindof MLVBlock*>* blocks;              // creates the block objects on access
+
+// dropped frames from the first frame number on and timestamps that are off by more than tolerance * frameDuration, index has to be sorted
+- (MLVFrameGapReport*) gapReportWithFrameDuration:(NSTimeInterval)frameDuration tolerance:(double)tolerance;
+// continues a report of the same growing index with the frames appended since, nil starts a new one
+- (MLVFrameGapReport*) gapReportByExtendingReport:(nullable MLVFrameGapReport*)report frameDuration:(NSTimeInterval)frameDuration tolerance:(double)tolerance;
+
+@end
+
+@interface MLVFrameGapReport : NSObject
+@property (readonly) NSIndexSet* missingFrameNumbers;
+@property (readonly) NSIndexSet* jitterFrameNumbers;                    // frames with an unexpected distance to the previous frame
+@property (readonly) NSArray<NSNumber*>* missingFramesPerChunk;         // by chunk number, counted at the frame after the gap
+@property (readonly) NSArray<NSNumber*>* jitterFramesPerChunk;
+@property (readonly) NSIndexSet* damagedFrameIndexes;                   // positions in the index of frames whose number does not fit their neighbours
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,683 @@
+/*
+ * Copyright (C) 2017 Martin Hering
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#import "MLVFrameIndex.h"
+#import "mlv.h"
+
+/* wider columns first, so every column is naturally aligned when the data starts 8 byte aligned */
+enum {
+    kColumnTimestamp = 0,
+    kColumnFilePosition,
+    kColumnSize,
+    kColumnFrameSpace,
+    kColumnFrameNumber,
+    kColumnFileNum,
+    kColumnCropPosX,
+    kColumnCropPosY,
+    kColumnPanPosX,
+    kColumnPanPosY,
+    kColumnCount
+};
+
+static const size_t kColumnWidth[kColumnCount] = { 8, 8, 4, 4, 4, 2, 2, 2, 2, 2 };
+
+#define COLUMN(type, c, i) (((type*)_columns[c])[i])
+
+@interface MLVFrameIndexArray : NSArray
+- (instancetype) initWithFrameIndex:(MLVFrameIndex*)frameIndex;
+@end
+
+@interface MLVFrameGapReport ()
+@property (readwrite) NSIndexSet* missingFrameNumbers;
+@property (readwrite) NSIndexSet* jitterFrameNumbers;
+@property (readwrite) NSArray<NSNumber*>* missingFramesPerChunk;
+@property (readwrite) NSArray<NSNumber*>* jitterFramesPerChunk;
+@property (readwrite) NSIndexSet* damagedFrameIndexes;
+@property (nonatomic) NSUInteger frameCount;            // frames of the index the report covers
+@property (nonatomic) NSUInteger lastGoodIndex;         // NSNotFound before the first good frame
+@property (nonatomic, nullable) MLVFrameGapReport* checkpoint;   // all but the last frame, which was classified without the next one
+@property (nonatomic) NSTimeInterval frameDuration;
+@property (nonatomic) double tolerance;
+@end
+
+@implementation MLVFrameIndex {
+    uint8_t* _columns[kColumnCount];
+    NSUInteger _count;
+    NSUInteger _capacity;
+    NSData* _storage;           // set when the columns point into external data
+    NSMutableData* _columnData; // own columns in one block, snapshots keep an outgrown block alive
+
+    UInt32* _frameNumberTable;  // index by frame number - _frameNumberTableOffset
+    UInt64 _frameNumberTableLength;
+    UInt32 _frameNumberTableOffset;
+    UInt64* _frameNumberKeys;   // frame number << 32 | index, sorted, used instead of the table for sparse frame numbers
+}
+
+- (instancetype) initWithBlockType:(MLVBlockType)blockType
+{
+    if ((self = [super init])) {
+        _blockType = blockType;
+    }
+    return self;
+}
+
+- (nullable instancetype) initWithBlockType:(MLVBlockType)blockType count:(NSUInteger)count data:(NSData*)data offset:(size_t)offset
+{
+    if ((self = [super init])) {
+        if (offset + [MLVFrameIndex dataLengthWithCount:count] > data.length || (offset & 7) != 0) {
+            return nil;
+        }
+
+        _blockType = blockType;
+        _storage = data;
+        _count = count;
+        _capacity = count;
+
+        const uint8_t* columnData = (const uint8_t*)data.bytes + offset;
+        for(int c=0; c<kColumnCount; c++) {
+            _columns[c] = (uint8_t*)columnData;
+            columnData += count * kColumnWidth[c];
+        }
+    }
+    return self;
+}
+
+- (void) dealloc
+{
+    free(_frameNumberTable);
+    free(_frameNumberKeys);
+}
+
++ (size_t) dataLengthWithCount:(NSUInteger)count
+{
+    size_t rowLength = 0;
+    for(int c=0; c<kColumnCount; c++) {
+        rowLength += kColumnWidth[c];
+    }
+    return (count * rowLength + 7) & ~(size_t)7;
+}
+
+- (void) appendToData:(NSMutableData*)data
+{
+    NSUInteger start = data.length;
+    for(int c=0; c<kColumnCount; c++) {
+        [data appendBytes:_columns[c] length:_count * kColumnWidth[c]];
+    }
+    data.length = start + [MLVFrameIndex dataLengthWithCount:_count];
+}
+
+#pragma mark -
+
+/* rows below _count are never written in place, a new block is filled instead */
+- (void) _setColumnsWithCapacity:(NSUInteger)capacity order:(nullable const UInt32*)order count:(NSUInteger)count
+{
+    NSMutableData* columnData = [[NSMutableData alloc] initWithLength:[MLVFrameIndex dataLengthWithCount:capacity]];
+    uint8_t* column = columnData.mutableBytes;
+
+    for(int c=0; c<kColumnCount; c++) {
+        size_t width = kColumnWidth[c];
+        if (order) {
+            for(NSUInteger i=0; i<count; i++) {
+                memcpy(column + i * width, _columns[c] + order[i] * width, width);
+            }
+        }
+        else if (count > 0) {
+            memcpy(column, _columns[c], count * width);
+        }
+        _columns[c] = column;
+        column += capacity * width;
+    }
+
+    _columnData = columnData;
+    _storage = nil;
+    _capacity = capacity;
+    _count = count;
+}
+
+- (void) _reserveCapacity:(NSUInteger)capacity
+{
+    if (capacity <= _capacity && !_storage) {
+        return;
+    }
+
+    /* external data is left alone, the index continues with own columns */
+    [self _setColumnsWithCapacity:MAX(capacity, MAX(_capacity * 2, 256)) order:NULL count:_count];
+}
+
+- (void) _invalidateFrameNumberTable
+{
+    @synchronized (self) {
+        free(_frameNumberTable);
+        _frameNumberTable = NULL;
+        _frameNumberTableLength = 0;
+        _frameNumberTableOffset = 0;
+        free(_frameNumberKeys);
+        _frameNumberKeys = NULL;
+    }
+}
+
+- (void) addBlockBuffer:(const void*)blockBuffer fileNum:(UInt16)fileNum filePosition:(UInt64)filePosition
+{
+    [self _reserveCapacity:_count + 1];
+
+    NSUInteger i = _count;
+    if (_blockType == kMLVBlockTypeVideo) {
+        const mlv_vidf_hdr_t* hdr = blockBuffer;
+        COLUMN(UInt64, kColumnTimestamp, i) = CFSwapInt64LittleToHost(hdr->timestamp);
+        COLUMN(UInt32, kColumnSize, i) = CFSwapInt32LittleToHost(hdr->blockSize);
+        COLUMN(UInt32, kColumnFrameSpace, i) = CFSwapInt32LittleToHost(hdr->frameSpace);
+        COLUMN(UInt32, kColumnFrameNumber, i) = CFSwapInt32LittleToHost(hdr->frameNumber);
+        COLUMN(UInt16, kColumnCropPosX, i) = CFSwapInt16LittleToHost(hdr->cropPosX);
+        COLUMN(UInt16, kColumnCropPosY, i) = CFSwapInt16LittleToHost(hdr->cropPosY);
+        COLUMN(UInt16, kColumnPanPosX, i) = CFSwapInt16LittleToHost(hdr->panPosX);
+        COLUMN(UInt16, kColumnPanPosY, i) = CFSwapInt16LittleToHost(hdr->panPosY);
+    }
+    else {
+        const mlv_audf_hdr_t* hdr = blockBuffer;
+        COLUMN(UInt64, kColumnTimestamp, i) = CFSwapInt64LittleToHost(hdr->timestamp);
+        COLUMN(UInt32, kColumnSize, i) = CFSwapInt32LittleToHost(hdr->blockSize);
+        COLUMN(UInt32, kColumnFrameSpace, i) = CFSwapInt32LittleToHost(hdr->frameSpace);
+        COLUMN(UInt32, kColumnFrameNumber, i) = CFSwapInt32LittleToHost(hdr->frameNumber);
+        COLUMN(UInt16, kColumnCropPosX, i) = 0;
+        COLUMN(UInt16, kColumnCropPosY, i) = 0;
+        COLUMN(UInt16, kColumnPanPosX, i) = 0;
+        COLUMN(UInt16, kColumnPanPosY, i) = 0;
+    }
+    COLUMN(UInt64, kColumnFilePosition, i) = filePosition;
+    COLUMN(UInt16, kColumnFileNum, i) = fileNum;
+
+    _count++;
+    [self _invalidateFrameNumberTable];
+}
+
+- (void) addFrameIndex:(MLVFrameIndex*)frameIndex
+{
+    if (frameIndex.count == 0) {
+        return;
+    }
+
+    [self _reserveCapacity:_count + frameIndex->_count];
+
+    for(int c=0; c<kColumnCount; c++) {
+        memcpy(_columns[c] + _count * kColumnWidth[c], frameIndex->_columns[c], frameIndex->_count * kColumnWidth[c]);
+    }
+    _count += frameIndex->_count;
+    [self _invalidateFrameNumberTable];
+}
+
+- (NSUInteger) appendFrameIndex:(MLVFrameIndex*)frameIndex
+{
+    [frameIndex sortByTime];
+    if (_count == 0) {
+        [self addFrameIndex:frameIndex];
+        return frameIndex.count;
+    }
+
+    [self _reserveCapacity:_count + frameIndex->_count];
+
+    /* only frames that continue the index are appended, so frames that were handed out keep their index */
+    UInt64 lastTimestamp = COLUMN(UInt64, kColumnTimestamp, _count - 1);
+    UInt32 lastFrameNumber = COLUMN(UInt32, kColumnFrameNumber, _count - 1);
+    NSUInteger appendedCount = 0;
+
+    for(NSUInteger i=0; i<frameIndex->_count; i++) {
+        UInt64 timestamp = ((const UInt64*)frameIndex->_columns[kColumnTimestamp])[i];
+        UInt32 frameNumber = ((const UInt32*)frameIndex->_columns[kColumnFrameNumber])[i];
+        if (timestamp < lastTimestamp || frameNumber <= lastFrameNumber) {
+            continue;
+        }
+
+        for(int c=0; c<kColumnCount; c++) {
+            memcpy(_columns[c] + _count * kColumnWidth[c], frameIndex->_columns[c] + i * kColumnWidth[c], kColumnWidth[c]);
+        }
+        _count++;
+        appendedCount++;
+        lastTimestamp = timestamp;
+        lastFrameNumber = frameNumber;
+    }
+
+    if (appendedCount > 0) {
+        [self _invalidateFrameNumberTable];
+    }
+    return appendedCount;
+}
+
+- (MLVFrameIndex*) snapshot
+{
+    MLVFrameIndex* snapshot = [[MLVFrameIndex alloc] initWithBlockType:_blockType];
+    snapshot->_storage = (_storage) ?: _columnData;
+    snapshot->_count = _count;
+    snapshot->_capacity = _count;
+    memcpy(snapshot->_columns, _columns, sizeof(_columns));
+    return snapshot;
+}
+
+/* LSD radix sort of a permutation by (timestamp, frameNumber), 16 bits per pass, passes where every key has the same digit are skipped */
+static void _MLVRadixSortOrder(const UInt64* timestamps, const UInt32* frameNumbers, NSUInteger count, UInt32* order, UInt32* scratch)
+{
+    UInt64 minTimestamp = UINT64_MAX;
+    UInt64 maxTimestamp = 0;
+    for(NSUInteger i=0; i<count; i++) {
+        minTimestamp = MIN(minTimestamp, timestamps[i]);
+        maxTimestamp = MAX(maxTimestamp, timestamps[i]);
+        order[i] = (UInt32)i;
+    }
+
+    /* the least significant key is sorted first */
+    int timestampPasses = 0;
+    for(UInt64 range = maxTimestamp - minTimestamp; range > 0; range >>= 16) {
+        timestampPasses++;
+    }
+
+    UInt32* counts = malloc(65536 * sizeof(UInt32));
+
+    #define DIGIT(i) ((pass < 2) ? ((frameNumbers[i] >> (pass * 16)) & 0xFFFF) \
+                                 : (((timestamps[i] - minTimestamp) >> ((pass - 2) * 16)) & 0xFFFF))
+
+    for(int pass=0; pass<2+timestampPasses; pass++) {
+        memset(counts, 0, 65536 * sizeof(UInt32));
+
+        for(NSUInteger i=0; i<count; i++) {
+            counts[DIGIT(i)]++;
+        }
+        if (counts[DIGIT(0)] == count) {
+            continue;
+        }
+
+        UInt32 sum = 0;
+        for(int d=0; d<65536; d++) {
+            UInt32 c = counts[d];
+            counts[d] = sum;
+            sum += c;
+        }
+
+        for(NSUInteger i=0; i<count; i++) {
+            UInt32 row = order[i];
+            scratch[counts[DIGIT(row)]++] = row;
+        }
+        memcpy(order, scratch, count * sizeof(UInt32));
+    }
+
+    #undef DIGIT
+
+    free(counts);
+}
+
+- (void) sortByTime
+{
+    const UInt64* timestamps = (const UInt64*)_columns[kColumnTimestamp];
+    const UInt32* frameNumbers = (const UInt32*)_columns[kColumnFrameNumber];
+
+    /* usually the frames are in order already */
+    BOOL sorted = YES;
+    for(NSUInteger i=1; i<_count && sorted; i++) {
+        sorted = (timestamps[i-1] < timestamps[i] || (timestamps[i-1] == timestamps[i] && frameNumbers[i-1] < frameNumbers[i])) &&
+                 frameNumbers[i-1] < frameNumbers[i];
+    }
+    if (sorted) {
+        return;
+    }
+
+    /* stable, frames with equal keys keep their file order */
+    UInt32* order = malloc(_count * sizeof(UInt32));
+    UInt32* scratch = malloc(_count * sizeof(UInt32));
+    _MLVRadixSortOrder(timestamps, frameNumbers, _count, order, scratch);
+
+    /* a frame written twice is kept with its earliest timestamp, later copies are dropped */
+    UInt32 minFrameNumber = UINT32_MAX;
+    UInt32 maxFrameNumber = 0;
+    for(NSUInteger i=0; i<_count; i++) {
+        minFrameNumber = MIN(minFrameNumber, frameNumbers[i]);
+        maxFrameNumber = MAX(maxFrameNumber, frameNumbers[i]);
+    }
+
+    UInt64 span = (UInt64)maxFrameNumber - minFrameNumber + 1;
+    uint8_t* seenBits = (span <= 16 * (UInt64)_count + 1024) ? calloc((size_t)(span + 7) / 8, 1) : NULL;
+    NSMutableIndexSet* seenSet = (seenBits) ? nil : [[NSMutableIndexSet alloc] init];
+
+    NSUInteger keptCount = 0;
+    for(NSUInteger i=0; i<_count; i++) {
+        UInt32 frameNumber = frameNumbers[order[i]];
+        BOOL seen;
+        if (seenBits) {
+            UInt32 bit = frameNumber - minFrameNumber;
+            seen = (seenBits[bit >> 3] & (1 << (bit & 7))) != 0;
+            seenBits[bit >> 3] |= (1 << (bit & 7));
+        }
+        else {
+            seen = [seenSet containsIndex:frameNumber];
+            [seenSet addIndex:frameNumber];
+        }
+
+        if (!seen) {
+            order[keptCount++] = order[i];
+        }
+    }
+    free(seenBits);
+
+    if (keptCount < _count) {
+        DebugLog(@"Removed %lu duplicate frames", (unsigned long)(_count - keptCount));
+    }
+
+    [self _setColumnsWithCapacity:MAX(_capacity, 256) order:order count:keptCount];
+
+    free(order);
+    free(scratch);
+
+    [self _invalidateFrameNumberTable];
+}
+
+- (NSUInteger) count {
+    return _count;
+}
+
+- (UInt64) timestampAtIndex:(NSUInteger)index {
+    return COLUMN(UInt64, kColumnTimestamp, index);
+}
+
+- (UInt64) filePositionAtIndex:(NSUInteger)index {
+    return COLUMN(UInt64, kColumnFilePosition, index);
+}
+
+- (UInt32) sizeAtIndex:(NSUInteger)index {
+    return COLUMN(UInt32, kColumnSize, index);
+}
+
+- (UInt32) frameNumberAtIndex:(NSUInteger)index {
+    return COLUMN(UInt32, kColumnFrameNumber, index);
+}
+
+- (UInt16) fileNumAtIndex:(NSUInteger)index {
+    return COLUMN(UInt16, kColumnFileNum, index);
+}
+
+- (NSUInteger) indexOfFirstBlockAtOrAfterTime:(NSTimeInterval)time
+{
+    const UInt64* timestamps = (const UInt64*)_columns[kColumnTimestamp];
+
+    NSUInteger lower = 0;
+    NSUInteger upper = _count;
+    while (lower < upper) {
+        NSUInteger mid = lower + (upper - lower) / 2;
+        if (timestamps[mid] / 1000000.0 >= time) {
+            upper = mid;
+        }
+        else {
+            lower = mid + 1;
+        }
+    }
+    return (lower < _count) ? lower : NSNotFound;
+}
+
+static int _MLVCompareFrameNumberKeys(const void* a, const void* b)
+{
+    UInt64 keyA = *(const UInt64*)a;
+    UInt64 keyB = *(const UInt64*)b;
+    return (keyA > keyB) - (keyA < keyB);
+}
+
+- (void) _buildFrameNumberTable
+{
+    const UInt32* frameNumbers = (const UInt32*)_columns[kColumnFrameNumber];
+
+    UInt32 minFrameNumber = UINT32_MAX;
+    UInt32 maxFrameNumber = 0;
+    for(NSUInteger i=0; i<_count; i++) {
+        minFrameNumber = MIN(minFrameNumber, frameNumbers[i]);
+        maxFrameNumber = MAX(maxFrameNumber, frameNumbers[i]);
+    }
+
+    /* frame numbers are usually dense, a damaged header must not blow the table up */
+    UInt64 span = (UInt64)maxFrameNumber - minFrameNumber + 1;
+    if (span <= 16 * (UInt64)_count + 1024) {
+        _frameNumberTableOffset = minFrameNumber;
+        _frameNumberTableLength = span;
+        _frameNumberTable = malloc((size_t)span * sizeof(UInt32));
+        memset(_frameNumberTable, 0xff, (size_t)span * sizeof(UInt32));
+
+        for(NSUInteger i=0; i<_count; i++) {
+            UInt32* entry = &_frameNumberTable[frameNumbers[i] - minFrameNumber];
+            if (*entry == UINT32_MAX) {
+                *entry = (UInt32)i;
+            }
+        }
+        return;
+    }
+
+    /* the lowest index of a frame number sorts first */
+    _frameNumberKeys = malloc(_count * sizeof(UInt64));
+    for(NSUInteger i=0; i<_count; i++) {
+        _frameNumberKeys[i] = ((UInt64)frameNumbers[i] << 32) | i;
+    }
+    qsort(_frameNumberKeys, _count, sizeof(UInt64), _MLVCompareFrameNumberKeys);
+}
+
+- (NSUInteger) indexOfFrameNumber:(UInt32)frameNumber
+{
+    @synchronized (self) {
+        if (_count == 0) {
+            return NSNotFound;
+        }
+
+        if (!_frameNumberTable && !_frameNumberKeys) {
+            [self _buildFrameNumberTable];
+        }
+
+        if (_frameNumberTable) {
+            UInt64 entry = (UInt64)frameNumber - _frameNumberTableOffset;
+            if (frameNumber < _frameNumberTableOffset || entry >= _frameNumberTableLength || _frameNumberTable[entry] == UINT32_MAX) {
+                return NSNotFound;
+            }
+            return _frameNumberTable[entry];
+        }
+
+        UInt64 key = (UInt64)frameNumber << 32;
+        NSUInteger lower = 0;
+        NSUInteger upper = _count;
+        while (lower < upper) {
+            NSUInteger mid = lower + (upper - lower) / 2;
+            if (_frameNumberKeys[mid] < key) {
+                lower = mid + 1;
+            }
+            else {
+                upper = mid;
+            }
+        }
+
+        if (lower >= _count || (_frameNumberKeys[lower] >> 32) != frameNumber) {
+            return NSNotFound;
+        }
+        return (NSUInteger)(_frameNumberKeys[lower] & 0xFFFFFFFF);
+    }
+}
+
+- (__kindof MLVBlock*) blockAtIndex:(NSUInteger)index
+{
+    if (index >= _count) {
+        [NSException raise:NSRangeException format:@"index %lu beyond bounds [0 .. %lu]", (unsigned long)index, (unsigned long)_count];
+    }
+
+    UInt16 fileNum = COLUMN(UInt16, kColumnFileNum, index);
+    UInt64 filePosition = COLUMN(UInt64, kColumnFilePosition, index);
+
+    if (_blockType == kMLVBlockTypeVideo) {
+        mlv_vidf_hdr_t hdr;
+        memcpy(hdr.blockType, "VIDF", 4);
+        hdr.blockSize = CFSwapInt32HostToLittle(COLUMN(UInt32, kColumnSize, index));
+        hdr.timestamp = CFSwapInt64HostToLittle(COLUMN(UInt64, kColumnTimestamp, index));
+        hdr.frameNumber = CFSwapInt32HostToLittle(COLUMN(UInt32, kColumnFrameNumber, index));
+        hdr.cropPosX = CFSwapInt16HostToLittle(COLUMN(UInt16, kColumnCropPosX, index));
+        hdr.cropPosY = CFSwapInt16HostToLittle(COLUMN(UInt16, kColumnCropPosY, index));
+        hdr.panPosX = CFSwapInt16HostToLittle(COLUMN(UInt16, kColumnPanPosX, index));
+        hdr.panPosY = CFSwapInt16HostToLittle(COLUMN(UInt16, kColumnPanPosY, index));
+        hdr.frameSpace = CFSwapInt32HostToLittle(COLUMN(UInt32, kColumnFrameSpace, index));
+        return [[MLVVideoBlock alloc] initWithBlockBuffer:&hdr fileNum:fileNum filePosition:filePosition];
+    }
+
+    mlv_audf_hdr_t hdr;
+    memcpy(hdr.blockType, "AUDF", 4);
+    hdr.blockSize = CFSwapInt32HostToLittle(COLUMN(UInt32, kColumnSize, index));
+    hdr.timestamp = CFSwapInt64HostToLittle(COLUMN(UInt64, kColumnTimestamp, index));
+    hdr.frameNumber = CFSwapInt32HostToLittle(COLUMN(UInt32, kColumnFrameNumber, index));
+    hdr.frameSpace = CFSwapInt32HostToLittle(COLUMN(UInt32, kColumnFrameSpace, index));
+    return [[MLVAudioBlock alloc] initWithBlockBuffer:&hdr fileNum:fileNum filePosition:filePosition];
+}
+
+- (MLVFrameGapReport*) gapReportWithFrameDuration:(NSTimeInterval)frameDuration tolerance:(double)tolerance
+{
+    return [self gapReportByExtendingReport:nil frameDuration:frameDuration tolerance:tolerance];
+}
+
+- (MLVFrameGapReport*) gapReportByExtendingReport:(nullable MLVFrameGapReport*)report frameDuration:(NSTimeInterval)frameDuration tolerance:(double)tolerance
+{
+    /* a report of another index or with other parameters is not continued */
+    if (report && (report.frameCount > _count || report.frameDuration != frameDuration || report.tolerance != tolerance)) {
+        report = nil;
+    }
+
+    /* the last frame has no next frame to tell a damaged frame number apart, it is classified again once one follows */
+    MLVFrameGapReport* checkpoint = [self _gapReportByExtendingReport:report.checkpoint toCount:(_count > 0) ? _count - 1 : 0 frameDuration:frameDuration tolerance:tolerance];
+    MLVFrameGapReport* gapReport = [self _gapReportByExtendingReport:checkpoint toCount:_count frameDuration:frameDuration tolerance:tolerance];
+    gapReport.checkpoint = checkpoint;
+    return gapReport;
+}
+
+- (MLVFrameGapReport*) _gapReportByExtendingReport:(nullable MLVFrameGapReport*)report toCount:(NSUInteger)count frameDuration:(NSTimeInterval)frameDuration tolerance:(double)tolerance
+{
+    const UInt64* timestamps = (const UInt64*)_columns[kColumnTimestamp];
+    const UInt32* frameNumbers = (const UInt32*)_columns[kColumnFrameNumber];
+    const UInt16* fileNums = (const UInt16*)_columns[kColumnFileNum];
+
+    NSUInteger start = report.frameCount;
+    NSUInteger lastGood = (report) ? report.lastGoodIndex : NSNotFound;
+
+    NSMutableIndexSet* missingFrameNumbers = (report) ? [report.missingFrameNumbers mutableCopy] : [[NSMutableIndexSet alloc] init];
+    NSMutableIndexSet* jitterFrameNumbers = (report) ? [report.jitterFrameNumbers mutableCopy] : [[NSMutableIndexSet alloc] init];
+    NSMutableIndexSet* damagedFrameIndexes = (report) ? [report.damagedFrameIndexes mutableCopy] : [[NSMutableIndexSet alloc] init];
+
+    NSUInteger chunkCount = MAX(report.missingFramesPerChunk.count, 1);
+    for(NSUInteger i=start; i<count; i++) {
+        chunkCount = MAX(chunkCount, (NSUInteger)fileNums[i] + 1);
+    }
+    NSUInteger* missingPerChunk = calloc(chunkCount, sizeof(NSUInteger));
+    NSUInteger* jitterPerChunk = calloc(chunkCount, sizeof(NSUInteger));
+    for(NSUInteger f=0; f<report.missingFramesPerChunk.count; f++) {
+        missingPerChunk[f] = report.missingFramesPerChunk[f].unsignedIntegerValue;
+        jitterPerChunk[f] = report.jitterFramesPerChunk[f].unsignedIntegerValue;
+    }
+
+    double frameDurationUsec = frameDuration * 1000000.0;
+    double maxDeviation = tolerance * frameDurationUsec;
+
+    /* gaps are counted from the first frame number seen, recordings may start late or be cut */
+    for(NSUInteger i=start; i<count; i++) {
+        UInt32 current = frameNumbers[i];
+        BOOL hasNext = (i + 1 < _count);
+
+        /* a damaged frame number is out of order or jumps past the frame that follows it */
+        BOOL damaged;
+        if (lastGood == NSNotFound) {
+            damaged = (hasNext && frameNumbers[i+1] < current);
+        } else {
+            UInt32 previous = frameNumbers[lastGood];
+            damaged = (current <= previous) || (hasNext && frameNumbers[i+1] > previous && frameNumbers[i+1] < current);
+        }
+
+        if (damaged) {
+            [damagedFrameIndexes addIndex:i];
+            continue;
+        }
+
+        if (lastGood != NSNotFound) {
+            UInt32 previous = frameNumbers[lastGood];
+            if (current > previous + 1) {
+                [missingFrameNumbers addIndexesInRange:NSMakeRange(previous + 1, current - previous - 1)];
+                missingPerChunk[fileNums[i]] += current - previous - 1;
+            }
+
+            /* the distance is compared with the frames in between, a drop alone is no jitter */
+            if (frameDurationUsec > 0) {
+                double delta = (double)timestamps[i] - (double)timestamps[lastGood];
+                double expected = ((double)current - (double)previous) * frameDurationUsec;
+                if (fabs(delta - expected) > maxDeviation) {
+                    [jitterFrameNumbers addIndex:current];
+                    jitterPerChunk[fileNums[i]]++;
+                }
+            }
+        }
+        lastGood = i;
+    }
+
+    NSMutableArray<NSNumber*>* missingFramesPerChunk = [[NSMutableArray alloc] initWithCapacity:chunkCount];
+    NSMutableArray<NSNumber*>* jitterFramesPerChunk = [[NSMutableArray alloc] initWithCapacity:chunkCount];
+    for(NSUInteger f=0; f<chunkCount; f++) {
+        [missingFramesPerChunk addObject:@(missingPerChunk[f])];
+        [jitterFramesPerChunk addObject:@(jitterPerChunk[f])];
+    }
+    free(missingPerChunk);
+    free(jitterPerChunk);
+
+    MLVFrameGapReport* extendedReport = [[MLVFrameGapReport alloc] init];
+    extendedReport.missingFrameNumbers = missingFrameNumbers;
+    extendedReport.jitterFrameNumbers = jitterFrameNumbers;
+    extendedReport.damagedFrameIndexes = damagedFrameIndexes;
+    extendedReport.missingFramesPerChunk = missingFramesPerChunk;
+    extendedReport.jitterFramesPerChunk = jitterFramesPerChunk;
+    extendedReport.frameCount = count;
+    extendedReport.lastGoodIndex = lastGood;
+    extendedReport.frameDuration = frameDuration;
+    extendedReport.tolerance = tolerance;
+    return extendedReport;
+}
+
+- (NSArray<__kindof MLVBlock*>*) blocks {
+    return [[MLVFrameIndexArray alloc] initWithFrameIndex:self];
+}
+
+@end
+
+#pragma mark -
+
+/* read-only array that creates the block objects from the index on access */
+@implementation MLVFrameIndexArray {
+    MLVFrameIndex* _frameIndex;
+}
+
+- (instancetype) initWithFrameIndex:(MLVFrameIndex*)frameIndex {
+    if ((self = [super init])) {
+        _frameIndex = frameIndex;
+    }
+    return self;
+}
+
+- (NSUInteger) count {
+    return _frameIndex.count;
+}
+
+- (id) objectAtIndex:(NSUInteger)index {
+    return [_frameIndex blockAtIndex:index];
+}
+
+@end
+
+#pragma mark -
+
+@implementation MLVFrameGapReport
+@end
@@ -28,4 +28,6 @@
 
 @property (readonly) NSData* dngData;
 - (NSData*) dngDataIncludingThumbnail:(BOOL)includingThumbnail;
+// compressed writes Compression 7, uncompressed frames are encoded as lossless JPEG first
+- (NSData*) dngDataIncludingThumbnail:(BOOL)includingThumbnail compressed:(BOOL)compressed;
 @end
@@ -23,6 +23,8 @@
 
 #import "MLVRawImage+DNG.h"
 #import "MLVRawImage+Inline.h"
+#import "MLVRawPacking.h"
+#import "MLVRawKernels.h"
 
 #define T_BYTE      1
 #define T_ASCII     2
@@ -41,9 +43,6 @@
 
 #define BADPIX_CFA_INDEX    6   // Index of CFAPattern value in badpixel_opcodes array
 
-#define dng_th_width 256
-#define dng_th_height 168
-
 struct dir_entry {
     uint16_t tag;
     uint16_t type;
@@ -53,6 +52,10 @@ struct dir_entry {
 };
 
 
+@interface MLVRawImage ()
+- (NSData*) _thumbnailData;
+@end
+
 @implementation MLVRawImage (DNG)
 
 - (int32_t) _findTagIndex:(struct dir_entry *)ifd :(int32_t)num :(uint16_t)tag
@@ -119,9 +122,13 @@ struct dir_entry {
 #define DIR_SIZE(ifd)   (sizeof(ifd)/sizeof(ifd[0]))
 #define TIFF_HDR_SIZE (8)
 
+static int _MLVCompareDirEntries(const void* a, const void* b)
+{
+    return (int)((const struct dir_entry*)a)->tag - (int)((const struct dir_entry*)b)->tag;
+}
 
 
-- (BOOL) _createHeaderAndReturnBuf:(void**)outHeaderBuf headerSize:(int32_t*)outHeaderSize
+- (BOOL) _createHeaderAndReturnBuf:(void**)outHeaderBuf headerSize:(int32_t*)outHeaderSize thumbnail:(BOOL)thumbnail
 {
     NSParameterAssert(outHeaderBuf);
     NSParameterAssert(outHeaderSize);
@@ -315,6 +322,32 @@ struct dir_entry {
         ifd_list[0].count -= 2;
     }
 
+    /* without a preview the raw image is the first IFD, its tags are sorted in between the others */
+    struct dir_entry main_ifd[DIR_SIZE(ifd0) + DIR_SIZE(ifd1)];
+    if (!thumbnail) {
+        int32_t count = 0;
+        for (i=0; i<(int32_t)DIR_SIZE(ifd0); i++) {
+            if (ifd0[i].tag != 0x14A && [self _findTagIndex:ifd1 :DIR_SIZE(ifd1) :ifd0[i].tag] < 0) {
+                main_ifd[count++] = ifd0[i];
+            }
+        }
+        for (i=0; i<(int32_t)DIR_SIZE(ifd1); i++) {
+            main_ifd[count++] = ifd1[i];
+        }
+        qsort(main_ifd, count, sizeof(struct dir_entry), _MLVCompareDirEntries);
+
+        ifd_list[0].entry = main_ifd;
+        ifd_list[0].entry_count = count;
+        ifd_list[0].count = 0;
+        for (i=0; i<count; i++) {
+            if ((main_ifd[i].type & T_SKIP) == 0) {
+                ifd_list[0].count++;
+            }
+        }
+        ifd_list[1] = ifd_list[2];
+        ifd_count = 2;
+    }
+
     // calculating offset of RAW data and count of entries for each IFD
     raw_offset=TIFF_HDR_SIZE;
 
@@ -365,10 +398,16 @@ struct dir_entry {
 
     extra_offset=TIFF_HDR_SIZE;
 
-    ifd0[SUBIFDS_INDEX].offset = TIFF_HDR_SIZE + ifd_list[0].count * 12 + 6;                            // SubIFDs offset
-    ifd0[EXIF_IFD_INDEX].offset = TIFF_HDR_SIZE + (ifd_list[0].count + ifd_list[1].count) * 12 + 6 + 6; // EXIF IFD offset
-    ifd0[THUMB_DATA_INDEX].offset = raw_offset;                                     //StripOffsets for thumbnail
-    ifd1[RAW_DATA_INDEX].offset = raw_offset + dng_th_width * dng_th_height * 3;    //StripOffsets for main image
+    if (thumbnail) {
+        ifd0[SUBIFDS_INDEX].offset = TIFF_HDR_SIZE + ifd_list[0].count * 12 + 6;                            // SubIFDs offset
+        ifd0[EXIF_IFD_INDEX].offset = TIFF_HDR_SIZE + (ifd_list[0].count + ifd_list[1].count) * 12 + 6 + 6; // EXIF IFD offset
+        ifd0[THUMB_DATA_INDEX].offset = raw_offset;                                     //StripOffsets for thumbnail
+        ifd1[RAW_DATA_INDEX].offset = raw_offset + dng_th_width * dng_th_height * 3;    //StripOffsets for main image
+    } else {
+        int32_t count = ifd_list[0].entry_count;
+        main_ifd[[self _findTagIndex:main_ifd :count :0x8769]].offset = TIFF_HDR_SIZE + ifd_list[0].count * 12 + 6;  // EXIF IFD offset
+        main_ifd[[self _findTagIndex:main_ifd :count :0x111]].offset = raw_offset;                                   //StripOffsets for main image
+    }
 
     for (j=0;j<ifd_count;j++)
     {
@@ -452,15 +491,6 @@ struct dir_entry {
 }
 
 
-NS_INLINE void reverse_bytes_order(int8_t* buf, int32_t count)
-{
-    int16_t* buf16 = (int16_t*) buf;
-    register int32_t i;
-    for (i = 0; i < count/2; i++) {
-        buf16[i] = CFSwapInt16(buf16[i]);
-    }
-}
-
 - (void*) _createThumbnailImage:(BOOL)createThumbnail
 {
     void* thumbnailBuf = malloc(dng_th_width*dng_th_height*3);
@@ -468,26 +498,16 @@ NS_INLINE void reverse_bytes_order(int8_t* buf, int32_t count)
         return NULL;
     }
 
-    if (!self.compressed && createThumbnail) {
-        register int32_t i, j, x, y, yadj, xadj;
-        register char *buf = thumbnailBuf;
-
-        struct raw_info* rawInfo = self.rawInfo;
-        void* rawBuffer = self.rawBuffer;
-
-        yadj = (rawInfo->cfa_pattern == 0x01000201) ? 1 : 0;
-        xadj = (rawInfo->cfa_pattern == 0x01020001) ? 1 : 0;
-
-        for (i=0; i<dng_th_height; i++) {
-            for (j=0; j<dng_th_width; j++) {
-                x = rawInfo->active_area.x1 + ((rawInfo->jpeg.x + (rawInfo->jpeg.width  * j) / dng_th_width)  & 0xFFFFFFFE) + xadj;
-                y = rawInfo->active_area.y1 + ((rawInfo->jpeg.y + (rawInfo->jpeg.height * i) / dng_th_height) & 0xFFFFFFFE) + yadj;
-
-                *buf++ = RawTo8BitSRGB(GetRawPixel(rawInfo, rawBuffer, x,y), 0, rawInfo);        // red pixel
-                *buf++ = RawTo8BitSRGB(GetRawPixel(rawInfo, rawBuffer, x+1,y), -1, rawInfo);      // green pixel
-                *buf++ = RawTo8BitSRGB(GetRawPixel(rawInfo, rawBuffer, x+1,y+1), 0, rawInfo);    // blue pixel
-            }
-        }
+    /* sampled while the image was processed */
+    NSData* thumbnailData = [self _thumbnailData];
+    struct raw_info* rawInfo = self.bufferInfo;
+    BOOL truncated = !self.unpacked && (int64_t)rawInfo->pitch * rawInfo->height > rawInfo->frame_size;
+    const mlv_raw_kernels_t* kernels = (self.compressed || truncated) ? NULL : MLVRawKernelsForInfo(rawInfo);
+    if (thumbnailData && createThumbnail) {
+        memcpy(thumbnailBuf, thumbnailData.bytes, dng_th_width*dng_th_height*3);
+    }
+    else if (kernels && createThumbnail) {
+        kernels->thumbnail(rawInfo, self.rawBuffer, thumbnailBuf, dng_th_width, dng_th_height, rawInfo);
     }
     else {
         memset(thumbnailBuf, 0, dng_th_width*dng_th_height*3);
@@ -501,39 +521,70 @@ NS_INLINE void reverse_bytes_order(int8_t* buf, int32_t count)
 }
 
 - (NSData*) dngDataIncludingThumbnail:(BOOL)includingThumbnail
+{
+    return [self dngDataIncludingThumbnail:includingThumbnail compressed:NO];
+}
+
+- (NSData*) dngDataIncludingThumbnail:(BOOL)includingThumbnail compressed:(BOOL)compressed
+{
+    /* the thumbnail comes from the samples, before they are encoded. a passed through
+       frame has no samples to take it from, its DNG has no preview */
+    void* thumbnailBuf = NULL;
+    if (includingThumbnail && !self.compressed) {
+        thumbnailBuf = [self _createThumbnailImage:YES];
+        if (!thumbnailBuf) {
+            return nil;
+        }
+    }
+
+    /* a frame that can't be compressed, like a truncated one, is written uncompressed */
+    MLVRawImage* rawImage = (compressed) ? [self rawImageByCompressingBuffer] : self;
+    if (!rawImage) {
+        rawImage = self;
+    }
+
+    NSData* data = [rawImage _dngDataWithThumbnail:thumbnailBuf];
+    free(thumbnailBuf);
+    return data;
+}
+
+- (NSData*) _dngDataWithThumbnail:(void*)thumbnailBuf
 {
     struct raw_info* rawInfo = self.rawInfo;
     void* rawBuffer = self.rawBuffer;
 
     void* headerBuf = NULL;
     int32_t headerSize;
-    if (![self _createHeaderAndReturnBuf:&headerBuf headerSize:&headerSize]) {
-        return nil;
-    }
-
-    void* thumbnailBuf = [self _createThumbnailImage:YES];
-    if (!thumbnailBuf) {
-        free(headerBuf);
+    if (![self _createHeaderAndReturnBuf:&headerBuf headerSize:&headerSize thumbnail:(thumbnailBuf != NULL)]) {
         return nil;
     }
 
-    size_t data_size = headerSize + dng_th_width*dng_th_height*3 + rawInfo->frame_size;
+    size_t thumbnailSize = (thumbnailBuf) ? dng_th_width*dng_th_height*3 : 0;
+    size_t data_size = headerSize + thumbnailSize + rawInfo->frame_size;
     void* data_ptr = malloc(data_size);
     void* buf_ptr = data_ptr;
 
     memcpy(buf_ptr, headerBuf, headerSize);
     buf_ptr += headerSize;
 
-    memcpy(buf_ptr, thumbnailBuf, dng_th_width*dng_th_height*3);
-    buf_ptr += dng_th_width*dng_th_height*3;
+    if (thumbnailBuf) {
+        memcpy(buf_ptr, thumbnailBuf, thumbnailSize);
+        buf_ptr += thumbnailSize;
+    }
 
-    memcpy(buf_ptr, rawBuffer, rawInfo->frame_size);
-    if (!self.compressed) {
-        reverse_bytes_order(buf_ptr, rawInfo->frame_size);
+    /* DNG wants the plain bitstream, the words are swapped while copying */
+    if (self.unpacked) {
+        uint8_t* dst = buf_ptr;
+        dispatch_apply(rawInfo->height, dispatch_get_global_queue(0, 0), ^(size_t y) {
+            MLVPackRawRow((uint16_t*)rawBuffer + y * rawInfo->width, dst + y * rawInfo->pitch, rawInfo->width, rawInfo->bits_per_pixel, kMLVRawPackingBigEndian);
+        });
+    } else if (!self.compressed) {
+        MLVSwapRawBytes(rawBuffer, buf_ptr, rawInfo->frame_size);
+    } else {
+        memcpy(buf_ptr, rawBuffer, rawInfo->frame_size);
     }
 
     free(headerBuf);
-    free(thumbnailBuf);
 
     NSData* data = [NSData dataWithBytesNoCopy:data_ptr length:data_size freeWhenDone:YES];
 
@@ -23,6 +23,9 @@
 
 #import "raw.h"
 
+#define dng_th_width 256
+#define dng_th_height 168
+
 NS_INLINE uint8_t RawTo8BitSRGB(int32_t raw, int32_t wb, struct raw_info * raw_info)
 {
     float ev = log2f(MAX(1, raw - raw_info->black_level)) + wb - 5;
@@ -149,6 +152,11 @@ NS_INLINE void setRawPixel(const struct raw_info * raw_info, void* raw_buffer, i
             }
             break;
         }
+        case 16: {
+            uint16_t* buf = (uint16_t*)raw_buffer;
+            buf[y * raw_info->width + x] = px;
+            break;
+        }
 
         default:
             break;
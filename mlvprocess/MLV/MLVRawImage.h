@@ -41,14 +41,41 @@ typedef NS_ENUM(NSInteger, MLVRawImageFocusPixelsType) {
     kMLVRawImageFocusPixelsType2592x1108     = 1 << 19,
 };
 
+typedef NS_OPTIONS(NSUInteger, MLVRawImageCorrections) {
+    kMLVRawImageCorrectionsNone             = 0,
+    kMLVRawImageCorrectionsFocusPixels      = 1 << 0,
+    kMLVRawImageCorrectionsDeadPixels       = 1 << 1,
+    kMLVRawImageCorrectionsVerticalBanding  = 1 << 2,
+    kMLVRawImageCorrectionsHighlightMap     = 1 << 3,   // collected for highlightMap
+    kMLVRawImageCorrectionsThumbnail        = 1 << 4,   // collected for the DNG thumbnail
+};
+
+typedef NS_ENUM(NSInteger, MLVRawImageLayout) {
+    kMLVRawImageLayoutUnpacked              = 0,        // 16 bit samples, corrected and packed into the DNG in one pass each
+    kMLVRawImageLayoutPacked,                           // recorded bit depth, like the frames of uncompressed files
+};
+
 @interface MLVRawImage : NSObject <NSCopying>
 
 - (instancetype) initWithInfo:(struct raw_info)rawInfo buffer:(void*)rawBuffer compressed:(BOOL)compressed;
 
+// data is not copied, the buffer is treated as read-only and copied before the first modification
+- (instancetype) initWithInfo:(struct raw_info)rawInfo data:(NSData*)rawData compressed:(BOOL)compressed;
+
+// samples are uint16_t rows, rawInfo still describes the packed image that is written to DNG
+- (instancetype) initWithInfo:(struct raw_info)rawInfo unpackedBuffer:(uint16_t*)samples;
+
 @property (readonly) struct raw_info* rawInfo;
 @property (readonly) void* rawBuffer;
 @property (readonly) BOOL compressed;
 
+// unpacks the buffer once so the corrections work on plain samples, it is packed again when written to DNG
+- (void) unpackBuffer;
+@property (readonly, getter=isUnpacked) BOOL unpacked;
+
+// layout of rawBuffer, a 16 bit version of rawInfo if the image is unpacked
+@property (readonly) struct raw_info* bufferInfo;
+
 @property (readonly) NSData* highlightMap;
 
 // improve performance by creating a dead pixel map
@@ -62,7 +89,26 @@ typedef NS_ENUM(NSInteger, MLVRawImageFocusPixelsType) {
 - (void) fixVerticalBandingWithCoefficients:(nullable NSData*)coefficients;
 
 - (MLVRawImage*) rawImageByChangingBitsPerPixel:(int32_t)bitsPerPixel;
+
+/*
+ * Runs the corrections in two passes instead of one pass each. The first pass unpacks the frame and
+ * collects white level and banding statistics, the second one fixes, converts and samples bands of rows
+ * while they are in the cache. bitsPerPixel 0 keeps the bit depth.
+ */
+- (void) processWithCorrections:(MLVRawImageCorrections)corrections
+                focusPixelsType:(MLVRawImageFocusPixelsType)focusPixelsType cropX:(UInt16)cropX cropY:(UInt16)cropY
+    verticalBandingCoefficients:(nullable NSData*)coefficients
+                   bitsPerPixel:(int32_t)bitsPerPixel;
+
+// found by findVerticalBandingCoefficients or processWithCorrections:, nil if no correction is needed
+@property (nullable, readonly) NSData* verticalBandingCoefficients;
+
+// decodes into the layout the next step works on, no intermediate buffer is kept
 - (MLVRawImage*) rawImageByDecompressingBuffer;
+- (nullable MLVRawImage*) rawImageByDecompressingBufferToLayout:(MLVRawImageLayout)layout;
+
+// lossless JPEG like recorded LJ92 frames, for compressed DNGs. compressed images return themselves, truncated ones nil
+- (nullable MLVRawImage*) rawImageByCompressingBuffer;
 
 /* Metadata */
 @property (nullable, strong) NSString* camName;
@@ -22,17 +22,28 @@
 #import "MLVRawImage.h"
 #import "MLVRawImage+Inline.h"
 #import "MLVPixelMap.h"
+#import "MLVRawPacking.h"
+#import "MLVRawKernels.h"
 #import "lj92.h"
 
 #import <AppKit/NSImage.h>
 
+/* rows of a band should stay in the L2 cache while all stages work on them */
+#define MLV_BAND_BYTES (256 * 1024)
+
 @implementation MLVRawImage {
     struct raw_info _rawInfo;
     void*           _rawBuffer;
+    NSData*         _rawData;
     BOOL            _compressed;
+    BOOL            _unpacked;
+    struct raw_info _bufferInfo;
     
     double          _verticalBandingCoeffs[8];
     int8_t          _verticalBandingCorrectionNeeded;
+
+    NSData*         _highlightMap;
+    NSData*         _thumbnailData;
 }
 
 - (instancetype) initWithInfo:(struct raw_info)rawInfo buffer:(void*)rawBuffer compressed:(BOOL)compressed
@@ -51,59 +62,175 @@
     return self;
 }
 
+- (instancetype) initWithInfo:(struct raw_info)rawInfo data:(NSData*)rawData compressed:(BOOL)compressed
+{
+    NSParameterAssert(rawData);
+
+    if ((self = [self initWithInfo:rawInfo buffer:(void*)rawData.bytes compressed:compressed])) {
+        _rawData = rawData;
+    }
+    return self;
+}
+
+- (instancetype) initWithInfo:(struct raw_info)rawInfo unpackedBuffer:(uint16_t*)samples
+{
+    if ((self = [self initWithInfo:rawInfo buffer:samples compressed:NO])) {
+        _unpacked = YES;
+    }
+    return self;
+}
+
 - (struct raw_info*) rawInfo {
     return &(_rawInfo);
 }
 
+- (struct raw_info*) bufferInfo {
+    if (!_unpacked) {
+        return &(_rawInfo);
+    }
+
+    _bufferInfo = _rawInfo;
+    _bufferInfo.bits_per_pixel = 16;
+    _bufferInfo.pitch = _rawInfo.width * sizeof(uint16_t);
+    _bufferInfo.frame_size = _bufferInfo.pitch * _rawInfo.height;
+    return &(_bufferInfo);
+}
+
+- (void) unpackBuffer
+{
+    if (_compressed || _unpacked) {
+        return;
+    }
+
+    struct raw_info* rawInfo = &_rawInfo;
+    void* rawBuffer = _rawBuffer;
+    size_t width = rawInfo->width;
+
+    /* truncated frame, stay with the packed data */
+    if ((int64_t)rawInfo->pitch * rawInfo->height > rawInfo->frame_size) {
+        return;
+    }
+
+    /* reads the packed data in place, a mapped frame is not copied first */
+    uint16_t* samples = malloc(width * rawInfo->height * sizeof(uint16_t));
+    dispatch_apply(rawInfo->height, dispatch_get_global_queue(0, 0), ^(size_t y) {
+        MLVUnpackRawRow(rawBuffer + y * rawInfo->pitch, samples + y * width, width, rawInfo->bits_per_pixel);
+    });
+
+    if (!_rawData) {
+        free(_rawBuffer);
+    }
+    _rawData = nil;
+    _rawBuffer = samples;
+    _rawInfo.frame_size = _rawInfo.pitch * _rawInfo.height;
+    _unpacked = YES;
+}
+
 - (void*) rawBuffer {
     return _rawBuffer;
 }
 
 - (void) dealloc {
-    if (_rawBuffer) {
+    if (_rawBuffer && !_rawData) {
         free(_rawBuffer);
     }
 }
 
+- (void) _makeBufferWritable {
+    if (_rawData) {
+        void* rawBuffer = malloc(_rawData.length);
+        memcpy(rawBuffer, _rawData.bytes, _rawData.length);
+        _rawBuffer = rawBuffer;
+        _rawData = nil;
+    }
+}
+
 - (id) copyWithZone:(NSZone *)zone {
-    void* rawBufferCopy = malloc(_rawInfo.frame_size);
-    memcpy(rawBufferCopy, _rawBuffer, _rawInfo.frame_size);
+    size_t length = self.bufferInfo->frame_size;
+    void* rawBufferCopy = malloc(length);
+    memcpy(rawBufferCopy, _rawBuffer, length);
 
-    MLVRawImage* copy = [[MLVRawImage alloc] initWithInfo:_rawInfo buffer:rawBufferCopy compressed:_compressed];
+    MLVRawImage* copy = (_unpacked) ? [[MLVRawImage alloc] initWithInfo:_rawInfo unpackedBuffer:rawBufferCopy]
+                                    : [[MLVRawImage alloc] initWithInfo:_rawInfo buffer:rawBufferCopy compressed:_compressed];
     return copy;
 }
 
-- (void) _enumeratePixels:(void (^)(int32_t rx, int32_t ry, int32_t g1x, int32_t g1y, int32_t g2x, int32_t g2y, int32_t bx, int32_t by))callback
-{
-    register int32_t x, y, yadj, xadj, gadj;
+#pragma mark - Bands
 
-    // The sensor bayer patterns are:
-    //  0x02010100  0x01000201  0x01020001
-    //      R G         G B         G R
-    //      G B         R G         B G
+/* a few bands per core so uneven bands even out, with even rows so bayer quads are never split */
+#define MLV_BANDS_PER_CPU   4
+#define MLV_MIN_BAND_ROWS   8
 
-    yadj = (_rawInfo.cfa_pattern == 0x01000201) ? 1 : 0;
-    xadj = (_rawInfo.cfa_pattern == 0x01020001) ? 1 : 0;
-    gadj = (_rawInfo.cfa_pattern == 0x02010100) ? 0 : 1;
+typedef struct {
+    int32_t     rows;
+    size_t      count;
+} mlv_bands_t;
 
+static size_t _MLVCPUCount(void)
+{
+    static size_t cpuCount = 0;
+    if (cpuCount == 0) {
+        cpuCount = MAX(1, [NSProcessInfo processInfo].activeProcessorCount);
+    }
+    return cpuCount;
+}
 
-    size_t h = (_rawInfo.height >> 1 ) << 1;
+static mlv_bands_t _MLVBandsWithHeightAndCount(int32_t height, size_t target)
+{
+    int32_t rows = (int32_t)((height + target - 1) / target);
+    rows = MAX(MLV_MIN_BAND_ROWS, (rows + 1) & ~1);
+
+    mlv_bands_t bands;
+    bands.rows = rows;
+    bands.count = MAX(1, (height + rows - 1) / rows);
+    return bands;
+}
+
+static mlv_bands_t _MLVBandsWithHeight(int32_t height)
+{
+    return _MLVBandsWithHeightAndCount(height, _MLVCPUCount() * MLV_BANDS_PER_CPU);
+}
 
-    for (y=0; y<h; y+=2) {
-        for (x=0; x<_rawInfo.width; x+=2) {
-            callback(x+xadj, y+xadj, x+1-gadj, y, x+gadj, y+1, x+1-xadj, y+1-yadj);
+/* runs the block for every band concurrently, per band results are merged by the caller */
+static void _MLVApplyToBands(mlv_bands_t bands, int32_t height, void (^block)(size_t band, int32_t firstRow, int32_t endRow))
+{
+    dispatch_apply(bands.count, dispatch_get_global_queue(0, 0), ^(size_t b) {
+        int32_t firstRow = (int32_t)b * bands.rows;
+        int32_t endRow = MIN(height, firstRow + bands.rows);
+        if (firstRow < endRow) {
+            block(b, firstRow, endRow);
         }
+    });
+}
+
+_Static_assert(sizeof(MLVPixelMapPixel) == sizeof(mlv_raw_pixel_t), "kernels write pixel maps directly");
+
+/* kernels of the buffer layout, looked up once per frame */
+- (const mlv_raw_kernels_t*) _kernels
+{
+    const mlv_raw_kernels_t* kernels = MLVRawKernelsForInfo(self.bufferInfo);
+    if (!kernels) {
+        ErrLog(@"no kernels for %d bits per pixel", _rawInfo.bits_per_pixel);
     }
+    return kernels;
 }
 
 #pragma mark -
 
 - (NSData*) highlightMap
 {
-    if (self.compressed) {
+    if (_highlightMap) {
+        return _highlightMap;
+    }
+
+    const mlv_raw_kernels_t* kernels = (self.compressed) ? NULL : [self _kernels];
+    if (!kernels) {
         return nil;
     }
 
+    struct raw_info* bufferInfo = self.bufferInfo;
+    void* rawBuffer = _rawBuffer;
+    struct raw_info* rawInfo = &_rawInfo;
     size_t halfW = _rawInfo.width/2;
     size_t halfH = _rawInfo.height/2;
 
@@ -112,22 +239,11 @@
 
     CGContextRef bitmapContext = CGBitmapContextCreate(nil, halfW, halfH, 8, halfW*bytesPerPixel, colorSpace, kCGImageAlphaNone);
     CGColorSpaceRelease(colorSpace);
-    __block uint8_t* pixelPtr = CGBitmapContextGetData(bitmapContext);
-
-    [self _enumeratePixels:^(int32_t rx, int32_t ry, int32_t g1x, int32_t g1y, int32_t g2x, int32_t g2y, int32_t bx, int32_t by) {
+    uint8_t* pixelPtr = CGBitmapContextGetData(bitmapContext);
 
-        int32_t r = GetRawPixel(&_rawInfo, _rawBuffer, rx, ry);
-        int32_t g1 = GetRawPixel(&_rawInfo, _rawBuffer, g1x, g1y);
-        int32_t g2 = GetRawPixel(&_rawInfo, _rawBuffer, g2x, g2y);
-        int32_t b = GetRawPixel(&_rawInfo, _rawBuffer, bx, by);
-
-        int32_t l =  MAX(MAX(MAX(r, g1), g2), b); //(r+g1+g2+b) >> 2;
-        l = RawTo8BitSRGB(l, 0, &_rawInfo);
-        l = COERCE((MAX(0, l-204)*5), 0, 255);
-
-        *pixelPtr = l;
-        pixelPtr++;
-    }];
+    _MLVApplyToBands(_MLVBandsWithHeight((int32_t)halfH * 2), (int32_t)halfH * 2, ^(size_t band, int32_t firstRow, int32_t endRow) {
+        kernels->highlightRows(bufferInfo, rawBuffer, firstRow, endRow, pixelPtr, halfW, rawInfo);
+    });
 
     CGImageRef imageRef = CGBitmapContextCreateImage(bitmapContext);
     CGContextRelease(bitmapContext);
@@ -141,80 +257,130 @@
 #pragma mark - Repair Pixels
 
 - (MLVPixelMap*) deadPixelMap {
-    size_t h = (_rawInfo.height >> 1 ) << 1;
-    MLVPixelMap* deadPixelMap = [[MLVPixelMap alloc] initWithCapacity:(_rawInfo.width*h)];
+    const mlv_raw_kernels_t* kernels = [self _kernels];
+    if (!kernels) {
+        return nil;
+    }
 
+    struct raw_info* bufferInfo = self.bufferInfo;
+    void* rawBuffer = _rawBuffer;
+    int32_t width = _rawInfo.width;
+    int32_t h = (_rawInfo.height >> 1 ) << 1;
+    MLVPixelMap* deadPixelMap = [[MLVPixelMap alloc] initWithCapacity:(_rawInfo.width*h)];
 
-    __block NSUInteger numberOfDeadPixels = 0;
+    /* every band fills the part of the map that matches its rows, the parts are moved together afterwards */
     MLVPixelMapPixel* pixelMapPtr = deadPixelMap.pixelMapPtr;
+    mlv_bands_t bands = _MLVBandsWithHeight(h);
+    NSUInteger* bandCounts = calloc(bands.count, sizeof(NSUInteger));
 
-    int32_t black_level = _rawInfo.black_level;
-    void (^findDeadPixel)(int32_t, int32_t) = ^void(int32_t cx, int32_t cy) {
-        int32_t r = GetRawPixel(&_rawInfo, _rawBuffer, cx, cy);
-        if (r == 0 || r < black_level-500) {
-            pixelMapPtr[numberOfDeadPixels].x = (int32_t)cx;
-            pixelMapPtr[numberOfDeadPixels].y = (int32_t)cy;
-            numberOfDeadPixels++;
-        }
-    };
-
-
-    [self _enumeratePixels:^(int32_t rx, int32_t ry, int32_t g1x, int32_t g1y, int32_t g2x, int32_t g2y, int32_t bx, int32_t by) {
-        findDeadPixel(rx, ry);
-        findDeadPixel(g1x, g1y);
-        findDeadPixel(g2x, g2y);
-        findDeadPixel(bx, by);
-    }];
+    _MLVApplyToBands(bands, h, ^(size_t band, int32_t firstRow, int32_t endRow) {
+        mlv_raw_pixel_t* dst = (mlv_raw_pixel_t*)pixelMapPtr + (size_t)firstRow * width;
+        bandCounts[band] = kernels->findDeadPixels(bufferInfo, rawBuffer, firstRow, endRow, dst);
+    });
 
+    NSUInteger numberOfDeadPixels = 0;
+    for (size_t b=0; b<bands.count; b++) {
+        memmove(pixelMapPtr + numberOfDeadPixels, pixelMapPtr + b * bands.rows * width, bandCounts[b] * sizeof(MLVPixelMapPixel));
+        numberOfDeadPixels += bandCounts[b];
+    }
+    free(bandCounts);
 
     deadPixelMap.numberOfPixels = numberOfDeadPixels;
     deadPixelMap.capacity = deadPixelMap.numberOfPixels;
     return deadPixelMap;
 }
 
-- (void) fixDeadPixelsBasedOnPixelMap:(nullable MLVPixelMap*)pixelMap
+/* a dead pixel interpolates from pixels two rows away, which another band may be fixing at the same
+   time. every band collects the values of its pixels from the unfixed frame first and writes them after
+   all bands are done, so the result doesn't depend on the order the bands run in */
+typedef struct {
+    mlv_raw_fix_t*  fixes;
+    size_t          count;
+} mlv_fix_list_t;
+
+static mlv_fix_list_t* _MLVInterpolateDeadPixelsOfBands(const mlv_raw_kernels_t* kernels, const struct raw_info* info, const void* buffer,
+                                                        mlv_bands_t bands, int32_t height, const mlv_raw_pixel_t* pixels)
 {
-    NSParameterAssert(_rawBuffer);
+    mlv_fix_list_t* lists = calloc(bands.count, sizeof(mlv_fix_list_t));
+    int32_t width = info->width;
 
-    if (pixelMap) {
-        int32_t black_level = _rawInfo.black_level;
-        [pixelMap _enumeratePixels:^(MLVPixelMapPixel *pixel) {
+    _MLVApplyToBands(bands, height, ^(size_t band, int32_t first, int32_t end) {
+        mlv_fix_list_t* list = &lists[band];
 
-            int32_t cx = pixel->x;
-            int32_t cy = pixel->y;
-            int32_t r = GetRawPixel(&_rawInfo, _rawBuffer, cx, cy);
+        /* bands of a pixel map are ranges of the map */
+        if (pixels) {
+            list->fixes = malloc((end - first) * sizeof(mlv_raw_fix_t));
+            list->count = kernels->interpolateDeadPixelList(info, buffer, pixels + first, end - first, list->fixes);
+            return;
+        }
 
-            if (r == 0 || r < black_level-500) {
-                int32_t interpolated_pixel = GetInterpolatedPixel(&_rawInfo, _rawBuffer, cx, cy);
-                setRawPixel(&_rawInfo, _rawBuffer, cx, cy, interpolated_pixel);
+        /* dead pixels are rare, the list grows with the rows */
+        size_t capacity = width * 2;
+        list->fixes = malloc(capacity * sizeof(mlv_raw_fix_t));
+        for (int32_t y=first; y<end; y++) {
+            if (list->count + width > capacity) {
+                capacity = MAX(capacity * 2, list->count + width);
+                list->fixes = realloc(list->fixes, capacity * sizeof(mlv_raw_fix_t));
             }
+            list->count += kernels->interpolateDeadPixels(info, buffer, y, y+1, list->fixes + list->count);
+        }
+    });
+    return lists;
+}
 
-        }];
+static void _MLVFreeFixLists(mlv_fix_list_t* lists, size_t count)
+{
+    for (size_t b=0; b<count; b++) {
+        free(lists[b].fixes);
     }
-    else
-    {
-        int32_t black_level = _rawInfo.black_level;
-        void (^findAndFixDeadPixel)(int32_t, int32_t) = ^void(int32_t cx, int32_t cy) {
-            int32_t r = GetRawPixel(&_rawInfo, _rawBuffer, cx, cy);
-            if (r == 0 || r < black_level-500) {
-                int32_t interpolated_pixel = GetInterpolatedPixel(&_rawInfo, _rawBuffer, cx, cy);
-                setRawPixel(&_rawInfo, _rawBuffer, cx, cy, interpolated_pixel);
-            }
-        };
+    free(lists);
+}
+
+- (void) fixDeadPixelsBasedOnPixelMap:(nullable MLVPixelMap*)pixelMap
+{
+    NSParameterAssert(_rawBuffer);
+    [self _makeBufferWritable];
 
+    const mlv_raw_kernels_t* kernels = [self _kernels];
+    if (!kernels) {
+        return;
+    }
 
-        [self _enumeratePixels:^(int32_t rx, int32_t ry, int32_t g1x, int32_t g1y, int32_t g2x, int32_t g2y, int32_t bx, int32_t by) {
-            findAndFixDeadPixel(rx, ry);
-            findAndFixDeadPixel(g1x, g1y);
-            findAndFixDeadPixel(g2x, g2y);
-            findAndFixDeadPixel(bx, by);
-        }];
+    struct raw_info* bufferInfo = self.bufferInfo;
+    void* rawBuffer = _rawBuffer;
+
+    const mlv_raw_pixel_t* pixels = NULL;
+    int32_t length;
+    if (pixelMap) {
+        pixels = (const mlv_raw_pixel_t*)pixelMap.pixelMapPtr;
+        length = (int32_t)pixelMap.numberOfPixels;
+    } else {
+        length = (_rawInfo.height >> 1 ) << 1;
+    }
+
+    mlv_bands_t bands = _MLVBandsWithHeight(length);
+    mlv_fix_list_t* lists = _MLVInterpolateDeadPixelsOfBands(kernels, bufferInfo, rawBuffer, bands, length, pixels);
+
+    /* bands of rows write their own rows. pixels of a map may be in any row, packed ones
+       of the same row share words and are written in order */
+    if (pixels && !_unpacked) {
+        for (size_t b=0; b<bands.count; b++) {
+            kernels->applyFixes(bufferInfo, rawBuffer, lists[b].fixes, lists[b].count);
+        }
+    } else {
+        _MLVApplyToBands(bands, length, ^(size_t band, int32_t first, int32_t end) {
+            kernels->applyFixes(bufferInfo, rawBuffer, lists[band].fixes, lists[band].count);
+        });
     }
+    _MLVFreeFixLists(lists, bands.count);
 }
 
 - (void) fixFocusPixelsWithType:(MLVRawImageFocusPixelsType)type withCropX:(UInt16)cropX :(UInt16)cropY
 {
     NSParameterAssert(_rawBuffer);
+    [self _makeBufferWritable];
+
+    struct raw_info* bufferInfo = self.bufferInfo;
 
     MLVPixelMap* focusPixelMapRed;
     MLVPixelMap* focusPixelMapBlue;
@@ -265,8 +431,8 @@
             int32_t y = pixel->y - cropY + xadj;
 
             if (x >= 0 && x < _rawInfo.width && y > 0 && y < _rawInfo.height) {
-                int32_t ir = GetInterpolatedPixel(&_rawInfo, _rawBuffer, x, y);
-                setRawPixel(&_rawInfo, _rawBuffer, x, y, ir);
+                int32_t ir = GetInterpolatedPixel(bufferInfo, _rawBuffer, x, y);
+                setRawPixel(bufferInfo, _rawBuffer, x, y, ir);
             }
         }];
 
@@ -275,8 +441,8 @@
             int32_t y = pixel->y - cropY +1-yadj;
 
             if (x >= 0 && x < _rawInfo.width && y > 0 && y < _rawInfo.height) {
-                int32_t ib = GetInterpolatedPixel(&_rawInfo, _rawBuffer, x, y);
-                setRawPixel(&_rawInfo, _rawBuffer, x, y, ib);
+                int32_t ib = GetInterpolatedPixel(bufferInfo, _rawBuffer, x, y);
+                setRawPixel(bufferInfo, _rawBuffer, x, y, ib);
             }
         }];
     }
@@ -286,99 +452,176 @@
 
 - (uint32_t) calculatedWhiteLevel
 {
-    __block int32_t white = _rawInfo.white_level * 2 / 3;
-    
-    [self _enumeratePixels:^(int32_t rx, int32_t ry, int32_t g1x, int32_t g1y, int32_t g2x, int32_t g2y, int32_t bx, int32_t by) {
-        white = MAX(white, GetRawPixel(&_rawInfo, _rawBuffer, rx, ry));
-        white = MAX(white, GetRawPixel(&_rawInfo, _rawBuffer, g1x, g1y));
-        white = MAX(white, GetRawPixel(&_rawInfo, _rawBuffer, g2x, g2y));
-        white = MAX(white, GetRawPixel(&_rawInfo, _rawBuffer, bx, by));
-    }];
+    const mlv_raw_kernels_t* kernels = [self _kernels];
+    if (!kernels) {
+        return _rawInfo.white_level;
+    }
+
+    struct raw_info* bufferInfo = self.bufferInfo;
+    void* rawBuffer = _rawBuffer;
+    int32_t h = (_rawInfo.height >> 1 ) << 1;
+
+    mlv_bands_t bands = _MLVBandsWithHeight(h);
+    int32_t* bandWhite = calloc(bands.count, sizeof(int32_t));
+
+    _MLVApplyToBands(bands, h, ^(size_t band, int32_t firstRow, int32_t endRow) {
+        bandWhite[band] = kernels->maxValue(bufferInfo, rawBuffer, firstRow, endRow);
+    });
+
+    int32_t white = _rawInfo.white_level * 2 / 3;
+    for (size_t b=0; b<bands.count; b++) {
+        white = MAX(white, bandWhite[b]);
+    }
+    free(bandWhite);
     
     return white;
 }
 
 
-- (NSData*) findVerticalBandingCoefficients {
-    int32_t range = 1 << 16;
-    double halfRange = (range>>1);
-    int32_t* histogram[8];
-    int32_t num[8];
-    
-    memset(num, 0, sizeof(num));
-    
+typedef struct {
+    int32_t*    histogram[8];
+    int32_t     num[8];
+    int32_t     black;
+    int32_t     white;
+    int32_t     cutoff_black;
+    unsigned    seed;
+} mlv_banding_stats_t;
+
+#define MLV_BANDING_RANGE (1 << 16)
+
+static void _MLVBandingStatsInit(mlv_banding_stats_t* stats, const struct raw_info* rawInfo)
+{
+    memset(stats->num, 0, sizeof(stats->num));
     for(int32_t i=0; i<8; i++) {
-        histogram[i] = (int32_t*)calloc(sizeof(int32_t), range);
+        stats->histogram[i] = (int32_t*)calloc(sizeof(int32_t), MLV_BANDING_RANGE);
     }
-    
-    register int32_t x, y;
-    register int32_t white = _rawInfo.white_level;
-    register int32_t black = _rawInfo.black_level;
-    register int32_t cutoff_black = 1 << MAX(0, (_rawInfo.bits_per_pixel-9));
-    
-    void (^addHistogramValue)(int32_t*[8], int32_t[8], int32_t, int32_t, int32_t, int32_t) = ^void(int32_t* histogram[8], int32_t num[8], int32_t offset, int32_t p1, int32_t p2, int32_t weight) {
-        if (MIN(p1,p2) < cutoff_black)
-            return; /* too noisy */
-        
-        if (MAX(p1,p2) > white / 1.5)
-            return; /* too bright */
-        
-        double p1f = p1 + (rand() % 1024) / 1024.0 - 0.5;
-        double p2f = p2 + (rand() % 1024) / 1024.0 - 0.5;
-        double factor = p1f / p2f;
-        double ev = log2(factor);
-        
-        int32_t histogramOffset = COERCE((int)(halfRange + ev * halfRange), 0, range-1);
-        histogram[offset][histogramOffset] += weight;
-        num[offset] += weight;
-    };
-    
-    
-    for (y=0; y<_rawInfo.height; y++) {
-        for (x=0; x<_rawInfo.width-8; x+=8) {
-            int32_t pa = GetRawPixel(&_rawInfo, _rawBuffer, x, y) - black;
-            int32_t pb = GetRawPixel(&_rawInfo, _rawBuffer, x+1, y) - black;
-            int32_t pc = GetRawPixel(&_rawInfo, _rawBuffer, x+2, y) - black;
-            int32_t pd = GetRawPixel(&_rawInfo, _rawBuffer, x+3, y) - black;
-            int32_t pe = GetRawPixel(&_rawInfo, _rawBuffer, x+4, y) - black;
-            int32_t pf = GetRawPixel(&_rawInfo, _rawBuffer, x+5, y) - black;
-            int32_t pg = GetRawPixel(&_rawInfo, _rawBuffer, x+6, y) - black;
-            int32_t ph = GetRawPixel(&_rawInfo, _rawBuffer, x+7, y) - black;
-            
-            int32_t pa2 = GetRawPixel(&_rawInfo, _rawBuffer, x+8, y) - black;
-            int32_t pb2 = GetRawPixel(&_rawInfo, _rawBuffer, x+9, y) - black;
-            
-            addHistogramValue(histogram, num, 2, pa, pc, 3);
-            addHistogramValue(histogram, num, 2, pa2, pc, 1);
-            
-            addHistogramValue(histogram, num, 3, pb, pd, 2);
-            addHistogramValue(histogram, num, 3, pb2, pd, 2);
-            
-            addHistogramValue(histogram, num, 4, pa, pe, 2);
-            addHistogramValue(histogram, num, 4, pa2, pe, 2);
-            
-            addHistogramValue(histogram, num, 5, pb, pf, 2);
-            addHistogramValue(histogram, num, 5, pb2, pf, 2);
-            
-            addHistogramValue(histogram, num, 6, pa, pg, 1);
-            addHistogramValue(histogram, num, 6, pa2, pg, 3);
-            
-            addHistogramValue(histogram, num, 7, pb, ph, 1);
-            addHistogramValue(histogram, num, 7, pb2, ph, 3);
+    stats->black = rawInfo->black_level;
+    stats->white = rawInfo->white_level;
+    stats->cutoff_black = 1 << MAX(0, (rawInfo->bits_per_pixel-9));
+    stats->seed = 0;
+}
+
+static void _MLVBandingStatsFree(mlv_banding_stats_t* stats)
+{
+    for(int32_t i=0; i<8; i++) {
+        free(stats->histogram[i]);
+    }
+}
+
+NS_INLINE void _MLVBandingStatsAddValue(mlv_banding_stats_t* stats, int32_t offset, int32_t p1, int32_t p2, int32_t weight)
+{
+    double halfRange = (MLV_BANDING_RANGE>>1);
+
+    if (MIN(p1,p2) < stats->cutoff_black)
+        return; /* too noisy */
+
+    if (MAX(p1,p2) > stats->white / 1.5)
+        return; /* too bright */
+
+    double p1f = p1 + (rand_r(&stats->seed) % 1024) / 1024.0 - 0.5;
+    double p2f = p2 + (rand_r(&stats->seed) % 1024) / 1024.0 - 0.5;
+    double factor = p1f / p2f;
+    double ev = log2(factor);
+
+    int32_t histogramOffset = COERCE((int)(halfRange + ev * halfRange), 0, MLV_BANDING_RANGE-1);
+    stats->histogram[offset][histogramOffset] += weight;
+    stats->num[offset] += weight;
+}
+
+static void _MLVBandingStatsAddRow(mlv_banding_stats_t* stats, const uint16_t* row, int32_t width)
+{
+    register int32_t black = stats->black;
+
+    for (int32_t x=0; x<width-8; x+=8) {
+        int32_t pa = row[x] - black;
+        int32_t pb = row[x+1] - black;
+        int32_t pc = row[x+2] - black;
+        int32_t pd = row[x+3] - black;
+        int32_t pe = row[x+4] - black;
+        int32_t pf = row[x+5] - black;
+        int32_t pg = row[x+6] - black;
+        int32_t ph = row[x+7] - black;
+
+        int32_t pa2 = row[x+8] - black;
+        int32_t pb2 = row[x+9] - black;
+
+        _MLVBandingStatsAddValue(stats, 2, pa, pc, 3);
+        _MLVBandingStatsAddValue(stats, 2, pa2, pc, 1);
+
+        _MLVBandingStatsAddValue(stats, 3, pb, pd, 2);
+        _MLVBandingStatsAddValue(stats, 3, pb2, pd, 2);
+
+        _MLVBandingStatsAddValue(stats, 4, pa, pe, 2);
+        _MLVBandingStatsAddValue(stats, 4, pa2, pe, 2);
+
+        _MLVBandingStatsAddValue(stats, 5, pb, pf, 2);
+        _MLVBandingStatsAddValue(stats, 5, pb2, pf, 2);
+
+        _MLVBandingStatsAddValue(stats, 6, pa, pg, 1);
+        _MLVBandingStatsAddValue(stats, 6, pa2, pg, 3);
+
+        _MLVBandingStatsAddValue(stats, 7, pb, ph, 1);
+        _MLVBandingStatsAddValue(stats, 7, pb2, ph, 3);
+    }
+}
+
+/* every band fills its own histograms, about one band per core as they are large. the dither of a
+   band is seeded by its first row, so the same frame always gives the same coefficients */
+static void _MLVCollectBandingStats(mlv_banding_stats_t* stats, const struct raw_info* rawInfo, const void* buffer, BOOL unpacked)
+{
+    int32_t width = rawInfo->width;
+    int32_t height = rawInfo->height;
+    mlv_bands_t bands = _MLVBandsWithHeightAndCount(height, _MLVCPUCount());
+    mlv_banding_stats_t* bandStats = calloc(bands.count, sizeof(mlv_banding_stats_t));
+
+    _MLVApplyToBands(bands, height, ^(size_t band, int32_t firstRow, int32_t endRow) {
+        mlv_banding_stats_t* s = &bandStats[band];
+        _MLVBandingStatsInit(s, rawInfo);
+        s->seed = firstRow;
+
+        uint16_t* row = (unpacked) ? NULL : malloc(width * sizeof(uint16_t));
+        for (int32_t y=firstRow; y<endRow; y++) {
+            if (unpacked) {
+                _MLVBandingStatsAddRow(s, (const uint16_t*)buffer + (size_t)y * width, width);
+            } else {
+                MLVUnpackRawRow(buffer + (size_t)y * rawInfo->pitch, row, width, rawInfo->bits_per_pixel);
+                _MLVBandingStatsAddRow(s, row, width);
+            }
+        }
+        free(row);
+    });
+
+    /* only columns 2 to 7 are compared with the reference columns */
+    for (size_t b=0; b<bands.count; b++) {
+        mlv_banding_stats_t* s = &bandStats[b];
+        if (s->histogram[0]) {
+            for (int32_t j=2; j<8; j++) {
+                for (int32_t k=0; k<MLV_BANDING_RANGE; k++) {
+                    stats->histogram[j][k] += s->histogram[j][k];
+                }
+                stats->num[j] += s->num[j];
+            }
+            _MLVBandingStatsFree(s);
         }
     }
-    
+    free(bandStats);
+}
+
+- (NSData*) _finishBandingStats:(mlv_banding_stats_t*)stats
+{
+    double halfRange = (MLV_BANDING_RANGE>>1);
+
     _verticalBandingCoeffs[0] = 1;
     _verticalBandingCoeffs[1] = 1;
     
     for (int32_t j = 2; j < 8; j++)
     {
-        if (num[j] < _rawInfo.frame_size / 128) continue;
+        if (stats->num[j] < _rawInfo.frame_size / 128) continue;
         int32_t t = 0;
-        for (int32_t k = 0; k < range; k++)
+        for (int32_t k = 0; k < MLV_BANDING_RANGE; k++)
         {
-            t += histogram[j][k];
-            if (t >= num[j]>>1) {
+            t += stats->histogram[j][k];
+            if (t >= stats->num[j]>>1) {
                 _verticalBandingCoeffs[j] = pow(2, (k-(halfRange))/(halfRange));
                 break;
             }
@@ -395,17 +638,24 @@
         }
     }
     
-    for(int32_t i=0; i<8; i++) {
-        free(histogram[i]);
-    }
-    
+    _MLVBandingStatsFree(stats);
+    return self.verticalBandingCoefficients;
+}
+
+- (NSData*) verticalBandingCoefficients {
     if (_verticalBandingCorrectionNeeded == 1) {
         return [NSData dataWithBytes:_verticalBandingCoeffs length:(sizeof(double)*8)];
     }
-    
     return nil;
 }
 
+- (NSData*) findVerticalBandingCoefficients {
+    mlv_banding_stats_t stats;
+    _MLVBandingStatsInit(&stats, &_rawInfo);
+    _MLVCollectBandingStats(&stats, &_rawInfo, _rawBuffer, _unpacked);
+    return [self _finishBandingStats:&stats];
+}
+
 - (void) fixVerticalBandingWithCoefficients:(NSData*)coefficients
 {
     if (_verticalBandingCorrectionNeeded == 0) {
@@ -422,55 +672,27 @@
     if (_verticalBandingCorrectionNeeded == 2) {
         return;
     }
-    
-    
-    register int32_t white = [self calculatedWhiteLevel];
-    register int32_t black = _rawInfo.black_level;
-    register int32_t cutoff_black = 1 << MAX(0, (_rawInfo.bits_per_pixel-8));
-    register int32_t x, y;
-    
-    for (y=0; y<_rawInfo.height; y++) {
-        for (x=0; x<_rawInfo.width; x+=8) {
-            //int32_t pa = GetRawPixel(&_rawInfo, _rawBuffer, x, y);
-            //int32_t pb = GetRawPixel(&_rawInfo, _rawBuffer, x+1, y);
-            int32_t pc = GetRawPixel(&_rawInfo, _rawBuffer, x+2, y);
-            int32_t pd = GetRawPixel(&_rawInfo, _rawBuffer, x+3, y);
-            int32_t pe = GetRawPixel(&_rawInfo, _rawBuffer, x+4, y);
-            int32_t pf = GetRawPixel(&_rawInfo, _rawBuffer, x+5, y);
-            int32_t pg = GetRawPixel(&_rawInfo, _rawBuffer, x+6, y);
-            int32_t ph = GetRawPixel(&_rawInfo, _rawBuffer, x+7, y);
-            
-            if (pc < white && pc > black + cutoff_black) {
-                pc = MIN((int32_t)((pc - black) * _verticalBandingCoeffs[2] + black), white);
-                setRawPixel(&_rawInfo, _rawBuffer, x+2, y, pc);
-            }
-            
-            if (pd < white && pd > black + cutoff_black) {
-                pd = MIN((int32_t)((pd - black) * _verticalBandingCoeffs[3] + black), white);
-                setRawPixel(&_rawInfo, _rawBuffer, x+3, y, pd);
-            }
-            
-            if (pe < white && pe > black + cutoff_black) {
-                pe = MIN((int32_t)((pe - black) * _verticalBandingCoeffs[4] + black), white);
-                setRawPixel(&_rawInfo, _rawBuffer, x+4, y, pe);
-            }
-            
-            if (pf < white && pf > black + cutoff_black) {
-                pf = MIN((int32_t)((pf - black) * _verticalBandingCoeffs[5] + black), white);
-                setRawPixel(&_rawInfo, _rawBuffer, x+5, y, pf);
-            }
-            
-            if (pg < white && pg > black + cutoff_black) {
-                pg = MIN((int32_t)((pg - black) * _verticalBandingCoeffs[6] + black), white);
-                setRawPixel(&_rawInfo, _rawBuffer, x+6, y, pg);
-            }
-            
-            if (ph < white && ph > black + cutoff_black) {
-                ph = MIN((int32_t)((ph - black) * _verticalBandingCoeffs[7] + black), white);
-                setRawPixel(&_rawInfo, _rawBuffer, x+7, y, ph);
-            }
-        }
+
+    const mlv_raw_kernels_t* kernels = [self _kernels];
+    if (!kernels) {
+        return;
     }
+
+    [self _makeBufferWritable];
+    
+    struct raw_info* bufferInfo = self.bufferInfo;
+    int32_t white = [self calculatedWhiteLevel];
+    int32_t low = _rawInfo.black_level + (1 << MAX(0, (_rawInfo.bits_per_pixel-8)));
+    void* rawBuffer = _rawBuffer;
+    int32_t height = _rawInfo.height;
+
+    double coeffs[8];
+    memcpy(coeffs, _verticalBandingCoeffs, sizeof(coeffs));
+
+    /* only the pixels of a row are touched, bands are independent */
+    _MLVApplyToBands(_MLVBandsWithHeight(height), height, ^(size_t band, int32_t firstRow, int32_t endRow) {
+        kernels->fixVerticalBanding(bufferInfo, rawBuffer, firstRow, endRow, coeffs, low, white);
+    });
 }
 
 #pragma mark - Bit depth conversion
@@ -483,58 +705,65 @@
     new_raw_info.frame_size = new_raw_info.pitch * new_raw_info.height;
 
 
-    void* new_raw_buffer = malloc(new_raw_info.frame_size);
     int32_t lessBits = _rawInfo.bits_per_pixel-bitsPerPixel;
     int32_t moreBits = bitsPerPixel - _rawInfo.bits_per_pixel;
 
-    if (moreBits > 0) {
-        [self _enumeratePixels:^(int32_t rx, int32_t ry, int32_t g1x, int32_t g1y, int32_t g2x, int32_t g2y, int32_t bx, int32_t by) {
-            int32_t r = GetRawPixel(&_rawInfo, _rawBuffer, rx, ry);
-            int32_t g1 = GetRawPixel(&_rawInfo, _rawBuffer, g1x, g1y);
-            int32_t g2 = GetRawPixel(&_rawInfo, _rawBuffer, g2x, g2y);
-            int32_t b = GetRawPixel(&_rawInfo, _rawBuffer, bx, by);
-
-            r =  r << moreBits;
-            g1 = g1 << moreBits;
-            g2 = g2 << moreBits;
-            b = b << moreBits;
-
-            setRawPixel(&new_raw_info, new_raw_buffer, rx, ry, r);
-            setRawPixel(&new_raw_info, new_raw_buffer, g1x, g1y, g1);
-            setRawPixel(&new_raw_info, new_raw_buffer, g2x, g2y, g2);
-            setRawPixel(&new_raw_info, new_raw_buffer, bx, by, b);
-        }];
+    if (moreBits <= 0 && lessBits <= 0) {
+        return NULL;
+    }
 
+    int32_t width = _rawInfo.width;
+    BOOL unpacked = _unpacked;
+
+    /* unpacked images stay unpacked, the samples are only shifted */
+    void* new_raw_buffer = (unpacked) ? malloc(width * _rawInfo.height * sizeof(uint16_t)) : malloc(new_raw_info.frame_size);
+
+    void* rawBuffer = _rawBuffer;
+    int32_t pitch = _rawInfo.pitch;
+    int32_t bitsPerPixelIn = _rawInfo.bits_per_pixel;
+
+    _MLVApplyToBands(_MLVBandsWithHeight(_rawInfo.height), _rawInfo.height, ^(size_t band, int32_t firstRow, int32_t endRow) {
+        /* packed rows go through one unpacked row per band */
+        uint16_t* rowBuffer = (unpacked) ? NULL : malloc(width * sizeof(uint16_t));
+
+        for (int32_t y=firstRow; y<endRow; y++) {
+            const uint16_t* src;
+            uint16_t* row;
+            if (unpacked) {
+                src = (uint16_t*)rawBuffer + y * width;
+                row = (uint16_t*)new_raw_buffer + y * width;
+            } else {
+                MLVUnpackRawRow(rawBuffer + y * pitch, rowBuffer, width, bitsPerPixelIn);
+                src = row = rowBuffer;
+            }
+
+            if (moreBits > 0) {
+                for (int32_t x=0; x<width; x++) {
+                    row[x] = src[x] << moreBits;
+                }
+            } else {
+                for (int32_t x=0; x<width; x++) {
+                    row[x] = src[x] >> lessBits;
+                }
+            }
+
+            if (!unpacked) {
+                MLVPackRawRow(row, new_raw_buffer + y * new_raw_info.pitch, width, bitsPerPixel, kMLVRawPackingLittleEndian);
+            }
+        }
+        free(rowBuffer);
+    });
+
+    if (moreBits > 0) {
         new_raw_info.white_level = new_raw_info.white_level << moreBits;
         new_raw_info.black_level = new_raw_info.black_level << moreBits;
-    }
-    else if (lessBits > 0) {
-        [self _enumeratePixels:^(int32_t rx, int32_t ry, int32_t g1x, int32_t g1y, int32_t g2x, int32_t g2y, int32_t bx, int32_t by) {
-            int32_t r = GetRawPixel(&_rawInfo, _rawBuffer, rx, ry);
-            int32_t g1 = GetRawPixel(&_rawInfo, _rawBuffer, g1x, g1y);
-            int32_t g2 = GetRawPixel(&_rawInfo, _rawBuffer, g2x, g2y);
-            int32_t b = GetRawPixel(&_rawInfo, _rawBuffer, bx, by);
-
-            r =  r >> lessBits;
-            g1 = g1 >> lessBits;
-            g2 = g2 >> lessBits;
-            b = b >> lessBits;
-
-            setRawPixel(&new_raw_info, new_raw_buffer, rx, ry, r);
-            setRawPixel(&new_raw_info, new_raw_buffer, g1x, g1y, g1);
-            setRawPixel(&new_raw_info, new_raw_buffer, g2x, g2y, g2);
-            setRawPixel(&new_raw_info, new_raw_buffer, bx, by, b);
-        }];
-
+    } else {
         new_raw_info.white_level = new_raw_info.white_level >> lessBits;
         new_raw_info.black_level = new_raw_info.black_level >> lessBits;
     }
-    else {
-        free(new_raw_buffer);
-        return NULL;
-    }
 
-    MLVRawImage* rawImage = [[MLVRawImage alloc] initWithInfo:new_raw_info buffer:new_raw_buffer compressed:NO];
+    MLVRawImage* rawImage = (unpacked) ? [[MLVRawImage alloc] initWithInfo:new_raw_info unpackedBuffer:new_raw_buffer]
+                                       : [[MLVRawImage alloc] initWithInfo:new_raw_info buffer:new_raw_buffer compressed:NO];
     [self _copyMetadataToRawImage:rawImage];
     return rawImage;
 }
@@ -553,9 +782,224 @@
     rawImage.cameraMatrices = self.cameraMatrices;
 }
 
+#pragma mark - Processing
+
+- (void) processWithCorrections:(MLVRawImageCorrections)corrections
+                focusPixelsType:(MLVRawImageFocusPixelsType)focusPixelsType cropX:(UInt16)cropX cropY:(UInt16)cropY
+    verticalBandingCoefficients:(nullable NSData*)coefficients
+                   bitsPerPixel:(int32_t)bitsPerPixel
+{
+    if (_compressed) {
+        return;
+    }
+
+    if ((corrections & kMLVRawImageCorrectionsVerticalBanding) && coefficients && _verticalBandingCorrectionNeeded == 0) {
+        NSAssert(coefficients.length == sizeof(double)*8, @"coefficients have invalid length");
+        memcpy(_verticalBandingCoeffs, coefficients.bytes, sizeof(double)*8);
+        _verticalBandingCorrectionNeeded = 1;
+    }
+
+    /* truncated frame, it can't be unpacked and keeps its bit depth */
+    if (!_unpacked && (int64_t)_rawInfo.pitch * _rawInfo.height > _rawInfo.frame_size) {
+        if (corrections & kMLVRawImageCorrectionsFocusPixels) {
+            [self fixFocusPixelsWithType:focusPixelsType withCropX:cropX :cropY];
+        }
+        if (corrections & kMLVRawImageCorrectionsDeadPixels) {
+            [self fixDeadPixelsBasedOnPixelMap:nil];
+        }
+        if (corrections & kMLVRawImageCorrectionsVerticalBanding) {
+            [self fixVerticalBandingWithCoefficients:coefficients];
+        }
+        return;
+    }
+
+    /* pass 1: unpack, focus pixels are few and fixed right away */
+    [self unpackBuffer];
+
+    if (corrections & kMLVRawImageCorrectionsFocusPixels) {
+        [self fixFocusPixelsWithType:focusPixelsType withCropX:cropX :cropY];
+    }
+
+    const mlv_raw_kernels_t* kernels = [self _kernels];
+    struct raw_info* bufferInfo = self.bufferInfo;
+    uint16_t* samples = _rawBuffer;
+    int32_t width = _rawInfo.width;
+    int32_t height = _rawInfo.height;
+    int32_t h = (height >> 1 ) << 1;
+    int32_t cacheRows = MAX(8, (int32_t)(MLV_BAND_BYTES / (width * sizeof(uint16_t))) & ~1);
+    mlv_bands_t bands = _MLVBandsWithHeight(height);
+
+    /* dead pixels read rows of the neighbouring bands, they are all interpolated before any is written */
+    BOOL fixDeadPixels = (corrections & kMLVRawImageCorrectionsDeadPixels) > 0;
+    mlv_fix_list_t* deadPixels = (fixDeadPixels) ? _MLVInterpolateDeadPixelsOfBands(kernels, bufferInfo, samples, bands, h, NULL) : NULL;
+
+    /* pass 2: the banding statistics and white level are taken from the repaired frame,
+       as the separate corrections do */
+    int32_t maxValue = 0;
+    if (corrections & kMLVRawImageCorrectionsVerticalBanding) {
+        int32_t* bandMax = calloc(bands.count, sizeof(int32_t));
+        _MLVApplyToBands(bands, height, ^(size_t band, int32_t firstRow, int32_t endRow) {
+            if (deadPixels) {
+                kernels->applyFixes(bufferInfo, samples, deadPixels[band].fixes, deadPixels[band].count);
+            }
+            if (firstRow < h) {
+                bandMax[band] = kernels->maxValue(bufferInfo, samples, firstRow, MIN(endRow, h));
+            }
+        });
+
+        for (size_t b=0; b<bands.count; b++) {
+            maxValue = MAX(maxValue, bandMax[b]);
+        }
+        free(bandMax);
+
+        if (deadPixels) {
+            _MLVFreeFixLists(deadPixels, bands.count);
+            deadPixels = NULL;
+        }
+
+        if (_verticalBandingCorrectionNeeded == 0) {
+            mlv_banding_stats_t bandingStats;
+            _MLVBandingStatsInit(&bandingStats, &_rawInfo);
+            _MLVCollectBandingStats(&bandingStats, &_rawInfo, samples, YES);
+            [self _finishBandingStats:&bandingStats];
+        }
+    }
+
+    /* pass 3: dead pixels unless written above, then banding, bit depth and highlights of every band while its rows are cached */
+    BOOL fixBanding = (corrections & kMLVRawImageCorrectionsVerticalBanding) && _verticalBandingCorrectionNeeded == 1;
+    int32_t white = MAX(maxValue, _rawInfo.white_level * 2 / 3);
+    int32_t low = _rawInfo.black_level + (1 << MAX(0, (_rawInfo.bits_per_pixel-8)));
+    double* coeffs = _verticalBandingCoeffs;
+
+    struct raw_info finalInfo = _rawInfo;
+    int32_t moreBits = 0;
+    int32_t lessBits = 0;
+    if (bitsPerPixel > 0 && bitsPerPixel != _rawInfo.bits_per_pixel) {
+        moreBits = MAX(0, bitsPerPixel - _rawInfo.bits_per_pixel);
+        lessBits = MAX(0, _rawInfo.bits_per_pixel - bitsPerPixel);
+        finalInfo.bits_per_pixel = bitsPerPixel;
+        finalInfo.pitch = _rawInfo.width * bitsPerPixel >> 3;
+        finalInfo.frame_size = finalInfo.pitch * finalInfo.height;
+        finalInfo.white_level = (moreBits > 0) ? finalInfo.white_level << moreBits : finalInfo.white_level >> lessBits;
+        finalInfo.black_level = (moreBits > 0) ? finalInfo.black_level << moreBits : finalInfo.black_level >> lessBits;
+    }
+
+    CGContextRef highlightContext = NULL;
+    uint8_t* highlightPtr = NULL;
+    size_t halfW = width/2;
+    if (corrections & kMLVRawImageCorrectionsHighlightMap) {
+        CGColorSpaceRef colorSpace = CGColorSpaceCreateWithName(kCGColorSpaceGenericGrayGamma2_2);
+        highlightContext = CGBitmapContextCreate(nil, halfW, height/2, 8, halfW, colorSpace, kCGImageAlphaNone);
+        CGColorSpaceRelease(colorSpace);
+        highlightPtr = CGBitmapContextGetData(highlightContext);
+    }
+
+    void (^correctRows)(int32_t, int32_t) = ^(int32_t y0, int32_t y1) {
+        for (int32_t y=y0; y<y1; y++) {
+            uint16_t* row = samples + (size_t)y * width;
+
+            if (fixBanding) {
+                kernels->fixVerticalBanding(bufferInfo, samples, y, y+1, coeffs, low, white);
+            }
+
+            if (moreBits > 0) {
+                for (int32_t x=0; x<width; x++) {
+                    row[x] = row[x] << moreBits;
+                }
+            } else if (lessBits > 0) {
+                for (int32_t x=0; x<width; x++) {
+                    row[x] = row[x] >> lessBits;
+                }
+            }
+        }
+    };
+
+    struct raw_info* finalRawInfo = &finalInfo;
+    void (^highlightRows)(int32_t, int32_t) = ^(int32_t y0, int32_t y1) {
+        kernels->highlightRows(bufferInfo, samples, y0, y1, highlightPtr, halfW, finalRawInfo);
+    };
+
+    BOOL correct = fixBanding || moreBits > 0 || lessBits > 0;
+
+    /* the other stages only touch the rows of their band */
+    _MLVApplyToBands(bands, height, ^(size_t band, int32_t firstRow, int32_t endRow) {
+        if (deadPixels) {
+            kernels->applyFixes(bufferInfo, samples, deadPixels[band].fixes, deadPixels[band].count);
+        }
+
+        for (int32_t r0=firstRow; r0<endRow; r0+=cacheRows) {
+            int32_t r1 = MIN(r0 + cacheRows, endRow);
+            if (correct) {
+                correctRows(r0, r1);
+            }
+            if (highlightPtr) {
+                highlightRows(r0, r1);
+            }
+        }
+    });
+
+    if (deadPixels) {
+        _MLVFreeFixLists(deadPixels, bands.count);
+    }
+
+    /* the thumbnail only samples a few rows of the final frame */
+    NSMutableData* thumbnailData = nil;
+    if (corrections & kMLVRawImageCorrectionsThumbnail) {
+        thumbnailData = [[NSMutableData alloc] initWithLength:dng_th_width*dng_th_height*3];
+        kernels->thumbnail(bufferInfo, samples, thumbnailData.mutableBytes, dng_th_width, dng_th_height, &finalInfo);
+    }
+
+    if (moreBits > 0 || lessBits > 0) {
+        _rawInfo.bits_per_pixel = finalInfo.bits_per_pixel;
+        _rawInfo.pitch = finalInfo.pitch;
+        _rawInfo.frame_size = finalInfo.frame_size;
+        _rawInfo.white_level = finalInfo.white_level;
+        _rawInfo.black_level = finalInfo.black_level;
+    }
+
+    if (highlightContext) {
+        CGImageRef imageRef = CGBitmapContextCreateImage(highlightContext);
+        CGContextRelease(highlightContext);
+
+        NSBitmapImageRep* bitmapRep = [[NSBitmapImageRep alloc] initWithCGImage:imageRef];
+        CGImageRelease(imageRef);
+        _highlightMap = [bitmapRep TIFFRepresentation];
+    }
+
+    _thumbnailData = thumbnailData;
+}
+
+- (NSData*) _thumbnailData {
+    return _thumbnailData;
+}
+
 #pragma mark - Decomression
 
 - (MLVRawImage*) rawImageByDecompressingBuffer
+{
+    return [self rawImageByDecompressingBufferToLayout:kMLVRawImageLayoutUnpacked];
+}
+
+/* packs the rows over their own samples. a packed row only overlaps samples of the rows before it
+   and its own, which are copied out first */
+static BOOL _MLVPackSamplesInPlace(uint16_t* samples, const struct raw_info* rawInfo)
+{
+    size_t width = rawInfo->width;
+    size_t rowLength = MLVRawPackedRowLength(width, rawInfo->bits_per_pixel);
+    if (rowLength != (size_t)rawInfo->pitch) {
+        return NO;
+    }
+
+    uint16_t* row = malloc(width * sizeof(uint16_t));
+    for (int32_t y=0; y<rawInfo->height; y++) {
+        memcpy(row, samples + y * width, width * sizeof(uint16_t));
+        MLVPackRawRow(row, (uint8_t*)samples + y * rowLength, width, rawInfo->bits_per_pixel, kMLVRawPackingLittleEndian);
+    }
+    free(row);
+    return YES;
+}
+
+- (MLVRawImage*) rawImageByDecompressingBufferToLayout:(MLVRawImageLayout)layout
 {
 #ifdef DEBUG
     NSDate* startDate = [NSDate date];
@@ -569,12 +1013,17 @@
     
     
     int ret = lj92_open(&lj92_handle, (uint8_t *)_rawBuffer, (int)_rawInfo.frame_size, &lj92_width, &lj92_height, &lj92_bitdepth, &lj92_components);
-    int32_t out_size = lj92_width * lj92_height * lj92_components * sizeof(uint16_t);
-    
     if(ret != LJ92_ERROR_NONE) {
         return nil;
     }
     
+    size_t out_size = (size_t)lj92_width * lj92_height * lj92_components * sizeof(uint16_t);
+    if (out_size < _rawInfo.width * _rawInfo.height * sizeof(uint16_t)) {
+        lj92_close(lj92_handle);
+        return nil;
+    }
+    
+    /* the decoder writes plain 16 bit rows, the working layout. other layouts are made in the same buffer */
     uint16_t *decompressedRawBuffer = malloc(out_size);
     ret = lj92_decode(lj92_handle, decompressedRawBuffer, lj92_width, 0, NULL, 0);
     
@@ -585,65 +1034,87 @@
         return nil;
     }
     
-    
-    struct raw_info decompressedRawInfo = _rawInfo;
-    decompressedRawInfo.frame_size = out_size;
-    decompressedRawInfo.bits_per_pixel = 16;
-    decompressedRawInfo.pitch = decompressedRawInfo.width * sizeof(uint16_t);
-    
-    int32_t newFrameSize = (lj92_width * lj92_height * lj92_components * 14) >> 3;
-    void* newRawBuffer = malloc(newFrameSize);
-    
     struct raw_info newRawInfo = _rawInfo;
-    newRawInfo.frame_size = newFrameSize;
-    
-    register int32_t yadj, xadj, gadj;
-    yadj = (_rawInfo.cfa_pattern == 0x01000201) ? 1 : 0;
-    xadj = (_rawInfo.cfa_pattern == 0x01020001) ? 1 : 0;
-    gadj = (_rawInfo.cfa_pattern == 0x02010100) ? 0 : 1;
+    newRawInfo.frame_size = newRawInfo.pitch * newRawInfo.height;
     
-    
-    dispatch_apply(_rawInfo.height >> 1, dispatch_get_global_queue(0, 0), ^(size_t i) {
-        int32_t y = (int32_t)i << 1;
-        
-        register int32_t x;
-        for (x=0; x<_rawInfo.width; x+=2) {
-            
-            int32_t rx = x+xadj;
-            int32_t ry = y+yadj;
-            
-            int32_t g1x = x+1-gadj;
-            int32_t g1y = y;
-            
-            int32_t g2x = x+gadj;
-            int32_t g2y = y+1;
-            
-            int32_t bx = x+1-xadj;
-            int32_t by = y+1-yadj;
-            
-            int32_t r = GetRawPixel(&decompressedRawInfo, decompressedRawBuffer, rx, ry);
-            setRawPixel(&newRawInfo, newRawBuffer, rx, ry, r);
-            
-            int32_t g1 = GetRawPixel(&decompressedRawInfo, decompressedRawBuffer, g1x, g1y);
-            setRawPixel(&newRawInfo, newRawBuffer, g1x, g1y, g1);
-            
-            int32_t g2 = GetRawPixel(&decompressedRawInfo, decompressedRawBuffer, g2x, g2y);
-            setRawPixel(&newRawInfo, newRawBuffer, g2x, g2y, g2);
-            
-            int32_t b = GetRawPixel(&decompressedRawInfo, decompressedRawBuffer, bx, by);
-            setRawPixel(&newRawInfo, newRawBuffer, bx, by, b);
+    MLVRawImage* rawImage;
+    if (layout == kMLVRawImageLayoutPacked) {
+        if (!_MLVPackSamplesInPlace(decompressedRawBuffer, &newRawInfo)) {
+            ErrLog(@"can't pack %d bit rows of %d pixels", newRawInfo.bits_per_pixel, newRawInfo.width);
+            free(decompressedRawBuffer);
+            return nil;
         }
-    });
-    
-    
-    free(decompressedRawBuffer);
-    
-    MLVRawImage* rawImage = [[MLVRawImage alloc] initWithInfo:newRawInfo buffer:newRawBuffer compressed:NO];
+        void* packedRawBuffer = realloc(decompressedRawBuffer, newRawInfo.frame_size);
+        rawImage = [[MLVRawImage alloc] initWithInfo:newRawInfo buffer:(packedRawBuffer) ? packedRawBuffer : decompressedRawBuffer compressed:NO];
+    } else {
+        rawImage = [[MLVRawImage alloc] initWithInfo:newRawInfo unpackedBuffer:decompressedRawBuffer];
+    }
 #ifdef DEBUG
     DebugLog(@"decompress done in %lf", -[startDate timeIntervalSinceNow]);
 #endif
     return rawImage;
 }
 
+#pragma mark - Compression
+
+- (MLVRawImage*) rawImageByCompressingBuffer
+{
+    if (_compressed) {
+        return self;
+    }
+
+    /* truncated frame, there are no samples for its last rows */
+    if (!_unpacked && (int64_t)_rawInfo.pitch * _rawInfo.height > _rawInfo.frame_size) {
+        ErrLog(@"can't compress truncated frame: %d of %d bytes", _rawInfo.frame_size, _rawInfo.pitch * _rawInfo.height);
+        return nil;
+    }
+
+#ifdef DEBUG
+    NSDate* startDate = [NSDate date];
+#endif
+
+    int32_t width = _rawInfo.width;
+    int32_t height = _rawInfo.height;
+    uint16_t* samples = _rawBuffer;
+
+    if (!_unpacked) {
+        samples = malloc(width * height * sizeof(uint16_t));
+        void* rawBuffer = _rawBuffer;
+        struct raw_info rawInfo = _rawInfo;
+        _MLVApplyToBands(_MLVBandsWithHeight(height), height, ^(size_t band, int32_t firstRow, int32_t endRow) {
+            for (int32_t y=firstRow; y<endRow; y++) {
+                MLVUnpackRawRow(rawBuffer + y * rawInfo.pitch, samples + y * width, width, rawInfo.bits_per_pixel);
+            }
+        });
+    }
+
+    /* two components of half the width, predictor 1 then predicts every sample from the same bayer color.
+       one restart interval per band, they are encoded in parallel */
+    int components = (width % 2 == 0) ? 2 : 1;
+    uint8_t* encoded = NULL;
+    int encodedLength = 0;
+    int ret = lj92_encode(samples, width / components, height, _rawInfo.bits_per_pixel, components, width, 1,
+                          _MLVBandsWithHeight(height).rows, &encoded, &encodedLength);
+
+    if (!_unpacked) {
+        free(samples);
+    }
+
+    if (ret != LJ92_ERROR_NONE) {
+        ErrLog(@"can't compress frame: %d", ret);
+        return nil;
+    }
+
+    struct raw_info newRawInfo = _rawInfo;
+    newRawInfo.frame_size = encodedLength;
+
+    MLVRawImage* rawImage = [[MLVRawImage alloc] initWithInfo:newRawInfo buffer:encoded compressed:YES];
+    [self _copyMetadataToRawImage:rawImage];
+#ifdef DEBUG
+    DebugLog(@"compress done in %lf", -[startDate timeIntervalSinceNow]);
+#endif
+    return rawImage;
+}
+
 
 @end
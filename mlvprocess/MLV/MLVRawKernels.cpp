@@ -0,0 +1,368 @@
+/*
+ * Copyright (C) 2017 Martin Hering
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include "MLVRawKernels.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__clang__)
+#define MLV_UNROLL _Pragma("clang loop unroll(full)")
+#else
+#define MLV_UNROLL
+#endif
+
+/* eight pixels of every bit depth fill Bits bytes */
+#define BLOCK_PIXELS 8
+
+namespace {
+
+/*
+ * Sample access of one row. Packed rows are little endian 16 bit words with the pixels
+ * starting at the most significant bit, see raw_pixblock. Inside a block of eight
+ * pixels the bit positions are constants once the block loop is unrolled.
+ */
+template <int Bits>
+struct RawRow {
+    static const uint32_t Mask = (1u << Bits) - 1;
+
+    static inline int32_t get(const uint8_t* block, int32_t i) {
+        const uint16_t* words = (const uint16_t*)block;
+        uint32_t bit = (uint32_t)i * Bits;
+        uint32_t offset = bit & 15;
+        uint32_t v = (uint32_t)words[bit >> 4] << 16;
+        if (offset + Bits > 16) {
+            v |= words[(bit >> 4) + 1];
+        }
+        return (v >> (32 - offset - Bits)) & Mask;
+    }
+
+    static inline void set(uint8_t* block, int32_t i, int32_t value) {
+        uint16_t* words = (uint16_t*)block;
+        uint32_t bit = (uint32_t)i * Bits;
+        uint32_t offset = bit & 15;
+        uint32_t shift = 32 - offset - Bits;
+        bool spans = offset + Bits > 16;
+
+        uint32_t v = (uint32_t)words[bit >> 4] << 16;
+        if (spans) {
+            v |= words[(bit >> 4) + 1];
+        }
+        v = (v & ~(Mask << shift)) | (((uint32_t)value & Mask) << shift);
+        words[bit >> 4] = v >> 16;
+        if (spans) {
+            words[(bit >> 4) + 1] = v & 0xFFFF;
+        }
+    }
+};
+
+template <>
+struct RawRow<16> {
+    static inline int32_t get(const uint8_t* block, int32_t i) {
+        return ((const uint16_t*)block)[i];
+    }
+
+    static inline void set(uint8_t* block, int32_t i, int32_t value) {
+        ((uint16_t*)block)[i] = value;
+    }
+};
+
+template <int Bits>
+static inline const uint8_t* _block(const struct raw_info* info, const void* buffer, int32_t x, int32_t y) {
+    return (const uint8_t*)buffer + (size_t)y * info->pitch + (x / BLOCK_PIXELS) * Bits;
+}
+
+template <int Bits>
+static inline int32_t _pixel(const struct raw_info* info, const void* buffer, int32_t x, int32_t y) {
+    return RawRow<Bits>::get(_block<Bits>(info, buffer, x, y), x % BLOCK_PIXELS);
+}
+
+template <int Bits>
+static inline void _setPixel(const struct raw_info* info, void* buffer, int32_t x, int32_t y, int32_t value) {
+    RawRow<Bits>::set((uint8_t*)_block<Bits>(info, buffer, x, y), x % BLOCK_PIXELS, value);
+}
+
+/* calls op(x, value) for every pixel of a row, whole blocks first */
+template <int Bits, typename Op>
+static inline void _forEachPixel(const uint8_t* row, int32_t width, Op op) {
+    int32_t x = 0;
+    for (; x + BLOCK_PIXELS <= width; x += BLOCK_PIXELS) {
+        const uint8_t* block = row + (x / BLOCK_PIXELS) * Bits;
+        MLV_UNROLL
+        for (int32_t i=0; i<BLOCK_PIXELS; i++) {
+            op(x + i, RawRow<Bits>::get(block, i));
+        }
+    }
+    for (; x<width; x++) {
+        op(x, RawRow<Bits>::get(row + (x / BLOCK_PIXELS) * Bits, x % BLOCK_PIXELS));
+    }
+}
+
+static inline bool _isDead(int32_t r, int32_t deadLevel) {
+    return r == 0 || r < deadLevel;
+}
+
+/* average of the same color neighbors that are not dead themselves */
+template <int Bits>
+static inline int32_t _interpolatedPixel(const struct raw_info* info, const void* buffer, int32_t cx, int32_t cy) {
+    int32_t deadLevel = info->black_level - 500;
+    int32_t neighbors = 0;
+    int32_t numNeighbors = 0;
+
+    for (int32_t x=cx-2; x<=cx+2; x+=2) {
+        for (int32_t y=cy-2; y<=cy+2; y+=2) {
+            if (x<0 || y<0 || x>=info->width || y>=info->height || (x==cx && y==cy)) {
+                continue;
+            }
+            int32_t r = _pixel<Bits>(info, buffer, x, y);
+            if (r < deadLevel) {
+                continue;
+            }
+            neighbors += r;
+            numNeighbors++;
+        }
+    }
+    return (numNeighbors > 0) ? neighbors / numNeighbors : 0;
+}
+
+/* same mapping as RawTo8BitSRGB with the white level term of a row range precomputed */
+struct SRGBMapping {
+    int32_t black;
+    float   max;
+
+    SRGBMapping(const struct raw_info* levels)
+        : black(levels->black_level), max(log2f(levels->white_level - levels->black_level) - 5) {}
+
+    inline uint8_t operator()(int32_t raw, int32_t wb) const {
+        int32_t d = raw - black;
+        float ev = log2f(d > 1 ? d : 1) + wb - 5;
+        int32_t out = ev * 255 / max;
+        return (uint8_t)(out < 0 ? 0 : (out > 255 ? 255 : out));
+    }
+};
+
+/*
+ * The bayer patterns, as read by the thumbnail code
+ *  0x02010100  0x01000201  0x01020001
+ *      R G         G B         G R
+ *      G B         R G         B G
+ * 0x00010102 is sampled like 0x02010100.
+ */
+template <uint32_t Pattern>
+struct Bayer {
+    static const int32_t RedX = (Pattern == 0x01020001) ? 1 : 0;
+    static const int32_t RedY = (Pattern == 0x01000201) ? 1 : 0;
+};
+
+#pragma mark - Kernels
+
+template <int Bits>
+static size_t _findDeadPixels(const struct raw_info* info, const void* buffer, int32_t y0, int32_t y1, mlv_raw_pixel_t* pixels) {
+    int32_t deadLevel = info->black_level - 500;
+    size_t count = 0;
+    for (int32_t y=y0; y<y1; y++) {
+        const uint8_t* row = (const uint8_t*)buffer + (size_t)y * info->pitch;
+        _forEachPixel<Bits>(row, info->width, [&](int32_t x, int32_t r) {
+            if (_isDead(r, deadLevel)) {
+                pixels[count].x = x;
+                pixels[count].y = y;
+                count++;
+            }
+        });
+    }
+    return count;
+}
+
+template <int Bits>
+static size_t _interpolateDeadPixels(const struct raw_info* info, const void* buffer, int32_t y0, int32_t y1, mlv_raw_fix_t* fixes) {
+    int32_t deadLevel = info->black_level - 500;
+    size_t count = 0;
+    for (int32_t y=y0; y<y1; y++) {
+        const uint8_t* row = (const uint8_t*)buffer + (size_t)y * info->pitch;
+        _forEachPixel<Bits>(row, info->width, [&](int32_t x, int32_t r) {
+            if (_isDead(r, deadLevel)) {
+                fixes[count].x = x;
+                fixes[count].y = y;
+                fixes[count].value = _interpolatedPixel<Bits>(info, buffer, x, y);
+                count++;
+            }
+        });
+    }
+    return count;
+}
+
+template <int Bits>
+static size_t _interpolateDeadPixelList(const struct raw_info* info, const void* buffer, const mlv_raw_pixel_t* pixels, size_t count, mlv_raw_fix_t* fixes) {
+    int32_t deadLevel = info->black_level - 500;
+    size_t numberOfFixes = 0;
+    for (size_t i=0; i<count; i++) {
+        int32_t x = pixels[i].x;
+        int32_t y = pixels[i].y;
+        if (_isDead(_pixel<Bits>(info, buffer, x, y), deadLevel)) {
+            fixes[numberOfFixes].x = x;
+            fixes[numberOfFixes].y = y;
+            fixes[numberOfFixes].value = _interpolatedPixel<Bits>(info, buffer, x, y);
+            numberOfFixes++;
+        }
+    }
+    return numberOfFixes;
+}
+
+template <int Bits>
+static void _applyFixes(const struct raw_info* info, void* buffer, const mlv_raw_fix_t* fixes, size_t count) {
+    for (size_t i=0; i<count; i++) {
+        _setPixel<Bits>(info, buffer, fixes[i].x, fixes[i].y, fixes[i].value);
+    }
+}
+
+template <int Bits>
+static int32_t _maxValue(const struct raw_info* info, const void* buffer, int32_t y0, int32_t y1) {
+    int32_t maxValue = 0;
+    for (int32_t y=y0; y<y1; y++) {
+        const uint8_t* row = (const uint8_t*)buffer + (size_t)y * info->pitch;
+        _forEachPixel<Bits>(row, info->width, [&](int32_t, int32_t r) {
+            maxValue = (r > maxValue) ? r : maxValue;
+        });
+    }
+    return maxValue;
+}
+
+template <int Bits>
+static void _fixVerticalBanding(const struct raw_info* info, void* buffer, int32_t y0, int32_t y1, const double* coefficients, int32_t low, int32_t white) {
+    int32_t black = info->black_level;
+    int32_t blocks = info->width / BLOCK_PIXELS;
+    int32_t tail = info->width % BLOCK_PIXELS;
+
+    auto fix = [&](uint8_t* block, int32_t i) {
+        int32_t p = RawRow<Bits>::get(block, i);
+        if (p < white && p > low) {
+            int32_t scaled = (int32_t)((p - black) * coefficients[i] + black);
+            RawRow<Bits>::set(block, i, (scaled < white) ? scaled : white);
+        }
+    };
+
+    for (int32_t y=y0; y<y1; y++) {
+        uint8_t* row = (uint8_t*)buffer + (size_t)y * info->pitch;
+        for (int32_t b=0; b<blocks; b++) {
+            uint8_t* block = row + b * Bits;
+            /* the first two columns are the reference */
+            MLV_UNROLL
+            for (int32_t i=2; i<BLOCK_PIXELS; i++) {
+                fix(block, i);
+            }
+        }
+
+        /* the columns of a partial block at the end of the row */
+        for (int32_t i=2; i<tail; i++) {
+            fix(row + blocks * Bits, i);
+        }
+    }
+}
+
+template <int Bits>
+static void _highlightRows(const struct raw_info* info, const void* buffer, int32_t y0, int32_t y1, uint8_t* dst, size_t dstRowBytes, const struct raw_info* levels) {
+    SRGBMapping toSRGB(levels);
+    int32_t width = info->width;
+
+    for (int32_t y=y0; y+1<y1; y+=2) {
+        const uint8_t* row0 = (const uint8_t*)buffer + (size_t)y * info->pitch;
+        const uint8_t* row1 = row0 + info->pitch;
+        uint8_t* out = dst + (y/2) * dstRowBytes;
+
+        for (int32_t x=0; x+1<width; x+=2) {
+            const uint8_t* block0 = row0 + (x / BLOCK_PIXELS) * Bits;
+            const uint8_t* block1 = row1 + (x / BLOCK_PIXELS) * Bits;
+            int32_t i = x % BLOCK_PIXELS;
+
+            int32_t l = RawRow<Bits>::get(block0, i);
+            int32_t v = RawRow<Bits>::get(block0, i+1); l = (v > l) ? v : l;
+            v = RawRow<Bits>::get(block1, i);           l = (v > l) ? v : l;
+            v = RawRow<Bits>::get(block1, i+1);         l = (v > l) ? v : l;
+
+            l = toSRGB(l, 0) - 204;
+            l = (l > 0) ? l * 5 : 0;
+            out[x/2] = (l > 255) ? 255 : l;
+        }
+    }
+}
+
+template <int Bits, uint32_t Pattern>
+static void _thumbnailOfPattern(const struct raw_info* info, const void* buffer, uint8_t* dst, int32_t width, int32_t height, const struct raw_info* levels) {
+    SRGBMapping toSRGB(levels);
+
+    for (int32_t i=0; i<height; i++) {
+        int32_t y = info->active_area.y1 + ((info->jpeg.y + (info->jpeg.height * i) / height) & 0xFFFFFFFE) + Bayer<Pattern>::RedY;
+        if (y < 0 || y + 1 >= info->height) {
+            memset(dst, 0, width * 3);
+            dst += width * 3;
+            continue;
+        }
+
+        for (int32_t j=0; j<width; j++) {
+            int32_t x = info->active_area.x1 + ((info->jpeg.x + (info->jpeg.width * j) / width) & 0xFFFFFFFE) + Bayer<Pattern>::RedX;
+            *dst++ = toSRGB(_pixel<Bits>(info, buffer, x, y), 0);          // red pixel
+            *dst++ = toSRGB(_pixel<Bits>(info, buffer, x+1, y), -1);       // green pixel
+            *dst++ = toSRGB(_pixel<Bits>(info, buffer, x+1, y+1), 0);      // blue pixel
+        }
+    }
+}
+
+/* the pattern is looked up once per thumbnail, the samples are read with constant offsets */
+template <int Bits>
+static void _thumbnail(const struct raw_info* info, const void* buffer, uint8_t* dst, int32_t width, int32_t height, const struct raw_info* levels) {
+    switch (info->cfa_pattern) {
+        case 0x01000201: _thumbnailOfPattern<Bits, 0x01000201>(info, buffer, dst, width, height, levels); break;
+        case 0x01020001: _thumbnailOfPattern<Bits, 0x01020001>(info, buffer, dst, width, height, levels); break;
+        default:         _thumbnailOfPattern<Bits, 0x02010100>(info, buffer, dst, width, height, levels); break;
+    }
+}
+
+} // namespace
+
+#pragma mark - Dispatch
+
+#define MLV_RAW_KERNELS(bits) {                 \
+    _findDeadPixels<bits>,                      \
+    _interpolateDeadPixels<bits>,               \
+    _interpolateDeadPixelList<bits>,            \
+    _applyFixes<bits>,                          \
+    _maxValue<bits>,                            \
+    _fixVerticalBanding<bits>,                  \
+    _highlightRows<bits>,                       \
+    _thumbnail<bits>,                           \
+}
+
+static const mlv_raw_kernels_t _MLVRawKernels[4] = {
+    MLV_RAW_KERNELS(10),
+    MLV_RAW_KERNELS(12),
+    MLV_RAW_KERNELS(14),
+    MLV_RAW_KERNELS(16),
+};
+
+const mlv_raw_kernels_t* MLVRawKernelsForInfo(const struct raw_info* info)
+{
+    switch (info->bits_per_pixel) {
+        case 10: return &_MLVRawKernels[0];
+        case 12: return &_MLVRawKernels[1];
+        case 14: return &_MLVRawKernels[2];
+        case 16: return &_MLVRawKernels[3];
+        default: return NULL;
+    }
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2017 Martin Hering
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef MLVRawKernels_h
+#define MLVRawKernels_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "raw.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Pixel kernels of MLVRawImage, compiled once for every bit depth (10, 12, 14 and
+ * packed or 16 bit unpacked samples), the thumbnail also for every bayer pattern.
+ * A frame looks up its kernels once and calls them for row ranges [y0, y1), usually
+ * one band per thread.
+ */
+
+// same layout as MLVPixelMapPixel
+typedef struct {
+    int32_t x;
+    int32_t y;
+} mlv_raw_pixel_t;
+
+// a dead pixel and the value interpolated for it
+typedef struct {
+    int32_t x;
+    int32_t y;
+    int32_t value;
+} mlv_raw_fix_t;
+
+typedef struct {
+    // writes the coordinates of dead pixels and returns their number
+    size_t  (*findDeadPixels)(const struct raw_info* info, const void* buffer, int32_t y0, int32_t y1, mlv_raw_pixel_t* pixels);
+    // interpolates dead pixels from their neighbors of the same color without changing the buffer,
+    // so rows next to the range may be fixed concurrently. writes at most width*(y1-y0) fixes
+    size_t  (*interpolateDeadPixels)(const struct raw_info* info, const void* buffer, int32_t y0, int32_t y1, mlv_raw_fix_t* fixes);
+    // same for the pixels of a map that are dead, at most count fixes
+    size_t  (*interpolateDeadPixelList)(const struct raw_info* info, const void* buffer, const mlv_raw_pixel_t* pixels, size_t count, mlv_raw_fix_t* fixes);
+    void    (*applyFixes)(const struct raw_info* info, void* buffer, const mlv_raw_fix_t* fixes, size_t count);
+
+    int32_t (*maxValue)(const struct raw_info* info, const void* buffer, int32_t y0, int32_t y1);
+
+    // scales the columns of every 8 pixel block, only values between low and white are changed
+    void    (*fixVerticalBanding)(const struct raw_info* info, void* buffer, int32_t y0, int32_t y1, const double* coefficients, int32_t low, int32_t white);
+
+    // maximum of every bayer quad as 8 bit highlight value into the quad rows of dst, y0 is even
+    // levels are the black and white level of the final frame
+    void    (*highlightRows)(const struct raw_info* info, const void* buffer, int32_t y0, int32_t y1, uint8_t* dst, size_t dstRowBytes, const struct raw_info* levels);
+
+    // RGB thumbnail of the jpeg area in the bayer pattern of info, width*height*3 bytes
+    void    (*thumbnail)(const struct raw_info* info, const void* buffer, uint8_t* dst, int32_t width, int32_t height, const struct raw_info* levels);
+} mlv_raw_kernels_t;
+
+// NULL for an unsupported bit depth
+const mlv_raw_kernels_t* MLVRawKernelsForInfo(const struct raw_info* info);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MLVRawKernels_h */
@@ -0,0 +1,455 @@
+/*
+ * Copyright (C) 2017 Martin Hering
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include "MLVRawPacking.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MLV_RAW_PACKING_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define MLV_RAW_PACKING_NEON 1
+#include <arm_neon.h>
+#endif
+
+/*
+ * Eight pixels always fill a whole number of 16 bit words, bitsPerPixel bytes.
+ * The SIMD kernels load 16 bytes per block and leave the last blocks of a row
+ * to the scalar code, so they never read past the row.
+ */
+#define BLOCK_PIXELS 8
+
+typedef struct {
+    uint8_t     shuffle[32];        /* bytes of pixel k in 32 bit lane k, most significant first */
+    uint32_t    shifts[8];          /* bits to drop in front of pixel k */
+} mlv_unpack_table_t;
+
+static void _MLVBuildUnpackTable(int bitsPerPixel, mlv_unpack_table_t* table)
+{
+    int blockBytes = bitsPerPixel;
+
+    for(int k=0; k<BLOCK_PIXELS; k++) {
+        int bit = k * bitsPerPixel;
+        int streamByte = bit / 8;
+
+        /* byte j of the bitstream is byte j^1 in memory, the words are little endian */
+        table->shuffle[k*4 + 0] = 0x80;
+        for(int b=0; b<3; b++) {
+            int j = streamByte + b;
+            table->shuffle[k*4 + 3 - b] = (j < blockBytes) ? (uint8_t)(j ^ 1) : 0x80;
+        }
+        table->shifts[k] = bit % 8;
+    }
+}
+
+typedef struct {
+    uint8_t     shuffle[64];        /* stream bytes from the lanes of pixels 0-3 and 4-7, even and odd pixels apart */
+    uint8_t     lookup[32];         /* the same for one 32 byte table, even and odd pixels */
+    uint32_t    shifts[8];          /* moves pixel k to its bit position in the lane */
+} mlv_pack_table_t;
+
+static void _MLVBuildPackTable(int bitsPerPixel, MLVRawPackingByteOrder byteOrder, mlv_pack_table_t* table)
+{
+    memset(table->shuffle, 0x80, sizeof(table->shuffle));
+    memset(table->lookup, 0xff, sizeof(table->lookup));
+
+    for(int k=0; k<BLOCK_PIXELS; k++) {
+        int bit = k * bitsPerPixel;
+        int first = bit / 8;
+        int last = (bit + bitsPerPixel - 1) / 8;
+
+        /* most significant bit of the pixel goes to lane bit 31 - (bit % 8) */
+        table->shifts[k] = 32 - bitsPerPixel - bit % 8;
+
+        /* the pixels of one parity never share a byte, the OR of both tables merges them */
+        for(int p=0; p<16; p++) {
+            int j = (byteOrder == kMLVRawPackingLittleEndian) ? p ^ 1 : p;
+            if (j < first || j > last) {
+                continue;
+            }
+            int laneByte = 4 * (k % 4) + 3 - (j - first);
+            int half = k / 4;
+            int parity = k % 2;
+            table->shuffle[parity * 32 + half * 16 + p] = (uint8_t)laneByte;
+            table->lookup[parity * 16 + p] = (uint8_t)(half * 16 + laneByte);
+        }
+    }
+}
+
+size_t MLVRawPackedRowLength(size_t width, int bitsPerPixel)
+{
+    return ((width * bitsPerPixel + 15) / 16) * 2;
+}
+
+#pragma mark - Scalar
+
+static void _MLVUnpackRawRowScalar(const uint8_t* src, uint16_t* dst, size_t width, int bitsPerPixel)
+{
+    if (bitsPerPixel == 16) {
+        memcpy(dst, src, width * sizeof(uint16_t));
+        return;
+    }
+
+    uint32_t mask = (1u << bitsPerPixel) - 1;
+    uint32_t acc = 0;
+    int bits = 0;
+
+    for(size_t x=0; x<width; x++) {
+        if (bits < bitsPerPixel) {
+            acc = (acc << 16) | (uint32_t)(src[0] | (src[1] << 8));
+            src += 2;
+            bits += 16;
+        }
+        bits -= bitsPerPixel;
+        dst[x] = (uint16_t)((acc >> bits) & mask);
+    }
+}
+
+static void _MLVPackRawRowScalar(const uint16_t* src, uint8_t* dst, size_t width, int bitsPerPixel, MLVRawPackingByteOrder byteOrder)
+{
+    if (bitsPerPixel == 16) {
+        if (byteOrder == kMLVRawPackingLittleEndian) {
+            memcpy(dst, src, width * sizeof(uint16_t));
+        } else {
+            MLVSwapRawBytes(src, dst, width * sizeof(uint16_t));
+        }
+        return;
+    }
+
+    uint32_t mask = (1u << bitsPerPixel) - 1;
+    uint32_t acc = 0;
+    int bits = 0;
+    int lo = (byteOrder == kMLVRawPackingLittleEndian) ? 0 : 1;
+
+    for(size_t x=0; x<width; x++) {
+        acc = (acc << bitsPerPixel) | (src[x] & mask);
+        bits += bitsPerPixel;
+        if (bits >= 16) {
+            bits -= 16;
+            uint16_t word = (uint16_t)(acc >> bits);
+            dst[lo] = (uint8_t)word;
+            dst[lo ^ 1] = (uint8_t)(word >> 8);
+            dst += 2;
+        }
+    }
+
+    /* rows end on full words */
+    if (bits > 0) {
+        uint16_t word = (uint16_t)(acc << (16 - bits));
+        dst[lo] = (uint8_t)word;
+        dst[lo ^ 1] = (uint8_t)(word >> 8);
+    }
+}
+
+#pragma mark - SSE4.1 / AVX2
+
+#if MLV_RAW_PACKING_X86
+
+__attribute__((target("sse4.1")))
+static size_t _MLVUnpackRawBlocksSSE41(const uint8_t* src, uint16_t* dst, size_t blocks, size_t rowLength, int bitsPerPixel, const mlv_unpack_table_t* table)
+{
+    const __m128i shuffleLo = _mm_loadu_si128((const __m128i*)table->shuffle);
+    const __m128i shuffleHi = _mm_loadu_si128((const __m128i*)(table->shuffle + 16));
+
+    /* SSE4.1 has no per lane shift, multiplying by 2^s is the same */
+    const __m128i scaleLo = _mm_setr_epi32(1 << table->shifts[0], 1 << table->shifts[1], 1 << table->shifts[2], 1 << table->shifts[3]);
+    const __m128i scaleHi = _mm_setr_epi32(1 << table->shifts[4], 1 << table->shifts[5], 1 << table->shifts[6], 1 << table->shifts[7]);
+    const __m128i shift = _mm_cvtsi32_si128(32 - bitsPerPixel);
+
+    size_t b = 0;
+    for(; b < blocks && b * bitsPerPixel + 16 <= rowLength; b++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + b * bitsPerPixel));
+
+        __m128i lo = _mm_srl_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(v, shuffleLo), scaleLo), shift);
+        __m128i hi = _mm_srl_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(v, shuffleHi), scaleHi), shift);
+
+        _mm_storeu_si128((__m128i*)(dst + b * BLOCK_PIXELS), _mm_packus_epi32(lo, hi));
+    }
+    return b;
+}
+
+__attribute__((target("avx2")))
+static size_t _MLVUnpackRawBlocksAVX2(const uint8_t* src, uint16_t* dst, size_t blocks, size_t rowLength, int bitsPerPixel, const mlv_unpack_table_t* table)
+{
+    /* a block is broadcast to both lanes, the low lane extracts pixels 0-3 and the high lane 4-7 */
+    const __m256i shuffle = _mm256_loadu_si256((const __m256i*)table->shuffle);
+    const __m256i shifts = _mm256_loadu_si256((const __m256i*)table->shifts);
+    const __m128i shift = _mm_cvtsi32_si128(32 - bitsPerPixel);
+
+    size_t b = 0;
+    for(; b + 1 < blocks && (b + 1) * bitsPerPixel + 16 <= rowLength; b += 2) {
+        __m256i v0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(src + b * bitsPerPixel)));
+        __m256i v1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(src + (b + 1) * bitsPerPixel)));
+
+        v0 = _mm256_srl_epi32(_mm256_sllv_epi32(_mm256_shuffle_epi8(v0, shuffle), shifts), shift);
+        v1 = _mm256_srl_epi32(_mm256_sllv_epi32(_mm256_shuffle_epi8(v1, shuffle), shifts), shift);
+
+        /* packing works per lane, the quads come out as 0-3, 8-11, 4-7, 12-15 */
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(v0, v1), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i*)(dst + b * BLOCK_PIXELS), packed);
+    }
+
+    return b + _MLVUnpackRawBlocksSSE41(src + b * bitsPerPixel, dst + b * BLOCK_PIXELS, blocks - b, rowLength - b * bitsPerPixel, bitsPerPixel, table);
+}
+
+__attribute__((target("sse4.1")))
+static size_t _MLVPackRawBlocksSSE41(const uint16_t* src, uint8_t* dst, size_t blocks, size_t rowLength, int bitsPerPixel, const mlv_pack_table_t* table)
+{
+    const __m128i evenLo = _mm_loadu_si128((const __m128i*)table->shuffle);
+    const __m128i evenHi = _mm_loadu_si128((const __m128i*)(table->shuffle + 16));
+    const __m128i oddLo = _mm_loadu_si128((const __m128i*)(table->shuffle + 32));
+    const __m128i oddHi = _mm_loadu_si128((const __m128i*)(table->shuffle + 48));
+    const __m128i scaleLo = _mm_setr_epi32(1 << table->shifts[0], 1 << table->shifts[1], 1 << table->shifts[2], 1 << table->shifts[3]);
+    const __m128i scaleHi = _mm_setr_epi32(1 << table->shifts[4], 1 << table->shifts[5], 1 << table->shifts[6], 1 << table->shifts[7]);
+    const __m128i mask = _mm_set1_epi16((short)((1 << bitsPerPixel) - 1));
+
+    /* a block stores 16 bytes, the bytes past bitsPerPixel are overwritten by the next block */
+    size_t b = 0;
+    for(; b < blocks && b * bitsPerPixel + 16 <= rowLength; b++) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + b * BLOCK_PIXELS)), mask);
+
+        __m128i lo = _mm_mullo_epi32(_mm_cvtepu16_epi32(v), scaleLo);
+        __m128i hi = _mm_mullo_epi32(_mm_cvtepu16_epi32(_mm_srli_si128(v, 8)), scaleHi);
+
+        __m128i even = _mm_or_si128(_mm_shuffle_epi8(lo, evenLo), _mm_shuffle_epi8(hi, evenHi));
+        __m128i odd = _mm_or_si128(_mm_shuffle_epi8(lo, oddLo), _mm_shuffle_epi8(hi, oddHi));
+        _mm_storeu_si128((__m128i*)(dst + b * bitsPerPixel), _mm_or_si128(even, odd));
+    }
+    return b;
+}
+
+__attribute__((target("avx2")))
+static size_t _MLVPackRawBlocksAVX2(const uint16_t* src, uint8_t* dst, size_t blocks, size_t rowLength, int bitsPerPixel, const mlv_pack_table_t* table)
+{
+    /* the low lane holds pixels 0-3 and the high lane 4-7, both lanes are merged at the end */
+    const __m256i even = _mm256_loadu_si256((const __m256i*)table->shuffle);
+    const __m256i odd = _mm256_loadu_si256((const __m256i*)(table->shuffle + 32));
+    const __m256i shifts = _mm256_loadu_si256((const __m256i*)table->shifts);
+    const __m128i mask = _mm_set1_epi16((short)((1 << bitsPerPixel) - 1));
+
+    size_t b = 0;
+    for(; b < blocks && b * bitsPerPixel + 16 <= rowLength; b++) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + b * BLOCK_PIXELS)), mask);
+        __m256i lanes = _mm256_sllv_epi32(_mm256_cvtepu16_epi32(v), shifts);
+
+        __m256i merged = _mm256_or_si256(_mm256_shuffle_epi8(lanes, even), _mm256_shuffle_epi8(lanes, odd));
+        __m128i packed = _mm_or_si128(_mm256_castsi256_si128(merged), _mm256_extracti128_si256(merged, 1));
+        _mm_storeu_si128((__m128i*)(dst + b * bitsPerPixel), packed);
+    }
+    return b;
+}
+
+#endif
+
+#pragma mark - NEON
+
+#if MLV_RAW_PACKING_NEON
+
+static size_t _MLVUnpackRawBlocksNEON(const uint8_t* src, uint16_t* dst, size_t blocks, size_t rowLength, int bitsPerPixel, const mlv_unpack_table_t* table)
+{
+    /* table indexes out of range give 0 like 0x80 does on x86 */
+    const uint8x16_t shuffleLo = vld1q_u8(table->shuffle);
+    const uint8x16_t shuffleHi = vld1q_u8(table->shuffle + 16);
+    const int32x4_t shiftsLo = vreinterpretq_s32_u32(vld1q_u32(table->shifts));
+    const int32x4_t shiftsHi = vreinterpretq_s32_u32(vld1q_u32(table->shifts + 4));
+    const int32x4_t shift = vdupq_n_s32(-(32 - bitsPerPixel));
+
+    size_t b = 0;
+    for(; b < blocks && b * bitsPerPixel + 16 <= rowLength; b++) {
+        uint8x16_t v = vld1q_u8(src + b * bitsPerPixel);
+
+        uint32x4_t lo = vreinterpretq_u32_u8(vqtbl1q_u8(v, shuffleLo));
+        uint32x4_t hi = vreinterpretq_u32_u8(vqtbl1q_u8(v, shuffleHi));
+        lo = vshlq_u32(vshlq_u32(lo, shiftsLo), shift);
+        hi = vshlq_u32(vshlq_u32(hi, shiftsHi), shift);
+
+        vst1q_u16(dst + b * BLOCK_PIXELS, vcombine_u16(vmovn_u32(lo), vmovn_u32(hi)));
+    }
+    return b;
+}
+
+static size_t _MLVPackRawBlocksNEON(const uint16_t* src, uint8_t* dst, size_t blocks, size_t rowLength, int bitsPerPixel, const mlv_pack_table_t* table)
+{
+    const uint8x16_t even = vld1q_u8(table->lookup);
+    const uint8x16_t odd = vld1q_u8(table->lookup + 16);
+    const uint32x4_t shiftsLo = vld1q_u32(table->shifts);
+    const uint32x4_t shiftsHi = vld1q_u32(table->shifts + 4);
+    const uint16x8_t mask = vdupq_n_u16((uint16_t)((1 << bitsPerPixel) - 1));
+
+    size_t b = 0;
+    for(; b < blocks && b * bitsPerPixel + 16 <= rowLength; b++) {
+        uint16x8_t v = vandq_u16(vld1q_u16(src + b * BLOCK_PIXELS), mask);
+
+        uint8x16x2_t lanes;
+        lanes.val[0] = vreinterpretq_u8_u32(vshlq_u32(vmovl_u16(vget_low_u16(v)), vreinterpretq_s32_u32(shiftsLo)));
+        lanes.val[1] = vreinterpretq_u8_u32(vshlq_u32(vmovl_u16(vget_high_u16(v)), vreinterpretq_s32_u32(shiftsHi)));
+
+        vst1q_u8(dst + b * bitsPerPixel, vorrq_u8(vqtbl2q_u8(lanes, even), vqtbl2q_u8(lanes, odd)));
+    }
+    return b;
+}
+
+#endif
+
+#pragma mark - Dispatch
+
+bool MLVRawPackingIsSupported(MLVRawPackingImplementation implementation)
+{
+    switch (implementation) {
+        case kMLVRawPackingAuto:
+        case kMLVRawPackingScalar:
+            return true;
+#if MLV_RAW_PACKING_X86
+        case kMLVRawPackingSSE41:
+            return __builtin_cpu_supports("sse4.1");
+        case kMLVRawPackingAVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#if MLV_RAW_PACKING_NEON
+        case kMLVRawPackingNEON:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+static MLVRawPackingImplementation _MLVRawPackingBestImplementation(void)
+{
+    static MLVRawPackingImplementation best = kMLVRawPackingAuto;
+
+    /* racing threads compute the same value */
+    if (best == kMLVRawPackingAuto) {
+        if (MLVRawPackingIsSupported(kMLVRawPackingNEON)) {
+            best = kMLVRawPackingNEON;
+        }
+        else if (MLVRawPackingIsSupported(kMLVRawPackingAVX2)) {
+            best = kMLVRawPackingAVX2;
+        }
+        else if (MLVRawPackingIsSupported(kMLVRawPackingSSE41)) {
+            best = kMLVRawPackingSSE41;
+        }
+        else {
+            best = kMLVRawPackingScalar;
+        }
+    }
+    return best;
+}
+
+void MLVUnpackRawRowWithImplementation(const void* src, uint16_t* dst, size_t width, int bitsPerPixel, MLVRawPackingImplementation implementation)
+{
+    if (implementation == kMLVRawPackingAuto) {
+        implementation = _MLVRawPackingBestImplementation();
+    }
+
+    size_t blocks = width / BLOCK_PIXELS;
+    size_t done = 0;
+
+    if (bitsPerPixel != 16 && blocks > 0 && implementation != kMLVRawPackingScalar) {
+        mlv_unpack_table_t table;
+        _MLVBuildUnpackTable(bitsPerPixel, &table);
+        size_t rowLength = MLVRawPackedRowLength(width, bitsPerPixel);
+
+        switch (implementation) {
+#if MLV_RAW_PACKING_X86
+            case kMLVRawPackingSSE41:
+                done = _MLVUnpackRawBlocksSSE41(src, dst, blocks, rowLength, bitsPerPixel, &table);
+                break;
+            case kMLVRawPackingAVX2:
+                done = _MLVUnpackRawBlocksAVX2(src, dst, blocks, rowLength, bitsPerPixel, &table);
+                break;
+#endif
+#if MLV_RAW_PACKING_NEON
+            case kMLVRawPackingNEON:
+                done = _MLVUnpackRawBlocksNEON(src, dst, blocks, rowLength, bitsPerPixel, &table);
+                break;
+#endif
+            default:
+                break;
+        }
+    }
+
+    _MLVUnpackRawRowScalar((const uint8_t*)src + done * bitsPerPixel, dst + done * BLOCK_PIXELS, width - done * BLOCK_PIXELS, bitsPerPixel);
+}
+
+void MLVUnpackRawRow(const void* src, uint16_t* dst, size_t width, int bitsPerPixel)
+{
+    MLVUnpackRawRowWithImplementation(src, dst, width, bitsPerPixel, kMLVRawPackingAuto);
+}
+
+void MLVPackRawRowWithImplementation(const uint16_t* src, void* dst, size_t width, int bitsPerPixel, MLVRawPackingByteOrder byteOrder, MLVRawPackingImplementation implementation)
+{
+    if (implementation == kMLVRawPackingAuto) {
+        implementation = _MLVRawPackingBestImplementation();
+    }
+
+    size_t blocks = width / BLOCK_PIXELS;
+    size_t done = 0;
+
+    if (bitsPerPixel != 16 && blocks > 0 && implementation != kMLVRawPackingScalar) {
+        mlv_pack_table_t table;
+        _MLVBuildPackTable(bitsPerPixel, byteOrder, &table);
+        size_t rowLength = MLVRawPackedRowLength(width, bitsPerPixel);
+
+        switch (implementation) {
+#if MLV_RAW_PACKING_X86
+            case kMLVRawPackingSSE41:
+                done = _MLVPackRawBlocksSSE41(src, dst, blocks, rowLength, bitsPerPixel, &table);
+                break;
+            case kMLVRawPackingAVX2:
+                done = _MLVPackRawBlocksAVX2(src, dst, blocks, rowLength, bitsPerPixel, &table);
+                break;
+#endif
+#if MLV_RAW_PACKING_NEON
+            case kMLVRawPackingNEON:
+                done = _MLVPackRawBlocksNEON(src, dst, blocks, rowLength, bitsPerPixel, &table);
+                break;
+#endif
+            default:
+                break;
+        }
+    }
+
+    _MLVPackRawRowScalar(src + done * BLOCK_PIXELS, (uint8_t*)dst + done * bitsPerPixel, width - done * BLOCK_PIXELS, bitsPerPixel, byteOrder);
+}
+
+void MLVPackRawRow(const uint16_t* src, void* dst, size_t width, int bitsPerPixel, MLVRawPackingByteOrder byteOrder)
+{
+    MLVPackRawRowWithImplementation(src, dst, width, bitsPerPixel, byteOrder, kMLVRawPackingAuto);
+}
+
+void MLVSwapRawBytes(const void* src, void* dst, size_t length)
+{
+    /* simple enough for the compiler to vectorize */
+    const uint8_t* s = src;
+    uint8_t* d = dst;
+    for(size_t i=0; i+1<length; i+=2) {
+        uint16_t word;
+        memcpy(&word, s + i, 2);
+        word = __builtin_bswap16(word);
+        memcpy(d + i, &word, 2);
+    }
+    if (length & 1) {
+        d[length - 1] = s[length - 1];
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2017 Martin Hering
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef MLVRawPacking_h
+#define MLVRawPacking_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Row conversion between packed raw data and 16 bit samples.
+ *
+ * Packed rows are the raw_pixblock/raw12_pixblock/raw10_pixblock layout of raw.h:
+ * little endian 16 bit words, the pixels follow each other starting at the most
+ * significant bit of the first word. 16 bit rows are plain uint16_t.
+ */
+
+typedef enum {
+    kMLVRawPackingAuto = 0,         // fastest implementation of the running CPU
+    kMLVRawPackingScalar,
+    kMLVRawPackingSSE41,
+    kMLVRawPackingAVX2,
+    kMLVRawPackingNEON,
+} MLVRawPackingImplementation;
+
+typedef enum {
+    kMLVRawPackingLittleEndian = 0, // 16 bit words as stored in MLV files
+    kMLVRawPackingBigEndian,        // plain bitstream as stored in DNG files
+} MLVRawPackingByteOrder;
+
+bool MLVRawPackingIsSupported(MLVRawPackingImplementation implementation);
+
+// bytes of a packed row, rows are padded to full 16 bit words
+size_t MLVRawPackedRowLength(size_t width, int bitsPerPixel);
+
+// bitsPerPixel is 10, 12, 14 or 16
+void MLVUnpackRawRow(const void* src, uint16_t* dst, size_t width, int bitsPerPixel);
+void MLVUnpackRawRowWithImplementation(const void* src, uint16_t* dst, size_t width, int bitsPerPixel, MLVRawPackingImplementation implementation);
+
+// samples are masked to bitsPerPixel
+void MLVPackRawRow(const uint16_t* src, void* dst, size_t width, int bitsPerPixel, MLVRawPackingByteOrder byteOrder);
+void MLVPackRawRowWithImplementation(const uint16_t* src, void* dst, size_t width, int bitsPerPixel, MLVRawPackingByteOrder byteOrder, MLVRawPackingImplementation implementation);
+
+// copies packed data and swaps the 16 bit words, little endian rows become big endian and back
+void MLVSwapRawBytes(const void* src, void* dst, size_t length);
+
+#endif /* MLVRawPacking_h */
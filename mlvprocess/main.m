@@ -37,6 +37,10 @@
     // Next, set the object that the connection exports. All messages sent on the connection to this service will be sent to the exported object to handle. The connection retains the exported object.
     mlvprocess *exportedObject = [mlvprocess new];
     newConnection.exportedObject = exportedObject;
+
+    // The service tells the client about recordings that grew.
+    newConnection.remoteObjectInterface = [NSXPCInterface interfaceWithProtocol:@protocol(MLVProcessorClientProtocol)];
+    exportedObject.connection = newConnection;
     
     // Resuming the connection allows the system to deliver more incoming messages.
     [newConnection resume];
@@ -24,4 +24,5 @@
 
 // This object implements the protocol which we have defined. It provides the actual behavior for the service. It is 'exported' by the service to make it available to the process hosting the service over an NSXPCConnection.
 @interface mlvprocess : NSObject <MLVProcessorProtocol>
+@property (weak) NSXPCConnection* connection;     // remote object implements MLVProcessorClientProtocol
 @end
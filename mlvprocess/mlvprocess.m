@@ -21,9 +21,11 @@
 #import "mlvprocess.h"
 #import "MLVFile.h"
 #import "MLVBlock.h"
+#import "MLVFrameIndex.h"
 #import "MLVRawImage+DNG.h"
 
 #define METADATA_VERSION 3
+#define CHANGE_NOTIFICATION_INTERVAL 1.0     // seconds, a growing recording is reported at most once per interval
 
 @implementation mlvprocess {
     NSMutableDictionary<NSString*, MLVFile*>* _openFiles;
@@ -32,11 +34,13 @@
     NSMutableDictionary<NSString*, MLVPixelMap*>* _deadPixelMaps;
     
     dispatch_queue_t _readQueue;
+    dispatch_queue_t _notifyQueue;
 }
 
 - (instancetype) init {
     if ((self = [super init])) {
         _readQueue = dispatch_queue_create("org.mlvprocess.fileRead", DISPATCH_QUEUE_SERIAL);
+        _notifyQueue = dispatch_queue_create("org.mlvprocess.fileNotify", DISPATCH_QUEUE_SERIAL);
     }
     return self;
 }
@@ -44,8 +48,11 @@
 - (NSMutableDictionary<NSString*, id>*) _attributesWithFile:(MLVFile*)file
 {
     NSMutableDictionary<NSString*, id>* attributes = [[NSMutableDictionary alloc] init];
-    attributes[kMLVAttributeKeyVideoBlocksCount] = @(file.videoBlocks.count);
-    attributes[kMLVAttributeKeyAudioBlocksCount] = @(file.audioBlocks.count);
+    attributes[kMLVAttributeKeyVideoBlocksCount] = @(file.videoIndex.count);
+    attributes[kMLVAttributeKeyAudioBlocksCount] = @(file.audioIndex.count);
+    attributes[kMLVAttributeKeyIndexing] = @(file.indexing);
+    attributes[kMLVAttributeKeySkippedBytes] = @(file.skippedBytes);
+    attributes[kMLVAttributeKeyDroppedFrames] = @(file.videoGapReport.missingFrameNumbers.count);
     attributes[kMLVAttributeKeyVersion] = @(METADATA_VERSION);
     attributes[kMLVAttributeKeyDuration] = @(file.duration);
     attributes[kMLVAttributeKeyFrameTime] = [NSString stringWithFormat:@"%lld/%ld", file.frameTime.value, (long)file.frameTime.timescale];
@@ -119,6 +126,34 @@
 }
 
 - (void) openFileWithURL:(NSURL*)url withReply:(void (^)(NSString *fileId, NSDictionary<NSString*, id>* attributes, NSData* archiveData, NSError* error))reply
+{
+    [self _openFileWithURL:url options:kMLVFileOptionsNone withReply:reply];
+}
+
+- (void) openFileWithURL:(NSURL*)url options:(MLVOpenOptions)options withReply:(void (^)(NSString *fileId, NSDictionary<NSString*, id>* attributes, NSData* archiveData, NSError* error))reply
+{
+    MLVFileOptions fileOptions = kMLVFileOptionsNone;
+    if (options & kMLVOpenOptionsMemoryMapped) {
+        fileOptions |= kMLVFileOptionsMemoryMapped;
+    }
+    if (options & kMLVOpenOptionsWriteIndex) {
+        fileOptions |= kMLVFileOptionsWriteIndex;
+    }
+    if (options & kMLVOpenOptionsWatchForChanges) {
+        fileOptions |= kMLVFileOptionsWatchForChanges;
+    }
+    if (options & kMLVOpenOptionsRecover) {
+        fileOptions |= kMLVFileOptionsRecover;
+    }
+    [self _openFileWithURL:url options:fileOptions withReply:reply];
+}
+
+- (void) openFileProgressivelyWithURL:(NSURL*)url withReply:(void (^)(NSString *fileId, NSDictionary<NSString*, id>* attributes, NSData* archiveData, NSError* error))reply
+{
+    [self _openFileWithURL:url options:kMLVFileOptionsProgressive withReply:reply];
+}
+
+- (void) _openFileWithURL:(NSURL*)url options:(MLVFileOptions)options withReply:(void (^)(NSString *fileId, NSDictionary<NSString*, id>* attributes, NSData* archiveData, NSError* error))reply
 {
     if (!_openFiles) {
         _openFiles = [[NSMutableDictionary alloc] init];
@@ -143,11 +178,12 @@
             file = _openFiles[fileId];
         }
         if (!file) {
-            file = [[MLVFile alloc] initWithURL:url reportProgress:^(float progress) {
+            file = [[MLVFile alloc] initWithURL:url options:options|kMLVFileOptionsIndexCache reportProgress:^(float progress) {
                 @synchronized(_openFiles) {
                     _readProgress[url] = @(progress);
                 }
             }];
+            [self _notifyChangesOfFile:file withId:fileId];
             @synchronized(_openFiles) {
                 _openFiles[fileId] = file;
             }
@@ -161,6 +197,44 @@
     });
 }
 
+- (void) _notifyChangesOfFile:(MLVFile*)file withId:(NSString*)fileId
+{
+    if (!(file.options & kMLVFileOptionsWatchForChanges)) {
+        return;
+    }
+
+    /* changes that arrive while a notification is pending are sent with it, with the attributes at the time it is sent */
+    __block BOOL notificationScheduled = NO;
+    __block uint64_t lastNotificationTime = 0;
+
+    WEAK_SELF
+    file.blockInfosDidChangeHandler = ^(MLVFile* changedFile) {
+        STRONG_SELF
+        if (!self) {
+            return;
+        }
+
+        dispatch_async(self->_notifyQueue, ^{
+            if (notificationScheduled) {
+                return;
+            }
+            notificationScheduled = YES;
+
+            uint64_t now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+            uint64_t interval = (uint64_t)(CHANGE_NOTIFICATION_INTERVAL * NSEC_PER_SEC);
+            int64_t delay = (lastNotificationTime + interval > now) ? (int64_t)(lastNotificationTime + interval - now) : 0;
+
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, delay), self->_notifyQueue, ^{
+                notificationScheduled = NO;
+                lastNotificationTime = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+                NSMutableDictionary<NSString*, id>* attributes = [self _attributesWithFile:changedFile];
+                [[self.connection remoteObjectProxy] fileWithIdDidChange:fileId attributes:attributes];
+            });
+        });
+    };
+}
+
 - (void) requestReadProgressForFileWithURL:(NSURL*)url withReply:(void (^)(float progress))reply {
     NSNumber* progress;
     @synchronized(_openFiles) {
@@ -183,37 +257,94 @@
         return;
     }
     
-    __block NSUInteger videoBlockIndex = NSNotFound;
-    __block NSUInteger audioBlockIndex = NSNotFound;
-    
-    NSTimeInterval firstTime = file.firstTime;
-    [file.videoBlocks enumerateObjectsUsingBlock:^(MLVVideoBlock *obj, NSUInteger idx, BOOL *stop) {
-        NSTimeInterval blockTime = obj.time;
-        if (blockTime-firstTime >= time) {
-            videoBlockIndex = idx;
-            *stop = YES;
-        }
-    }];
+    MLVFrameIndex* videoIndex = file.videoIndex;
+    MLVFrameIndex* audioIndex = file.audioIndex;
+    NSTimeInterval blockTime = file.firstTime + time;
+
+    NSUInteger videoBlockIndex = [videoIndex indexOfFirstBlockAtOrAfterTime:blockTime];
     if (videoBlockIndex == NSNotFound) {
-        videoBlockIndex = file.videoBlocks.count - 1;
+        videoBlockIndex = videoIndex.count - 1;
     }
-    
-    if (file.audioBlocks.count > 0) {
-        [file.audioBlocks enumerateObjectsUsingBlock:^(MLVAudioBlock *obj, NSUInteger idx, BOOL *stop) {
-            NSTimeInterval blockTime = obj.time;
-            if (blockTime-firstTime >= time) {
-                audioBlockIndex = idx;
-                *stop = YES;
-            }
-        }];
+
+    NSUInteger audioBlockIndex = NSNotFound;
+    if (audioIndex.count > 0) {
+        audioBlockIndex = [audioIndex indexOfFirstBlockAtOrAfterTime:blockTime];
         if (audioBlockIndex == NSNotFound) {
-            audioBlockIndex = file.audioBlocks.count - 1;
+            audioBlockIndex = audioIndex.count - 1;
         }
     }
 
     reply(videoBlockIndex, audioBlockIndex, nil);
 }
 
+- (void) requestFrameGapsForFileWithId:(NSString*)fileId tolerance:(double)tolerance withReply:(void (^)(NSDictionary<NSString*, id>* frameGaps, NSError* error))reply
+{
+    MLVFile* file;
+    @synchronized(_openFiles) {
+        file = _openFiles[fileId];
+    }
+    if (!file) {
+        NSError* error = NS_ERROR(-1, @"file is not open: %@", fileId);
+        reply(nil, error);
+        return;
+    }
+
+    MLVFrameGapReport* report = [file videoGapReportWithTolerance:tolerance];
+
+    NSMutableArray<NSArray<NSNumber*>*>* missingFrames = [[NSMutableArray alloc] init];
+    [report.missingFrameNumbers enumerateRangesUsingBlock:^(NSRange range, BOOL* stop) {
+        [missingFrames addObject:@[@(range.location), @(range.length)]];
+    }];
+
+    NSMutableArray<NSNumber*>* jitterFrames = [[NSMutableArray alloc] init];
+    [report.jitterFrameNumbers enumerateIndexesUsingBlock:^(NSUInteger frameNumber, BOOL* stop) {
+        [jitterFrames addObject:@(frameNumber)];
+    }];
+
+    NSMutableArray<NSNumber*>* damagedFrames = [[NSMutableArray alloc] init];
+    [report.damagedFrameIndexes enumerateIndexesUsingBlock:^(NSUInteger frameIndex, BOOL* stop) {
+        [damagedFrames addObject:@(frameIndex)];
+    }];
+
+    NSMutableDictionary<NSString*, id>* frameGaps = [[NSMutableDictionary alloc] init];
+    frameGaps[kMLVFrameGapsKeyMissingFrames] = missingFrames;
+    frameGaps[kMLVFrameGapsKeyJitterFrames] = jitterFrames;
+    frameGaps[kMLVFrameGapsKeyMissingPerChunk] = report.missingFramesPerChunk ?: @[];
+    frameGaps[kMLVFrameGapsKeyJitterPerChunk] = report.jitterFramesPerChunk ?: @[];
+    frameGaps[kMLVFrameGapsKeyDamagedFrames] = damagedFrames;
+    reply(frameGaps, nil);
+}
+
+- (void) updateFileWithId:(NSString*)fileId withReply:(void (^)(NSDictionary<NSString*, id>* attributes, NSError* error))reply
+{
+    MLVFile* file;
+    @synchronized(_openFiles) {
+        file = _openFiles[fileId];
+    }
+    if (!file) {
+        NSError* error = NS_ERROR(-1, @"file is not open: %@", fileId);
+        reply(nil, error);
+        return;
+    }
+
+    dispatch_async(_readQueue, ^{
+        /* files are only watched on request, and a recording on a network volume may not report changes */
+        MLVErrorCode errorCode = [file updateBlockInfos];
+        if (errorCode != kMLVErrorCodeNone) {
+            NSError* error = NS_ERROR(-1, @"error while updating block index: %ld", errorCode);
+            dispatch_async(dispatch_get_main_queue(), ^{
+                reply(nil, error);
+            });
+            return;
+        }
+
+        NSMutableDictionary<NSString*, id>* attributes = [self _attributesWithFile:file];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            reply(attributes, nil);
+        });
+    });
+}
+
 - (void) closeFileWithId:(NSString*)fileId withReply:(void (^)(NSError* error))reply
 {
     MLVFile* file;
@@ -246,6 +377,7 @@
         }
         if (!file) {
             file = [NSKeyedUnarchiver unarchiveObjectWithData:data];
+            [self _notifyChangesOfFile:file withId:fileId];
             @synchronized(_openFiles) {
                 _openFiles[fileId] = file;
             }
@@ -270,18 +402,35 @@
         return;
     }
 
-    NSArray<MLVVideoBlock*>* videoBlocks = file.videoBlocks;
-    if (frameIndex < 0 || frameIndex >= videoBlocks.count) {
-        NSError* error = NS_ERROR(-1, @"video frame index is invalid: %ld/%ld", frameIndex, videoBlocks.count);
+    NSUInteger videoBlocksCount = file.videoIndex.count;
+    if (frameIndex >= 0 && frameIndex >= videoBlocksCount && file.indexing) {
+        /* not indexed yet, the reply is sent when the indexer publishes the frame */
+        [file whenVideoBlockAtIndex:frameIndex isIndexed:^(BOOL available) {
+            [self readVideoFrameAtIndex:frameIndex fileId:fileId options:options withReply:reply];
+        }];
+        return;
+    }
+
+    if (frameIndex < 0 || frameIndex >= videoBlocksCount) {
+        NSError* error = NS_ERROR(-1, @"video frame index is invalid: %ld/%ld", frameIndex, videoBlocksCount);
         reply(nil, nil, nil, error);
         return;
     }
 
     dispatch_async(_readQueue, ^{
         @autoreleasepool {
-            MLVVideoBlock* videoBlock = videoBlocks[frameIndex];
+            MLVVideoBlock* videoBlock = [file videoBlockAtIndex:frameIndex];
             MLVErrorCode errorCode = kMLVErrorCodeNone;
-            __block MLVRawImage* rawImage = [file readVideoDataBlock:videoBlock errorCode:&errorCode];
+            MLVFileReadOptions readOptions = (options & kMLVProcessorOptionsBulkRead) ? kMLVFileReadOptionsUncached : kMLVFileReadOptionsNone;
+
+            /* without pixel changes the recorded LJ92 bitstream goes into the DNG, nothing is decoded.
+               a highlights map needs the decoded frame, which is then written like any other */
+            MLVProcessorOptions pixelOptions = kMLVProcessorOptionsFixFocusPixels | kMLVProcessorOptionsFixDeadPixels | kMLVProcessorOptionsFixVerticalBanding | kMLVProcessorOptionsCreateHighlightsMap;
+            BOOL convertsBitDepth = (options & kMLVProcessorOptionsConvertTo14Bit) && file.rawiInfo.bitsPerPixel < 14;
+            if ((options & kMLVProcessorOptionsKeepCompressed) && !(options & pixelOptions) && !convertsBitDepth) {
+                readOptions |= kMLVFileReadOptionsCompressed;
+            }
+            __block MLVRawImage* rawImage = [file readVideoDataBlock:videoBlock options:readOptions errorCode:&errorCode];
 
             if (errorCode != kMLVErrorCodeNone) {
                 NSError* error = NS_ERROR(-1, @"error while reading video block: %ld", errorCode);
@@ -293,8 +442,10 @@
     
             dispatch_async(dispatch_get_global_queue(0, 0), ^{
                 if (!rawImage.compressed) {
+                    MLVRawImageCorrections corrections = kMLVRawImageCorrectionsNone;
+                    MLVRawImageFocusPixelsType type = kMLVRawImageFocusPixelsTypeNone;
+
                     if (options & kMLVProcessorOptionsFixFocusPixels) {
-                        MLVRawImageFocusPixelsType type = kMLVRawImageFocusPixelsTypeNone;
                         struct raw_info* rawInfo = rawImage.rawInfo;
                         
                         NSInteger rawBufWidth = 0;
@@ -349,28 +500,42 @@
                         }
                         
                         if (type > kMLVRawImageFocusPixelsTypeNone) {
-                            [rawImage fixFocusPixelsWithType:type withCropX:videoBlock.cropPosX: videoBlock.cropPosY];
+                            corrections |= kMLVRawImageCorrectionsFocusPixels;
                         }
                     }
                     
                     if (options & kMLVProcessorOptionsFixDeadPixels) {
-                        [rawImage fixDeadPixelsBasedOnPixelMap:nil];
+                        corrections |= kMLVRawImageCorrectionsDeadPixels;
                     }
                     
+                    NSData* verticalBandingData = nil;
                     if (options & kMLVProcessorOptionsFixVerticalBanding) {
-                        NSData* verticalBandingData = _verticalBandingData[fileId];
-                        if (!verticalBandingData) {
-                            verticalBandingData = [rawImage findVerticalBandingCoefficients];
-                            _verticalBandingData[fileId] = verticalBandingData;
-                        }
-                        [rawImage fixVerticalBandingWithCoefficients:verticalBandingData];
+                        corrections |= kMLVRawImageCorrectionsVerticalBanding;
+                        verticalBandingData = _verticalBandingData[fileId];
                     }
                     
-                    if (options & kMLVProcessorOptionsConvertTo14Bit && file.rawiInfo.bitsPerPixel < 14) {
-                        MLVRawImage* newRawImage = [rawImage rawImageByChangingBitsPerPixel:14];
-                        if (newRawImage) {
-                            rawImage = newRawImage;
-                        }
+                    if (options & kMLVProcessorOptionsCreateHighlightsMap) {
+                        corrections |= kMLVRawImageCorrectionsHighlightMap;
+                    }
+                    
+                    if (!(options & kMLVProcessorOptionsOmitDngThumbnail)) {
+                        corrections |= kMLVRawImageCorrectionsThumbnail;
+                    }
+                    
+                    int32_t bitsPerPixel = (options & kMLVProcessorOptionsConvertTo14Bit && file.rawiInfo.bitsPerPixel < 14) ? 14 : 0;
+                    
+                    /* everything in one go while the frame is in the cache, the DNG writer only packs it.
+                       without corrections the packed frame is cheaper, it only gets swapped */
+                    MLVRawImageCorrections sampling = kMLVRawImageCorrectionsHighlightMap|kMLVRawImageCorrectionsThumbnail;
+                    if ((corrections & ~sampling) != kMLVRawImageCorrectionsNone || bitsPerPixel > 0) {
+                        [rawImage processWithCorrections:corrections
+                                         focusPixelsType:type cropX:videoBlock.cropPosX cropY:videoBlock.cropPosY
+                             verticalBandingCoefficients:verticalBandingData
+                                            bitsPerPixel:bitsPerPixel];
+                    }
+                    
+                    if ((options & kMLVProcessorOptionsFixVerticalBanding) && !verticalBandingData) {
+                        _verticalBandingData[fileId] = rawImage.verticalBandingCoefficients;
                     }
                 }
                 
@@ -379,8 +544,10 @@
                     highlightsMap = rawImage.highlightMap;
                 }
                 
+                /* encoding a frame takes longer than packing it, frames are written on the concurrent queue */
+                NSData* data = [rawImage dngDataIncludingThumbnail:!(options & kMLVProcessorOptionsOmitDngThumbnail)
+                                                        compressed:(options & kMLVProcessorOptionsCompressDng) != 0];
                 dispatch_async(dispatch_get_main_queue(), ^{
-                    NSData* data = [rawImage dngDataIncludingThumbnail:!(options & kMLVProcessorOptionsOmitDngThumbnail)];
                     reply(data, highlightsMap, file.imageSettings, nil);
                 });
             });
@@ -400,9 +567,16 @@
         return;
     }
     
-    NSArray<MLVAudioBlock*>* audioBlocks = file.audioBlocks;
-    if (frameIndex < 0 || frameIndex >= audioBlocks.count) {
-        NSError* error = NS_ERROR(-1, @"audio frame index is invalid: %ld/%ld", frameIndex, audioBlocks.count);
+    NSUInteger audioBlocksCount = file.audioIndex.count;
+    if (frameIndex >= 0 && frameIndex >= audioBlocksCount && file.indexing) {
+        [file whenAudioBlockAtIndex:frameIndex isIndexed:^(BOOL available) {
+            [self readAudioFrameAtIndex:frameIndex fileId:fileId options:options withReply:reply];
+        }];
+        return;
+    }
+
+    if (frameIndex < 0 || frameIndex >= audioBlocksCount) {
+        NSError* error = NS_ERROR(-1, @"audio frame index is invalid: %ld/%ld", frameIndex, audioBlocksCount);
         reply(nil, nil, error);
         return;
     }
@@ -410,7 +584,7 @@
     dispatch_async(_readQueue, ^{
         @autoreleasepool {
 
-            MLVAudioBlock* audioBlock = audioBlocks[frameIndex];
+            MLVAudioBlock* audioBlock = [file audioBlockAtIndex:frameIndex];
             MLVErrorCode errorCode = kMLVErrorCodeNone;
             NSData* data = [file readAudioDataBlock:audioBlock errorCode:&errorCode];
 